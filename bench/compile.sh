@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+# bench/compile.sh — Compile throughput over a synthetic 100k-line program
+#
+# Usage: bench/compile.sh [sky binary] [lines]
+# Functions with many long-named locals stress scope resolution; a block
+# of top-level lets past the global slot limit stresses global lookup.
+
+SKY=${1:-./sky}
+LINES=${2:-100000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v lines="$LINES" 'BEGIN {
+    for (g = 0; g < 400; g++) printf "let global_setting_%d = %d\n", g, g
+    n = 400
+    for (f = 0; n < lines; f++) {
+        printf "fn handler_%d(request) {\n", f
+        for (k = 0; k < 100; k++)
+            printf "    let request_field_value_%d = request + global_setting_%d\n", k, (f + k) % 400
+        for (k = 1; k < 96; k++)
+            printf "    request_field_value_%d = request_field_value_%d + request_field_value_%d\n", k, k, k - 1
+        printf "    return request_field_value_95\n"
+        printf "}\n"
+        n += 198
+    }
+    printf "print(handler_0(1))\n"
+}' > "$DIR/program.sky"
+
+TIMEFORMAT="compile $(wc -l < "$DIR/program.sky") lines: %Rs"
+time "$SKY" build "$DIR/program.sky" -o "$DIR/program.skyc" > /dev/null
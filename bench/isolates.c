@@ -0,0 +1,102 @@
+/* bench/isolates.c — Request throughput of an isolate pool over worker threads
+ *
+ * Usage: bench/isolates <program.skyc> <workers> [requests]
+ * Every request calls the program's handle(id) on an isolate taken from
+ * a pool with one isolate per worker, and resets it afterwards. All
+ * workers share one loaded program. */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime, nanosleep */
+#endif
+#endif
+#include "isolate.h"
+#include "serializer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    SkyIsolatePool *pool;
+    int             first;
+    int             count;
+    int             failed;
+} Worker;
+
+static void* worker_main(void *arg) {
+    Worker *w = (Worker*)arg;
+    int i;
+    for (i = 0; i < w->count; i++) {
+        SkyIsolate *isolate = sky_isolate_pool_acquire(w->pool);
+        SkyValue id = SKY_INT(w->first + i);
+        SkyValue status;
+        if (sky_isolate_call(isolate, "handle", 1, &id, &status) != VM_OK ||
+            !IS_INT(status) || AS_INT(status) != 200) {
+            w->failed++;
+        }
+        sky_isolate_pool_release(w->pool, isolate);
+    }
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    SkyChunk chunk;
+    SkyImage image;
+    SkyProgram program;
+    SkyIsolatePool pool;
+    Worker *workers;
+    sky_thread_t *threads;
+    char error[128];
+    int count, requests, i, failed = 0;
+    double start, elapsed;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <program.skyc> <workers> [requests]\n", argv[0]);
+        return 1;
+    }
+    count = atoi(argv[2]);
+    requests = argc > 3 ? atoi(argv[3]) : 400000;
+    if (count < 1 || requests < count) {
+        fprintf(stderr, "Error: Need at least one worker and a request per worker\n");
+        return 1;
+    }
+    if (!sky_skyc_load(argv[1], 0, &chunk, &image, error, sizeof(error)) ||
+        !sky_program_init(&program, &chunk, error, sizeof(error))) {
+        fprintf(stderr, "Error: Cannot load '%s': %s\n", argv[1], error);
+        return 1;
+    }
+    if (!sky_isolate_pool_init(&pool, &program, count)) {
+        fprintf(stderr, "Error: Cannot start isolates\n");
+        return 1;
+    }
+
+    workers = (Worker*)calloc((size_t)count, sizeof(Worker));
+    threads = (sky_thread_t*)malloc(sizeof(sky_thread_t) * count);
+    start = now_seconds();
+    for (i = 0; i < count; i++) {
+        workers[i].pool = &pool;
+        workers[i].first = requests / count * i;
+        workers[i].count = requests / count;
+        sky_thread_create(&threads[i], worker_main, &workers[i]);
+    }
+    for (i = 0; i < count; i++) {
+        sky_thread_join(threads[i]);
+        failed += workers[i].failed;
+    }
+    elapsed = now_seconds() - start;
+
+    printf("isolates x%d: %.0f requests/s%s\n", count, requests / count * count / elapsed,
+           failed ? " (some failed)" : "");
+    free(workers);
+    free(threads);
+    sky_isolate_pool_destroy(&pool);
+    sky_program_free(&program);
+    sky_chunk_free(&chunk);
+    sky_image_free(&image);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# bench/startup.sh — Cold start against resuming from a heap snapshot
+#
+# Usage: bench/startup.sh [sky binary] [entries]
+# The top level builds a lookup table as a chain of [key, value, next]
+# arrays; main() only reads it. A cold run pays for the table every time,
+# a snapshot run restores it.
+
+SKY=${1:-./sky}
+ENTRIES=${2:-200000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/program.sky" <<SKY
+let table = nil
+let checksum = 0
+for i in 0..$ENTRIES {
+    let key = "route-" + str(i)
+    checksum = (checksum * 31 + len(key)) % 1000003
+    table = [key, i * 7, table]
+}
+
+fn main() {
+    print("entries=" + str(len(table)) + " checksum=" + str(checksum))
+}
+SKY
+
+"$SKY" snapshot "$DIR/program.sky" -o "$DIR/program.skysnap" > /dev/null || exit 1
+TIMEFORMAT="cold start ($ENTRIES entries): %Rs"
+time "$SKY" run --no-cache "$DIR/program.sky" > /dev/null
+TIMEFORMAT="snapshot start ($ENTRIES entries): %Rs"
+time "$SKY" run "$DIR/program.skysnap" > /dev/null
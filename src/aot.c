@@ -0,0 +1,629 @@
+﻿/* aot.c — Ahead-of-time compilation of Sky programs to C
+ *
+ * `sky build app.sky -o app` translates every chunk of the compiled
+ * program into a C function and links the result against the runtime
+ * (libsky.a). A chunk's function enters at the frame's ip through a
+ * switch over its instruction offsets and runs until the frame is left:
+ * jumps are gotos, and the common instructions are plain C over the VM's
+ * stack and frame slots, falling back to one interpreter step whenever a
+ * type guard misses. Functions, constants and line tables come from the
+ * bytecode image embedded alongside, so the program starts without
+ * parsing or compiling anything and reports errors like `sky run`.
+ *
+ * Bodies are matched to chunks by walking function constants depth first
+ * from the top-level chunk, both here and in the loaded image. */
+#include "aot.h"
+#include "serializer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    SkyChunk **items;
+    int        count;
+    int        capacity;
+} ChunkList;
+
+static bool set_error(char *error, size_t error_size, const char *message) {
+    snprintf(error, error_size, "%s", message);
+    return false;
+}
+
+/* Appends `chunk` and every function chunk reachable from its constants */
+static bool collect_chunks(ChunkList *list, SkyChunk *chunk) {
+    int i;
+    for (i = 0; i < list->count; i++) {
+        if (list->items[i] == chunk) return true;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        SkyChunk **grown = (SkyChunk**)realloc(list->items, sizeof(SkyChunk*) * capacity);
+        if (!grown) return false;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = chunk;
+    for (i = 0; i < chunk->constants.count; i++) {
+        SkyValue k = chunk->constants.values[i];
+        if (IS_FUNCTION(k) && !collect_chunks(list, &AS_FUNCTION(k)->chunk)) return false;
+    }
+    return true;
+}
+
+/* ---- Generating C ---- */
+
+/* Helpers the generated functions are written in. The stack top lives
+ * in `sp` and is stored back to the VM around anything that may look at
+ * it: an interpreter step, or boxing an int (which can collect). Values
+ * are copied field by field, as a 16-byte load of a value just stored as
+ * two fields cannot be forwarded from the stores and stalls. STEP runs
+ * the instruction at `at` in the interpreter; STEP_JUMP also follows a
+ * branch it took. Int arithmetic wraps, as in the interpreter. */
+static const char prelude[] =
+    "#ifdef SKY_NAN_BOXING\n"
+    "#define COPY(dst, src) ((dst) = (src))\n"
+    "#define INT(v)     (vm->stack_top = sp, SKY_INT(v))\n"
+    "#else\n"
+    "#define COPY(dst, src) ((dst).type = (src).type, (dst).as = (src).as)\n"
+    "#define INT(v)     SKY_INT(v)\n"
+    "#endif\n"
+    "#define PUSH(v)    (COPY(sp[0], v), sp++)\n"
+    "#define PEEK(d)    (sp[-1 - (d)])\n"
+    "#define R(i)       (frame->slots[i])\n"
+    "#define TRUTHY(v)  (IS_BOOL(v) ? AS_BOOL(v) : !IS_NIL(v))\n"
+    "#define FALSEY(v)  (IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)) || (IS_INT(v) && AS_INT(v) == 0))\n"
+    "#define WRAP(a, op, b) ((int64_t)((uint64_t)(a) op (uint64_t)(b)))\n"
+    "\n"
+    "#define STEP(at)                                                     \\\n"
+    "    do {                                                             \\\n"
+    "        vm->stack_top = sp;                                          \\\n"
+    "        status = sky_vm_step(vm, frame, code + (at));                \\\n"
+    "        if (status != SKY_STEP_NEXT) return status;                  \\\n"
+    "        sp = vm->stack_top;                                          \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define STEP_JUMP(at, target)                                        \\\n"
+    "    do {                                                             \\\n"
+    "        vm->stack_top = sp;                                          \\\n"
+    "        status = sky_vm_step(vm, frame, code + (at));                \\\n"
+    "        if (status != SKY_STEP_NEXT && status != SKY_STEP_BRANCH) return status; \\\n"
+    "        sp = vm->stack_top;                                          \\\n"
+    "        if (status == SKY_STEP_BRANCH) goto target;                  \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define ARITH(at, op)                                                \\\n"
+    "    do {                                                             \\\n"
+    "        SkyValue b = PEEK(0), a = PEEK(1);                           \\\n"
+    "        if (IS_INT(a) && IS_INT(b)) {                                \\\n"
+    "            sp--;                                                    \\\n"
+    "            PEEK(0) = INT(WRAP(AS_INT(a), op, AS_INT(b)));           \\\n"
+    "        } else if (IS_FLOAT(a) && IS_FLOAT(b)) {                     \\\n"
+    "            sp--;                                                    \\\n"
+    "            PEEK(0) = SKY_FLOAT(AS_FLOAT(a) op AS_FLOAT(b));         \\\n"
+    "        } else {                                                     \\\n"
+    "            STEP(at);                                                \\\n"
+    "        }                                                            \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define COMPARE(at, op)                                              \\\n"
+    "    do {                                                             \\\n"
+    "        SkyValue b = PEEK(0), a = PEEK(1);                           \\\n"
+    "        if (IS_INT(a) && IS_INT(b)) {                                \\\n"
+    "            sp--;                                                    \\\n"
+    "            PEEK(0) = SKY_BOOL(AS_INT(a) op AS_INT(b));              \\\n"
+    "        } else if (IS_FLOAT(a) && IS_FLOAT(b)) {                     \\\n"
+    "            sp--;                                                    \\\n"
+    "            PEEK(0) = SKY_BOOL(AS_FLOAT(a) op AS_FLOAT(b));          \\\n"
+    "        } else {                                                     \\\n"
+    "            STEP(at);                                                \\\n"
+    "        }                                                            \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define COMPARE_JUMP(at, op, target)                                 \\\n"
+    "    do {                                                             \\\n"
+    "        SkyValue b = PEEK(0), a = PEEK(1);                           \\\n"
+    "        if (IS_INT(a) && IS_INT(b)) {                                \\\n"
+    "            sp -= 2;                                                 \\\n"
+    "            if (!(AS_INT(a) op AS_INT(b))) goto target;              \\\n"
+    "        } else {                                                     \\\n"
+    "            STEP_JUMP(at, target);                                   \\\n"
+    "        }                                                            \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define REGISTER_ARITH(at, op, dst, a, b)                            \\\n"
+    "    do {                                                             \\\n"
+    "        if (IS_INT(a) && IS_INT(b)) {                                \\\n"
+    "            R(dst) = INT(WRAP(AS_INT(a), op, AS_INT(b)));            \\\n"
+    "        } else {                                                     \\\n"
+    "            STEP(at);                                                \\\n"
+    "        }                                                            \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define REGISTER_COMPARE_JUMP(at, op, a, b, target)                  \\\n"
+    "    do {                                                             \\\n"
+    "        if (IS_INT(a) && IS_INT(b)) {                                \\\n"
+    "            if (!(AS_INT(a) op AS_INT(b))) goto target;              \\\n"
+    "        } else {                                                     \\\n"
+    "            STEP_JUMP(at, target);                                   \\\n"
+    "        }                                                            \\\n"
+    "    } while (0)\n";
+
+static bool is_jump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_BACK:
+        case OP_AND_JUMP: case OP_OR_JUMP: case OP_POP_JUMP_IF_FALSE:
+        case OP_FOR_RANGE_PREP: case OP_FOR_RANGE_LOOP:
+        case OP_LESS_JUMP_IF_FALSE: case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE: case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE: case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_LESS_RR_JUMP_IF_FALSE: case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE: case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE: case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE: case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE: case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE: case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* The jump distance is always an instruction's last two bytes */
+static int jump_target(const SkyChunk *chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    int end = offset + sky_opcode_length(op);
+    int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return (op == OP_JUMP_BACK || op == OP_FOR_RANGE_LOOP) ? end - distance : end + distance;
+}
+
+/* C operator of a compare or arithmetic opcode, NULL for any other */
+static const char* c_operator(uint8_t op) {
+    switch (op) {
+        case OP_ADD: case OP_ADD_INT_INT: case OP_ADD_FLOAT_FLOAT:
+        case OP_ADD_RR: case OP_ADD_RK:
+            return "+";
+        case OP_SUB: case OP_SUB_INT_INT: case OP_SUB_FLOAT_FLOAT:
+        case OP_SUB_RR: case OP_SUB_RK:
+            return "-";
+        case OP_MUL: case OP_MUL_INT_INT: case OP_MUL_FLOAT_FLOAT:
+        case OP_MUL_RR: case OP_MUL_RK:
+            return "*";
+        case OP_LESS: case OP_LESS_INT_INT: case OP_LESS_FLOAT_FLOAT:
+        case OP_LESS_JUMP_IF_FALSE: case OP_LESS_RR_JUMP_IF_FALSE: case OP_LESS_RK_JUMP_IF_FALSE:
+            return "<";
+        case OP_LESS_EQ: case OP_LESS_EQ_INT_INT: case OP_LESS_EQ_FLOAT_FLOAT:
+        case OP_LESS_EQ_JUMP_IF_FALSE: case OP_LESS_EQ_RR_JUMP_IF_FALSE: case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+            return "<=";
+        case OP_GREATER: case OP_GREATER_INT_INT: case OP_GREATER_FLOAT_FLOAT:
+        case OP_GREATER_JUMP_IF_FALSE: case OP_GREATER_RR_JUMP_IF_FALSE: case OP_GREATER_RK_JUMP_IF_FALSE:
+            return ">";
+        case OP_GREATER_EQ: case OP_GREATER_EQ_INT_INT: case OP_GREATER_EQ_FLOAT_FLOAT:
+        case OP_GREATER_EQ_JUMP_IF_FALSE: case OP_GREATER_EQ_RR_JUMP_IF_FALSE: case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+            return ">=";
+        case OP_EQUAL_JUMP_IF_FALSE: case OP_EQUAL_RR_JUMP_IF_FALSE: case OP_EQUAL_RK_JUMP_IF_FALSE:
+            return "==";
+        case OP_NOT_EQUAL_JUMP_IF_FALSE: case OP_NOT_EQUAL_RR_JUMP_IF_FALSE: case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return "!=";
+        default:
+            return NULL;
+    }
+}
+
+/* The C statement for the instruction at `at` */
+static void write_instruction(FILE *out, const SkyChunk *chunk, int at) {
+    const uint8_t *code = chunk->code + at;
+    uint8_t op = code[0];
+    const char *cop = c_operator(op);
+    int target = is_jump(op) ? jump_target(chunk, at) : -1;
+
+    switch (op) {
+        case OP_NOP:
+            fprintf(out, ";\n");
+            break;
+        case OP_CONSTANT:
+            fprintf(out, "PUSH(K[%d]);\n", code[1]);
+            break;
+        case OP_CONSTANT_LONG:
+            fprintf(out, "PUSH(K[%d]);\n", (code[1] << 16) | (code[2] << 8) | code[3]);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            fprintf(out, "PUSH(SKY_BOOL(%s));\n", op == OP_TRUE ? "true" : "false");
+            break;
+        case OP_NIL:
+            fprintf(out, "PUSH(SKY_NIL());\n");
+            break;
+        case OP_POP:
+            fprintf(out, "sp--;\n");
+            break;
+        case OP_DUP:
+            fprintf(out, "PUSH(PEEK(0));\n");
+            break;
+        case OP_GET_LOCAL:
+            fprintf(out, "PUSH(R(%d));\n", code[1]);
+            break;
+        case OP_SET_LOCAL:
+            fprintf(out, "COPY(R(%d), PEEK(0));\n", code[1]);
+            break;
+        case OP_GET_GLOBAL_SLOT:
+            fprintf(out, "if (vm->global_slots[%d].defined) PUSH(vm->global_slots[%d].value); else STEP(%d);\n",
+                    code[1], code[1], at);
+            break;
+        case OP_SET_GLOBAL_SLOT:
+            fprintf(out, "{ COPY(vm->global_slots[%d].value, PEEK(0)); vm->global_slots[%d].defined = true; }\n",
+                    code[1], code[1]);
+            break;
+        case OP_MOVE:
+            fprintf(out, "COPY(R(%d), R(%d));\n", code[1], code[2]);
+            break;
+        case OP_LOAD_CONST:
+            fprintf(out, "COPY(R(%d), K[%d]);\n", code[1], code[2]);
+            break;
+
+        case OP_ADD: case OP_ADD_INT_INT: case OP_ADD_FLOAT_FLOAT:
+        case OP_SUB: case OP_SUB_INT_INT: case OP_SUB_FLOAT_FLOAT:
+        case OP_MUL: case OP_MUL_INT_INT: case OP_MUL_FLOAT_FLOAT:
+            fprintf(out, "ARITH(%d, %s);\n", at, cop);
+            break;
+        case OP_LESS: case OP_LESS_INT_INT: case OP_LESS_FLOAT_FLOAT:
+        case OP_LESS_EQ: case OP_LESS_EQ_INT_INT: case OP_LESS_EQ_FLOAT_FLOAT:
+        case OP_GREATER: case OP_GREATER_INT_INT: case OP_GREATER_FLOAT_FLOAT:
+        case OP_GREATER_EQ: case OP_GREATER_EQ_INT_INT: case OP_GREATER_EQ_FLOAT_FLOAT:
+            fprintf(out, "COMPARE(%d, %s);\n", at, cop);
+            break;
+        case OP_DIV:
+            /* Zero divisors error and -1 can overflow: both go the slow way */
+            fprintf(out, "{ SkyValue b = PEEK(0), a = PEEK(1); "
+                         "if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 && AS_INT(b) != -1) "
+                         "{ sp--; PEEK(0) = INT(AS_INT(a) / AS_INT(b)); } "
+                         "else if (IS_FLOAT(a) && IS_FLOAT(b) && AS_FLOAT(b) != 0.0) "
+                         "{ sp--; PEEK(0) = SKY_FLOAT(AS_FLOAT(a) / AS_FLOAT(b)); } "
+                         "else STEP(%d); }\n", at);
+            break;
+        case OP_MOD:
+            fprintf(out, "{ SkyValue b = PEEK(0), a = PEEK(1); "
+                         "if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 && AS_INT(b) != -1) "
+                         "{ sp--; PEEK(0) = INT(AS_INT(a) %% AS_INT(b)); } "
+                         "else STEP(%d); }\n", at);
+            break;
+        case OP_NEGATE:
+            fprintf(out, "if (IS_INT(PEEK(0))) PEEK(0) = INT(WRAP(0, -, AS_INT(PEEK(0)))); "
+                         "else if (IS_FLOAT(PEEK(0))) PEEK(0) = SKY_FLOAT(-AS_FLOAT(PEEK(0))); "
+                         "else STEP(%d);\n", at);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            fprintf(out, "{ SkyValue b = PEEK(0), a = PEEK(1); sp--; "
+                         "PEEK(0) = SKY_BOOL(%ssky_values_equal(a, b)); }\n",
+                    op == OP_EQUAL ? "" : "!");
+            break;
+        case OP_NOT:
+            fprintf(out, "PEEK(0) = SKY_BOOL(!TRUTHY(PEEK(0)));\n");
+            break;
+        case OP_AND:
+        case OP_OR:
+            fprintf(out, "{ SkyValue b = PEEK(0), a = PEEK(1); sp--; "
+                         "PEEK(0) = SKY_BOOL(TRUTHY(a) %s TRUTHY(b)); }\n",
+                    op == OP_AND ? "&&" : "||");
+            break;
+        case OP_TO_BOOL:
+            fprintf(out, "PEEK(0) = SKY_BOOL(TRUTHY(PEEK(0)));\n");
+            break;
+        case OP_INC_LOCAL:
+            fprintf(out, "if (IS_INT(R(%d)) && IS_INT(K[%d])) R(%d) = INT(WRAP(AS_INT(R(%d)), +, AS_INT(K[%d]))); "
+                         "else STEP(%d);\n",
+                    code[1], code[2], code[1], code[1], code[2], at);
+            break;
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            fprintf(out, "if (IS_INT(R(%d)) && IS_INT(R(%d))) PUSH(INT(WRAP(AS_INT(R(%d)), +, AS_INT(R(%d))))); "
+                         "else STEP(%d);\n",
+                    code[1], code[2], code[1], code[2], at);
+            break;
+        case OP_ADD_RR: case OP_SUB_RR: case OP_MUL_RR:
+            fprintf(out, "REGISTER_ARITH(%d, %s, %d, R(%d), R(%d));\n", at, cop, code[1], code[2], code[3]);
+            break;
+        case OP_ADD_RK: case OP_SUB_RK: case OP_MUL_RK:
+            fprintf(out, "REGISTER_ARITH(%d, %s, %d, R(%d), K[%d]);\n", at, cop, code[1], code[2], code[3]);
+            break;
+
+        case OP_JUMP:
+        case OP_JUMP_BACK:
+            fprintf(out, "goto L%d;\n", target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "if (FALSEY(PEEK(0))) goto L%d;\n", target);
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            fprintf(out, "{ SkyValue c = *--sp; if (FALSEY(c)) goto L%d; }\n", target);
+            break;
+        case OP_AND_JUMP:
+            fprintf(out, "if (TRUTHY(PEEK(0))) sp--; else { PEEK(0) = SKY_BOOL(false); goto L%d; }\n",
+                    target);
+            break;
+        case OP_OR_JUMP:
+            fprintf(out, "if (TRUTHY(PEEK(0))) { PEEK(0) = SKY_BOOL(true); goto L%d; } else sp--;\n",
+                    target);
+            break;
+        case OP_FOR_RANGE_PREP:
+            fprintf(out, "if (IS_INT(R(%d)) && IS_INT(R(%d))) { if (AS_INT(R(%d)) >= AS_INT(R(%d))) goto L%d; } "
+                         "else STEP_JUMP(%d, L%d);\n",
+                    code[1], code[1] + 1, code[1], code[1] + 1, target, at, target);
+            break;
+        case OP_FOR_RANGE_LOOP:
+            fprintf(out, "if (IS_INT(R(%d)) && IS_INT(R(%d))) { int64_t n = WRAP(AS_INT(R(%d)), +, 1); "
+                         "R(%d) = INT(n); if (n < AS_INT(R(%d))) goto L%d; } "
+                         "else STEP_JUMP(%d, L%d);\n",
+                    code[1], code[1] + 1, code[1], code[1], code[1] + 1, target, at, target);
+            break;
+        case OP_LESS_JUMP_IF_FALSE: case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE: case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE: case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            fprintf(out, "COMPARE_JUMP(%d, %s, L%d);\n", at, cop, target);
+            break;
+        case OP_LESS_RR_JUMP_IF_FALSE: case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE: case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE: case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+            fprintf(out, "REGISTER_COMPARE_JUMP(%d, %s, R(%d), R(%d), L%d);\n", at, cop, code[1], code[2], target);
+            break;
+        case OP_LESS_RK_JUMP_IF_FALSE: case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE: case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE: case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            fprintf(out, "REGISTER_COMPARE_JUMP(%d, %s, R(%d), K[%d], L%d);\n", at, cop, code[1], code[2], target);
+            break;
+
+        case OP_RETURN:
+            /* The last return ends the program in the interpreter */
+            fprintf(out, "if (vm->frame_count > 1) { COPY(R(0), PEEK(0)); vm->stack_top = frame->slots + 1; "
+                         "vm->frame_count--; return SKY_STEP_EXIT; } else STEP(%d);\n", at);
+            break;
+        case OP_HALT:
+            fprintf(out, "{ vm->stack_top = sp; return SKY_STEP_HALT; }\n");
+            break;
+
+        default:
+            if (target >= 0) {
+                fprintf(out, "STEP_JUMP(%d, L%d);\n", at, target);
+            } else {
+                fprintf(out, "STEP(%d);\n", at);
+            }
+            break;
+    }
+}
+
+/* A chunk's body is entered at its start or where a call returns to;
+ * frames only ever stop there. A frame the interpreter carried on with
+ * is stepped until it reaches one (the default case). Labels go only on
+ * entries and jump targets, which keeps the C compiler's work close to
+ * linear in the size of the chunk. */
+static bool write_function(FILE *out, const SkyChunk *chunk, int index, const char *name) {
+    bool *label = (bool*)calloc((size_t)chunk->code_count + 1, sizeof(bool));
+    int at;
+
+    if (!label) return false;
+    label[0] = true;
+    for (at = 0; at < chunk->code_count; at += sky_opcode_length(chunk->code[at])) {
+        uint8_t op = chunk->code[at];
+        if (is_jump(op)) label[jump_target(chunk, at)] = true;
+        if (op == OP_CALL || op == OP_INVOKE || op == OP_INVOKE_LONG) {
+            label[at + sky_opcode_length(op)] = true;
+        }
+    }
+
+    fprintf(out, "/* %s */\n", name);
+    fprintf(out, "static int chunk_%d(SkyVM *vm, SkyCallFrame *frame) {\n", index);
+    fprintf(out, "    uint8_t *code = frame->chunk->code;\n");
+    fprintf(out, "    const SkyValue *K = frame->chunk->constants.values;\n");
+    fprintf(out, "    SkyValue *sp = vm->stack_top;\n");
+    fprintf(out, "    int status;\n");
+    fprintf(out, "    (void)K; (void)status;\n");
+    fprintf(out, "    switch (frame->ip - code) {\n");
+    fprintf(out, "        case 0: goto L0;\n");
+    for (at = 0; at < chunk->code_count; at += sky_opcode_length(chunk->code[at])) {
+        uint8_t op = chunk->code[at];
+        int next = at + sky_opcode_length(op);
+        if ((op == OP_CALL || op == OP_INVOKE || op == OP_INVOKE_LONG) && next < chunk->code_count) {
+            fprintf(out, "        case %d: goto L%d;\n", next, next);
+        }
+    }
+    fprintf(out, "        default: return sky_vm_step(vm, frame, frame->ip);\n");
+    fprintf(out, "    }\n");
+    for (at = 0; at < chunk->code_count; at += sky_opcode_length(chunk->code[at])) {
+        if (label[at]) fprintf(out, "L%d: ", at);
+        else fprintf(out, "    ");
+        write_instruction(out, chunk, at);
+    }
+    fprintf(out, "    return SKY_STEP_ERROR;\n");
+    fprintf(out, "}\n\n");
+    free(label);
+    return true;
+}
+
+/* Name of each function chunk, for the comments */
+static const char* chunk_name(ChunkList *list, int index) {
+    int i, j;
+    for (i = 0; i < index; i++) {
+        SkyChunk *owner = list->items[i];
+        for (j = 0; j < owner->constants.count; j++) {
+            SkyValue k = owner->constants.values[j];
+            if (IS_FUNCTION(k) && &AS_FUNCTION(k)->chunk == list->items[index]) {
+                return AS_FUNCTION(k)->name;
+            }
+        }
+    }
+    return "<script>";
+}
+
+bool sky_aot_write_c(SkyChunk *chunk, const char *source_path, const char *path,
+                     char *error, size_t error_size) {
+    ChunkList list;
+    uint8_t *image;
+    size_t image_size, i;
+    const char *p;
+    FILE *out;
+    int c;
+    bool ok;
+
+    memset(&list, 0, sizeof(list));
+    if (!collect_chunks(&list, chunk)) {
+        free(list.items);
+        return set_error(error, error_size, "Out of memory");
+    }
+    if (!sky_skyc_encode(chunk, 0, &image, &image_size, error, error_size)) {
+        free(list.items);
+        return false;
+    }
+    out = fopen(path, "w");
+    if (!out) {
+        free(list.items);
+        free(image);
+        return set_error(error, error_size, "Cannot open output file");
+    }
+
+    fprintf(out, "/* Generated by sky build from %s; do not edit */\n", source_path);
+#ifdef SKY_NAN_BOXING
+    fprintf(out, "#define SKY_NAN_BOXING\n");
+#endif
+    fprintf(out, "#include \"aot.h\"\n\n%s\n", prelude);
+
+    /* A string literal of exactly the image's size (no terminator): much
+     * quicker for the C compiler to read than a list of numbers */
+    fprintf(out, "static _Alignas(8) uint8_t image[%lu] =", (unsigned long)image_size);
+    for (i = 0; i < image_size; i++) {
+        fprintf(out, "%s\\%o", i % 32 == 0 ? "\n    \"" : "", (unsigned)image[i]);
+        if (i % 32 == 31 || i + 1 == image_size) fputc('"', out);
+    }
+    fprintf(out, ";\n\n");
+
+    ok = true;
+    for (c = 0; c < list.count && ok; c++) ok = write_function(out, list.items[c], c, chunk_name(&list, c));
+
+    fprintf(out, "static const SkyAotFn bodies[%d] = {", list.count);
+    for (c = 0; c < list.count; c++) fprintf(out, "%schunk_%d,", c % 8 == 0 ? "\n    " : " ", c);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "int main(void) {\n    return sky_aot_main(\"");
+    for (p = source_path; *p; p++) {
+        if (*p == '"' || *p == '\\') fputc('\\', out);
+        fputc(*p, out);
+    }
+    fprintf(out, "\", image, sizeof(image), bodies, %d);\n}\n", list.count);
+
+    ok = !ferror(out) && ok;
+    ok = fclose(out) == 0 && ok;
+    free(list.items);
+    free(image);
+    if (!ok) {
+        remove(path);
+        return set_error(error, error_size, "Cannot write output file");
+    }
+    return true;
+}
+
+/* ---- Building ---- */
+
+#ifndef _WIN32
+/* Runs argv[0] with `argv`; true if it exits with status 0 */
+static bool run_command(char *const argv[]) {
+    int status;
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+#endif
+
+bool sky_aot_build(SkyChunk *chunk, const char *source_path, const char *output,
+                   char *error, size_t error_size) {
+#ifdef _WIN32
+    (void)chunk;
+    (void)source_path;
+    (void)output;
+    return set_error(error, error_size, "Native builds need a POSIX system");
+#else
+    char c_path[1024], include[1024], library[1024];
+    const char *home = getenv("SKY_HOME");
+    const char *cc = getenv("CC");
+    char *argv[16];
+    int argc = 0;
+    FILE *f;
+    bool ok;
+
+    if (!home || !*home) home = SKY_RUNTIME_DIR;
+    if (!cc || !*cc) cc = "cc";
+    if ((size_t)snprintf(c_path, sizeof(c_path), "%s.tmp.c", output) >= sizeof(c_path) ||
+        (size_t)snprintf(include, sizeof(include), "-I%s/src", home) >= sizeof(include) ||
+        (size_t)snprintf(library, sizeof(library), "%s/libsky.a", home) >= sizeof(library)) {
+        return set_error(error, error_size, "Path too long");
+    }
+    f = fopen(library, "rb");
+    if (!f) return set_error(error, error_size, "Cannot find libsky.a (set SKY_HOME to the sky build tree)");
+    fclose(f);
+
+    if (!sky_aot_write_c(chunk, source_path, c_path, error, error_size)) return false;
+
+    argv[argc++] = (char*)cc;
+    argv[argc++] = "-O2";
+    argv[argc++] = "-std=c11";
+    argv[argc++] = "-D_POSIX_C_SOURCE=200809L";
+    argv[argc++] = include;
+    argv[argc++] = "-o";
+    argv[argc++] = (char*)output;
+    argv[argc++] = c_path;
+    argv[argc++] = library;
+    argv[argc++] = "-lpthread";
+    argv[argc++] = "-lm";
+    argv[argc] = NULL;
+    ok = run_command(argv);
+    remove(c_path);
+    return ok ? true : set_error(error, error_size, "C compiler failed");
+#endif
+}
+
+/* ---- Running ---- */
+
+int sky_aot_main(const char *source_path, uint8_t *image, size_t image_size,
+                 const SkyAotFn *bodies, int body_count) {
+    SkyChunk chunk;
+    SkyImage loaded;
+    ChunkList list;
+    SkyVM vm;
+    SkyVMResult result;
+    char error[128];
+    int i;
+
+    if (!sky_skyc_load_memory(image, image_size, &chunk, &loaded, error, sizeof(error))) {
+        fprintf(stderr, "Error: Cannot load '%s': %s\n", source_path, error);
+        return 1;
+    }
+    memset(&list, 0, sizeof(list));
+    if (!collect_chunks(&list, &chunk) || list.count != body_count) {
+        fprintf(stderr, "Error: Cannot load '%s': Compiled code does not match the program\n", source_path);
+        free(list.items);
+        sky_chunk_free(&chunk);
+        sky_image_free(&loaded);
+        return 1;
+    }
+    for (i = 0; i < list.count; i++) list.items[i]->aot = bodies[i];
+    free(list.items);
+
+    sky_vm_init(&vm);
+    result = sky_vm_execute(&vm, &chunk);
+    if (result != VM_OK) {
+        fprintf(stderr, "Error: Runtime error in '%s'\n", source_path);
+    }
+
+    sky_vm_destroy(&vm);
+    sky_chunk_free(&chunk);
+    sky_image_free(&loaded);
+    return result == VM_OK ? 0 : 1;
+}
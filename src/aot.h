@@ -0,0 +1,40 @@
+﻿/* aot.h — Ahead-of-time compilation of Sky programs to C */
+#ifndef SKY_AOT_H
+#define SKY_AOT_H
+
+#include "vm.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where `sky build` finds libsky.a and the headers when SKY_HOME is not
+ * set; the Makefile points it at the build tree. */
+#ifndef SKY_RUNTIME_DIR
+#define SKY_RUNTIME_DIR "."
+#endif
+
+/* Compiled body of one chunk (SkyChunk.aot): runs `frame` from frame->ip
+ * until it leaves the frame, and returns a SkyStepStatus like JIT code. */
+typedef int (*SkyAotFn)(SkyVM *vm, SkyCallFrame *frame);
+
+/* Writes a C program that runs `chunk` (optimized, ending in HALT). Each
+ * chunk becomes a function with a label per instruction and gotos for
+ * jumps; stack, local and global moves, truth tests and the int and
+ * float paths of arithmetic and compares are inline C behind type guards,
+ * everything else calls sky_vm_step. The bytecode image is embedded, so
+ * constants, functions and line tables for error traces load as from a
+ * .skyc file. */
+bool sky_aot_write_c(SkyChunk *chunk, const char *source_path, const char *path,
+                     char *error, size_t error_size);
+
+/* Writes the C program beside `output` and compiles it with the system C
+ * compiler ($CC, else cc) against libsky.a into the executable `output`. */
+bool sky_aot_build(SkyChunk *chunk, const char *source_path, const char *output,
+                   char *error, size_t error_size);
+
+/* main() of a generated program: loads the embedded image, attaches the
+ * compiled bodies in chunk order and runs it. Returns the exit status. */
+int  sky_aot_main(const char *source_path, uint8_t *image, size_t image_size,
+                  const SkyAotFn *bodies, int body_count);
+
+#endif
@@ -136,6 +136,9 @@ void sky_ast_free(SkyASTNode *node) {
             break;
         case AST_CLASS:
             free(node->data.class_def.name);
+            for (i = 0; i < node->data.class_def.field_count; i++)
+                free(node->data.class_def.fields[i]);
+            free(node->data.class_def.fields);
             for (i = 0; i < node->data.class_def.member_count; i++)
                 sky_ast_free(node->data.class_def.members[i]);
             free(node->data.class_def.members);
@@ -188,6 +188,8 @@ struct SkyASTNode {
         /* class */
         struct {
             char *name;
+            char **fields;          /* declared field names, in order */
+            int field_count;
             SkyASTNode **members;
             int member_count;
         } class_def;
@@ -4,71 +4,276 @@
 
 #include <stdint.h>
 #include "value.h"
+#include "table.h"
+
+/* GET_FIELD, SET_FIELD and INVOKE (and their *_LONG forms) carry an
+ * inline cache after their other operands: SKY_IC_WAYS entries of a
+ * shape id (native byte order, 0 for an empty entry) and the field slot
+ * or method index that shape resolved to. The VM fills entries as it
+ * meets new shapes at the site; see class.h. Ids mean nothing outside
+ * the process, so writing bytecode out clears every cache. */
+#define SKY_IC_WAYS  4
+#define SKY_IC_ENTRY 5
+#define SKY_IC_SIZE  (SKY_IC_WAYS * SKY_IC_ENTRY)
+
+/* Every opcode in encoding order with the number of operand bytes that
+ * follow it. Expanded into the enum below, the disassembler name table,
+ * sky_opcode_length() and the VM dispatch table so they cannot drift. */
+#define SKY_OPCODE_LIST(X)             \
+    X(NOP, 0)                          \
+    X(CONSTANT, 1)                     \
+    X(CONSTANT_LONG, 3)                \
+    X(TRUE, 0)                         \
+    X(FALSE, 0)                        \
+    X(NIL, 0)                          \
+    X(POP, 0)                          \
+    X(DUP, 0)                          \
+    X(GET_LOCAL, 1)                    \
+    X(SET_LOCAL, 1)                    \
+    X(GET_GLOBAL, 1)                   \
+    X(SET_GLOBAL, 1)                   \
+    X(GET_GLOBAL_SLOT, 1)              \
+    X(SET_GLOBAL_SLOT, 1)              \
+    X(GET_FIELD, 1 + SKY_IC_SIZE)      \
+    X(SET_FIELD, 1 + SKY_IC_SIZE)      \
+    X(GET_GLOBAL_LONG, 3)              \
+    X(SET_GLOBAL_LONG, 3)              \
+    X(GET_FIELD_LONG, 3 + SKY_IC_SIZE) \
+    X(SET_FIELD_LONG, 3 + SKY_IC_SIZE) \
+    X(GET_INDEX, 0)                    \
+    X(SET_INDEX, 0)                    \
+    X(GET_INDEX_UNCHECKED, 0)          \
+    X(ADD, 0)                          \
+    X(SUB, 0)                          \
+    X(MUL, 0)                          \
+    X(DIV, 0)                          \
+    X(MOD, 0)                          \
+    X(NEGATE, 0)                       \
+    X(NOT, 0)                          \
+    X(EQUAL, 0)                        \
+    X(NOT_EQUAL, 0)                    \
+    X(GREATER, 0)                      \
+    X(GREATER_EQ, 0)                   \
+    X(LESS, 0)                         \
+    X(LESS_EQ, 0)                      \
+    X(AND, 0)                          \
+    X(OR, 0)                           \
+    X(AND_JUMP, 2)                     \
+    X(OR_JUMP, 2)                      \
+    X(TO_BOOL, 0)                      \
+    X(JUMP, 2)                         \
+    X(JUMP_IF_FALSE, 2)                \
+    X(JUMP_BACK, 2)                    \
+    X(FOR_RANGE_PREP, 3)               \
+    X(FOR_RANGE_LOOP, 3)               \
+    X(CALL, 1)                         \
+    X(TAIL_CALL, 1)                    \
+    X(RETURN, 0)                       \
+    X(PRINT, 0)                        \
+    X(ARRAY, 1)                        \
+    X(MAP, 1)                          \
+    X(CLASS, 1)                        \
+    X(METHOD, 0)                       \
+    X(INVOKE, 2 + SKY_IC_SIZE)         \
+    X(INVOKE_LONG, 4 + SKY_IC_SIZE)    \
+    X(IMPORT, 0)                       \
+    X(SERVER, 0)                       \
+    X(ROUTE, 0)                        \
+    X(RESPOND, 0)                      \
+    X(SECURITY, 0)                     \
+    X(ASYNC, 0)                        \
+    X(AWAIT, 0)                        \
+    X(HALT, 0)                         \
+    X(ADD_INT_INT, 0)                  \
+    X(ADD_FLOAT_FLOAT, 0)              \
+    X(SUB_INT_INT, 0)                  \
+    X(SUB_FLOAT_FLOAT, 0)              \
+    X(MUL_INT_INT, 0)                  \
+    X(MUL_FLOAT_FLOAT, 0)              \
+    X(LESS_INT_INT, 0)                 \
+    X(LESS_FLOAT_FLOAT, 0)             \
+    X(LESS_EQ_INT_INT, 0)              \
+    X(LESS_EQ_FLOAT_FLOAT, 0)          \
+    X(GREATER_INT_INT, 0)              \
+    X(GREATER_FLOAT_FLOAT, 0)          \
+    X(GREATER_EQ_INT_INT, 0)           \
+    X(GREATER_EQ_FLOAT_FLOAT, 0)       \
+    X(INC_LOCAL, 2)                    \
+    X(GET_LOCAL_GET_LOCAL_ADD, 2)      \
+    X(LESS_JUMP_IF_FALSE, 2)           \
+    X(LESS_EQ_JUMP_IF_FALSE, 2)        \
+    X(GREATER_JUMP_IF_FALSE, 2)        \
+    X(GREATER_EQ_JUMP_IF_FALSE, 2)     \
+    X(EQUAL_JUMP_IF_FALSE, 2)          \
+    X(NOT_EQUAL_JUMP_IF_FALSE, 2)      \
+    X(POP_JUMP_IF_FALSE, 2)            \
+    X(MOVE, 2)                         \
+    X(LOAD_CONST, 2)                   \
+    X(ADD_RR, 3)                       \
+    X(SUB_RR, 3)                       \
+    X(MUL_RR, 3)                       \
+    X(ADD_RK, 3)                       \
+    X(SUB_RK, 3)                       \
+    X(MUL_RK, 3)                       \
+    X(LESS_RR_JUMP_IF_FALSE, 4)        \
+    X(LESS_EQ_RR_JUMP_IF_FALSE, 4)     \
+    X(GREATER_RR_JUMP_IF_FALSE, 4)     \
+    X(GREATER_EQ_RR_JUMP_IF_FALSE, 4)  \
+    X(EQUAL_RR_JUMP_IF_FALSE, 4)       \
+    X(NOT_EQUAL_RR_JUMP_IF_FALSE, 4)   \
+    X(LESS_RK_JUMP_IF_FALSE, 4)        \
+    X(LESS_EQ_RK_JUMP_IF_FALSE, 4)     \
+    X(GREATER_RK_JUMP_IF_FALSE, 4)     \
+    X(GREATER_EQ_RK_JUMP_IF_FALSE, 4)  \
+    X(EQUAL_RK_JUMP_IF_FALSE, 4)       \
+    X(NOT_EQUAL_RK_JUMP_IF_FALSE, 4)
 
 typedef enum {
-    OP_NOP = 0,
-    OP_CONSTANT,
-    OP_CONSTANT_LONG,
-    OP_TRUE,
-    OP_FALSE,
-    OP_NIL,
-    OP_POP,
-    OP_DUP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_FIELD,
-    OP_SET_FIELD,
-    OP_GET_INDEX,
-    OP_SET_INDEX,
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    OP_MOD,
-    OP_NEGATE,
-    OP_NOT,
-    OP_EQUAL,
-    OP_NOT_EQUAL,
-    OP_GREATER,
-    OP_GREATER_EQ,
-    OP_LESS,
-    OP_LESS_EQ,
-    OP_AND,
-    OP_OR,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_JUMP_BACK,
-    OP_CALL,
-    OP_RETURN,
-    OP_PRINT,
-    OP_ARRAY,
-    OP_MAP,
-    OP_CLASS,
-    OP_METHOD,
-    OP_INVOKE,
-    OP_IMPORT,
-    OP_SERVER,
-    OP_ROUTE,
-    OP_RESPOND,
-    OP_SECURITY,
-    OP_ASYNC,
-    OP_AWAIT,
-    OP_HALT
+#define SKY_OPCODE_ENUM(name, operand_bytes) OP_##name,
+    SKY_OPCODE_LIST(SKY_OPCODE_ENUM)
+#undef SKY_OPCODE_ENUM
+    OP_COUNT
 } SkyOpCode;
 
+/* GET_GLOBAL_SLOT / SET_GLOBAL_SLOT index the VM's dense global array.
+ * The compiler gives every global name it sees a slot in the chunk's
+ * global_names table; the VM binds the slots against vm->globals before
+ * running. GET_GLOBAL / SET_GLOBAL (name constant, hash lookup) remain
+ * for names past the one-byte slot range. */
+#define SKY_MAX_GLOBAL_SLOTS 256
+
+/* Every constant-taking opcode has a *_LONG form with a 24-bit big-endian
+ * index, which the compiler emits once a chunk has more than 256 constants.
+ * Equal constants share one pool entry per chunk. */
+#define SKY_MAX_CONSTANTS (1 << 24)
+
+/* Classes are built at run time from what the compiler pushes:
+ *   CLASS n            class name, n declared field names -> class
+ *   METHOD             class, method name, function -> class
+ *   INVOKE argc name   nil, receiver, argc arguments -> result
+ * INVOKE fills the nil below the receiver with the method, so the
+ * method's frame sees itself in slot 0 and the receiver (self) in slot 1.
+ * A receiver with no such method calls the field of that name, if any,
+ * with the arguments alone. */
+
+/* GET_INDEX_UNCHECKED is GET_INDEX without the bounds check on arrays,
+ * which the compiler emits for `a[i]` inside `for i in 0..len(a)` when
+ * nothing in the loop body can change a, i or the length of a. The
+ * receiver and index types are still checked. */
+
+/* `and` / `or` short-circuit. AND_JUMP leaves false and jumps when the
+ * left operand is nil or false, otherwise pops it and falls into the
+ * right operand, which TO_BOOL then converts; OR_JUMP is the mirror
+ * image. AND / OR (both operands evaluated) are no longer emitted. */
+
+/* `for i in a..b` keeps the counter in the loop variable's slot and the
+ * bound, evaluated once, in the hidden slot above it. Operands are that
+ * slot and a jump distance:
+ *   FOR_RANGE_PREP slot off   skip the loop (forward) unless i < bound
+ *   FOR_RANGE_LOOP slot off   i += 1, back to the body while i < bound
+ * Every jump keeps its distance in the last two operand bytes. */
+
+/* The *_INT_INT / *_FLOAT_FLOAT opcodes are never emitted by the compiler.
+ * The VM rewrites a generic arithmetic or comparison op in place once it
+ * has seen its operand types, and rewrites it back when a guard misses. */
+#define SKY_QUICKEN_MAX_DEOPTS 4
+
+/* INC_LOCAL and later are superinstructions produced by the fusion pass
+ * in optimizer.c from common compiler sequences:
+ *   INC_LOCAL slot k               GET_LOCAL s; CONSTANT k; ADD; SET_LOCAL s; POP
+ *   GET_LOCAL_GET_LOCAL_ADD a b    GET_LOCAL a; GET_LOCAL b; ADD
+ *   <CMP>_JUMP_IF_FALSE off        <CMP>; JUMP_IF_FALSE; POP (and the POP at the target)
+ *   POP_JUMP_IF_FALSE off          JUMP_IF_FALSE; POP (and the POP at the target)
+ */
+
+/* MOVE and later are the register forms, produced at -O3 by the same
+ * pass. They read and write frame slots directly and leave the operand
+ * stack alone; R is a local slot, K a one-byte constant index:
+ *   MOVE d s                       R[d] = R[s]
+ *   LOAD_CONST d k                 R[d] = K[k]
+ *   <ARITH>_RR d a b               R[d] = R[a] op R[b]    (ADD, SUB, MUL)
+ *   <ARITH>_RK d a k               R[d] = R[a] op K[k]
+ *   <CMP>_RR_JUMP_IF_FALSE a b off jump unless R[a] cmp R[b]
+ *   <CMP>_RK_JUMP_IF_FALSE a k off jump unless R[a] cmp K[k]
+ * Each replaces a whole statement (`d = a + b` is GET_LOCAL, GET_LOCAL,
+ * ADD, SET_LOCAL, POP) or a whole loop or if condition. */
+
+typedef struct {
+    uint64_t quickened;   /* generic ops rewritten to a specialized form */
+    uint64_t deopts;      /* specialized ops that missed their type guard */
+    uint64_t hits;        /* specialized executions (instrumented loop only) */
+    uint64_t generic;     /* quickenable generic executions (instrumented loop only) */
+} SkyQuickenStats;
+
+/* Source lines, run-length encoded: one run per change of line, in code
+ * order. Only read when disassembling or reporting an error. */
+typedef struct {
+    int offset;   /* first code byte of the run */
+    int line;
+} SkyLineRun;
+
+typedef struct {
+    SkyLineRun *runs;
+    int         count;
+    int         capacity;
+} SkyLineTable;
+
+typedef struct {
+    int lookups;     /* constants requested by the compiler */
+    int reused;      /* requests answered by an existing pool entry */
+    int wide;        /* *_LONG instructions emitted */
+} SkyConstantStats;
+
+struct SkyVM;
+struct SkyCallFrame;
+
 typedef struct {
     uint8_t      *code;
     int           code_count;
     int           code_capacity;
     SkyValueArray constants;
-    int          *lines;
+    SkyLineTable  lines;
+    uint8_t      *deopt_counts;   /* per-offset guard misses, allocated on first deopt */
+    SkyString   **global_names;   /* global slot -> interned name */
+    int           global_count;
+    int           global_capacity;
+    int           max_stack;      /* deepest operand stack, from the frame base */
+    bool          verified;       /* max_stack is valid; set by sky_verify_chunk */
+    bool          borrowed;       /* code and lines live in a loaded .skyc image */
+    bool          shared;         /* part of a SkyProgram (isolate.h): never rewritten */
+    SkyQuickenStats quicken;
+    SkyConstantStats constant_stats;
+    SkyStringSet  strings;        /* interned string constants and names; top-level chunk only */
+    struct SkyJitCode *jit;       /* native code once the chunk is hot (jit.h) */
+    uint32_t      hotness;        /* calls, returns and back-edges seen before that */
+    int         (*aot)(struct SkyVM *vm, struct SkyCallFrame *frame);   /* compiled body (aot.h) */
 } SkyChunk;
 
+/* A compiled Sky function. Called with the callee and its arguments on
+ * the stack; the new frame's slot 0 is the callee, slots 1..arity the
+ * arguments, so nothing is copied on entry. */
+typedef struct {
+    SkyObj   obj;
+    char    *name;
+    int      arity;
+    SkyChunk chunk;
+} SkyFunction;
+
+#define AS_FUNCTION(v)     ((SkyFunction*)AS_OBJECT(v))
+
 void sky_chunk_init(SkyChunk *chunk);
 void sky_chunk_free(SkyChunk *chunk);
 void sky_chunk_write(SkyChunk *chunk, uint8_t byte, int line);
 int  sky_chunk_add_constant(SkyChunk *chunk, SkyValue value);
+int  sky_chunk_global_slot(SkyChunk *chunk, SkyString *name);
+SkyString* sky_chunk_intern(SkyChunk *chunk, const char *chars, int length);
+int  sky_chunk_get_line(const SkyChunk *chunk, int offset);
+int  sky_opcode_length(uint8_t op);
+
+void sky_line_table_add(SkyLineTable *table, int offset, int line);
+void sky_line_table_free(SkyLineTable *table);
+
+SkyFunction* sky_function_new(const char *name, int arity);
+void         sky_function_free(SkyFunction *fn);
 
 #endif
@@ -0,0 +1,187 @@
+﻿/* class.c — Classes, instances and their shapes (VAL_CLASS, VAL_INSTANCE) */
+#include "class.h"
+#include "gc.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Shared by every VM in the process, so no two shapes anywhere have the
+ * same id and a cache entry can never match the wrong one. 0 is never
+ * handed out: it marks an empty cache entry. */
+static _Atomic uint32_t g_next_shape_id = 1;
+
+static void* checked_realloc(void *items, size_t size) {
+    void *grown = realloc(items, size);
+    if (!grown) {
+        fprintf(stderr, "[SKY] Out of memory growing a class\n");
+        exit(1);
+    }
+    return grown;
+}
+
+/* Shape memory is charged to the class that owns the tree. */
+static void charge(SkyClass *klass, size_t bytes) {
+    klass->buffer_size += bytes;
+    sky_gc_account((ptrdiff_t)bytes);
+}
+
+static SkyShape* shape_new(SkyClass *klass, SkyShape *parent, int field_count) {
+    SkyShape *shape = (SkyShape*)checked_realloc(NULL, sizeof(SkyShape));
+    shape->id = atomic_fetch_add(&g_next_shape_id, 1);
+    shape->field_count = field_count;
+    shape->names = field_count > 0
+                 ? (SkyString**)checked_realloc(NULL, sizeof(SkyString*) * field_count) : NULL;
+    shape->parent = parent;
+    shape->children = NULL;
+    shape->child_count = 0;
+    shape->child_capacity = 0;
+    charge(klass, sizeof(SkyShape) + sizeof(SkyString*) * field_count);
+    return shape;
+}
+
+static void shape_free(SkyShape *shape) {
+    int i;
+    for (i = 0; i < shape->child_count; i++) shape_free(shape->children[i]);
+    free(shape->children);
+    free(shape->names);
+    free(shape);
+}
+
+int sky_shape_find(const SkyShape *shape, const SkyString *name) {
+    int i;
+    for (i = 0; i < shape->field_count; i++) {
+        if (shape->names[i] == name) return i;
+    }
+    for (i = 0; i < shape->field_count; i++) {
+        if (sky_strings_equal(shape->names[i], name)) return i;
+    }
+    return -1;
+}
+
+/* The shape `shape` becomes once `name` is added. */
+static SkyShape* shape_child(SkyClass *klass, SkyShape *shape, SkyString *name) {
+    SkyShape *child;
+    int i;
+    for (i = 0; i < shape->child_count; i++) {
+        child = shape->children[i];
+        if (sky_strings_equal(child->names[shape->field_count], name)) return child;
+    }
+    if (shape->child_count == shape->child_capacity) {
+        int capacity = shape->child_capacity < 4 ? 4 : shape->child_capacity * 2;
+        shape->children = (SkyShape**)checked_realloc(shape->children, sizeof(SkyShape*) * capacity);
+        charge(klass, sizeof(SkyShape*) * (size_t)(capacity - shape->child_capacity));
+        shape->child_capacity = capacity;
+    }
+    child = shape_new(klass, shape, shape->field_count + 1);
+    if (shape->field_count > 0) {
+        memcpy(child->names, shape->names, sizeof(SkyString*) * shape->field_count);
+    }
+    child->names[shape->field_count] = name;
+    shape->children[shape->child_count++] = child;
+    return child;
+}
+
+SkyClass* sky_class_new(SkyString *name, const SkyValue *fields, int field_count) {
+    SkyClass *klass = (SkyClass*)sky_gc_alloc(sizeof(SkyClass), VAL_CLASS);
+    int i;
+    klass->name = name;
+    klass->method_names = NULL;
+    klass->methods = NULL;
+    klass->method_count = 0;
+    klass->method_capacity = 0;
+    klass->init = NULL;
+    klass->buffer_size = 0;
+    klass->shape = shape_new(klass, NULL, field_count);
+    for (i = 0; i < field_count; i++) klass->shape->names[i] = AS_STRING_OBJ(fields[i]);
+    return klass;
+}
+
+int sky_class_find_method(const SkyClass *klass, const SkyString *name) {
+    int i;
+    for (i = 0; i < klass->method_count; i++) {
+        if (sky_strings_equal(klass->method_names[i], name)) return i;
+    }
+    return -1;
+}
+
+void sky_class_set_method(SkyClass *klass, SkyString *name, SkyFunction *fn) {
+    int index = sky_class_find_method(klass, name);
+    if (index < 0) {
+        if (klass->method_count == klass->method_capacity) {
+            int capacity = klass->method_capacity < 4 ? 4 : klass->method_capacity * 2;
+            klass->method_names = (SkyString**)checked_realloc(klass->method_names,
+                                                               sizeof(SkyString*) * capacity);
+            klass->methods = (SkyFunction**)checked_realloc(klass->methods,
+                                                            sizeof(SkyFunction*) * capacity);
+            charge(klass, (sizeof(SkyString*) + sizeof(SkyFunction*)) *
+                          (size_t)(capacity - klass->method_capacity));
+            klass->method_capacity = capacity;
+        }
+        index = klass->method_count++;
+    }
+    klass->method_names[index] = name;
+    klass->methods[index] = fn;
+    if (name->length == 4 && memcmp(name->chars, "init", 4) == 0) klass->init = fn;
+}
+
+void sky_class_free_buffers(SkyClass *klass) {
+    if (klass->shape) shape_free(klass->shape);
+    free(klass->method_names);
+    free(klass->methods);
+    klass->shape = NULL;
+    klass->method_names = NULL;
+    klass->methods = NULL;
+    klass->method_count = klass->method_capacity = 0;
+    klass->buffer_size = 0;
+}
+
+SkyInstance* sky_instance_new(SkyClass *klass) {
+    SkyInstance *instance = (SkyInstance*)sky_gc_alloc(sizeof(SkyInstance), VAL_INSTANCE);
+    int capacity = klass->shape->field_count;
+    int i;
+    instance->klass = klass;
+    instance->shape = klass->shape;
+    instance->capacity = capacity;
+    instance->fields = capacity > 0
+                     ? (SkyValue*)checked_realloc(NULL, sizeof(SkyValue) * capacity) : NULL;
+    for (i = 0; i < capacity; i++) instance->fields[i] = SKY_NIL();
+    sky_gc_account((ptrdiff_t)(sizeof(SkyValue) * capacity));
+    return instance;
+}
+
+void sky_instance_add_field(SkyInstance *instance, SkyString *name, SkyValue value) {
+    SkyShape *shape = shape_child(instance->klass, instance->shape, name);
+    if (shape->field_count > instance->capacity) {
+        int capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+        instance->fields = (SkyValue*)checked_realloc(instance->fields, sizeof(SkyValue) * capacity);
+        sky_gc_account((ptrdiff_t)(sizeof(SkyValue) * (capacity - instance->capacity)));
+        instance->capacity = capacity;
+    }
+    instance->fields[shape->field_count - 1] = value;
+    instance->shape = shape;
+}
+
+void sky_instance_free_buffers(SkyInstance *instance) {
+    free(instance->fields);
+    instance->fields = NULL;
+    instance->capacity = 0;
+}
+
+void sky_ic_clear(uint8_t *code, int count) {
+    int at, length;
+    for (at = 0; at < count; at += length) {
+        length = sky_opcode_length(code[at]);
+        switch (code[at]) {
+            case OP_GET_FIELD:
+            case OP_SET_FIELD:
+            case OP_GET_FIELD_LONG:
+            case OP_SET_FIELD_LONG:
+            case OP_INVOKE:
+            case OP_INVOKE_LONG:
+                if (at + length <= count) memset(code + at + length - SKY_IC_SIZE, 0, SKY_IC_SIZE);
+                break;
+            default:
+                break;
+        }
+    }
+}
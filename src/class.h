@@ -0,0 +1,108 @@
+﻿/* class.h — Classes, instances and their shapes (VAL_CLASS, VAL_INSTANCE) */
+#ifndef SKY_CLASS_H
+#define SKY_CLASS_H
+
+#include "bytecode.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Instances keep their fields in a flat array of slots; which name is in
+ * which slot is their shape, shared by every instance built the same
+ * way. A class's own shape holds its declared fields, and storing a
+ * field an instance lacks moves it to the child shape for that name,
+ * made once and reused from then on, so shapes form a tree per class.
+ *
+ * Every shape gets an id never given to another in the process, which
+ * is what the inline caches in the bytecode remember (bytecode.h): a
+ * site that has seen a shape reads or writes the slot it recorded
+ * without looking at any names. */
+typedef struct SkyShape {
+    uint32_t          id;
+    int               field_count;
+    SkyString       **names;         /* slot -> field name */
+    struct SkyShape  *parent;
+    struct SkyShape **children;      /* one more field each */
+    int               child_count;
+    int               child_capacity;
+} SkyShape;
+
+typedef struct {
+    SkyObj        obj;
+    SkyString    *name;
+    SkyShape     *shape;             /* declared fields; root of the tree */
+    SkyString   **method_names;
+    SkyFunction **methods;
+    int           method_count;
+    int           method_capacity;
+    SkyFunction  *init;              /* the method named init, if any */
+    size_t        buffer_size;       /* shapes and method table, as accounted */
+} SkyClass;
+
+typedef struct {
+    SkyObj     obj;
+    SkyClass  *klass;
+    SkyShape  *shape;                /* one of klass's */
+    SkyValue  *fields;               /* shape->field_count of them in use */
+    int        capacity;
+} SkyInstance;
+
+#ifdef SKY_NAN_BOXING
+#define IS_CLASS(v)        sky_nan_is_obj_type(v, VAL_CLASS)
+#define IS_INSTANCE(v)     sky_nan_is_obj_type(v, VAL_INSTANCE)
+#else
+#define IS_CLASS(v)        ((v).type == VAL_CLASS)
+#define IS_INSTANCE(v)     ((v).type == VAL_INSTANCE)
+#endif
+#define AS_CLASS(v)        ((SkyClass*)AS_OBJECT(v))
+#define AS_INSTANCE(v)     ((SkyInstance*)AS_OBJECT(v))
+
+/* A class with `field_count` declared fields, from string values. */
+SkyClass* sky_class_new(SkyString *name, const SkyValue *fields, int field_count);
+/* Adds or replaces a method; callers apply the GC barrier for the name. */
+void      sky_class_set_method(SkyClass *klass, SkyString *name, SkyFunction *fn);
+int       sky_class_find_method(const SkyClass *klass, const SkyString *name);
+void      sky_class_free_buffers(SkyClass *klass);
+
+/* An instance in the class's own shape, every field nil. */
+SkyInstance* sky_instance_new(SkyClass *klass);
+/* Appends a field the instance's shape lacks, moving it to the child
+ * shape; callers apply the GC barrier for the name and value. */
+void         sky_instance_add_field(SkyInstance *instance, SkyString *name, SkyValue value);
+void         sky_instance_free_buffers(SkyInstance *instance);
+
+/* Slot of `name` in `shape`, or -1. */
+int  sky_shape_find(const SkyShape *shape, const SkyString *name);
+
+/* Empties the inline cache of every instruction in `code`. */
+void sky_ic_clear(uint8_t *code, int count);
+
+/* Slot or method index a site recorded for `shape_id`, or -1. */
+static inline int sky_ic_find(const uint8_t *cache, uint32_t shape_id) {
+    int i;
+    for (i = 0; i < SKY_IC_WAYS; i++) {
+        uint32_t id;
+        memcpy(&id, cache + i * SKY_IC_ENTRY, sizeof(id));
+        if (id == shape_id) return cache[i * SKY_IC_ENTRY + sizeof(id)];
+    }
+    return -1;
+}
+
+/* Records `index` for `shape_id` in the first free entry. A site that
+ * has seen more shapes than that keeps the ones it has and looks the
+ * rest up every time. */
+static inline void sky_ic_add(uint8_t *cache, uint32_t shape_id, int index) {
+    int i;
+    if (index > 0xff) return;
+    for (i = 0; i < SKY_IC_WAYS; i++) {
+        uint32_t id;
+        memcpy(&id, cache + i * SKY_IC_ENTRY, sizeof(id));
+        if (id != 0) continue;
+        memcpy(cache + i * SKY_IC_ENTRY, &shape_id, sizeof(shape_id));
+        cache[i * SKY_IC_ENTRY + sizeof(shape_id)] = (uint8_t)index;
+        return;
+    }
+}
+
+#endif
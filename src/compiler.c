@@ -1,6 +1,8 @@
 ﻿/* compiler.c — Bytecode compiler implementation */
 #include "compiler.h"
 #include "token.h"
+#include "gc.h"
+#include "jit.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,39 +34,225 @@ static void patch_jump(SkyCompiler *c, int offset) {
     c->chunk->code[offset + 1] = jump & 0xff;
 }
 
+/* Payload bits of a constant that may share a pool entry; functions
+ * never do. Floats compare bitwise so 0.0 and -0.0 stay distinct. */
+static bool constant_bits(SkyValue val, uint64_t *bits) {
+    switch (SKY_TYPE(val)) {
+        case VAL_INT: {
+            int64_t i = AS_INT(val);
+            memcpy(bits, &i, sizeof(i));
+            return true;
+        }
+        case VAL_FLOAT: {
+            double d = AS_FLOAT(val);
+            memcpy(bits, &d, sizeof(d));
+            return true;
+        }
+        case VAL_STRING:
+            *bits = (uint64_t)(uintptr_t)AS_STRING_OBJ(val);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static ConstantEntry* find_constant(ConstantEntry *entries, int capacity,
+                                    SkyValueType type, uint64_t bits) {
+    uint64_t h = (bits ^ (uint64_t)type) * 0x9e3779b97f4a7c15ull;
+    uint32_t index = (uint32_t)(h >> 32) & (uint32_t)(capacity - 1);
+    while (entries[index].index >= 0 &&
+           (entries[index].type != type || entries[index].bits != bits)) {
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    }
+    return &entries[index];
+}
+
+static void grow_constant_index(SkyCompiler *c) {
+    int capacity = c->constant_index_capacity < 16 ? 16 : c->constant_index_capacity * 2;
+    ConstantEntry *entries = (ConstantEntry*)malloc(sizeof(ConstantEntry) * capacity);
+    int i;
+    for (i = 0; i < capacity; i++) entries[i].index = -1;
+    for (i = 0; i < c->constant_index_capacity; i++) {
+        ConstantEntry *old = &c->constant_index[i];
+        if (old->index >= 0) *find_constant(entries, capacity, old->type, old->bits) = *old;
+    }
+    free(c->constant_index);
+    c->constant_index = entries;
+    c->constant_index_capacity = capacity;
+}
+
+static void free_constant_index(SkyCompiler *c) {
+    free(c->constant_index);
+    c->constant_index = NULL;
+    c->constant_index_count = 0;
+    c->constant_index_capacity = 0;
+}
+
+/* Pool index for a constant, reusing an equal entry when there is one. */
 static int make_constant(SkyCompiler *c, SkyValue val) {
-    int idx = sky_chunk_add_constant(c->chunk, val);
-    if (idx > 255) {
+    SkyChunk *chunk = c->chunk;
+    ConstantEntry *entry = NULL;
+    uint64_t bits;
+    int idx;
+
+    chunk->constant_stats.lookups++;
+    if (constant_bits(val, &bits)) {
+        if ((c->constant_index_count + 1) * 4 > c->constant_index_capacity * 3) {
+            grow_constant_index(c);
+        }
+        entry = find_constant(c->constant_index, c->constant_index_capacity, SKY_TYPE(val), bits);
+        if (entry->index >= 0) {
+            /* A boxed int made for this use is a duplicate now */
+            SkyObj *obj = sky_gc_object_of(val);
+            if (obj && obj != sky_gc_object_of(chunk->constants.values[entry->index]) &&
+                (obj->flags & SKY_OBJ_STATIC) && !(obj->flags & SKY_OBJ_INTERNED)) {
+                sky_obj_free(obj);
+            }
+            chunk->constant_stats.reused++;
+            return entry->index;
+        }
+    }
+    if (chunk->constants.count >= SKY_MAX_CONSTANTS) {
         fprintf(stderr, "Compiler error: Too many constants\n");
         c->had_error = true;
         return 0;
     }
+    idx = sky_chunk_add_constant(chunk, val);
+    if (entry) {
+        entry->type = SKY_TYPE(val);
+        entry->bits = bits;
+        entry->index = idx;
+        c->constant_index_count++;
+    }
     return idx;
 }
 
+/* `op` with a one-byte constant index, or `long_op` with three bytes. */
+static void emit_constant_op(SkyCompiler *c, uint8_t op, uint8_t long_op, int idx, int line) {
+    if (idx <= 0xff) {
+        emit_bytes(c, op, (uint8_t)idx, line);
+        return;
+    }
+    emit_byte(c, long_op, line);
+    emit_byte(c, (uint8_t)((idx >> 16) & 0xff), line);
+    emit_byte(c, (uint8_t)((idx >> 8) & 0xff), line);
+    emit_byte(c, (uint8_t)(idx & 0xff), line);
+    c->chunk->constant_stats.wide++;
+}
+
+/* The inline cache that follows a field or INVOKE instruction's other
+ * operands (bytecode.h); it starts out empty. */
+static void emit_cache(SkyCompiler *c, int line) {
+    int i;
+    for (i = 0; i < SKY_IC_SIZE; i++) emit_byte(c, 0, line);
+}
+
+static SkyCompiler* root_compiler(SkyCompiler *c) {
+    while (c->enclosing) c = c->enclosing;
+    return c;
+}
+
+/* Names and string literals are interned in the top-level chunk, so each
+ * distinct string is one static object shared by every function. */
+static SkyString* intern(SkyCompiler *c, const char *chars) {
+    if (!chars) chars = "";
+    return sky_chunk_intern(root_compiler(c)->chunk, chars, (int)strlen(chars));
+}
+
+static SkyValue string_constant(SkyCompiler *c, const char *chars) {
+    return SKY_STRING(intern(c, chars));
+}
+
 static void emit_constant(SkyCompiler *c, SkyValue val, int line) {
-    emit_bytes(c, OP_CONSTANT, (uint8_t)make_constant(c, val), line);
+    emit_constant_op(c, OP_CONSTANT, OP_CONSTANT_LONG, make_constant(c, val), line);
+}
+
+static SymbolEntry* find_symbol(SymbolEntry *entries, int capacity, SkyString *name) {
+    uint32_t index = sky_string_hash(name) & (uint32_t)(capacity - 1);
+    while (entries[index].name && entries[index].name != name) {
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    }
+    return &entries[index];
+}
+
+/* Slot bound to `name`, or -1. */
+static int lookup_symbol(SymbolTable *table, SkyString *name) {
+    SymbolEntry *entry;
+    if (table->count == 0) return -1;
+    entry = find_symbol(table->entries, table->capacity, name);
+    return entry->name ? entry->index : -1;
+}
+
+/* Entry for `name`, added unbound (-1) on first use. */
+static SymbolEntry* symbol_entry(SymbolTable *table, SkyString *name) {
+    SymbolEntry *entry;
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        int capacity = table->capacity < 16 ? 16 : table->capacity * 2;
+        SymbolEntry *entries = (SymbolEntry*)calloc(capacity, sizeof(SymbolEntry));
+        int i;
+        for (i = 0; i < table->capacity; i++) {
+            SymbolEntry *old = &table->entries[i];
+            if (old->name) *find_symbol(entries, capacity, old->name) = *old;
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    entry = find_symbol(table->entries, table->capacity, name);
+    if (!entry->name) {
+        entry->name = name;
+        entry->index = -1;
+        table->count++;
+    }
+    return entry;
+}
+
+static void free_symbols(SymbolTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+    table->capacity = 0;
 }
 
-static int add_local(SkyCompiler *c, const char *name) {
+/* Globals get a dense slot when one is available; past that the name
+ * goes into the constant pool and the VM falls back to a table lookup. */
+static void emit_global(SkyCompiler *c, uint8_t slot_op, uint8_t name_op,
+                        uint8_t name_long_op, SkyString *name, int line) {
+    /* Slots are numbered in the top-level chunk so every function shares them */
+    SkyCompiler *root = root_compiler(c);
+    SymbolEntry *entry = symbol_entry(&root->globals, name);
+    if (entry->index < 0 && root->chunk->global_count < SKY_MAX_GLOBAL_SLOTS) {
+        entry->index = sky_chunk_global_slot(root->chunk, name);
+    }
+    if (entry->index >= 0) {
+        emit_bytes(c, slot_op, (uint8_t)entry->index, line);
+    } else {
+        emit_constant_op(c, name_op, name_long_op, make_constant(c, SKY_STRING(name)), line);
+    }
+}
+
+/* A NULL name reserves a slot that no identifier can reach. */
+static int add_local(SkyCompiler *c, SkyString *name) {
+    Local *local;
     if (c->local_count >= SKY_MAX_LOCALS) {
         fprintf(stderr, "Compiler error: Too many local variables\n");
         c->had_error = true;
         return -1;
     }
-    Local *local = &c->locals[c->local_count];
-    strncpy(local->name, name, sizeof(local->name) - 1);
-    local->name[sizeof(local->name) - 1] = '\0';
+    local = &c->locals[c->local_count];
+    local->name = name;
     local->depth = c->scope_depth;
+    local->shadowed = -1;
+    if (name) {
+        SymbolEntry *entry = symbol_entry(&c->scope, name);
+        local->shadowed = entry->index;
+        entry->index = c->local_count;
+    }
     return c->local_count++;
 }
 
-static int resolve_local(SkyCompiler *c, const char *name) {
-    int i;
-    for (i = c->local_count - 1; i >= 0; i--) {
-        if (strcmp(c->locals[i].name, name) == 0) return i;
-    }
-    return -1;
+static int resolve_local(SkyCompiler *c, SkyString *name) {
+    return lookup_symbol(&c->scope, name);
 }
 
 static void begin_scope(SkyCompiler *c) {
@@ -74,24 +262,201 @@ static void begin_scope(SkyCompiler *c) {
 static void end_scope(SkyCompiler *c, int line) {
     c->scope_depth--;
     while (c->local_count > 0 && c->locals[c->local_count - 1].depth > c->scope_depth) {
+        Local *local = &c->locals[--c->local_count];
+        if (local->name) {
+            find_symbol(c->scope.entries, c->scope.capacity, local->name)->index = local->shadowed;
+        }
         emit_byte(c, OP_POP, line);
-        c->local_count--;
     }
 }
 
 static void compile_node(SkyCompiler *c, SkyASTNode *node);
 
+/* Compile a function body into its own chunk. Slot 0 of the frame holds
+ * the callee, parameters follow in order. An initializer (a class's init)
+ * returns self, its first parameter, wherever it returns. */
+static SkyFunction* compile_function(SkyCompiler *c, SkyASTNode *node, bool initializer) {
+    SkyFunction *fn = sky_function_new(node->data.function.name,
+                                       node->data.function.param_count);
+    SkyCompiler sub;
+    SkyASTNode *body = node->data.function.body;
+    int i;
+
+    sky_compiler_init(&sub, &fn->chunk);
+    sub.enclosing = c;
+    sub.scope_depth = 1;
+    sub.initializer = initializer;
+    add_local(&sub, NULL);
+    for (i = 0; i < node->data.function.param_count; i++)
+        add_local(&sub, intern(c, node->data.function.param_names[i]));
+
+    if (body && body->type == AST_BLOCK) {
+        for (i = 0; i < body->data.block.count; i++)
+            compile_node(&sub, body->data.block.statements[i]);
+    } else {
+        compile_node(&sub, body);
+    }
+    if (initializer) emit_bytes(&sub, OP_GET_LOCAL, 1, node->line);
+    else emit_byte(&sub, OP_NIL, node->line);
+    emit_byte(&sub, OP_RETURN, node->line);
+    free_constant_index(&sub);
+    free_symbols(&sub.scope);
+
+    if (sub.had_error) c->had_error = true;
+    return fn;
+}
+
 static void compile_block(SkyCompiler *c, SkyASTNode *node) {
     int i;
     if (!node) return;
     if (node->type == AST_BLOCK) {
+        /* Loop bodies get their own scope so per-iteration locals are popped */
+        begin_scope(c);
         for (i = 0; i < node->data.block.count; i++)
             compile_node(c, node->data.block.statements[i]);
+        end_scope(c, node->line);
     } else {
         compile_node(c, node);
     }
 }
 
+/* `a and b` / `a or b`: the right operand runs only when the left one
+ * leaves the result open. Both edges end with a bool on the stack. */
+static void compile_logical(SkyCompiler *c, SkyASTNode *node) {
+    int jump;
+    compile_node(c, node->data.binary.left);
+    jump = emit_jump(c, node->data.binary.op == TOKEN_AND ? OP_AND_JUMP : OP_OR_JUMP,
+                     node->line);
+    compile_node(c, node->data.binary.right);
+    emit_byte(c, OP_TO_BOOL, node->line);
+    patch_jump(c, jump);
+}
+
+/* Whether running `node` could bind `name` (let, assignment, loop
+ * variable, parameter, function or class), or, with `calls`, call
+ * anything at all. Node types this does not know about count as both. */
+static bool binds_name(const SkyASTNode *node, const char *name, bool calls) {
+    int i;
+    if (!node) return false;
+    switch (node->type) {
+        case AST_INT_LITERAL:
+        case AST_FLOAT_LITERAL:
+        case AST_STRING_LITERAL:
+        case AST_BOOL_LITERAL:
+        case AST_NIL_LITERAL:
+        case AST_IDENTIFIER:
+        case AST_IMPORT:
+        case AST_BREAK:
+        case AST_CONTINUE:
+            return false;
+        case AST_PROGRAM:
+            for (i = 0; i < node->data.program.count; i++)
+                if (binds_name(node->data.program.statements[i], name, calls)) return true;
+            return false;
+        case AST_BLOCK:
+            for (i = 0; i < node->data.block.count; i++)
+                if (binds_name(node->data.block.statements[i], name, calls)) return true;
+            return false;
+        case AST_BINARY:
+            return binds_name(node->data.binary.left, name, calls) ||
+                   binds_name(node->data.binary.right, name, calls);
+        case AST_UNARY:
+            return binds_name(node->data.unary.operand, name, calls);
+        case AST_CALL:
+            if (calls) return true;
+            for (i = 0; i < node->data.call.arg_count; i++)
+                if (binds_name(node->data.call.args[i], name, calls)) return true;
+            return binds_name(node->data.call.callee, name, calls);
+        case AST_DOT:
+            return binds_name(node->data.dot.object, name, calls);
+        case AST_INDEX:
+            return binds_name(node->data.index_access.object, name, calls) ||
+                   binds_name(node->data.index_access.index, name, calls);
+        case AST_ARRAY_LITERAL:
+            for (i = 0; i < node->data.array_literal.count; i++)
+                if (binds_name(node->data.array_literal.elements[i], name, calls)) return true;
+            return false;
+        case AST_MAP_LITERAL:
+            for (i = 0; i < node->data.map_literal.count; i++)
+                if (binds_name(node->data.map_literal.keys[i], name, calls) ||
+                    binds_name(node->data.map_literal.values[i], name, calls)) return true;
+            return false;
+        case AST_ASSIGN:
+            if (node->data.assign.target->type == AST_IDENTIFIER &&
+                strcmp(node->data.assign.target->data.identifier.name, name) == 0) return true;
+            return binds_name(node->data.assign.target, name, calls) ||
+                   binds_name(node->data.assign.value, name, calls);
+        case AST_LET:
+            return strcmp(node->data.let.name, name) == 0 ||
+                   binds_name(node->data.let.initializer, name, calls);
+        case AST_IF:
+            return binds_name(node->data.if_stmt.condition, name, calls) ||
+                   binds_name(node->data.if_stmt.then_branch, name, calls) ||
+                   binds_name(node->data.if_stmt.else_branch, name, calls);
+        case AST_WHILE:
+            return binds_name(node->data.while_stmt.condition, name, calls) ||
+                   binds_name(node->data.while_stmt.body, name, calls);
+        case AST_FOR:
+            return strcmp(node->data.for_range.var_name, name) == 0 ||
+                   binds_name(node->data.for_range.start, name, calls) ||
+                   binds_name(node->data.for_range.end, name, calls) ||
+                   binds_name(node->data.for_range.body, name, calls);
+        case AST_FUNCTION:
+            if (node->data.function.name && strcmp(node->data.function.name, name) == 0) return true;
+            for (i = 0; i < node->data.function.param_count; i++)
+                if (strcmp(node->data.function.param_names[i], name) == 0) return true;
+            return binds_name(node->data.function.body, name, calls);
+        case AST_CLASS:
+            if (strcmp(node->data.class_def.name, name) == 0) return true;
+            for (i = 0; i < node->data.class_def.member_count; i++)
+                if (binds_name(node->data.class_def.members[i], name, calls)) return true;
+            return false;
+        case AST_RETURN:
+            return binds_name(node->data.return_stmt.value, name, calls);
+        case AST_PRINT:
+            return binds_name(node->data.print_stmt.value, name, calls);
+        case AST_EXPRESSION_STMT:
+            return binds_name(node->data.expr_stmt.expr, name, calls);
+        default:
+            return true;
+    }
+}
+
+/* `for i in 0..len(a)` (or any non-negative literal start) keeps i below
+ * len(a) for the whole loop as long as the body cannot rebind i or a, or
+ * call anything that could shrink a, and `len` is the native one. */
+static bool for_is_bounded(SkyCompiler *c, SkyASTNode *node) {
+    SkyASTNode *start = node->data.for_range.start;
+    SkyASTNode *end = node->data.for_range.end;
+    const char *array;
+    if (root_compiler(c)->len_rebound) return false;
+    if (start && (start->type != AST_INT_LITERAL || start->data.int_literal.value < 0)) return false;
+    if (!end || end->type != AST_CALL || end->data.call.arg_count != 1) return false;
+    if (end->data.call.callee->type != AST_IDENTIFIER ||
+        strcmp(end->data.call.callee->data.identifier.name, "len") != 0) return false;
+    if (end->data.call.args[0]->type != AST_IDENTIFIER) return false;
+    array = end->data.call.args[0]->data.identifier.name;
+    if (strcmp(array, node->data.for_range.var_name) == 0) return false;
+    return !binds_name(node->data.for_range.body, array, true) &&
+           !binds_name(node->data.for_range.body, node->data.for_range.var_name, true);
+}
+
+/* a[i] with both names those of an enclosing bounded loop */
+static bool index_is_bounded(SkyCompiler *c, SkyASTNode *node) {
+    SkyASTNode *object = node->data.index_access.object;
+    SkyASTNode *index = node->data.index_access.index;
+    SkyString *array, *var;
+    int i;
+    if (c->bounded_count == 0) return false;
+    if (object->type != AST_IDENTIFIER || index->type != AST_IDENTIFIER) return false;
+    array = intern(c, object->data.identifier.name);
+    var = intern(c, index->data.identifier.name);
+    for (i = c->bounded_count - 1; i >= 0; i--) {
+        if (c->bounded[i].array == array && c->bounded[i].index == var) return true;
+    }
+    return false;
+}
+
 static void compile_node(SkyCompiler *c, SkyASTNode *node) {
     int i, slot, jump_false, jump_end, loop_start;
     if (!node) return;
@@ -110,7 +475,7 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             break;
 
         case AST_STRING_LITERAL:
-            emit_constant(c, SKY_STRING(node->data.string_literal.value), node->line);
+            emit_constant(c, string_constant(c, node->data.string_literal.value), node->line);
             break;
 
         case AST_BOOL_LITERAL:
@@ -122,18 +487,22 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             break;
 
         case AST_IDENTIFIER: {
-            const char *name = node->data.identifier.name;
+            SkyString *name = intern(c, node->data.identifier.name);
             slot = resolve_local(c, name);
             if (slot >= 0) {
                 emit_bytes(c, OP_GET_LOCAL, (uint8_t)slot, node->line);
             } else {
-                emit_bytes(c, OP_GET_GLOBAL,
-                    (uint8_t)make_constant(c, SKY_STRING(name)), node->line);
+                emit_global(c, OP_GET_GLOBAL_SLOT, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG,
+                            name, node->line);
             }
             break;
         }
 
         case AST_BINARY:
+            if (node->data.binary.op == TOKEN_AND || node->data.binary.op == TOKEN_OR) {
+                compile_logical(c, node);
+                break;
+            }
             compile_node(c, node->data.binary.left);
             compile_node(c, node->data.binary.right);
             switch (node->data.binary.op) {
@@ -148,8 +517,6 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
                 case TOKEN_LESS_EQUAL:    emit_byte(c, OP_LESS_EQ, node->line); break;
                 case TOKEN_GREATER:       emit_byte(c, OP_GREATER, node->line); break;
                 case TOKEN_GREATER_EQUAL: emit_byte(c, OP_GREATER_EQ, node->line); break;
-                case TOKEN_AND:           emit_byte(c, OP_AND, node->line); break;
-                case TOKEN_OR:            emit_byte(c, OP_OR, node->line); break;
                 default:
                     fprintf(stderr, "Compiler error: Unknown binary operator %d\n", node->data.binary.op);
                     c->had_error = true;
@@ -170,6 +537,27 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             break;
 
         case AST_CALL:
+            if (node->data.call.callee->type == AST_DOT) {
+                /* obj.name(args): the nil is where INVOKE puts the method */
+                SkyASTNode *dot = node->data.call.callee;
+                emit_byte(c, OP_NIL, node->line);
+                compile_node(c, dot->data.dot.object);
+                for (i = 0; i < node->data.call.arg_count; i++)
+                    compile_node(c, node->data.call.args[i]);
+                slot = make_constant(c, string_constant(c, dot->data.dot.field));
+                if (slot <= 0xff) {
+                    emit_bytes(c, OP_INVOKE, (uint8_t)node->data.call.arg_count, node->line);
+                    emit_byte(c, (uint8_t)slot, node->line);
+                } else {
+                    emit_bytes(c, OP_INVOKE_LONG, (uint8_t)node->data.call.arg_count, node->line);
+                    emit_byte(c, (uint8_t)((slot >> 16) & 0xff), node->line);
+                    emit_byte(c, (uint8_t)((slot >> 8) & 0xff), node->line);
+                    emit_byte(c, (uint8_t)(slot & 0xff), node->line);
+                    c->chunk->constant_stats.wide++;
+                }
+                emit_cache(c, node->line);
+                break;
+            }
             compile_node(c, node->data.call.callee);
             for (i = 0; i < node->data.call.arg_count; i++)
                 compile_node(c, node->data.call.args[i]);
@@ -178,14 +566,16 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
 
         case AST_DOT:
             compile_node(c, node->data.dot.object);
-            emit_bytes(c, OP_GET_FIELD,
-                (uint8_t)make_constant(c, SKY_STRING(node->data.dot.field)), node->line);
+            emit_constant_op(c, OP_GET_FIELD, OP_GET_FIELD_LONG,
+                make_constant(c, string_constant(c, node->data.dot.field)), node->line);
+            emit_cache(c, node->line);
             break;
 
         case AST_INDEX:
             compile_node(c, node->data.index_access.object);
             compile_node(c, node->data.index_access.index);
-            emit_byte(c, OP_GET_INDEX, node->line);
+            emit_byte(c, index_is_bounded(c, node) ? OP_GET_INDEX_UNCHECKED : OP_GET_INDEX,
+                      node->line);
             break;
 
         case AST_ARRAY_LITERAL:
@@ -194,22 +584,38 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             emit_bytes(c, OP_ARRAY, (uint8_t)node->data.array_literal.count, node->line);
             break;
 
+        case AST_MAP_LITERAL:
+            /* The pair count doubles as the size hint: the map is built
+             * with room for every pair and never grows while filled */
+            if (node->data.map_literal.count > 0xff) {
+                fprintf(stderr, "Compiler error: Too many entries in map literal\n");
+                c->had_error = true;
+                break;
+            }
+            for (i = 0; i < node->data.map_literal.count; i++) {
+                compile_node(c, node->data.map_literal.keys[i]);
+                compile_node(c, node->data.map_literal.values[i]);
+            }
+            emit_bytes(c, OP_MAP, (uint8_t)node->data.map_literal.count, node->line);
+            break;
+
         case AST_ASSIGN:
             compile_node(c, node->data.assign.value);
             if (node->data.assign.target->type == AST_IDENTIFIER) {
-                const char *name = node->data.assign.target->data.identifier.name;
+                SkyString *name = intern(c, node->data.assign.target->data.identifier.name);
                 slot = resolve_local(c, name);
                 if (slot >= 0) {
                     emit_bytes(c, OP_SET_LOCAL, (uint8_t)slot, node->line);
                 } else {
-                    emit_bytes(c, OP_SET_GLOBAL,
-                        (uint8_t)make_constant(c, SKY_STRING(name)), node->line);
+                    emit_global(c, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG,
+                                name, node->line);
                 }
             } else if (node->data.assign.target->type == AST_DOT) {
                 compile_node(c, node->data.assign.target->data.dot.object);
-                emit_bytes(c, OP_SET_FIELD,
-                    (uint8_t)make_constant(c, SKY_STRING(node->data.assign.target->data.dot.field)),
+                emit_constant_op(c, OP_SET_FIELD, OP_SET_FIELD_LONG,
+                    make_constant(c, string_constant(c, node->data.assign.target->data.dot.field)),
                     node->line);
+                emit_cache(c, node->line);
             } else if (node->data.assign.target->type == AST_INDEX) {
                 compile_node(c, node->data.assign.target->data.index_access.object);
                 compile_node(c, node->data.assign.target->data.index_access.index);
@@ -224,10 +630,11 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
                 emit_byte(c, OP_NIL, node->line);
             }
             if (c->scope_depth > 0) {
-                add_local(c, node->data.let.name);
+                add_local(c, intern(c, node->data.let.name));
             } else {
-                emit_bytes(c, OP_SET_GLOBAL,
-                    (uint8_t)make_constant(c, SKY_STRING(node->data.let.name)), node->line);
+                emit_global(c, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG,
+                            intern(c, node->data.let.name), node->line);
+                emit_byte(c, OP_POP, node->line);
             }
             break;
 
@@ -236,16 +643,11 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             jump_false = emit_jump(c, OP_JUMP_IF_FALSE, node->line);
             emit_byte(c, OP_POP, node->line);
             compile_node(c, node->data.if_stmt.then_branch);
-            if (node->data.if_stmt.else_branch) {
-                jump_end = emit_jump(c, OP_JUMP, node->line);
-                patch_jump(c, jump_false);
-                emit_byte(c, OP_POP, node->line);
-                compile_node(c, node->data.if_stmt.else_branch);
-                patch_jump(c, jump_end);
-            } else {
-                patch_jump(c, jump_false);
-                emit_byte(c, OP_POP, node->line);
-            }
+            jump_end = emit_jump(c, OP_JUMP, node->line);
+            patch_jump(c, jump_false);
+            emit_byte(c, OP_POP, node->line);
+            compile_node(c, node->data.if_stmt.else_branch);
+            patch_jump(c, jump_end);
             break;
 
         case AST_WHILE:
@@ -264,41 +666,39 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             emit_byte(c, OP_POP, node->line);
             break;
 
-        case AST_FOR:
+        case AST_FOR: {
+            /* The bound is evaluated once, before the loop variable is in
+             * scope, and lives in a hidden local above it */
+            bool bounded = c->bounded_count < SKY_MAX_BOUNDED_LOOPS && for_is_bounded(c, node);
             begin_scope(c);
-            /* Push initial value (start of range) */
             if (node->data.for_range.start)
                 compile_node(c, node->data.for_range.start);
             else
                 emit_constant(c, SKY_INT(0), node->line);
-            slot = add_local(c, node->data.for_range.var_name);
-            /* Loop start */
-            loop_start = c->chunk->code_count;
-            /* Compare: local < end */
-            emit_bytes(c, OP_GET_LOCAL, (uint8_t)slot, node->line);
             compile_node(c, node->data.for_range.end);
-            emit_byte(c, OP_LESS, node->line);
-            jump_false = emit_jump(c, OP_JUMP_IF_FALSE, node->line);
-            emit_byte(c, OP_POP, node->line);  /* pop condition */
-            /* Body */
+            slot = add_local(c, intern(c, node->data.for_range.var_name));
+            add_local(c, NULL);
+            emit_bytes(c, OP_FOR_RANGE_PREP, (uint8_t)slot, node->line);
+            emit_bytes(c, 0xff, 0xff, node->line);
+            jump_false = c->chunk->code_count - 2;
+            loop_start = c->chunk->code_count;
+            if (bounded) {
+                BoundedLoop *loop = &c->bounded[c->bounded_count++];
+                loop->array = intern(c, node->data.for_range.end->data.call.args[0]->data.identifier.name);
+                loop->index = intern(c, node->data.for_range.var_name);
+            }
             compile_block(c, node->data.for_range.body);
-            /* Increment: local = local + 1 */
-            emit_bytes(c, OP_GET_LOCAL, (uint8_t)slot, node->line);
-            emit_constant(c, SKY_INT(1), node->line);
-            emit_byte(c, OP_ADD, node->line);
-            emit_bytes(c, OP_SET_LOCAL, (uint8_t)slot, node->line);
-            emit_byte(c, OP_POP, node->line);  /* pop set result */
-            /* Jump back */
+            if (bounded) c->bounded_count--;
             {
-                int back = c->chunk->code_count - loop_start + 3;
-                emit_byte(c, OP_JUMP_BACK, node->line);
+                int back = c->chunk->code_count - loop_start + 4;
+                emit_bytes(c, OP_FOR_RANGE_LOOP, (uint8_t)slot, node->line);
                 emit_byte(c, (back >> 8) & 0xff, node->line);
                 emit_byte(c, back & 0xff, node->line);
             }
             patch_jump(c, jump_false);
-            emit_byte(c, OP_POP, node->line);  /* pop condition */
             end_scope(c, node->line);
             break;
+        }
 
         case AST_BLOCK:
             begin_scope(c);
@@ -307,17 +707,88 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
             end_scope(c, node->line);
             break;
 
-        case AST_FUNCTION:
-            /* Simplified: store function name as global with nil for now */
-            emit_byte(c, OP_NIL, node->line);
-            if (c->scope_depth == 0) {
-                emit_bytes(c, OP_SET_GLOBAL,
-                    (uint8_t)make_constant(c, SKY_STRING(node->data.function.name)), node->line);
+        case AST_FUNCTION: {
+            SkyFunction *fn = compile_function(c, node, false);
+            emit_constant(c, SKY_OBJECT(fn), node->line);
+            if (c->scope_depth > 0) {
+                add_local(c, intern(c, node->data.function.name));
+            } else {
+                emit_global(c, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG,
+                            intern(c, node->data.function.name), node->line);
+                emit_byte(c, OP_POP, node->line);
             }
             break;
+        }
+
+        case AST_CLASS: {
+            /* CLASS takes the name and declared fields, then each METHOD
+             * adds a compiled method to the class left on the stack */
+            int field_count = node->data.class_def.field_count;
+            if (field_count > 0xff) {
+                fprintf(stderr, "Compiler error: Too many fields in class '%s'\n",
+                        node->data.class_def.name);
+                c->had_error = true;
+                break;
+            }
+            emit_constant(c, string_constant(c, node->data.class_def.name), node->line);
+            for (i = 0; i < field_count; i++) {
+                int j;
+                for (j = 0; j < i; j++) {
+                    if (strcmp(node->data.class_def.fields[i], node->data.class_def.fields[j]) == 0) {
+                        fprintf(stderr, "Compiler error: Duplicate field '%s' in class '%s'\n",
+                                node->data.class_def.fields[i], node->data.class_def.name);
+                        c->had_error = true;
+                    }
+                }
+                emit_constant(c, string_constant(c, node->data.class_def.fields[i]), node->line);
+            }
+            emit_bytes(c, OP_CLASS, (uint8_t)field_count, node->line);
+            for (i = 0; i < node->data.class_def.member_count; i++) {
+                SkyASTNode *method = node->data.class_def.members[i];
+                SkyFunction *fn;
+                if (method->data.function.param_count < 1 ||
+                    strcmp(method->data.function.param_names[0], "self") != 0) {
+                    fprintf(stderr, "Compiler error: Method '%s' must take self as its first parameter\n",
+                            method->data.function.name);
+                    c->had_error = true;
+                    continue;
+                }
+                fn = compile_function(c, method, strcmp(method->data.function.name, "init") == 0);
+                emit_constant(c, string_constant(c, method->data.function.name), method->line);
+                emit_constant(c, SKY_OBJECT(fn), method->line);
+                emit_byte(c, OP_METHOD, method->line);
+            }
+            if (c->scope_depth > 0) {
+                add_local(c, intern(c, node->data.class_def.name));
+            } else {
+                emit_global(c, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG,
+                            intern(c, node->data.class_def.name), node->line);
+                emit_byte(c, OP_POP, node->line);
+            }
+            break;
+        }
 
         case AST_RETURN:
-            if (node->data.return_stmt.value) {
+            if (c->initializer) {
+                /* init hands back the new instance, whatever it returns */
+                if (node->data.return_stmt.value) {
+                    fprintf(stderr, "Compiler error: init cannot return a value\n");
+                    c->had_error = true;
+                }
+                emit_bytes(c, OP_GET_LOCAL, 1, node->line);
+                emit_byte(c, OP_RETURN, node->line);
+                break;
+            }
+            if (node->data.return_stmt.value &&
+                node->data.return_stmt.value->type == AST_CALL &&
+                node->data.return_stmt.value->data.call.callee->type != AST_DOT && c->enclosing) {
+                /* Tail position: reuse the frame; natives fall through to RETURN */
+                SkyASTNode *call = node->data.return_stmt.value;
+                compile_node(c, call->data.call.callee);
+                for (i = 0; i < call->data.call.arg_count; i++)
+                    compile_node(c, call->data.call.args[i]);
+                emit_bytes(c, OP_TAIL_CALL, (uint8_t)call->data.call.arg_count, node->line);
+            } else if (node->data.return_stmt.value) {
                 compile_node(c, node->data.return_stmt.value);
             } else {
                 emit_byte(c, OP_NIL, node->line);
@@ -341,8 +812,6 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
         case AST_RESPOND:
         case AST_SECURITY:
         case AST_SECURITY_RULE:
-        case AST_CLASS:
-        case AST_MAP_LITERAL:
         case AST_FOR_IN:
         case AST_BREAK:
         case AST_CONTINUE:
@@ -356,15 +825,28 @@ static void compile_node(SkyCompiler *c, SkyASTNode *node) {
 
 void sky_compiler_init(SkyCompiler *compiler, SkyChunk *chunk) {
     if (!compiler || !chunk) return;
+    compiler->enclosing = NULL;
     compiler->chunk = chunk;
     compiler->local_count = 0;
+    memset(&compiler->scope, 0, sizeof(compiler->scope));
+    memset(&compiler->globals, 0, sizeof(compiler->globals));
     compiler->scope_depth = 0;
+    compiler->initializer = false;
+    compiler->len_rebound = false;
+    compiler->bounded_count = 0;
     compiler->had_error = false;
+    compiler->constant_index = NULL;
+    compiler->constant_index_count = 0;
+    compiler->constant_index_capacity = 0;
 }
 
 bool sky_compiler_compile(SkyCompiler *compiler, SkyASTNode *ast) {
     if (!compiler || !ast) return false;
+    compiler->len_rebound = binds_name(ast, "len", false);
     compile_node(compiler, ast);
+    free_constant_index(compiler);
+    free_symbols(&compiler->scope);
+    free_symbols(&compiler->globals);
     return !compiler->had_error;
 }
 
@@ -373,26 +855,97 @@ void sky_chunk_init(SkyChunk *chunk) {
     chunk->code = NULL;
     chunk->code_count = 0;
     chunk->code_capacity = 0;
-    chunk->lines = NULL;
+    chunk->lines.runs = NULL;
+    chunk->lines.count = 0;
+    chunk->lines.capacity = 0;
+    chunk->deopt_counts = NULL;
+    chunk->global_names = NULL;
+    chunk->global_count = 0;
+    chunk->global_capacity = 0;
+    chunk->max_stack = 0;
+    chunk->verified = false;
+    chunk->borrowed = false;
+    chunk->shared = false;
+    chunk->jit = NULL;
+    chunk->hotness = 0;
+    chunk->aot = NULL;
+    memset(&chunk->quicken, 0, sizeof(chunk->quicken));
+    memset(&chunk->constant_stats, 0, sizeof(chunk->constant_stats));
     sky_value_array_init(&chunk->constants);
+    sky_string_set_init(&chunk->strings);
 }
 
 void sky_chunk_write(SkyChunk *chunk, uint8_t byte, int line) {
     if (chunk->code_count >= chunk->code_capacity) {
         int new_cap = chunk->code_capacity < 8 ? 8 : chunk->code_capacity * 2;
         chunk->code = (uint8_t*)realloc(chunk->code, new_cap);
-        chunk->lines = (int*)realloc(chunk->lines, sizeof(int) * new_cap);
         chunk->code_capacity = new_cap;
     }
+    sky_line_table_add(&chunk->lines, chunk->code_count, line);
     chunk->code[chunk->code_count] = byte;
-    chunk->lines[chunk->code_count] = line;
     chunk->code_count++;
 }
 
+/* Starts a run only when the line differs from the previous byte's. */
+void sky_line_table_add(SkyLineTable *table, int offset, int line) {
+    if (table->count > 0 && table->runs[table->count - 1].line == line) return;
+    if (table->count >= table->capacity) {
+        int new_cap = table->capacity < 8 ? 8 : table->capacity * 2;
+        table->runs = (SkyLineRun*)realloc(table->runs, sizeof(SkyLineRun) * new_cap);
+        table->capacity = new_cap;
+    }
+    table->runs[table->count].offset = offset;
+    table->runs[table->count].line = line;
+    table->count++;
+}
+
+void sky_line_table_free(SkyLineTable *table) {
+    free(table->runs);
+    table->runs = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+/* Line of the code byte at `offset`: the last run starting at or before it. */
+int sky_chunk_get_line(const SkyChunk *chunk, int offset) {
+    const SkyLineRun *runs = chunk->lines.runs;
+    int lo = 0, hi = chunk->lines.count - 1;
+    if (hi < 0) return 0;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (runs[mid].offset <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    return runs[lo].line;
+}
+
 void sky_chunk_free(SkyChunk *chunk) {
+    int i;
     if (!chunk) return;
-    free(chunk->code);
-    free(chunk->lines);
+    /* Static constants (functions, boxed ints) belong to the chunk that
+     * declared them; interned strings to the set that holds them */
+    for (i = 0; i < chunk->constants.count; i++) {
+        SkyValue constant = chunk->constants.values[i];
+        SkyObj *obj = sky_gc_object_of(constant);
+        if (!obj || !(obj->flags & SKY_OBJ_STATIC) || (obj->flags & SKY_OBJ_INTERNED)) continue;
+        if (IS_FUNCTION(constant)) {
+            sky_function_free(AS_FUNCTION(constant));
+        } else {
+            sky_obj_free(obj);
+        }
+    }
+    if (!chunk->borrowed) {
+        free(chunk->code);
+        sky_line_table_free(&chunk->lines);
+    }
+    free(chunk->deopt_counts);
+    free(chunk->global_names);
+    sky_jit_free(chunk->jit);
+    for (i = 0; i < chunk->strings.capacity; i++) {
+        SkyString *str = chunk->strings.entries[i];
+        if (str && str != SKY_STRING_SET_TOMBSTONE) free(str);
+    }
+    sky_string_set_free(&chunk->strings);
     sky_value_array_free(&chunk->constants);
     sky_chunk_init(chunk);
 }
@@ -402,4 +955,61 @@ int sky_chunk_add_constant(SkyChunk *chunk, SkyValue value) {
     return chunk->constants.count - 1;
 }
 
+SkyFunction* sky_function_new(const char *name, int arity) {
+    SkyFunction *fn = (SkyFunction*)malloc(sizeof(SkyFunction));
+    size_t len = name ? strlen(name) : 0;
+    sky_obj_init_static(&fn->obj, VAL_FUNCTION);
+    fn->name = (char*)malloc(len + 1);
+    if (len) memcpy(fn->name, name, len);
+    fn->name[len] = '\0';
+    fn->arity = arity;
+    sky_chunk_init(&fn->chunk);
+    return fn;
+}
+
+void sky_function_free(SkyFunction *fn) {
+    if (!fn) return;
+    sky_chunk_free(&fn->chunk);
+    free(fn->name);
+    free(fn);
+}
+
+/* Slot for an interned global name, allocating one on first use; -1 once
+ * the slot range is exhausted. */
+int sky_chunk_global_slot(SkyChunk *chunk, SkyString *name) {
+    int i;
+    for (i = 0; i < chunk->global_count; i++) {
+        if (chunk->global_names[i] == name) return i;
+    }
+    if (chunk->global_count >= SKY_MAX_GLOBAL_SLOTS) return -1;
+    if (chunk->global_count >= chunk->global_capacity) {
+        int new_cap = chunk->global_capacity < 8 ? 8 : chunk->global_capacity * 2;
+        chunk->global_names = (SkyString**)realloc(chunk->global_names, sizeof(SkyString*) * new_cap);
+        chunk->global_capacity = new_cap;
+    }
+    chunk->global_names[chunk->global_count] = name;
+    return chunk->global_count++;
+}
+
+/* The chunk's single static copy of a string, made on first use. */
+SkyString* sky_chunk_intern(SkyChunk *chunk, const char *chars, int length) {
+    uint32_t hash = sky_hash_chars(chars, length);
+    SkyString *str = sky_string_set_find(&chunk->strings, chars, length, hash);
+    if (str) return str;
+    str = sky_string_static(chars, length);
+    str->obj.flags |= SKY_OBJ_INTERNED;
+    sky_string_set_add(&chunk->strings, str);
+    return str;
+}
+
+int sky_opcode_length(uint8_t op) {
+    static const uint8_t lengths[] = {
+#define SKY_OPCODE_LENGTH(name, operand_bytes) 1 + operand_bytes,
+        SKY_OPCODE_LIST(SKY_OPCODE_LENGTH)
+#undef SKY_OPCODE_LENGTH
+    };
+    if (op >= OP_COUNT) return 1;
+    return lengths[op];
+}
+
 
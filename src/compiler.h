@@ -8,17 +8,59 @@
 
 #define SKY_MAX_LOCALS 256
 
+/* Names are interned, so locals and symbol tables compare them by address. */
 typedef struct {
-    char name[128];
-    int  depth;
+    SkyString *name;       /* NULL for hidden slots (callee, loop bounds) */
+    int        depth;
+    int        shadowed;   /* local this one hides, -1 if none */
 } Local;
 
+/* Open-addressed map from a name to a local or global slot. Entries are
+ * never removed; a name going out of scope maps to -1. */
 typedef struct {
+    SkyString *name;       /* NULL for an empty entry */
+    int        index;
+} SymbolEntry;
+
+typedef struct {
+    SymbolEntry *entries;
+    int          count;
+    int          capacity;
+} SymbolTable;
+
+/* Dedup index over the chunk's constant pool, keyed by type and payload
+ * bits (strings are interned, so their address is the payload). */
+typedef struct {
+    SkyValueType type;
+    uint64_t     bits;
+    int          index;   /* pool index, -1 for an empty slot */
+} ConstantEntry;
+
+#define SKY_MAX_BOUNDED_LOOPS 8
+
+/* `for index in 0..len(array)` whose body cannot rebind either name or
+ * run other code, so array[index] is always in bounds inside it. */
+typedef struct {
+    SkyString *array;
+    SkyString *index;
+} BoundedLoop;
+
+typedef struct SkyCompiler {
+    struct SkyCompiler *enclosing;   /* NULL at top level, else the outer compiler */
     SkyChunk   *chunk;
     Local       locals[SKY_MAX_LOCALS];
     int         local_count;
+    SymbolTable scope;               /* name -> innermost visible local */
+    SymbolTable globals;             /* top level only: name -> global slot */
     int         scope_depth;
+    bool        initializer;         /* compiling a class's init method */
+    bool        len_rebound;         /* top level only: the program binds `len` */
+    BoundedLoop bounded[SKY_MAX_BOUNDED_LOOPS];
+    int         bounded_count;
     bool        had_error;
+    ConstantEntry *constant_index;
+    int         constant_index_count;
+    int         constant_index_capacity;
 } SkyCompiler;
 
 void sky_compiler_init(SkyCompiler *compiler, SkyChunk *chunk);
@@ -5,70 +5,58 @@
 #include <string.h>
 
 bool sky_debug_trace_execution = false;
+bool sky_debug_collect_stats = false;
+bool sky_debug_profile_opcodes = false;
+
+static uint64_t g_op_counts[256];
+static uint64_t g_pair_counts[256][256];
+static int      g_last_op = -1;
 
 static const char* op_name(uint8_t op) {
-    switch (op) {
-        case OP_NOP: return "NOP";
-        case OP_CONSTANT: return "CONSTANT";
-        case OP_CONSTANT_LONG: return "CONSTANT_LONG";
-        case OP_TRUE: return "TRUE";
-        case OP_FALSE: return "FALSE";
-        case OP_NIL: return "NIL";
-        case OP_POP: return "POP";
-        case OP_DUP: return "DUP";
-        case OP_GET_LOCAL: return "GET_LOCAL";
-        case OP_SET_LOCAL: return "SET_LOCAL";
-        case OP_GET_GLOBAL: return "GET_GLOBAL";
-        case OP_SET_GLOBAL: return "SET_GLOBAL";
-        case OP_GET_FIELD: return "GET_FIELD";
-        case OP_SET_FIELD: return "SET_FIELD";
-        case OP_GET_INDEX: return "GET_INDEX";
-        case OP_SET_INDEX: return "SET_INDEX";
-        case OP_ADD: return "ADD";
-        case OP_SUB: return "SUB";
-        case OP_MUL: return "MUL";
-        case OP_DIV: return "DIV";
-        case OP_MOD: return "MOD";
-        case OP_NEGATE: return "NEGATE";
-        case OP_NOT: return "NOT";
-        case OP_EQUAL: return "EQUAL";
-        case OP_NOT_EQUAL: return "NOT_EQUAL";
-        case OP_GREATER: return "GREATER";
-        case OP_GREATER_EQ: return "GREATER_EQ";
-        case OP_LESS: return "LESS";
-        case OP_LESS_EQ: return "LESS_EQ";
-        case OP_AND: return "AND";
-        case OP_OR: return "OR";
-        case OP_JUMP: return "JUMP";
-        case OP_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
-        case OP_JUMP_BACK: return "JUMP_BACK";
-        case OP_CALL: return "CALL";
-        case OP_RETURN: return "RETURN";
-        case OP_PRINT: return "PRINT";
-        case OP_ARRAY: return "ARRAY";
-        case OP_MAP: return "MAP";
-        case OP_CLASS: return "CLASS";
-        case OP_METHOD: return "METHOD";
-        case OP_INVOKE: return "INVOKE";
-        case OP_IMPORT: return "IMPORT";
-        case OP_SERVER: return "SERVER";
-        case OP_ROUTE: return "ROUTE";
-        case OP_RESPOND: return "RESPOND";
-        case OP_SECURITY: return "SECURITY";
-        case OP_ASYNC: return "ASYNC";
-        case OP_AWAIT: return "AWAIT";
-        case OP_HALT: return "HALT";
-        default: return "UNKNOWN";
+    static const char *const names[] = {
+#define SKY_OPCODE_NAME(name, operand_bytes) #name,
+        SKY_OPCODE_LIST(SKY_OPCODE_NAME)
+#undef SKY_OPCODE_NAME
+    };
+    if (op >= OP_COUNT) return "UNKNOWN";
+    return names[op];
+}
+
+/* Field and INVOKE instructions: [argc] name, then how many shapes the
+ * inline cache holds. */
+static int disassemble_cached(SkyChunk *chunk, uint8_t op, int offset) {
+    int length = sky_opcode_length(op);
+    const uint8_t *operands = chunk->code + offset + 1;
+    const uint8_t *cache = chunk->code + offset + length - SKY_IC_SIZE;
+    bool wide = op == OP_GET_FIELD_LONG || op == OP_SET_FIELD_LONG || op == OP_INVOKE_LONG;
+    int cached = 0, i;
+    uint32_t idx;
+    if (op == OP_INVOKE || op == OP_INVOKE_LONG) printf(" %4d", *operands++);
+    idx = wide ? ((uint32_t)operands[0] << 16) | ((uint32_t)operands[1] << 8) | operands[2]
+               : operands[0];
+    printf(" %4d", idx);
+    if ((int)idx < chunk->constants.count) {
+        printf("  (");
+        sky_debug_print_value(chunk->constants.values[idx]);
+        printf(")");
     }
+    for (i = 0; i < SKY_IC_WAYS; i++) {
+        const uint8_t *id = cache + i * SKY_IC_ENTRY;
+        if (id[0] | id[1] | id[2] | id[3]) cached++;
+    }
+    if (cached > 0) printf("  [%d cached]", cached);
+    printf("\n");
+    return offset + length;
 }
 
 int sky_disassemble_instruction(SkyChunk *chunk, int offset) {
     uint8_t op;
+    int line = sky_chunk_get_line(chunk, offset);
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    if (offset > 0 && line == sky_chunk_get_line(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     op = chunk->code[offset];
     printf("%-20s", op_name(op));
@@ -78,12 +66,11 @@ int sky_disassemble_instruction(SkyChunk *chunk, int offset) {
         case OP_SET_LOCAL:
         case OP_GET_GLOBAL:
         case OP_SET_GLOBAL:
-        case OP_GET_FIELD:
-        case OP_SET_FIELD:
         case OP_CALL:
+        case OP_TAIL_CALL:
         case OP_ARRAY:
         case OP_MAP:
-        case OP_INVOKE: {
+        case OP_CLASS: {
             uint8_t idx = chunk->code[offset + 1];
             printf(" %4d", idx);
             if (op == OP_CONSTANT && idx < chunk->constants.count) {
@@ -94,12 +81,31 @@ int sky_disassemble_instruction(SkyChunk *chunk, int offset) {
             printf("\n");
             return offset + 2;
         }
-        case OP_CONSTANT_LONG: {
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT: {
+            uint8_t slot = chunk->code[offset + 1];
+            printf(" %4d", slot);
+            if (slot < chunk->global_count) {
+                printf("  '%s'", chunk->global_names[slot]->chars);
+            }
+            printf("\n");
+            return offset + 2;
+        }
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+        case OP_GET_FIELD_LONG:
+        case OP_SET_FIELD_LONG:
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+            return disassemble_cached(chunk, op, offset);
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG: {
             uint32_t idx = ((uint32_t)chunk->code[offset + 1] << 16) |
                            ((uint32_t)chunk->code[offset + 2] << 8) |
                            (uint32_t)chunk->code[offset + 3];
             printf(" %4d", idx);
-            if ((int)idx < chunk->constants.count) {
+            if (op == OP_CONSTANT_LONG && (int)idx < chunk->constants.count) {
                 printf("  (");
                 sky_debug_print_value(chunk->constants.values[idx]);
                 printf(")");
@@ -107,8 +113,77 @@ int sky_disassemble_instruction(SkyChunk *chunk, int offset) {
             printf("\n");
             return offset + 4;
         }
+        case OP_INC_LOCAL:
+        case OP_GET_LOCAL_GET_LOCAL_ADD: {
+            uint8_t a = chunk->code[offset + 1];
+            uint8_t b = chunk->code[offset + 2];
+            printf(" %4d %4d", a, b);
+            if (op == OP_INC_LOCAL && b < chunk->constants.count) {
+                printf("  (");
+                sky_debug_print_value(chunk->constants.values[b]);
+                printf(")");
+            }
+            printf("\n");
+            return offset + 3;
+        }
+        case OP_MOVE:
+        case OP_LOAD_CONST: {
+            uint8_t dst = chunk->code[offset + 1];
+            uint8_t src = chunk->code[offset + 2];
+            printf(" %4d %4d", dst, src);
+            if (op == OP_LOAD_CONST && src < chunk->constants.count) {
+                printf("  (");
+                sky_debug_print_value(chunk->constants.values[src]);
+                printf(")");
+            }
+            printf("\n");
+            return offset + 3;
+        }
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK: {
+            uint8_t k = chunk->code[offset + 3];
+            printf(" %4d %4d %4d", chunk->code[offset + 1], chunk->code[offset + 2], k);
+            if ((op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK) && k < chunk->constants.count) {
+                printf("  (");
+                sky_debug_print_value(chunk->constants.values[k]);
+                printf(")");
+            }
+            printf("\n");
+            return offset + 4;
+        }
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE: {
+            uint16_t target = ((uint16_t)chunk->code[offset + 3] << 8) |
+                              (uint16_t)chunk->code[offset + 4];
+            printf(" %4d %4d -> %04d\n", chunk->code[offset + 1], chunk->code[offset + 2],
+                   offset + 5 + target);
+            return offset + 5;
+        }
         case OP_JUMP:
-        case OP_JUMP_IF_FALSE: {
+        case OP_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_AND_JUMP:
+        case OP_OR_JUMP: {
             uint16_t target = ((uint16_t)chunk->code[offset + 1] << 8) |
                               (uint16_t)chunk->code[offset + 2];
             printf(" -> %04d\n", offset + 3 + target);
@@ -120,9 +195,18 @@ int sky_disassemble_instruction(SkyChunk *chunk, int offset) {
             printf(" -> %04d\n", offset + 3 - target);
             return offset + 3;
         }
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP: {
+            uint8_t slot = chunk->code[offset + 1];
+            uint16_t target = ((uint16_t)chunk->code[offset + 2] << 8) |
+                              (uint16_t)chunk->code[offset + 3];
+            printf(" %4d -> %04d\n", slot,
+                   op == OP_FOR_RANGE_LOOP ? offset + 4 - target : offset + 4 + target);
+            return offset + 4;
+        }
         default:
             printf("\n");
-            return offset + 1;
+            return offset + sky_opcode_length(op);
     }
 }
 
@@ -136,15 +220,15 @@ void sky_disassemble_chunk(SkyChunk *chunk, const char *name) {
 }
 
 void sky_debug_print_value(SkyValue value) {
-    switch (value.type) {
-        case VAL_INT: printf("%lld", (long long)value.as.integer); break;
-        case VAL_FLOAT: printf("%g", value.as.floating); break;
-        case VAL_BOOL: printf("%s", value.as.boolean ? "true" : "false"); break;
+    switch (SKY_TYPE(value)) {
+        case VAL_INT: printf("%lld", (long long)AS_INT(value)); break;
+        case VAL_FLOAT: printf("%g", AS_FLOAT(value)); break;
+        case VAL_BOOL: printf("%s", AS_BOOL(value) ? "true" : "false"); break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_STRING: printf("\"%s\"", value.as.string ? value.as.string : ""); break;
+        case VAL_STRING: printf("\"%s\"", AS_STRING(value)); break;
         case VAL_ARRAY: printf("[array]"); break;
         case VAL_MAP: printf("{map}"); break;
-        case VAL_FUNCTION: printf("<fn>"); break;
+        case VAL_FUNCTION: printf("<fn %s>", AS_FUNCTION(value)->name); break;
         case VAL_NATIVE_FN: printf("<native>"); break;
         case VAL_CLASS: printf("<class>"); break;
         case VAL_INSTANCE: printf("<instance>"); break;
@@ -152,6 +236,105 @@ void sky_debug_print_value(SkyValue value) {
     }
 }
 
+static void print_chunk_quicken(SkyChunk *chunk, const char *name) {
+    SkyQuickenStats *q = &chunk->quicken;
+    uint64_t total = q->hits + q->generic;
+    int i;
+    printf("  %-20s %9llu %9llu %12llu %12llu %6.1f%%\n", name,
+           (unsigned long long)q->quickened, (unsigned long long)q->deopts,
+           (unsigned long long)q->hits, (unsigned long long)q->generic,
+           total ? 100.0 * (double)q->hits / (double)total : 0.0);
+    for (i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            SkyFunction *fn = AS_FUNCTION(chunk->constants.values[i]);
+            print_chunk_quicken(&fn->chunk, fn->name);
+        }
+    }
+}
+
+/* One row per chunk, since each function counts into its own chunk: sites
+ * quickened, guard misses, and executions of specialized and generic forms. */
+void sky_debug_print_quicken_stats(SkyChunk *chunk, const char *name) {
+    printf("=== quickening: %s ===\n", name);
+    printf("  %-20s %9s %9s %12s %12s %7s\n", "chunk", "quickened", "misses",
+           "specialized", "generic", "hit%");
+    print_chunk_quicken(chunk, "<script>");
+}
+
+static void print_chunk_constants(SkyChunk *chunk, const char *name) {
+    SkyConstantStats *s = &chunk->constant_stats;
+    int strings = 0, numbers = 0, functions = 0, i;
+    for (i = 0; i < chunk->constants.count; i++) {
+        SkyValue value = chunk->constants.values[i];
+        if (IS_STRING(value)) strings++;
+        else if (IS_FUNCTION(value)) functions++;
+        else numbers++;
+    }
+    printf("  %-20s %7d %7d %7d %7d %7d %7d %7d\n", name, chunk->constants.count,
+           strings, numbers, functions, s->lookups, s->reused, s->wide);
+    for (i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            SkyFunction *fn = AS_FUNCTION(chunk->constants.values[i]);
+            print_chunk_constants(&fn->chunk, fn->name);
+        }
+    }
+}
+
+/* One row per chunk: pool size by kind, how many compiler requests were
+ * answered by an existing entry, and how many wide operands were needed. */
+void sky_debug_print_constant_stats(SkyChunk *chunk, const char *name) {
+    printf("=== constants: %s ===\n", name);
+    printf("  %-20s %7s %7s %7s %7s %7s %7s %7s\n", "chunk", "entries", "strings",
+           "numbers", "fns", "lookups", "reused", "wide");
+    print_chunk_constants(chunk, "<script>");
+}
+
+void sky_debug_record_opcode(uint8_t op) {
+    g_op_counts[op]++;
+    if (g_last_op >= 0) g_pair_counts[g_last_op][op]++;
+    g_last_op = op;
+}
+
+typedef struct {
+    uint8_t  first;
+    uint8_t  second;
+    uint64_t count;
+} OpcodePair;
+
+static int compare_pairs(const void *a, const void *b) {
+    const OpcodePair *pa = (const OpcodePair*)a;
+    const OpcodePair *pb = (const OpcodePair*)b;
+    if (pa->count == pb->count) return 0;
+    return pa->count < pb->count ? 1 : -1;
+}
+
+void sky_debug_print_opcode_profile(int top) {
+    OpcodePair *pairs;
+    uint64_t total = 0;
+    int i, j, count = 0;
+    for (i = 0; i < 256; i++) total += g_op_counts[i];
+    pairs = (OpcodePair*)malloc(sizeof(OpcodePair) * 256 * 256);
+    if (!pairs) return;
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 256; j++) {
+            if (g_pair_counts[i][j] == 0) continue;
+            pairs[count].first = (uint8_t)i;
+            pairs[count].second = (uint8_t)j;
+            pairs[count].count = g_pair_counts[i][j];
+            count++;
+        }
+    }
+    qsort(pairs, count, sizeof(OpcodePair), compare_pairs);
+    printf("=== opcode pairs (%llu instructions) ===\n", (unsigned long long)total);
+    for (i = 0; i < count && i < top; i++) {
+        printf("  %-24s %-24s %12llu  %5.1f%%\n",
+               op_name(pairs[i].first), op_name(pairs[i].second),
+               (unsigned long long)pairs[i].count,
+               total ? 100.0 * (double)pairs[i].count / (double)total : 0.0);
+    }
+    free(pairs);
+}
+
 void sky_debug_print_stack(SkyValue *stack, int stack_top) {
     int i;
     printf("          ");
@@ -9,7 +9,13 @@ void sky_disassemble_chunk(SkyChunk *chunk, const char *name);
 int  sky_disassemble_instruction(SkyChunk *chunk, int offset);
 void sky_debug_print_value(SkyValue value);
 void sky_debug_print_stack(SkyValue *stack, int stack_top);
+void sky_debug_print_quicken_stats(SkyChunk *chunk, const char *name);
+void sky_debug_print_constant_stats(SkyChunk *chunk, const char *name);
+void sky_debug_record_opcode(uint8_t op);
+void sky_debug_print_opcode_profile(int top);
 
 extern bool sky_debug_trace_execution;
+extern bool sky_debug_collect_stats;
+extern bool sky_debug_profile_opcodes;
 
 #endif
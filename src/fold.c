@@ -0,0 +1,383 @@
+﻿/* fold.c — AST constant folding */
+#include "fold.h"
+#include "token.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int folded;
+} Folder;
+
+static SkyASTNode* fold(Folder *f, SkyASTNode *node);
+
+static bool is_literal(const SkyASTNode *node) {
+    if (!node) return false;
+    switch (node->type) {
+        case AST_INT_LITERAL:
+        case AST_FLOAT_LITERAL:
+        case AST_STRING_LITERAL:
+        case AST_BOOL_LITERAL:
+        case AST_NIL_LITERAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Truthiness as JUMP_IF_FALSE sees it: nil, false and integer 0 fail. */
+static bool condition_truth(const SkyASTNode *lit) {
+    switch (lit->type) {
+        case AST_NIL_LITERAL:  return false;
+        case AST_BOOL_LITERAL: return lit->data.bool_literal.value;
+        case AST_INT_LITERAL:  return lit->data.int_literal.value != 0;
+        default:               return true;
+    }
+}
+
+/* Truthiness as `and`, `or` and `not` see it: only nil and false fail. */
+static bool logical_truth(const SkyASTNode *lit) {
+    if (lit->type == AST_NIL_LITERAL) return false;
+    if (lit->type == AST_BOOL_LITERAL) return lit->data.bool_literal.value;
+    return true;
+}
+
+static bool as_double(const SkyASTNode *lit, double *out) {
+    if (lit->type == AST_INT_LITERAL) {
+        *out = (double)lit->data.int_literal.value;
+        return true;
+    }
+    if (lit->type == AST_FLOAT_LITERAL) {
+        *out = lit->data.float_literal.value;
+        return true;
+    }
+    return false;
+}
+
+/* ---- Replacement nodes ---- */
+
+static SkyASTNode* make_int(int64_t value, int line) {
+    SkyASTNode *node = sky_ast_new(AST_INT_LITERAL, line);
+    if (node) node->data.int_literal.value = value;
+    return node;
+}
+
+static SkyASTNode* make_float(double value, int line) {
+    SkyASTNode *node = sky_ast_new(AST_FLOAT_LITERAL, line);
+    if (node) node->data.float_literal.value = value;
+    return node;
+}
+
+static SkyASTNode* make_bool(bool value, int line) {
+    SkyASTNode *node = sky_ast_new(AST_BOOL_LITERAL, line);
+    if (node) node->data.bool_literal.value = value;
+    return node;
+}
+
+static SkyASTNode* make_concat(const char *a, const char *b, int line) {
+    size_t la = strlen(a), lb = strlen(b);
+    SkyASTNode *node;
+    char *chars = (char*)malloc(la + lb + 1);
+    if (!chars) return NULL;
+    node = sky_ast_new(AST_STRING_LITERAL, line);
+    if (!node) {
+        free(chars);
+        return NULL;
+    }
+    memcpy(chars, a, la);
+    memcpy(chars + la, b, lb + 1);
+    node->data.string_literal.value = chars;
+    return node;
+}
+
+/* Swaps `old` for `with`, keeping `old` if no replacement could be made. */
+static SkyASTNode* replace(Folder *f, SkyASTNode *old, SkyASTNode *with) {
+    if (!with) return old;
+    sky_ast_free(old);
+    f->folded++;
+    return with;
+}
+
+/* ---- Expressions ---- */
+
+/* Overflow checks for int64 arithmetic; an overflowing expression is left
+ * to the VM rather than folded to a value it might not produce. */
+static bool add_overflows(int64_t a, int64_t b) {
+    return (b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b);
+}
+
+static bool sub_overflows(int64_t a, int64_t b) {
+    return (b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b);
+}
+
+static bool mul_overflows(int64_t a, int64_t b) {
+    if (a == 0 || b == 0) return false;
+    if (a == -1) return b == INT64_MIN;
+    if (b == -1) return a == INT64_MIN;
+    if (a > 0) return b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a;
+    return b > 0 ? a < INT64_MIN / b : a < INT64_MAX / b;
+}
+
+/* Mirrors OP_ADD .. OP_MOD: ints stay ints, any float makes a float,
+ * strings only concatenate. NULL when the VM would fail or overflow. */
+static SkyASTNode* fold_arithmetic(int op, SkyASTNode *l, SkyASTNode *r, int line) {
+    double x, y;
+
+    if (l->type == AST_INT_LITERAL && r->type == AST_INT_LITERAL) {
+        int64_t a = l->data.int_literal.value;
+        int64_t b = r->data.int_literal.value;
+        switch (op) {
+            case TOKEN_PLUS:  return add_overflows(a, b) ? NULL : make_int(a + b, line);
+            case TOKEN_MINUS: return sub_overflows(a, b) ? NULL : make_int(a - b, line);
+            case TOKEN_STAR:  return mul_overflows(a, b) ? NULL : make_int(a * b, line);
+            case TOKEN_SLASH:
+                if (b == 0 || (a == INT64_MIN && b == -1)) return NULL;
+                return make_int(a / b, line);
+            case TOKEN_PERCENT:
+                if (b == 0 || (a == INT64_MIN && b == -1)) return NULL;
+                return make_int(a % b, line);
+            default:
+                return NULL;
+        }
+    }
+    if (l->type == AST_STRING_LITERAL && r->type == AST_STRING_LITERAL) {
+        if (op != TOKEN_PLUS) return NULL;
+        return make_concat(l->data.string_literal.value, r->data.string_literal.value, line);
+    }
+    if (!as_double(l, &x) || !as_double(r, &y)) return NULL;
+    switch (op) {
+        case TOKEN_PLUS:  return make_float(x + y, line);
+        case TOKEN_MINUS: return make_float(x - y, line);
+        case TOKEN_STAR:  return make_float(x * y, line);
+        case TOKEN_SLASH: return y == 0.0 ? NULL : make_float(x / y, line);
+        default:          return NULL;   /* MOD requires integers */
+    }
+}
+
+/* Mirrors sky_values_equal: different types are never equal. */
+static bool literals_equal(const SkyASTNode *l, const SkyASTNode *r) {
+    if (l->type != r->type) return false;
+    switch (l->type) {
+        case AST_NIL_LITERAL:    return true;
+        case AST_BOOL_LITERAL:   return l->data.bool_literal.value == r->data.bool_literal.value;
+        case AST_INT_LITERAL:    return l->data.int_literal.value == r->data.int_literal.value;
+        case AST_FLOAT_LITERAL:  return l->data.float_literal.value == r->data.float_literal.value;
+        case AST_STRING_LITERAL:
+            return strcmp(l->data.string_literal.value, r->data.string_literal.value) == 0;
+        default:                 return false;
+    }
+}
+
+/* Mirrors vm_compare_values: ints with ints, floats with floats, and a
+ * mixed pair only for < and >. */
+static SkyASTNode* fold_comparison(int op, SkyASTNode *l, SkyASTNode *r, int line) {
+    double x, y;
+    if (op == TOKEN_EQUAL_EQUAL) return make_bool(literals_equal(l, r), line);
+    if (op == TOKEN_NOT_EQUAL) return make_bool(!literals_equal(l, r), line);
+    if (l->type == AST_INT_LITERAL && r->type == AST_INT_LITERAL) {
+        int64_t a = l->data.int_literal.value;
+        int64_t b = r->data.int_literal.value;
+        switch (op) {
+            case TOKEN_LESS:          return make_bool(a < b, line);
+            case TOKEN_LESS_EQUAL:    return make_bool(a <= b, line);
+            case TOKEN_GREATER:       return make_bool(a > b, line);
+            case TOKEN_GREATER_EQUAL: return make_bool(a >= b, line);
+            default:                  return NULL;
+        }
+    }
+    if (!as_double(l, &x) || !as_double(r, &y)) return NULL;
+    if (l->type != r->type && op != TOKEN_LESS && op != TOKEN_GREATER) return NULL;
+    switch (op) {
+        case TOKEN_LESS:          return make_bool(x < y, line);
+        case TOKEN_LESS_EQUAL:    return make_bool(x <= y, line);
+        case TOKEN_GREATER:       return make_bool(x > y, line);
+        case TOKEN_GREATER_EQUAL: return make_bool(x >= y, line);
+        default:                  return NULL;
+    }
+}
+
+static SkyASTNode* fold_binary(Folder *f, SkyASTNode *node) {
+    int op = node->data.binary.op;
+    SkyASTNode *l, *r;
+
+    node->data.binary.left = l = fold(f, node->data.binary.left);
+    node->data.binary.right = r = fold(f, node->data.binary.right);
+    if (!is_literal(l)) return node;
+
+    /* A decided left operand means the right one never runs */
+    if (op == TOKEN_AND || op == TOKEN_OR) {
+        bool truth = logical_truth(l);
+        if ((op == TOKEN_AND) != truth) return replace(f, node, make_bool(truth, node->line));
+        if (is_literal(r)) return replace(f, node, make_bool(logical_truth(r), node->line));
+        return node;
+    }
+    if (!is_literal(r)) return node;
+
+    switch (op) {
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+            return replace(f, node, fold_arithmetic(op, l, r, node->line));
+        case TOKEN_EQUAL_EQUAL:
+        case TOKEN_NOT_EQUAL:
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQUAL:
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQUAL:
+            return replace(f, node, fold_comparison(op, l, r, node->line));
+        default:
+            return node;
+    }
+}
+
+static SkyASTNode* fold_unary(Folder *f, SkyASTNode *node) {
+    SkyASTNode *operand = fold(f, node->data.unary.operand);
+    node->data.unary.operand = operand;
+    if (!is_literal(operand)) return node;
+
+    if (node->data.unary.op == TOKEN_NOT) {
+        return replace(f, node, make_bool(!logical_truth(operand), node->line));
+    }
+    if (node->data.unary.op == TOKEN_MINUS) {
+        if (operand->type == AST_INT_LITERAL && operand->data.int_literal.value != INT64_MIN) {
+            return replace(f, node, make_int(-operand->data.int_literal.value, node->line));
+        }
+        if (operand->type == AST_FLOAT_LITERAL) {
+            return replace(f, node, make_float(-operand->data.float_literal.value, node->line));
+        }
+    }
+    return node;
+}
+
+/* ---- Statements ---- */
+
+static void fold_list(Folder *f, SkyASTNode **nodes, int count) {
+    int i;
+    for (i = 0; i < count; i++) nodes[i] = fold(f, nodes[i]);
+}
+
+/* `if` with a literal condition becomes the branch it would take; a
+ * branch that is missing leaves an empty block, which compiles to
+ * nothing. The kept branch is a block or an `if`, so scoping is as it
+ * was. */
+static SkyASTNode* fold_if(Folder *f, SkyASTNode *node) {
+    SkyASTNode *kept;
+
+    node->data.if_stmt.condition = fold(f, node->data.if_stmt.condition);
+    node->data.if_stmt.then_branch = fold(f, node->data.if_stmt.then_branch);
+    node->data.if_stmt.else_branch = fold(f, node->data.if_stmt.else_branch);
+    if (!is_literal(node->data.if_stmt.condition)) return node;
+
+    if (condition_truth(node->data.if_stmt.condition)) {
+        kept = node->data.if_stmt.then_branch;
+        node->data.if_stmt.then_branch = NULL;
+    } else {
+        kept = node->data.if_stmt.else_branch;
+        node->data.if_stmt.else_branch = NULL;
+    }
+    if (!kept) kept = sky_ast_new(AST_BLOCK, node->line);
+    return replace(f, node, kept);
+}
+
+static SkyASTNode* fold(Folder *f, SkyASTNode *node) {
+    if (!node) return NULL;
+    switch (node->type) {
+        case AST_PROGRAM:
+            fold_list(f, node->data.program.statements, node->data.program.count);
+            break;
+        case AST_BLOCK:
+            fold_list(f, node->data.block.statements, node->data.block.count);
+            break;
+        case AST_BINARY:
+            return fold_binary(f, node);
+        case AST_UNARY:
+            return fold_unary(f, node);
+        case AST_CALL:
+            node->data.call.callee = fold(f, node->data.call.callee);
+            fold_list(f, node->data.call.args, node->data.call.arg_count);
+            break;
+        case AST_DOT:
+            node->data.dot.object = fold(f, node->data.dot.object);
+            break;
+        case AST_INDEX:
+            node->data.index_access.object = fold(f, node->data.index_access.object);
+            node->data.index_access.index = fold(f, node->data.index_access.index);
+            break;
+        case AST_ARRAY_LITERAL:
+            fold_list(f, node->data.array_literal.elements, node->data.array_literal.count);
+            break;
+        case AST_MAP_LITERAL:
+            fold_list(f, node->data.map_literal.keys, node->data.map_literal.count);
+            fold_list(f, node->data.map_literal.values, node->data.map_literal.count);
+            break;
+        case AST_ASSIGN:
+            node->data.assign.target = fold(f, node->data.assign.target);
+            node->data.assign.value = fold(f, node->data.assign.value);
+            break;
+        case AST_LET:
+            node->data.let.initializer = fold(f, node->data.let.initializer);
+            break;
+        case AST_IF:
+            return fold_if(f, node);
+        case AST_WHILE:
+            node->data.while_stmt.condition = fold(f, node->data.while_stmt.condition);
+            node->data.while_stmt.body = fold(f, node->data.while_stmt.body);
+            if (is_literal(node->data.while_stmt.condition) &&
+                !condition_truth(node->data.while_stmt.condition)) {
+                return replace(f, node, sky_ast_new(AST_BLOCK, node->line));
+            }
+            break;
+        case AST_FOR:
+            node->data.for_range.start = fold(f, node->data.for_range.start);
+            node->data.for_range.end = fold(f, node->data.for_range.end);
+            node->data.for_range.body = fold(f, node->data.for_range.body);
+            break;
+        case AST_FOR_IN:
+            node->data.for_each.iterable = fold(f, node->data.for_each.iterable);
+            node->data.for_each.body = fold(f, node->data.for_each.body);
+            break;
+        case AST_FUNCTION:
+            node->data.function.body = fold(f, node->data.function.body);
+            break;
+        case AST_RETURN:
+            node->data.return_stmt.value = fold(f, node->data.return_stmt.value);
+            break;
+        case AST_PRINT:
+            node->data.print_stmt.value = fold(f, node->data.print_stmt.value);
+            break;
+        case AST_EXPRESSION_STMT:
+            node->data.expr_stmt.expr = fold(f, node->data.expr_stmt.expr);
+            break;
+        case AST_CLASS:
+            fold_list(f, node->data.class_def.members, node->data.class_def.member_count);
+            break;
+        case AST_SERVER:
+            fold_list(f, node->data.server.routes, node->data.server.route_count);
+            break;
+        case AST_ROUTE:
+            node->data.route.body = fold(f, node->data.route.body);
+            break;
+        case AST_RESPOND:
+            node->data.respond.status = fold(f, node->data.respond.status);
+            node->data.respond.body = fold(f, node->data.respond.body);
+            break;
+        case AST_SECURITY:
+            fold_list(f, node->data.security.rules, node->data.security.rule_count);
+            break;
+        case AST_SECURITY_RULE:
+            fold_list(f, node->data.security_rule.actions, node->data.security_rule.action_count);
+            break;
+        default:
+            break;
+    }
+    return node;
+}
+
+int sky_fold_constants(SkyASTNode *ast) {
+    Folder f;
+    f.folded = 0;
+    fold(&f, ast);
+    return f.folded;
+}
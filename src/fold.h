@@ -0,0 +1,14 @@
+﻿/* fold.h — AST constant folding */
+#ifndef SKY_FOLD_H
+#define SKY_FOLD_H
+
+#include "ast.h"
+
+/* Evaluates constant subexpressions at compile time and removes `if`
+ * branches and `while` loops that a literal condition rules out. Anything
+ * the VM would reject (division by zero, mixed types, integer overflow)
+ * is left alone so the error still happens at runtime. Rewrites the tree
+ * in place; returns the number of nodes folded. */
+int sky_fold_constants(SkyASTNode *ast);
+
+#endif
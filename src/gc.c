@@ -0,0 +1,382 @@
+﻿/* gc.c — Incremental mark-sweep garbage collector */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L   /* clock_gettime */
+#endif
+#endif
+#include "gc.h"
+#include "vm.h"
+#include "map.h"
+#include "class.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+static _Thread_local SkyHeap *g_current_heap = NULL;
+
+/* Wall time: clock() is CPU time for the whole process, which would
+ * charge other isolates' threads to this heap's pauses. */
+static uint64_t now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)count.QuadPart * 1000000.0 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#endif
+}
+
+/* The object behind a value, or NULL for immediates. */
+SkyObj* sky_gc_object_of(SkyValue value) {
+#ifdef SKY_NAN_BOXING
+    uint64_t tag = value & SKY_TAG_MASK;
+    if ((value & SKY_QNAN) != SKY_QNAN) return NULL;
+    if (tag == SKY_TAG_STRING || tag == SKY_TAG_ARRAY || tag == SKY_TAG_OBJECT) {
+        return (SkyObj*)sky_nan_as_pointer(value);
+    }
+    return NULL;
+#else
+    switch (SKY_TYPE(value)) {
+        case VAL_STRING:
+        case VAL_ARRAY:
+        case VAL_MAP:
+        case VAL_FUNCTION:
+        case VAL_CLASS:
+        case VAL_INSTANCE:
+            return (SkyObj*)AS_OBJECT(value);
+        default:
+            return NULL;
+    }
+#endif
+}
+
+static size_t object_size(SkyObj *obj) {
+    switch (obj->type) {
+        case VAL_STRING: return sizeof(SkyString) + (size_t)((SkyString*)obj)->length + 1;
+        case VAL_ARRAY:  return sizeof(SkyArray) + sizeof(SkyValue) * ((SkyArray*)obj)->capacity;
+        case VAL_MAP:    return sizeof(SkyMap) + sky_map_buffer_size((SkyMap*)obj);
+        case VAL_CLASS:  return sizeof(SkyClass) + ((SkyClass*)obj)->buffer_size;
+        case VAL_INSTANCE:
+            return sizeof(SkyInstance) + sizeof(SkyValue) * ((SkyInstance*)obj)->capacity;
+#ifdef SKY_NAN_BOXING
+        case VAL_INT:    return sizeof(SkyBoxedInt);
+#endif
+        default:         return sizeof(SkyObj);
+    }
+}
+
+void sky_obj_init_static(SkyObj *obj, SkyValueType type) {
+    obj->type = type;
+    obj->marked = 0;
+    obj->flags = SKY_OBJ_STATIC;
+    obj->next = NULL;
+}
+
+void sky_obj_free(SkyObj *obj) {
+    if (!obj) return;
+    if (obj->type == VAL_ARRAY) free(((SkyArray*)obj)->items);
+    if (obj->type == VAL_MAP) sky_map_free_buffers((SkyMap*)obj);
+    if (obj->type == VAL_CLASS) sky_class_free_buffers((SkyClass*)obj);
+    if (obj->type == VAL_INSTANCE) sky_instance_free_buffers((SkyInstance*)obj);
+    free(obj);
+}
+
+/* ---- Marking ---- */
+
+static void mark_object(SkyHeap *heap, SkyObj *obj) {
+    if (!obj || obj->marked || (obj->flags & SKY_OBJ_STATIC)) return;
+    obj->marked = 1;
+    if (obj->type != VAL_ARRAY && obj->type != VAL_MAP &&
+        obj->type != VAL_CLASS && obj->type != VAL_INSTANCE) return;   /* no outgoing references */
+    if (heap->gray_count >= heap->gray_capacity) {
+        int cap = heap->gray_capacity < 64 ? 64 : heap->gray_capacity * 2;
+        SkyObj **gray = (SkyObj**)realloc(heap->gray, sizeof(SkyObj*) * cap);
+        if (!gray) {
+            fprintf(stderr, "[SKY GC] Out of memory growing the gray stack\n");
+            exit(1);
+        }
+        heap->gray = gray;
+        heap->gray_capacity = cap;
+    }
+    heap->gray[heap->gray_count++] = obj;
+}
+
+static void mark_value(SkyHeap *heap, SkyValue value) {
+    mark_object(heap, sky_gc_object_of(value));
+}
+
+/* Only the names a shape added are new; the rest are its parent's. */
+static void mark_shape(SkyHeap *heap, SkyShape *shape) {
+    int i;
+    if (shape->field_count > 0) {
+        int first = shape->parent ? shape->parent->field_count : 0;
+        for (i = first; i < shape->field_count; i++) mark_object(heap, &shape->names[i]->obj);
+    }
+    for (i = 0; i < shape->child_count; i++) mark_shape(heap, shape->children[i]);
+}
+
+static void trace_object(SkyHeap *heap, SkyObj *obj) {
+    if (obj->type == VAL_ARRAY) {
+        SkyArray *arr = (SkyArray*)obj;
+        int i;
+        for (i = 0; i < arr->count; i++) mark_value(heap, arr->items[i]);
+    } else if (obj->type == VAL_MAP) {
+        SkyMap *map = (SkyMap*)obj;
+        int i;
+        for (i = 0; i < map->used; i++) {
+            if (!map->entries[i].key) continue;
+            mark_object(heap, &map->entries[i].key->obj);
+            mark_value(heap, map->entries[i].value);
+        }
+    } else if (obj->type == VAL_CLASS) {
+        SkyClass *klass = (SkyClass*)obj;
+        int i;
+        mark_object(heap, &klass->name->obj);
+        mark_shape(heap, klass->shape);
+        for (i = 0; i < klass->method_count; i++) {
+            mark_object(heap, &klass->method_names[i]->obj);
+            mark_object(heap, &klass->methods[i]->obj);
+        }
+    } else if (obj->type == VAL_INSTANCE) {
+        SkyInstance *instance = (SkyInstance*)obj;
+        int i;
+        mark_object(heap, &instance->klass->obj);
+        for (i = 0; i < instance->shape->field_count; i++) mark_value(heap, instance->fields[i]);
+    }
+}
+
+static void mark_table(SkyHeap *heap, SkyTable *table) {
+    int i;
+    for (i = 0; i < table->capacity; i++) {
+        SkyTableEntry *entry = &table->entries[i];
+        if (!entry->occupied) continue;
+        mark_object(heap, &entry->key->obj);
+        mark_value(heap, entry->value);
+    }
+}
+
+static void mark_roots(SkyHeap *heap) {
+    SkyVM *vm = heap->vm;
+    SkyValue *slot;
+    int i, j;
+
+    for (i = 0; i < heap->temp_root_count; i++) mark_value(heap, heap->temp_roots[i]);
+    if (!vm) return;
+    for (slot = vm->stack; slot < vm->stack_top; slot++) mark_value(heap, *slot);
+    for (i = 0; i < vm->global_slot_count; i++) {
+        if (vm->global_slots[i].defined) mark_value(heap, vm->global_slots[i].value);
+    }
+    mark_table(heap, &vm->globals);
+    /* What sky_vm_reset will put back */
+    for (i = 0; i < vm->saved_slot_count; i++) {
+        if (vm->saved_slots[i].defined) mark_value(heap, vm->saved_slots[i].value);
+    }
+    mark_table(heap, &vm->saved_globals);
+    /* Constant pools are normally static, but trace them in case a chunk
+     * was compiled while this heap was current */
+    for (i = 0; i < vm->frame_count; i++) {
+        SkyValueArray *constants = &vm->frames[i].chunk->constants;
+        for (j = 0; j < constants->count; j++) mark_value(heap, constants->values[j]);
+    }
+}
+
+/* Trace up to `budget` gray objects; true once the gray set is empty. */
+static bool drain_gray(SkyHeap *heap, int budget) {
+    while (heap->gray_count > 0 && budget-- != 0) {
+        trace_object(heap, heap->gray[--heap->gray_count]);
+    }
+    return heap->gray_count == 0;
+}
+
+/* ---- Sweeping ---- */
+
+static void sweep(SkyHeap *heap) {
+    SkyObj **link = &heap->objects;
+    while (*link) {
+        SkyObj *obj = *link;
+        if (obj->marked) {
+            obj->marked = 0;
+            link = &obj->next;
+        } else {
+            size_t size = object_size(obj);
+            *link = obj->next;
+            heap->bytes_allocated -= size < heap->bytes_allocated ? size : heap->bytes_allocated;
+            heap->stats.bytes_freed += size;
+            heap->stats.objects_freed++;
+            sky_obj_free(obj);
+        }
+    }
+}
+
+/* Roots may have changed since marking began (the stack certainly has),
+ * so rescan them, finish tracing and sweep in one step. Objects made
+ * during marking start white and survive only if reachable now. */
+static void finish_cycle(SkyHeap *heap) {
+    size_t threshold;
+    mark_roots(heap);
+    drain_gray(heap, -1);
+    sky_string_set_remove_unmarked(&heap->strings);
+    sweep(heap);
+    heap->phase = SKY_GC_IDLE;
+    threshold = heap->bytes_allocated / 100 * (size_t)heap->config.growth_percent;
+    heap->next_gc = threshold > heap->config.initial_threshold ? threshold
+                                                             : heap->config.initial_threshold;
+}
+
+static void record_pause(SkyHeap *heap, uint64_t start) {
+    uint64_t pause = now_us() - start;
+    heap->stats.steps++;
+    heap->stats.total_pause_us += pause;
+    if (pause > heap->stats.max_pause_us) heap->stats.max_pause_us = pause;
+}
+
+static void gc_step(SkyHeap *heap) {
+    uint64_t start = now_us();
+    if (heap->phase == SKY_GC_IDLE) {
+        heap->phase = SKY_GC_MARKING;
+        heap->stats.cycles++;
+        mark_roots(heap);
+    }
+    if (drain_gray(heap, heap->config.step_budget)) finish_cycle(heap);
+    record_pause(heap, start);
+}
+
+void sky_gc_collect(SkyHeap *heap) {
+    uint64_t start = now_us();
+    if (!heap) return;
+    if (heap->phase == SKY_GC_IDLE) {
+        heap->phase = SKY_GC_MARKING;
+        heap->stats.cycles++;
+    }
+    finish_cycle(heap);
+    record_pause(heap, start);
+}
+
+/* ---- Allocation ---- */
+
+SkyHeap* sky_gc_set_current(SkyHeap *heap) {
+    SkyHeap *previous = g_current_heap;
+    g_current_heap = heap;
+    return previous;
+}
+
+SkyHeap* sky_gc_current(void) {
+    return g_current_heap;
+}
+
+SkyObj* sky_gc_alloc(size_t size, SkyValueType type) {
+    SkyHeap *heap = g_current_heap;
+    SkyObj *obj;
+
+    if (heap) {
+        /* Collect before the new object exists, so it needs no rooting */
+        if (heap->config.stress) {
+            sky_gc_collect(heap);
+        } else if (heap->phase == SKY_GC_MARKING || heap->bytes_allocated + size > heap->next_gc) {
+            gc_step(heap);
+        }
+    }
+    obj = (SkyObj*)malloc(size);
+    if (!obj) {
+        fprintf(stderr, "[SKY GC] Allocation failed: %zu bytes\n", size);
+        exit(1);
+    }
+    if (!heap) {
+        sky_obj_init_static(obj, type);
+        return obj;
+    }
+    obj->type = type;
+    obj->marked = 0;
+    obj->flags = 0;
+    obj->next = heap->objects;
+    heap->objects = obj;
+    heap->bytes_allocated += size;
+    if (heap->bytes_allocated > heap->stats.peak_bytes) heap->stats.peak_bytes = heap->bytes_allocated;
+    return obj;
+}
+
+/* Out-of-line buffers owned by an object (array items). */
+void sky_gc_account(ptrdiff_t bytes) {
+    SkyHeap *heap = g_current_heap;
+    if (!heap) return;
+    if (bytes < 0 && (size_t)-bytes > heap->bytes_allocated) {
+        heap->bytes_allocated = 0;
+        return;
+    }
+    heap->bytes_allocated += bytes;
+    if (heap->bytes_allocated > heap->stats.peak_bytes) heap->stats.peak_bytes = heap->bytes_allocated;
+}
+
+void sky_gc_push_root(SkyValue value) {
+    SkyHeap *heap = g_current_heap;
+    if (!heap) return;
+    if (heap->temp_root_count >= SKY_GC_MAX_TEMP_ROOTS) {
+        fprintf(stderr, "[SKY GC] Too many temporary roots\n");
+        exit(1);
+    }
+    heap->temp_roots[heap->temp_root_count++] = value;
+}
+
+void sky_gc_pop_root(void) {
+    SkyHeap *heap = g_current_heap;
+    if (heap && heap->temp_root_count > 0) heap->temp_root_count--;
+}
+
+/* Incremental-update barrier: storing into an object that marking has
+ * already traced would hide the value from this cycle, so shade it. */
+void sky_gc_barrier(SkyObj *container, SkyValue value) {
+    SkyHeap *heap = g_current_heap;
+    if (heap && heap->phase == SKY_GC_MARKING && container->marked) {
+        mark_value(heap, value);
+    }
+}
+
+/* ---- Heap lifetime ---- */
+
+void sky_gc_init(SkyHeap *heap, struct SkyVM *vm) {
+    memset(heap, 0, sizeof(SkyHeap));
+    heap->vm = vm;
+    heap->phase = SKY_GC_IDLE;
+    heap->config.initial_threshold = SKY_GC_INITIAL_THRESHOLD;
+    heap->config.growth_percent = SKY_GC_GROWTH_PERCENT;
+    heap->config.step_budget = SKY_GC_STEP_BUDGET;
+    heap->config.stress = false;
+    heap->next_gc = heap->config.initial_threshold;
+}
+
+void sky_gc_free_all(SkyHeap *heap) {
+    SkyObj *obj;
+    if (!heap) return;
+    obj = heap->objects;
+    while (obj) {
+        SkyObj *next = obj->next;
+        sky_obj_free(obj);
+        obj = next;
+    }
+    free(heap->gray);
+    sky_string_set_free(&heap->strings);
+    heap->objects = NULL;
+    heap->gray = NULL;
+    heap->gray_count = heap->gray_capacity = 0;
+    heap->bytes_allocated = 0;
+}
+
+void sky_gc_print_stats(SkyHeap *heap) {
+    SkyGCStats *s = &heap->stats;
+    printf("=== gc ===\n");
+    printf("  cycles              %llu\n", (unsigned long long)s->cycles);
+    printf("  steps               %llu\n", (unsigned long long)s->steps);
+    printf("  objects freed       %llu\n", (unsigned long long)s->objects_freed);
+    printf("  bytes freed         %llu\n", (unsigned long long)s->bytes_freed);
+    printf("  heap now            %zu bytes\n", heap->bytes_allocated);
+    printf("  heap peak           %zu bytes\n", s->peak_bytes);
+    printf("  pause total         %llu us\n", (unsigned long long)s->total_pause_us);
+    printf("  pause max           %llu us\n", (unsigned long long)s->max_pause_us);
+}
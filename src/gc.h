@@ -0,0 +1,89 @@
+﻿/* gc.h — Incremental mark-sweep garbage collector */
+#ifndef SKY_GC_H
+#define SKY_GC_H
+
+#include "value.h"
+#include "table.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct SkyVM;
+
+/* Pacing defaults (per heap in SkyGCConfig). A cycle starts once
+ * bytes_allocated passes next_gc; marking then advances step_budget
+ * objects per allocation until the gray set drains, and the cycle
+ * finishes with a root rescan and a sweep. */
+#ifndef SKY_GC_INITIAL_THRESHOLD
+#define SKY_GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+#ifndef SKY_GC_GROWTH_PERCENT
+#define SKY_GC_GROWTH_PERCENT    200
+#endif
+#ifndef SKY_GC_STEP_BUDGET
+#define SKY_GC_STEP_BUDGET       256
+#endif
+#define SKY_GC_MAX_TEMP_ROOTS    16
+
+typedef struct {
+    size_t initial_threshold;   /* bytes before the first cycle */
+    int    growth_percent;      /* next cycle at live bytes * growth / 100 */
+    int    step_budget;         /* gray objects traced per allocation */
+    bool   stress;              /* run a full collection on every allocation */
+} SkyGCConfig;
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t steps;
+    uint64_t objects_freed;
+    uint64_t bytes_freed;
+    uint64_t total_pause_us;
+    uint64_t max_pause_us;
+    size_t   peak_bytes;
+} SkyGCStats;
+
+typedef enum {
+    SKY_GC_IDLE,
+    SKY_GC_MARKING
+} SkyGCPhase;
+
+typedef struct SkyHeap {
+    struct SkyVM *vm;           /* owner, for the root set */
+    SkyObj      *objects;       /* every collectable object */
+    size_t       bytes_allocated;
+    size_t       next_gc;
+    SkyGCPhase   phase;
+    SkyObj     **gray;
+    int          gray_count;
+    int          gray_capacity;
+    SkyStringSet strings;       /* weak intern set, see sky_string_intern */
+    SkyValue     temp_roots[SKY_GC_MAX_TEMP_ROOTS];
+    int          temp_root_count;
+    SkyGCConfig  config;
+    SkyGCStats   stats;
+} SkyHeap;
+
+void sky_gc_init(SkyHeap *heap, struct SkyVM *vm);
+void sky_gc_free_all(SkyHeap *heap);
+void sky_gc_collect(SkyHeap *heap);
+void sky_gc_print_stats(SkyHeap *heap);
+
+/* Allocations go to the heap of the VM running on this thread; with none
+ * active (compiling) objects are static and owned by whoever made them. */
+SkyHeap* sky_gc_set_current(SkyHeap *heap);
+SkyHeap* sky_gc_current(void);
+SkyObj*  sky_gc_alloc(size_t size, SkyValueType type);
+void     sky_gc_account(ptrdiff_t bytes);
+
+/* Keep a value alive across an allocation while it is off the stack. */
+void sky_gc_push_root(SkyValue value);
+void sky_gc_pop_root(void);
+
+/* Must accompany every store of `value` into an existing object. */
+void sky_gc_barrier(SkyObj *container, SkyValue value);
+
+SkyObj* sky_gc_object_of(SkyValue value);   /* NULL for immediates */
+void sky_obj_init_static(SkyObj *obj, SkyValueType type);
+void sky_obj_free(SkyObj *obj);
+
+#endif
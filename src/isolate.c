@@ -0,0 +1,165 @@
+﻿/* isolate.c — Shared compiled programs and per-thread VM isolates
+ *
+ * Compiled code is only ever written by the VM itself: quickening and
+ * deoptimization rewrite opcodes, the JIT ticks hotness counters, and
+ * strings cache their hash on first lookup. A shared chunk turns the
+ * first two off and has every hash it will need computed up front, so
+ * isolates only read it. Everything mutable (stack, frames, globals,
+ * heap, interned strings) is per isolate, and allocation already goes
+ * to the heap current on each thread (gc.h). */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L   /* nanosleep (platform.h) */
+#endif
+#endif
+#include "isolate.h"
+#include "verifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool set_error(char *error, size_t error_size, const char *message) {
+    snprintf(error, error_size, "%s", message);
+    return false;
+}
+
+/* Appends `chunk` and every function chunk reachable from its constants */
+static bool collect_chunks(SkyProgram *program, SkyChunk *chunk, int *capacity) {
+    int i;
+    for (i = 0; i < program->chunk_count; i++) {
+        if (program->chunks[i] == chunk) return true;
+    }
+    if (program->chunk_count == *capacity) {
+        int grown_capacity = *capacity < 8 ? 8 : *capacity * 2;
+        SkyChunk **grown = (SkyChunk**)realloc(program->chunks, sizeof(SkyChunk*) * grown_capacity);
+        if (!grown) return false;
+        program->chunks = grown;
+        *capacity = grown_capacity;
+    }
+    program->chunks[program->chunk_count++] = chunk;
+    for (i = 0; i < chunk->constants.count; i++) {
+        SkyValue k = chunk->constants.values[i];
+        if (IS_FUNCTION(k) && !collect_chunks(program, &AS_FUNCTION(k)->chunk, capacity)) return false;
+    }
+    return true;
+}
+
+bool sky_program_init(SkyProgram *program, SkyChunk *chunk, char *error, size_t error_size) {
+    int capacity = 0;
+    int i, j;
+
+    memset(program, 0, sizeof(*program));
+    program->chunk = chunk;
+    if (!chunk->verified && !sky_verify_chunk(chunk, error, error_size)) return false;
+    if (!collect_chunks(program, chunk, &capacity)) {
+        sky_program_free(program);
+        return set_error(error, error_size, "Out of memory");
+    }
+    for (i = 0; i < program->chunk_count; i++) {
+        SkyChunk *c = program->chunks[i];
+        for (j = 0; j < c->constants.count; j++) {
+            if (IS_STRING(c->constants.values[j])) sky_string_hash(AS_STRING_OBJ(c->constants.values[j]));
+        }
+        for (j = 0; j < c->global_count; j++) sky_string_hash(c->global_names[j]);
+        c->shared = true;
+    }
+    return true;
+}
+
+/* The chunks stay shared: code may still be running them elsewhere */
+void sky_program_free(SkyProgram *program) {
+    free(program->chunks);
+    program->chunks = NULL;
+    program->chunk_count = 0;
+}
+
+/* ---- Isolates ---- */
+
+bool sky_isolate_init(SkyIsolate *isolate, const SkyProgram *program) {
+    isolate->program = program;
+    sky_vm_init(&isolate->vm);
+    if (sky_vm_execute(&isolate->vm, program->chunk) != VM_OK) {
+        sky_vm_destroy(&isolate->vm);
+        return false;
+    }
+    sky_vm_checkpoint(&isolate->vm);
+    return true;
+}
+
+void sky_isolate_destroy(SkyIsolate *isolate) {
+    sky_vm_destroy(&isolate->vm);
+    isolate->program = NULL;
+}
+
+void sky_isolate_reset(SkyIsolate *isolate) {
+    sky_vm_reset(&isolate->vm);
+}
+
+SkyVMResult sky_isolate_call(SkyIsolate *isolate, const char *name, int arg_count,
+                             const SkyValue *args, SkyValue *result) {
+    SkyValue callee;
+    if (!sky_vm_get_global(&isolate->vm, name, &callee)) {
+        fprintf(stderr, "[SKY RUNTIME ERROR] Undefined function '%s'\n", name);
+        return VM_RUNTIME_ERROR;
+    }
+    return sky_vm_call(&isolate->vm, callee, arg_count, args, result);
+}
+
+/* ---- Pool ---- */
+
+bool sky_isolate_pool_init(SkyIsolatePool *pool, const SkyProgram *program, int count) {
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (count < 1) return false;
+    pool->isolates = (SkyIsolate*)calloc((size_t)count, sizeof(SkyIsolate));
+    pool->idle = (SkyIsolate**)malloc(sizeof(SkyIsolate*) * count);
+    if (!pool->isolates || !pool->idle) {
+        free(pool->isolates);
+        free(pool->idle);
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        if (!sky_isolate_init(&pool->isolates[i], program)) {
+            while (--i >= 0) sky_isolate_destroy(&pool->isolates[i]);
+            free(pool->isolates);
+            free(pool->idle);
+            return false;
+        }
+        pool->idle[i] = &pool->isolates[i];
+    }
+    pool->count = pool->idle_count = count;
+    sky_mutex_init(&pool->lock);
+    sky_cond_init(&pool->available);
+    return true;
+}
+
+void sky_isolate_pool_destroy(SkyIsolatePool *pool) {
+    int i;
+    for (i = 0; i < pool->count; i++) sky_isolate_destroy(&pool->isolates[i]);
+    free(pool->isolates);
+    free(pool->idle);
+    sky_mutex_destroy(&pool->lock);
+    sky_cond_destroy(&pool->available);
+    pool->isolates = NULL;
+    pool->idle = NULL;
+    pool->count = pool->idle_count = 0;
+}
+
+SkyIsolate* sky_isolate_pool_acquire(SkyIsolatePool *pool) {
+    SkyIsolate *isolate;
+    sky_mutex_lock(&pool->lock);
+    while (pool->idle_count == 0) sky_cond_wait(&pool->available, &pool->lock);
+    isolate = pool->idle[--pool->idle_count];
+    sky_mutex_unlock(&pool->lock);
+    return isolate;
+}
+
+/* Reset outside the lock: it touches only this isolate */
+void sky_isolate_pool_release(SkyIsolatePool *pool, SkyIsolate *isolate) {
+    sky_isolate_reset(isolate);
+    sky_mutex_lock(&pool->lock);
+    pool->idle[pool->idle_count++] = isolate;
+    sky_cond_signal(&pool->available);
+    sky_mutex_unlock(&pool->lock);
+}
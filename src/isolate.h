@@ -0,0 +1,61 @@
+﻿/* isolate.h — Shared compiled programs and per-thread VM isolates */
+#ifndef SKY_ISOLATE_H
+#define SKY_ISOLATE_H
+
+#include "vm.h"
+#include "platform.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A compiled program frozen for sharing. Every chunk is verified, the
+ * hashes of its string constants and global names are cached, and it is
+ * marked shared so the VM never quickens or JIT-compiles it again. After
+ * that nothing writes to it, and isolates on any number of threads can
+ * run it at once. The chunk stays the caller's and must outlive the
+ * program and every isolate of it. */
+typedef struct {
+    SkyChunk  *chunk;
+    SkyChunk **chunks;        /* chunk, then every function chunk under it */
+    int        chunk_count;
+} SkyProgram;
+
+/* One VM bound to a program: its own stack, globals and heap. The top
+ * level runs once in sky_isolate_init; sky_isolate_reset goes back to the
+ * globals it left. An isolate is used by one thread at a time. */
+typedef struct {
+    SkyVM             vm;
+    const SkyProgram *program;
+} SkyIsolate;
+
+/* Isolates ready for requests. Acquire blocks until one is idle; release
+ * resets it and hands it to the next waiter. */
+typedef struct {
+    SkyIsolate  *isolates;
+    SkyIsolate **idle;
+    int          count;
+    int          idle_count;
+    sky_mutex_t  lock;
+    sky_cond_t   available;
+} SkyIsolatePool;
+
+bool sky_program_init(SkyProgram *program, SkyChunk *chunk, char *error, size_t error_size);
+void sky_program_free(SkyProgram *program);
+
+/* False if the top level fails; the error has been reported. */
+bool        sky_isolate_init(SkyIsolate *isolate, const SkyProgram *program);
+void        sky_isolate_destroy(SkyIsolate *isolate);
+void        sky_isolate_reset(SkyIsolate *isolate);
+
+/* Calls the global function `name`. The result lives in the isolate's
+ * heap until the next reset. */
+SkyVMResult sky_isolate_call(SkyIsolate *isolate, const char *name, int arg_count,
+                             const SkyValue *args, SkyValue *result);
+
+/* Initializes `count` isolates one after another on the calling thread,
+ * so the top level's output comes out in order. */
+bool        sky_isolate_pool_init(SkyIsolatePool *pool, const SkyProgram *program, int count);
+void        sky_isolate_pool_destroy(SkyIsolatePool *pool);
+SkyIsolate* sky_isolate_pool_acquire(SkyIsolatePool *pool);
+void        sky_isolate_pool_release(SkyIsolatePool *pool, SkyIsolate *isolate);
+
+#endif
@@ -0,0 +1,949 @@
+﻿/* jit.c — Baseline template JIT for x86-64
+ *
+ * A hot chunk is translated instruction by instruction into copies of
+ * machine-code templates, laid out in bytecode order so that branches
+ * become native jumps. Stack, local and global moves and returns are
+ * inline in every build; with 16-byte values so are truth tests, equality
+ * and the int paths of the quickened, fused and register ops, each behind
+ * a type guard. Any other opcode, and every guard miss, calls back into
+ * the interpreter for that one instruction. Native code shares the VM's
+ * value stack and call frames, so either tier can pick up at any
+ * instruction boundary, and a call or return between compiled chunks
+ * jumps straight from one's code to the other's.
+ *
+ * Inside native code rbx holds the VM and r12 the frame; rax, rcx, rdx
+ * and r8 are scratch. */
+#define _DEFAULT_SOURCE   /* MAP_ANONYMOUS */
+#include "jit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#if SKY_JIT_AVAILABLE
+#include <sys/mman.h>
+
+struct SkyJitCode {
+    uint8_t  *code;      /* mapped read + execute */
+    size_t    size;
+    uint32_t *entry;     /* bytecode offset -> native offset */
+};
+
+typedef int (*NativeEntry)(SkyVM *vm, SkyCallFrame *frame, uint8_t *start);
+
+#define NO_ENTRY           UINT32_MAX
+#define VALUE_SIZE         ((int32_t)sizeof(SkyValue))
+#define GLOBAL_SIZE        ((int32_t)sizeof(SkyGlobalSlot))
+#define OFF_TOP            ((int32_t)offsetof(SkyVM, stack_top))
+#define OFF_FRAME_COUNT    ((int32_t)offsetof(SkyVM, frame_count))
+#define OFF_GLOBALS        ((int32_t)offsetof(SkyVM, global_slots))
+#define OFF_SLOTS          ((int32_t)offsetof(SkyCallFrame, slots))
+#define OFF_GLOBAL_VALUE   ((int32_t)offsetof(SkyGlobalSlot, value))
+#define OFF_GLOBAL_DEFINED ((int32_t)offsetof(SkyGlobalSlot, defined))
+#ifndef SKY_NAN_BOXING
+#define OFF_TYPE           ((int32_t)offsetof(struct SkyValue, type))
+#define OFF_PAYLOAD        ((int32_t)offsetof(struct SkyValue, as))
+#endif
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Condition codes as encoded in Jcc / SETcc; cc ^ 1 is the negation */
+enum { CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf };
+
+/* "op r64, r/m64" opcodes */
+#define X86_ADD   0x03
+#define X86_SUB   0x2b
+#define X86_CMP   0x3b
+#define X86_IMUL  0x0faf
+#define X86_LOAD  0x8b
+#define X86_STORE 0x89
+
+typedef struct {
+    int at;         /* rel32 field in the buffer */
+    int target;     /* bytecode offset it jumps to */
+} Fixup;
+
+typedef struct {
+    uint8_t *buf;
+    int      count;
+    int      capacity;
+    Fixup   *fixups;
+    int      fixup_count;
+    int      fixup_capacity;
+    int      epilogue;   /* returns eax to the caller of the chunk's code */
+    int      out;        /* where a step that did not fall through goes */
+    bool     failed;     /* out of memory; the result is thrown away */
+} Assembler;
+
+/* ---- Encoding ---- */
+
+static void emit_byte(Assembler *a, uint8_t byte) {
+    if (a->failed) return;
+    if (a->count == a->capacity) {
+        int capacity = a->capacity < 1024 ? 1024 : a->capacity * 2;
+        uint8_t *buf = (uint8_t*)realloc(a->buf, (size_t)capacity);
+        if (!buf) {
+            a->failed = true;
+            return;
+        }
+        a->buf = buf;
+        a->capacity = capacity;
+    }
+    a->buf[a->count++] = byte;
+}
+
+static void emit_u32(Assembler *a, uint32_t value) {
+    int i;
+    for (i = 0; i < 4; i++) emit_byte(a, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit_u64(Assembler *a, uint64_t value) {
+    int i;
+    for (i = 0; i < 8; i++) emit_byte(a, (uint8_t)(value >> (8 * i)));
+}
+
+/* REX prefix, left out when it would carry nothing */
+static void emit_rex(Assembler *a, bool wide, int reg, int base) {
+    uint8_t rex = (uint8_t)(0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+    if (rex != 0x40) emit_byte(a, rex);
+}
+
+static void emit_opcode(Assembler *a, int opcode) {
+    if (opcode > 0xff) emit_byte(a, (uint8_t)(opcode >> 8));
+    emit_byte(a, (uint8_t)opcode);
+}
+
+/* opcode with a [base + disp32] operand; `reg` is the register operand
+ * or the opcode extension */
+static void emit_op_mem(Assembler *a, bool wide, int opcode, int reg, int base, int32_t disp) {
+    emit_rex(a, wide, reg, base);
+    emit_opcode(a, opcode);
+    emit_byte(a, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == RSP) emit_byte(a, 0x24);
+    emit_u32(a, (uint32_t)disp);
+}
+
+/* op dst, src on 64-bit registers */
+static void emit_op_reg(Assembler *a, int opcode, int dst, int src) {
+    emit_rex(a, true, dst, src);
+    emit_opcode(a, opcode);
+    emit_byte(a, (uint8_t)(0xc0 | ((dst & 7) << 3) | (src & 7)));
+}
+
+static void emit_load(Assembler *a, int reg, int base, int32_t disp) {
+    emit_op_mem(a, true, X86_LOAD, reg, base, disp);
+}
+
+static void emit_store(Assembler *a, int base, int32_t disp, int reg) {
+    emit_op_mem(a, true, X86_STORE, reg, base, disp);
+}
+
+static void emit_mov_imm(Assembler *a, int reg, uint64_t value) {
+    emit_rex(a, true, 0, reg);
+    emit_byte(a, (uint8_t)(0xb8 + (reg & 7)));
+    emit_u64(a, value);
+}
+
+static void emit_add_imm(Assembler *a, int reg, int32_t value) {
+    emit_rex(a, true, 0, reg);
+    emit_byte(a, 0x81);
+    emit_byte(a, (uint8_t)(0xc0 | (reg & 7)));
+    emit_u32(a, (uint32_t)value);
+}
+
+/* Jcc, or JMP when cc < 0, with its rel32 left to patch; returns where */
+static int emit_jump(Assembler *a, int cc) {
+    if (cc < 0) {
+        emit_byte(a, 0xe9);
+    } else {
+        emit_byte(a, 0x0f);
+        emit_byte(a, (uint8_t)(0x80 | cc));
+    }
+    emit_u32(a, 0);
+    return a->count - 4;
+}
+
+static void patch_jump(Assembler *a, int at, int to) {
+    uint32_t rel = (uint32_t)(to - (at + 4));
+    int i;
+    if (a->failed) return;
+    for (i = 0; i < 4; i++) a->buf[at + i] = (uint8_t)(rel >> (8 * i));
+}
+
+/* Jump to the native copy of a bytecode offset, patched once every
+ * instruction has been laid out */
+static void emit_branch(Assembler *a, int cc, int target) {
+    int at = emit_jump(a, cc);
+    if (a->fixup_count == a->fixup_capacity) {
+        int capacity = a->fixup_capacity < 64 ? 64 : a->fixup_capacity * 2;
+        Fixup *fixups = (Fixup*)realloc(a->fixups, sizeof(Fixup) * capacity);
+        if (!fixups) {
+            a->failed = true;
+            return;
+        }
+        a->fixups = fixups;
+        a->fixup_capacity = capacity;
+    }
+    a->fixups[a->fixup_count].at = at;
+    a->fixups[a->fixup_count].target = target;
+    a->fixup_count++;
+}
+
+/* [dst + dst_disp] = [src + src_disp], one whole SkyValue. Values are
+ * always moved as 8-byte halves so that loads forward from the stores
+ * that wrote them. */
+static void emit_copy_value(Assembler *a, int dst, int32_t dst_disp, int src, int32_t src_disp) {
+    emit_load(a, RDX, src, src_disp);
+#ifndef SKY_NAN_BOXING
+    emit_load(a, R8, src, src_disp + 8);
+    emit_store(a, dst, dst_disp + 8, R8);
+#endif
+    emit_store(a, dst, dst_disp, RDX);
+}
+
+/* ---- Bytecode ---- */
+
+static bool is_jump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_BACK:
+        case OP_AND_JUMP:
+        case OP_OR_JUMP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP:
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* The distance is always the last two operand bytes */
+static int jump_target(const SkyChunk *chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    int end = offset + sky_opcode_length(op);
+    int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return (op == OP_JUMP_BACK || op == OP_FOR_RANGE_LOOP) ? end - distance : end + distance;
+}
+
+/* Calls the interpreter for the instruction at `offset`, then follows
+ * what it did: on to the next template, to the jump target, or out. */
+static void emit_step(Assembler *a, const SkyChunk *chunk, int offset) {
+    emit_op_reg(a, X86_LOAD, RDI, RBX);
+    emit_op_reg(a, X86_LOAD, RSI, R12);
+    emit_mov_imm(a, RDX, (uint64_t)(uintptr_t)(chunk->code + offset));
+    emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)sky_vm_step);
+    emit_byte(a, 0xff);                                  /* call rax */
+    emit_byte(a, 0xd0);
+    if (is_jump(chunk->code[offset])) {
+        emit_byte(a, 0x83);                              /* cmp eax, BRANCH */
+        emit_byte(a, 0xf8);
+        emit_byte(a, SKY_STEP_BRANCH);
+        emit_branch(a, CC_E, jump_target(chunk, offset));
+    }
+    emit_byte(a, 0x85);                                  /* test eax, eax */
+    emit_byte(a, 0xc0);
+    patch_jump(a, emit_jump(a, CC_NE), a->out);
+}
+
+/* stack_top = rax + VALUE_SIZE, after writing the value at rax */
+static void emit_push_done(Assembler *a) {
+    emit_add_imm(a, RAX, VALUE_SIZE);
+    emit_store(a, RBX, OFF_TOP, RAX);
+}
+
+#ifndef SKY_NAN_BOXING
+
+static int x86_arith(uint8_t op) {
+    switch (op) {
+        case OP_SUB_INT_INT: case OP_SUB_RR: case OP_SUB_RK: return X86_SUB;
+        case OP_MUL_INT_INT: case OP_MUL_RR: case OP_MUL_RK: return X86_IMUL;
+        default:                                             return X86_ADD;
+    }
+}
+
+/* Condition under which the comparison holds (signed ints) */
+static int x86_compare(uint8_t op) {
+    switch (op) {
+        case OP_LESS_INT_INT: case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_RR_JUMP_IF_FALSE: case OP_LESS_RK_JUMP_IF_FALSE:
+            return CC_L;
+        case OP_LESS_EQ_INT_INT: case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE: case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+            return CC_LE;
+        case OP_GREATER_INT_INT: case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE: case OP_GREATER_RK_JUMP_IF_FALSE:
+            return CC_G;
+        case OP_GREATER_EQ_INT_INT: case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE: case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+            return CC_GE;
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE: case OP_EQUAL_RK_JUMP_IF_FALSE:
+            return CC_E;
+        default:
+            return CC_NE;
+    }
+}
+
+static void emit_cmp_type(Assembler *a, int base, int32_t disp, SkyValueType type) {
+    emit_op_mem(a, false, 0x81, 7, base, disp + OFF_TYPE);
+    emit_u32(a, (uint32_t)type);
+}
+
+/* Writes the whole first half, padding included (see emit_copy_value) */
+static void emit_set_type(Assembler *a, int base, int32_t disp, SkyValueType type) {
+    emit_op_mem(a, true, 0xc7, 0, base, disp + OFF_TYPE);
+    emit_u32(a, (uint32_t)type);
+}
+
+/* Type guard on the value at [base + disp]; returns the miss jump */
+static int emit_guard_int(Assembler *a, int base, int32_t disp) {
+    emit_cmp_type(a, base, disp, VAL_INT);
+    return emit_jump(a, CC_NE);
+}
+
+/* Stores a bool in [base + disp]: `flag` is a register holding 0 or 1,
+ * or -1 for the constant false / -2 for true */
+static void emit_store_bool(Assembler *a, int base, int32_t disp, int flag) {
+    emit_set_type(a, base, disp, VAL_BOOL);
+    if (flag >= 0) {
+        emit_store(a, base, disp + OFF_PAYLOAD, flag);
+    } else {
+        emit_op_mem(a, true, 0xc7, 0, base, disp + OFF_PAYLOAD);   /* mov qword [], imm32 */
+        emit_u32(a, flag == -2);
+    }
+}
+
+/* edx = truth of the value at [base + disp] as `and` / `or` see it:
+ * only nil and false are false */
+static void emit_logical_truth(Assembler *a, int base, int32_t disp) {
+    int not_bool, done, nil;
+    emit_byte(a, 0xba);                                  /* mov edx, 1 */
+    emit_u32(a, 1);
+    emit_cmp_type(a, base, disp, VAL_BOOL);
+    not_bool = emit_jump(a, CC_NE);
+    emit_op_mem(a, false, 0x0fb6, RDX, base, disp + OFF_PAYLOAD); /* movzx edx, byte [] */
+    done = emit_jump(a, -1);
+    patch_jump(a, not_bool, a->count);
+    emit_cmp_type(a, base, disp, VAL_NIL);
+    nil = emit_jump(a, CC_NE);
+    emit_byte(a, 0x31);                                  /* xor edx, edx */
+    emit_byte(a, 0xd2);
+    patch_jump(a, nil, a->count);
+    patch_jump(a, done, a->count);
+}
+
+/* Guard misses of an equality compare-and-jump call sky_values_equal
+ * instead of the interpreter: any two values compare and it cannot fail.
+ * Each operand is a 16-byte struct passed in two registers. */
+static int emit_equal_slow(Assembler *a, const SkyChunk *chunk, int offset, int *slow, int count) {
+    const uint8_t *ip = chunk->code + offset;
+    int32_t v = VALUE_SIZE;
+    int done = count > 0 ? emit_jump(a, -1) : -1, i;
+
+    for (i = 0; i < count; i++) patch_jump(a, slow[i], a->count);
+    switch (ip[0]) {
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_add_imm(a, RAX, -2 * v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            emit_load(a, RDI, RAX, 0);
+            emit_load(a, RSI, RAX, 8);
+            emit_load(a, RDX, RAX, v);
+            emit_load(a, RCX, RAX, v + 8);
+            break;
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+            emit_load(a, RAX, R12, OFF_SLOTS);
+            emit_load(a, RDI, RAX, ip[1] * v);
+            emit_load(a, RSI, RAX, ip[1] * v + 8);
+            emit_load(a, RDX, RAX, ip[2] * v);
+            emit_load(a, RCX, RAX, ip[2] * v + 8);
+            break;
+        default:
+            emit_load(a, RAX, R12, OFF_SLOTS);
+            emit_load(a, RDI, RAX, ip[1] * v);
+            emit_load(a, RSI, RAX, ip[1] * v + 8);
+            emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)&chunk->constants.values[ip[2]]);
+            emit_load(a, RDX, RAX, 0);
+            emit_load(a, RCX, RAX, 8);
+            break;
+    }
+    emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)sky_values_equal);
+    emit_byte(a, 0xff);                                  /* call rax */
+    emit_byte(a, 0xd0);
+    emit_byte(a, 0x84);                                  /* test al, al */
+    emit_byte(a, 0xc0);
+    emit_branch(a, x86_compare(ip[0]) == CC_E ? CC_E : CC_NE, jump_target(chunk, offset));
+    if (done >= 0) patch_jump(a, done, a->count);
+    return 0;
+}
+
+/* Templates that look at value types (see emit_template): int fast
+ * paths behind guards, plus the ops whose every case is handled inline. */
+static int emit_int_template(Assembler *a, const SkyChunk *chunk, int offset, int *slow) {
+    const uint8_t *ip = chunk->code + offset;
+    const SkyValue *k = chunk->constants.values;
+    int32_t v = VALUE_SIZE, p = OFF_PAYLOAD;
+    int n = 0;
+
+    switch (ip[0]) {
+        case OP_ADD_INT_INT:
+        case OP_SUB_INT_INT:
+        case OP_MUL_INT_INT:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            slow[n++] = emit_guard_int(a, RAX, -2 * v);
+            slow[n++] = emit_guard_int(a, RAX, -v);
+            emit_load(a, RDX, RAX, -2 * v + p);
+            emit_op_mem(a, true, x86_arith(ip[0]), RDX, RAX, -v + p);
+            emit_store(a, RAX, -2 * v + p, RDX);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            return n;
+
+        case OP_LESS_INT_INT:
+        case OP_LESS_EQ_INT_INT:
+        case OP_GREATER_INT_INT:
+        case OP_GREATER_EQ_INT_INT:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            slow[n++] = emit_guard_int(a, RAX, -2 * v);
+            slow[n++] = emit_guard_int(a, RAX, -v);
+            emit_load(a, RDX, RAX, -2 * v + p);
+            emit_op_mem(a, true, X86_CMP, RDX, RAX, -v + p);
+            emit_byte(a, 0x0f);                          /* setcc dl */
+            emit_byte(a, (uint8_t)(0x90 | x86_compare(ip[0])));
+            emit_byte(a, 0xc2);
+            emit_byte(a, 0x0f);                          /* movzx edx, dl */
+            emit_byte(a, 0xb6);
+            emit_byte(a, 0xd2);
+            emit_set_type(a, RAX, -2 * v, VAL_BOOL);
+            emit_store(a, RAX, -2 * v + p, RDX);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            return n;
+
+        case OP_MOD:
+            /* Zero and -1 divisors go to the interpreter (error, overflow) */
+            emit_load(a, RCX, RBX, OFF_TOP);
+            slow[n++] = emit_guard_int(a, RCX, -2 * v);
+            slow[n++] = emit_guard_int(a, RCX, -v);
+            emit_load(a, R8, RCX, -v + p);
+            emit_byte(a, 0x49);                          /* cmp r8, 0 */
+            emit_byte(a, 0x83);
+            emit_byte(a, 0xf8);
+            emit_byte(a, 0x00);
+            slow[n++] = emit_jump(a, CC_E);
+            emit_byte(a, 0x49);                          /* cmp r8, -1 */
+            emit_byte(a, 0x83);
+            emit_byte(a, 0xf8);
+            emit_byte(a, 0xff);
+            slow[n++] = emit_jump(a, CC_E);
+            emit_load(a, RAX, RCX, -2 * v + p);
+            emit_byte(a, 0x48);                          /* cqo */
+            emit_byte(a, 0x99);
+            emit_byte(a, 0x49);                          /* idiv r8 */
+            emit_byte(a, 0xf7);
+            emit_byte(a, 0xf8);
+            emit_store(a, RCX, -2 * v + p, RDX);
+            emit_add_imm(a, RCX, -v);
+            emit_store(a, RBX, OFF_TOP, RCX);
+            return n;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            emit_load(a, RDI, RAX, -v);
+            emit_load(a, RSI, RAX, -v + 8);
+            emit_load(a, RDX, RAX, 0);
+            emit_load(a, RCX, RAX, 8);
+            emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)sky_values_equal);
+            emit_byte(a, 0xff);                          /* call rax */
+            emit_byte(a, 0xd0);
+            emit_byte(a, 0x0f);                          /* movzx edx, al */
+            emit_byte(a, 0xb6);
+            emit_byte(a, 0xd0);
+            if (ip[0] == OP_NOT_EQUAL) {
+                emit_byte(a, 0x83);                      /* xor edx, 1 */
+                emit_byte(a, 0xf2);
+                emit_byte(a, 0x01);
+            }
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_store_bool(a, RAX, -v, RDX);
+            return 0;
+
+        case OP_TO_BOOL:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_logical_truth(a, RAX, -v);
+            emit_store_bool(a, RAX, -v, RDX);
+            return 0;
+
+        case OP_AND_JUMP:
+        case OP_OR_JUMP: {
+            /* and: a false left operand becomes the result, else it is
+             * dropped; or the other way round */
+            int keep, done;
+            bool is_and = ip[0] == OP_AND_JUMP;
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_logical_truth(a, RAX, -v);
+            emit_byte(a, 0x85);                          /* test edx, edx */
+            emit_byte(a, 0xd2);
+            keep = emit_jump(a, is_and ? CC_E : CC_NE);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            done = emit_jump(a, -1);
+            patch_jump(a, keep, a->count);
+            emit_store_bool(a, RAX, -v, is_and ? -1 : -2);
+            emit_branch(a, -1, jump_target(chunk, offset));
+            patch_jump(a, done, a->count);
+            return 0;
+        }
+
+        case OP_INC_LOCAL: {
+            int32_t local = ip[1] * v;
+            if (!IS_INT(k[ip[2]]) || AS_INT(k[ip[2]]) != (int32_t)AS_INT(k[ip[2]])) return -1;
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, local);
+            emit_op_mem(a, true, 0x81, 0, RCX, local + p);   /* add qword [], imm32 */
+            emit_u32(a, (uint32_t)(int32_t)AS_INT(k[ip[2]]));
+            return n;
+        }
+
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[1] * v);
+            slow[n++] = emit_guard_int(a, RCX, ip[2] * v);
+            emit_load(a, RDX, RCX, ip[1] * v + p);
+            emit_op_mem(a, true, X86_ADD, RDX, RCX, ip[2] * v + p);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_set_type(a, RAX, 0, VAL_INT);
+            emit_store(a, RAX, p, RDX);
+            emit_push_done(a);
+            return n;
+
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            slow[n++] = emit_guard_int(a, RAX, -2 * v);
+            slow[n++] = emit_guard_int(a, RAX, -v);
+            emit_add_imm(a, RAX, -2 * v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            emit_load(a, RDX, RAX, p);
+            emit_op_mem(a, true, X86_CMP, RDX, RAX, v + p);
+            emit_branch(a, x86_compare(ip[0]) ^ 1, jump_target(chunk, offset));
+            break;
+
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[2] * v);
+            slow[n++] = emit_guard_int(a, RCX, ip[3] * v);
+            emit_load(a, RDX, RCX, ip[2] * v + p);
+            emit_op_mem(a, true, x86_arith(ip[0]), RDX, RCX, ip[3] * v + p);
+            emit_set_type(a, RCX, ip[1] * v, VAL_INT);
+            emit_store(a, RCX, ip[1] * v + p, RDX);
+            return n;
+
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK:
+            if (!IS_INT(k[ip[3]])) return -1;
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[2] * v);
+            emit_load(a, RDX, RCX, ip[2] * v + p);
+            emit_mov_imm(a, R8, (uint64_t)AS_INT(k[ip[3]]));
+            emit_op_reg(a, x86_arith(ip[0]), RDX, R8);
+            emit_set_type(a, RCX, ip[1] * v, VAL_INT);
+            emit_store(a, RCX, ip[1] * v + p, RDX);
+            return n;
+
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[1] * v);
+            slow[n++] = emit_guard_int(a, RCX, ip[2] * v);
+            emit_load(a, RDX, RCX, ip[1] * v + p);
+            emit_op_mem(a, true, X86_CMP, RDX, RCX, ip[2] * v + p);
+            emit_branch(a, x86_compare(ip[0]) ^ 1, jump_target(chunk, offset));
+            break;
+
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            if (!IS_INT(k[ip[2]])) {
+                /* A string constant, say: no int path at all */
+                int cc = x86_compare(ip[0]);
+                return cc == CC_E || cc == CC_NE ? emit_equal_slow(a, chunk, offset, slow, 0) : -1;
+            }
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[1] * v);
+            emit_load(a, RDX, RCX, ip[1] * v + p);
+            emit_mov_imm(a, R8, (uint64_t)AS_INT(k[ip[2]]));
+            emit_op_reg(a, X86_CMP, RDX, R8);
+            emit_branch(a, x86_compare(ip[0]) ^ 1, jump_target(chunk, offset));
+            break;
+
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            slow[n++] = emit_guard_int(a, RCX, ip[1] * v);
+            slow[n++] = emit_guard_int(a, RCX, (ip[1] + 1) * v);
+            emit_load(a, RDX, RCX, ip[1] * v + p);
+            if (ip[0] == OP_FOR_RANGE_LOOP) {
+                emit_add_imm(a, RDX, 1);
+                emit_store(a, RCX, ip[1] * v + p, RDX);
+            }
+            emit_op_mem(a, true, X86_CMP, RDX, RCX, (ip[1] + 1) * v + p);
+            emit_branch(a, ip[0] == OP_FOR_RANGE_LOOP ? CC_L : CC_GE, jump_target(chunk, offset));
+            return n;
+
+        case OP_POP_JUMP_IF_FALSE: {
+            /* nil, false and 0 are falsy; never needs the interpreter */
+            int target = jump_target(chunk, offset);
+            int not_bool, not_int, done;
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            emit_cmp_type(a, RAX, 0, VAL_BOOL);
+            not_bool = emit_jump(a, CC_NE);
+            emit_op_mem(a, false, 0x80, 7, RAX, p);      /* cmp byte [], 0 */
+            emit_byte(a, 0);
+            emit_branch(a, CC_E, target);
+            done = emit_jump(a, -1);
+            patch_jump(a, not_bool, a->count);
+            emit_cmp_type(a, RAX, 0, VAL_NIL);
+            emit_branch(a, CC_E, target);
+            emit_cmp_type(a, RAX, 0, VAL_INT);
+            not_int = emit_jump(a, CC_NE);
+            emit_op_mem(a, true, 0x83, 7, RAX, p);       /* cmp qword [], 0 */
+            emit_byte(a, 0);
+            emit_branch(a, CC_E, target);
+            patch_jump(a, not_int, a->count);
+            patch_jump(a, done, a->count);
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+
+    /* The compare-and-jumps break out here */
+    switch (x86_compare(ip[0])) {
+        case CC_E:
+        case CC_NE:
+            return emit_equal_slow(a, chunk, offset, slow, n);
+        default:
+            return n;
+    }
+}
+
+#endif /* !SKY_NAN_BOXING */
+
+/* Template for the instruction at `offset`, leaving the jumps taken
+ * when a guard misses in `slow`. Returns how many there are, or -1 when
+ * the instruction has no template. */
+static int emit_template(Assembler *a, const SkyChunk *chunk, int offset, int *slow) {
+    const uint8_t *ip = chunk->code + offset;
+    int32_t v = VALUE_SIZE;
+
+    switch (ip[0]) {
+        case OP_GET_LOCAL:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_copy_value(a, RAX, 0, RCX, ip[1] * v);
+            emit_push_done(a);
+            return 0;
+
+        case OP_SET_LOCAL:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_copy_value(a, RCX, ip[1] * v, RAX, -v);
+            return 0;
+
+        case OP_CONSTANT:
+            emit_mov_imm(a, RCX, (uint64_t)(uintptr_t)&chunk->constants.values[ip[1]]);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_copy_value(a, RAX, 0, RCX, 0);
+            emit_push_done(a);
+            return 0;
+
+        case OP_POP:
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_add_imm(a, RAX, -v);
+            emit_store(a, RBX, OFF_TOP, RAX);
+            return 0;
+
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            SkyValue literal = ip[0] == OP_NIL ? SKY_NIL() : SKY_BOOL(ip[0] == OP_TRUE);
+            emit_load(a, RAX, RBX, OFF_TOP);
+#ifdef SKY_NAN_BOXING
+            emit_mov_imm(a, RDX, literal);
+            emit_store(a, RAX, 0, RDX);
+#else
+            emit_set_type(a, RAX, 0, literal.type);
+            emit_op_mem(a, true, 0xc7, 0, RAX, OFF_PAYLOAD);         /* mov qword [], imm32 */
+            emit_u32(a, ip[0] == OP_TRUE);
+#endif
+            emit_push_done(a);
+            return 0;
+        }
+
+        case OP_GET_GLOBAL_SLOT: {
+            int32_t global = ip[1] * GLOBAL_SIZE;
+            emit_load(a, RCX, RBX, OFF_GLOBALS);
+            emit_op_mem(a, false, 0x80, 7, RCX, global + OFF_GLOBAL_DEFINED);   /* cmp byte [], 0 */
+            emit_byte(a, 0);
+            slow[0] = emit_jump(a, CC_E);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_copy_value(a, RAX, 0, RCX, global + OFF_GLOBAL_VALUE);
+            emit_push_done(a);
+            return 1;
+        }
+
+        case OP_SET_GLOBAL_SLOT: {
+            int32_t global = ip[1] * GLOBAL_SIZE;
+            emit_load(a, RCX, RBX, OFF_GLOBALS);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_copy_value(a, RCX, global + OFF_GLOBAL_VALUE, RAX, -v);
+            emit_op_mem(a, false, 0xc6, 0, RCX, global + OFF_GLOBAL_DEFINED);   /* mov byte [], 1 */
+            emit_byte(a, 1);
+            return 0;
+        }
+
+        case OP_MOVE:
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            emit_copy_value(a, RCX, ip[1] * v, RCX, ip[2] * v);
+            return 0;
+
+        case OP_LOAD_CONST:
+            emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)&chunk->constants.values[ip[2]]);
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            emit_copy_value(a, RCX, ip[1] * v, RAX, 0);
+            return 0;
+
+        case OP_JUMP:
+        case OP_JUMP_BACK:
+            emit_branch(a, -1, jump_target(chunk, offset));
+            return 0;
+
+        case OP_RETURN:
+            /* The result replaces the callee and the caller resumes via
+             * `out`; the last return ends the program in the interpreter */
+            emit_op_mem(a, false, 0x83, 7, RBX, OFF_FRAME_COUNT);    /* cmp dword [], 1 */
+            emit_byte(a, 1);
+            slow[0] = emit_jump(a, CC_LE);
+            emit_load(a, RAX, RBX, OFF_TOP);
+            emit_load(a, RCX, R12, OFF_SLOTS);
+            emit_copy_value(a, RCX, 0, RAX, -v);
+            emit_add_imm(a, RCX, v);
+            emit_store(a, RBX, OFF_TOP, RCX);
+            emit_op_mem(a, false, 0x83, 5, RBX, OFF_FRAME_COUNT);    /* sub dword [], 1 */
+            emit_byte(a, 1);
+            emit_byte(a, 0xb8);                                      /* mov eax, EXIT */
+            emit_u32(a, SKY_STEP_EXIT);
+            patch_jump(a, emit_jump(a, -1), a->out);
+            return 1;
+
+        default:
+#ifndef SKY_NAN_BOXING
+            return emit_int_template(a, chunk, offset, slow);
+#else
+            return -1;
+#endif
+    }
+}
+
+static void emit_instruction(Assembler *a, const SkyChunk *chunk, int offset) {
+    int slow[4], count, i, done;
+
+    count = emit_template(a, chunk, offset, slow);
+    if (count == 0) return;
+    if (count > 0) {
+        done = emit_jump(a, -1);
+        for (i = 0; i < count; i++) patch_jump(a, slow[i], a->count);
+        emit_step(a, chunk, offset);
+        patch_jump(a, done, a->count);
+        return;
+    }
+    emit_step(a, chunk, offset);
+}
+
+/* Shared code at the start of every compiled chunk. The entry is called
+ * as int (*)(vm, frame, start); epilogue returns eax from it; out follows
+ * a step that did not fall through, either to the native code of the
+ * frame now on top or back out with its status. */
+static void emit_frame_code(Assembler *a, SkyJitResumeFn resume) {
+    static const uint8_t prologue[] = {
+        0x55,                   /* push rbp */
+        0x53,                   /* push rbx */
+        0x41, 0x54,             /* push r12 */
+        0x41, 0x55,             /* push r13 (keeps rsp 16-byte aligned) */
+        0x41, 0x56,             /* push r14 */
+        0x48, 0x89, 0xfb,       /* mov rbx, rdi */
+        0x49, 0x89, 0xf4,       /* mov r12, rsi */
+        0xff, 0xe2              /* jmp rdx */
+    };
+    static const uint8_t epilogue[] = {
+        0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3
+    };
+    size_t i;
+    int halt, interpret;
+
+    for (i = 0; i < sizeof(prologue); i++) emit_byte(a, prologue[i]);
+    a->epilogue = a->count;
+    for (i = 0; i < sizeof(epilogue); i++) emit_byte(a, epilogue[i]);
+
+    a->out = a->count;
+    emit_byte(a, 0x83);                                  /* cmp eax, EXIT */
+    emit_byte(a, 0xf8);
+    emit_byte(a, SKY_STEP_EXIT);
+    halt = emit_jump(a, CC_A);
+    patch_jump(a, halt, a->epilogue);
+    emit_op_reg(a, X86_LOAD, RDI, RBX);
+    emit_mov_imm(a, RAX, (uint64_t)(uintptr_t)resume);
+    emit_byte(a, 0xff);                                  /* call rax */
+    emit_byte(a, 0xd0);
+    emit_byte(a, 0x48);                                  /* test rax, rax */
+    emit_byte(a, 0x85);
+    emit_byte(a, 0xc0);
+    interpret = emit_jump(a, CC_E);
+    emit_op_reg(a, X86_LOAD, R12, RDX);
+    emit_byte(a, 0xff);                                  /* jmp rax */
+    emit_byte(a, 0xe0);
+    patch_jump(a, interpret, a->count);
+    emit_byte(a, 0xb8);                                  /* mov eax, EXIT */
+    emit_u32(a, SKY_STEP_EXIT);
+    patch_jump(a, emit_jump(a, -1), a->epilogue);
+}
+
+bool sky_jit_compile(SkyChunk *chunk, SkyJitResumeFn resume) {
+    Assembler a;
+    SkyJitCode *jit = NULL;
+    uint32_t *entry;
+    uint8_t *code = MAP_FAILED;
+    int offset, i;
+
+    if (!chunk || chunk->jit || chunk->code_count == 0) return false;
+    memset(&a, 0, sizeof(a));
+    entry = (uint32_t*)malloc(sizeof(uint32_t) * chunk->code_count);
+    if (!entry) return false;
+    for (offset = 0; offset < chunk->code_count; offset++) entry[offset] = NO_ENTRY;
+
+    emit_frame_code(&a, resume);
+    for (offset = 0; offset < chunk->code_count;
+         offset += sky_opcode_length(chunk->code[offset])) {
+        entry[offset] = (uint32_t)a.count;
+        emit_instruction(&a, chunk, offset);
+    }
+    emit_byte(&a, 0x0f);        /* ud2: verified code never runs off the end */
+    emit_byte(&a, 0x0b);
+
+    for (i = 0; i < a.fixup_count && !a.failed; i++) {
+        int target = a.fixups[i].target;
+        if (target < 0 || target >= chunk->code_count || entry[target] == NO_ENTRY) {
+            a.failed = true;
+            break;
+        }
+        patch_jump(&a, a.fixups[i].at, (int)entry[target]);
+    }
+
+    if (!a.failed) {
+        code = (uint8_t*)mmap(NULL, (size_t)a.count, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (code != MAP_FAILED) {
+        memcpy(code, a.buf, (size_t)a.count);
+        if (mprotect(code, (size_t)a.count, PROT_READ | PROT_EXEC) != 0 ||
+            !(jit = (SkyJitCode*)malloc(sizeof(SkyJitCode)))) {
+            munmap(code, (size_t)a.count);
+        }
+    }
+    free(a.buf);
+    free(a.fixups);
+    if (!jit) {
+        free(entry);
+        return false;
+    }
+    jit->code = code;
+    jit->size = (size_t)a.count;
+    jit->entry = entry;
+    chunk->jit = jit;
+    return true;
+}
+
+void* sky_jit_entry(const SkyChunk *chunk, const uint8_t *ip) {
+    return chunk->jit->code + chunk->jit->entry[ip - chunk->code];
+}
+
+int sky_jit_run(SkyChunk *chunk, SkyVM *vm, SkyCallFrame *frame) {
+    NativeEntry native = (NativeEntry)(void*)chunk->jit->code;
+    return native(vm, frame, (uint8_t*)sky_jit_entry(chunk, frame->ip));
+}
+
+void sky_jit_free(SkyJitCode *code) {
+    if (!code) return;
+    munmap(code->code, code->size);
+    free(code->entry);
+    free(code);
+}
+
+#else
+
+bool sky_jit_compile(SkyChunk *chunk, SkyJitResumeFn resume) {
+    (void)chunk;
+    (void)resume;
+    return false;
+}
+
+void* sky_jit_entry(const SkyChunk *chunk, const uint8_t *ip) {
+    (void)chunk;
+    (void)ip;
+    return NULL;
+}
+
+int sky_jit_run(SkyChunk *chunk, SkyVM *vm, SkyCallFrame *frame) {
+    (void)chunk;
+    (void)vm;
+    (void)frame;
+    return SKY_STEP_EXIT;
+}
+
+void sky_jit_free(SkyJitCode *code) {
+    (void)code;
+}
+
+#endif /* SKY_JIT_AVAILABLE */
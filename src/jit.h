@@ -0,0 +1,49 @@
+﻿/* jit.h — Baseline template JIT for x86-64 */
+#ifndef SKY_JIT_H
+#define SKY_JIT_H
+
+#include "vm.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Native code is only generated on x86-64 Linux; everywhere else (or
+ * built with -DSKY_NO_JIT) `sky run --jit` just interprets. */
+#if defined(__x86_64__) && defined(__linux__) && !defined(SKY_NO_JIT)
+#define SKY_JIT_AVAILABLE 1
+#else
+#define SKY_JIT_AVAILABLE 0
+#endif
+
+/* Calls, returns and loop back-edges a chunk sees before it is compiled */
+#ifndef SKY_JIT_THRESHOLD
+#define SKY_JIT_THRESHOLD 1000
+#endif
+
+typedef struct SkyJitCode SkyJitCode;
+
+/* Where native code continues after a step left its frame: the native
+ * code for the new top frame's ip, or NULL to hand that frame back to
+ * the interpreter. Returned in two registers, so calls and returns
+ * between compiled chunks never leave native code. */
+typedef struct {
+    void         *resume;
+    SkyCallFrame *frame;
+} SkyJitTarget;
+typedef SkyJitTarget (*SkyJitResumeFn)(SkyVM *vm);
+
+/* Every instruction of a chunk becomes a copy of its template (or a call
+ * to sky_vm_step), so native code can be entered at any instruction
+ * boundary. Sets chunk->jit. */
+bool  sky_jit_compile(SkyChunk *chunk, SkyJitResumeFn resume);
+
+/* Native address of the instruction at `ip` in a compiled chunk */
+void* sky_jit_entry(const SkyChunk *chunk, const uint8_t *ip);
+
+/* Runs `frame` (whose chunk has been compiled) from frame->ip until the
+ * program finishes or fails, or a frame without native code is on top
+ * (SKY_STEP_EXIT). */
+int   sky_jit_run(SkyChunk *chunk, SkyVM *vm, SkyCallFrame *frame);
+
+void sky_jit_free(SkyJitCode *code);
+
+#endif
@@ -3,9 +3,14 @@
 #include "lexer.h"
 #include "parser.h"
 #include "compiler.h"
+#include "fold.h"
+#include "optimizer.h"
 #include "vm.h"
 #include "debug.h"
 #include "bytecode.h"
+#include "serializer.h"
+#include "aot.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,18 +39,23 @@ static char* read_file(const char *path) {
     return buf;
 }
 
-static void run_file(const char *path) {
-    char *source;
+static bool gc_stress = false;
+static bool use_jit = false;
+static bool use_cache = true;
+static int opt_level = SKY_OPT_DEFAULT;
+static bool use_snapshot = false;
+
+static bool has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/* Source -> optimized chunk ending in HALT. */
+static bool compile_source(const char *path, const char *source, SkyChunk *chunk) {
     SkyLexer lexer;
     SkyParser parser;
     SkyASTNode *ast;
-    SkyChunk chunk;
     SkyCompiler compiler;
-    SkyVM vm;
-    SkyVMResult result;
-
-    source = read_file(path);
-    if (!source) return;
 
     sky_lexer_init(&lexer, source, path);
     sky_parser_init(&parser, &lexer);
@@ -53,34 +63,216 @@ static void run_file(const char *path) {
 
     if (!ast) {
         fprintf(stderr, "Error: Failed to parse '%s'\n", path);
-        free(source);
-        return;
+        return false;
     }
 
-    sky_chunk_init(&chunk);
-    sky_compiler_init(&compiler, &chunk);
+    if (opt_level >= SKY_OPT_PEEPHOLE) sky_fold_constants(ast);
+
+    sky_chunk_init(chunk);
+    sky_compiler_init(&compiler, chunk);
 
     if (!sky_compiler_compile(&compiler, ast)) {
         fprintf(stderr, "Error: Failed to compile '%s'\n", path);
         sky_ast_free(ast);
-        sky_chunk_free(&chunk);
+        sky_chunk_free(chunk);
+        return false;
+    }
+
+    sky_chunk_write(chunk, OP_HALT, 0);
+    sky_optimize_chunk(chunk, opt_level);
+    sky_ast_free(ast);
+    return true;
+}
+
+/* Cache entries are keyed by the source, the optimization level and this
+ * exact sky binary, so a rebuilt compiler never runs bytecode from an
+ * older one. */
+static uint64_t cache_key(const char *source) {
+    static const char stamp[] = SKY_VERSION_STRING " " __DATE__ " " __TIME__;
+    uint64_t key = sky_source_hash(source, strlen(source)) ^ sky_source_hash(stamp, sizeof(stamp) - 1);
+    key ^= (uint64_t)opt_level * 0x9e3779b97f4a7c15ull;
+    return key ? key : 1;
+}
+
+/* A .skyc file is loaded as is. A source file is served from its cache
+ * entry when that matches, otherwise compiled and the entry rewritten. */
+static bool load_program(const char *path, SkyChunk *chunk, SkyImage *image) {
+    char error[128];
+    char cache_path[1024];
+    char *source;
+    uint64_t key;
+
+    memset(image, 0, sizeof(*image));
+    if (has_suffix(path, ".skyc")) {
+        if (!sky_skyc_load(path, 0, chunk, image, error, sizeof(error))) {
+            fprintf(stderr, "Error: Cannot load '%s': %s\n", path, error);
+            return false;
+        }
+        return true;
+    }
+
+    source = read_file(path);
+    if (!source) return false;
+    key = cache_key(source);
+    if (use_cache && sky_skyc_cache_path(path, cache_path, sizeof(cache_path), false) &&
+        sky_skyc_load(cache_path, key, chunk, image, error, sizeof(error))) {
         free(source);
-        return;
+        return true;
+    }
+    if (!compile_source(path, source, chunk)) {
+        free(source);
+        return false;
     }
+    free(source);
+    /* Best effort: an unwritable directory just means no cache */
+    if (use_cache && sky_skyc_cache_path(path, cache_path, sizeof(cache_path), true)) {
+        sky_skyc_write(chunk, key, cache_path, error, sizeof(error));
+    }
+    return true;
+}
 
-    sky_chunk_write(&chunk, OP_HALT, 0);
+static void run_file(const char *path) {
+    SkyChunk chunk;
+    SkyImage image;
+    SkyVM vm;
+    SkyVMResult result;
+
+    if (!load_program(path, &chunk, &image)) return;
 
     sky_vm_init(&vm);
+    vm.heap.config.stress = gc_stress;
+    vm.jit = use_jit;
     result = sky_vm_execute(&vm, &chunk);
 
     if (result != VM_OK) {
         fprintf(stderr, "Error: Runtime error in '%s'\n", path);
     }
 
+    if (sky_debug_collect_stats) {
+        sky_debug_print_constant_stats(&chunk, path);
+        sky_debug_print_quicken_stats(&chunk, path);
+        sky_gc_print_stats(&vm.heap);
+    }
+    if (sky_debug_profile_opcodes) {
+        sky_debug_print_opcode_profile(20);
+    }
+
     sky_vm_destroy(&vm);
-    sky_ast_free(ast);
     sky_chunk_free(&chunk);
+    sky_image_free(&image);
+}
+
+/* Skips the top level: the snapshot's globals are restored instead, and
+ * the program's main(), if it has one, is called on them. */
+static void run_snapshot(const char *path) {
+    SkySnapshot snapshot;
+    SkyVM vm;
+    SkyValue entry, result;
+    char error[128];
+
+    if (!sky_snapshot_load(path, &snapshot, error, sizeof(error))) {
+        fprintf(stderr, "Error: Cannot load '%s': %s\n", path, error);
+        return;
+    }
+    sky_vm_init(&vm);
+    vm.heap.config.stress = gc_stress;
+    vm.jit = use_jit;
+    if (!sky_snapshot_restore(&snapshot, &vm, error, sizeof(error))) {
+        fprintf(stderr, "Error: Cannot restore '%s': %s\n", path, error);
+    } else if (sky_vm_get_global(&vm, "main", &entry) && IS_FUNCTION(entry) &&
+               sky_vm_call(&vm, entry, 0, NULL, &result) != VM_OK) {
+        fprintf(stderr, "Error: Runtime error in '%s'\n", path);
+    }
+
+    if (sky_debug_collect_stats) {
+        sky_gc_print_stats(&vm.heap);
+    }
+    sky_vm_destroy(&vm);
+    sky_snapshot_free(&snapshot);
+}
+
+/* Runs the top level of `path` once and saves the program with the
+ * globals it left behind. */
+static int snapshot_file(const char *path, const char *output) {
+    char default_output[1024];
+    char error[128];
+    SkyChunk chunk;
+    SkyImage image;
+    SkyVM vm;
+    bool ok;
+
+    if (!output) {
+        size_t n = strlen(path);
+        if (has_suffix(path, ".sky")) n -= 4;
+        if (n + 9 > sizeof(default_output)) {
+            fprintf(stderr, "Error: Path too long '%s'\n", path);
+            return 1;
+        }
+        memcpy(default_output, path, n);
+        memcpy(default_output + n, ".skysnap", 9);
+        output = default_output;
+    }
+    if (!load_program(path, &chunk, &image)) return 1;
+
+    sky_vm_init(&vm);
+    ok = sky_vm_execute(&vm, &chunk) == VM_OK;
+    if (!ok) {
+        fprintf(stderr, "Error: Runtime error in '%s'\n", path);
+    } else if (!sky_snapshot_write(&vm, &chunk, output, error, sizeof(error))) {
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", output, error);
+        ok = false;
+    } else {
+        printf("Snapshot %s\n", output);
+    }
+    sky_vm_destroy(&vm);
+    sky_chunk_free(&chunk);
+    sky_image_free(&image);
+    return ok ? 0 : 1;
+}
+
+static int build_file(const char *path, const char *output) {
+    char default_output[1024];
+    char error[128];
+    SkyChunk chunk;
+    char *source;
+    uint64_t key;
+    bool ok;
+
+    if (!output) {
+        size_t n = strlen(path);
+        if (has_suffix(path, ".sky")) n -= 4;
+        if (n + 6 > sizeof(default_output)) {
+            fprintf(stderr, "Error: Path too long '%s'\n", path);
+            return 1;
+        }
+        memcpy(default_output, path, n);
+        memcpy(default_output + n, ".skyc", 6);
+        output = default_output;
+    }
+
+    source = read_file(path);
+    if (!source) return 1;
+    key = cache_key(source);
+    ok = compile_source(path, source, &chunk);
     free(source);
+    if (!ok) return 1;
+
+    /* Anything but a .skyc output is native: C source for a .c name, else
+     * an executable */
+    if (has_suffix(output, ".skyc")) {
+        ok = sky_skyc_write(&chunk, key, output, error, sizeof(error));
+    } else if (has_suffix(output, ".c")) {
+        ok = sky_aot_write_c(&chunk, path, output, error, sizeof(error));
+    } else {
+        ok = sky_aot_build(&chunk, path, output, error, sizeof(error));
+    }
+    if (ok) {
+        printf("Built %s\n", output);
+    } else {
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", output, error);
+    }
+    sky_chunk_free(&chunk);
+    return ok ? 0 : 1;
 }
 
 static void check_file(const char *path) {
@@ -105,10 +297,36 @@ static void check_file(const char *path) {
     free(source);
 }
 
+/* The level named by -O0 to -O3, or -1 for any other argument. */
+static int opt_flag(const char *arg) {
+    if (arg[0] != '-' || arg[1] != 'O' || arg[2] < '0' || arg[2] > '0' + SKY_OPT_MAX || arg[3] != '\0') {
+        return -1;
+    }
+    return arg[2] - '0';
+}
+
 static void print_usage(void) {
     printf("Sky Programming Language v%s\n\n", SKY_VERSION_STRING);
     printf("Usage:\n");
     printf("  sky run <file.sky>    Compile and run\n");
+    printf("    --trace             Trace every executed instruction\n");
+    printf("    --stats             Print VM statistics after the run\n");
+    printf("    --profile           Print the most frequent opcode pairs\n");
+    printf("    --gc-stress         Collect garbage on every allocation\n");
+    printf("    --no-cache          Compile without reading or writing .skycache/\n");
+    printf("    --jit               Compile hot code to native code (x86-64 Linux)\n");
+    printf("    -O0 ... -O3         Bytecode optimization level (default -O2;\n");
+    printf("                        -O3 adds three-address register forms)\n");
+    printf("  sky run <file.skyc>   Run a compiled file\n");
+    printf("  sky build <file.sky> [-o out.skyc]\n");
+    printf("                        Compile to a bytecode file\n");
+    printf("  sky build <file.sky> -o <app>\n");
+    printf("                        Compile to a native executable via C\n");
+    printf("                        (-o app.c writes just the C source)\n");
+    printf("  sky snapshot <file.sky> [-o out.skysnap]\n");
+    printf("                        Run the top level and save its globals\n");
+    printf("  sky run --snapshot <file.skysnap>\n");
+    printf("                        Resume from a snapshot and call main()\n");
     printf("  sky check <file.sky>  Syntax check\n");
     printf("  sky version           Show version\n");
     printf("  sky help              Show this help\n");
@@ -131,14 +349,81 @@ int main(int argc, char *argv[]) {
     }
 
     if (strcmp(argv[1], "run") == 0 || strcmp(argv[1], "serve") == 0) {
-        if (argc < 3) {
+        const char *path = NULL;
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--trace") == 0) {
+                sky_debug_trace_execution = true;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                sky_debug_collect_stats = true;
+            } else if (strcmp(argv[i], "--profile") == 0) {
+                sky_debug_profile_opcodes = true;
+            } else if (strcmp(argv[i], "--gc-stress") == 0) {
+                gc_stress = true;
+            } else if (strcmp(argv[i], "--no-cache") == 0) {
+                use_cache = false;
+            } else if (strcmp(argv[i], "--jit") == 0) {
+                use_jit = true;
+            } else if (strcmp(argv[i], "--snapshot") == 0) {
+                use_snapshot = true;
+            } else if (opt_flag(argv[i]) >= 0) {
+                opt_level = opt_flag(argv[i]);
+            } else {
+                path = argv[i];
+            }
+        }
+        if (!path) {
             fprintf(stderr, "Error: No file specified\n");
             return 1;
         }
-        run_file(argv[2]);
+        if (use_snapshot || has_suffix(path, ".skysnap")) {
+            run_snapshot(path);
+        } else {
+            run_file(path);
+        }
         return 0;
     }
 
+    if (strcmp(argv[1], "snapshot") == 0) {
+        const char *path = NULL;
+        const char *output = NULL;
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                output = argv[++i];
+            } else if (opt_flag(argv[i]) >= 0) {
+                opt_level = opt_flag(argv[i]);
+            } else {
+                path = argv[i];
+            }
+        }
+        if (!path) {
+            fprintf(stderr, "Error: No file specified\n");
+            return 1;
+        }
+        return snapshot_file(path, output);
+    }
+
+    if (strcmp(argv[1], "build") == 0) {
+        const char *path = NULL;
+        const char *output = NULL;
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                output = argv[++i];
+            } else if (opt_flag(argv[i]) >= 0) {
+                opt_level = opt_flag(argv[i]);
+            } else {
+                path = argv[i];
+            }
+        }
+        if (!path) {
+            fprintf(stderr, "Error: No file specified\n");
+            return 1;
+        }
+        return build_file(path, output);
+    }
+
     if (strcmp(argv[1], "check") == 0) {
         if (argc < 3) {
             fprintf(stderr, "Error: No file specified\n");
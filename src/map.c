@@ -0,0 +1,198 @@
+﻿/* map.c — Insertion-ordered hash maps (VAL_MAP) */
+#include "map.h"
+#include "gc.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SKY_MAP_SSE2 1
+#endif
+
+/* Bit i set where control byte i of the group equals `byte`. */
+static inline uint32_t group_match(const uint8_t *group, uint8_t byte) {
+#ifdef SKY_MAP_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < SKY_MAP_GROUP; i++) mask |= (uint32_t)(group[i] == byte) << i;
+    return mask;
+#endif
+}
+
+static inline int lowest_bit(uint32_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(bits);
+#else
+    int i = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* The high hash bits pick the first group, the low 7 are the tag, and
+ * triangular steps visit every group of a power-of-two table. */
+#define GROUP_OF(hash, mask) (((hash) >> 7) & (mask))
+#define TAG_OF(hash)         ((uint8_t)((hash) & 0x7f))
+
+/* The slot holding `key`, or -1. */
+static int find_slot(const SkyMap *map, SkyString *key, uint32_t hash) {
+    uint32_t mask = (uint32_t)(map->slot_count / SKY_MAP_GROUP - 1);
+    uint32_t group = GROUP_OF(hash, mask);
+    uint32_t step = 0;
+    while (1) {
+        const uint8_t *ctrl = map->control + group * SKY_MAP_GROUP;
+        uint32_t bits = group_match(ctrl, TAG_OF(hash));
+        while (bits) {
+            uint32_t slot = group * SKY_MAP_GROUP + (uint32_t)lowest_bit(bits);
+            const SkyMapEntry *entry = &map->entries[map->slots[slot]];
+            if (entry->key == key || (entry->hash == hash && sky_strings_equal(entry->key, key))) {
+                return (int)slot;
+            }
+            bits &= bits - 1;
+        }
+        /* Nothing past an empty slot: the key was never inserted */
+        if (group_match(ctrl, SKY_MAP_EMPTY)) return -1;
+        group = (group + ++step) & mask;
+    }
+}
+
+static int find_entry(const SkyMap *map, SkyString *key, uint32_t hash) {
+    int slot = find_slot(map, key, hash);
+    return slot < 0 ? -1 : (int)map->slots[slot];
+}
+
+static void insert_slot(SkyMap *map, uint32_t hash, uint32_t index) {
+    uint32_t mask = (uint32_t)(map->slot_count / SKY_MAP_GROUP - 1);
+    uint32_t group = GROUP_OF(hash, mask);
+    uint32_t step = 0;
+    while (1) {
+        uint32_t empty = group_match(map->control + group * SKY_MAP_GROUP, SKY_MAP_EMPTY);
+        if (empty) {
+            uint32_t slot = group * SKY_MAP_GROUP + (uint32_t)lowest_bit(empty);
+            map->control[slot] = TAG_OF(hash);
+            map->slots[slot] = index;
+            return;
+        }
+        group = (group + ++step) & mask;
+    }
+}
+
+size_t sky_map_buffer_size(const SkyMap *map) {
+    return sizeof(SkyMapEntry) * (size_t)map->entry_capacity +
+           (sizeof(uint8_t) + sizeof(uint32_t)) * (size_t)map->slot_count;
+}
+
+/* Moves to `slot_count` slots (never fewer than now), closing the holes
+ * removed keys left and reindexing from the cached hashes. */
+static void resize(SkyMap *map, int slot_count) {
+    size_t before = sky_map_buffer_size(map);
+    int entry_capacity = slot_count / 8 * 7;
+    SkyMapEntry *entries = (SkyMapEntry*)realloc(map->entries, sizeof(SkyMapEntry) * entry_capacity);
+    uint8_t *control = (uint8_t*)malloc((sizeof(uint8_t) + sizeof(uint32_t)) * (size_t)slot_count);
+    int i, live = 0;
+    if (!entries || !control) {
+        fprintf(stderr, "[SKY] Out of memory growing a map\n");
+        exit(1);
+    }
+    for (i = 0; i < map->used; i++) {
+        if (entries[i].key) entries[live++] = entries[i];
+    }
+    map->used = live;
+    free(map->control);
+    map->entries = entries;
+    map->entry_capacity = entry_capacity;
+    map->control = control;
+    map->slots = (uint32_t*)(control + slot_count);
+    map->slot_count = slot_count;
+    memset(control, SKY_MAP_EMPTY, (size_t)slot_count);
+    for (i = 0; i < map->used; i++) insert_slot(map, entries[i].hash, (uint32_t)i);
+    sky_gc_account((ptrdiff_t)sky_map_buffer_size(map) - (ptrdiff_t)before);
+}
+
+SkyMap* sky_map_new(int count) {
+    SkyMap *map = (SkyMap*)sky_gc_alloc(sizeof(SkyMap), VAL_MAP);
+    int slot_count = SKY_MAP_GROUP;
+    while (count > slot_count / 8 * 7) slot_count *= 2;
+    map->entries = NULL;
+    map->used = 0;
+    map->count = 0;
+    map->entry_capacity = 0;
+    map->control = NULL;
+    map->slots = NULL;
+    map->slot_count = 0;
+    resize(map, slot_count);
+    return map;
+}
+
+bool sky_map_get(SkyMap *map, SkyString *key, SkyValue *out) {
+    int index = find_entry(map, key, sky_string_hash(key));
+    if (index < 0) return false;
+    *out = map->entries[index].value;
+    return true;
+}
+
+void sky_map_set(SkyMap *map, SkyString *key, SkyValue value) {
+    uint32_t hash = sky_string_hash(key);
+    int index = find_entry(map, key, hash);
+    SkyMapEntry *entry;
+    if (index >= 0) {
+        map->entries[index].value = value;
+        return;
+    }
+    if (map->used == map->entry_capacity) {
+        /* Mostly holes: closing them makes room without growing */
+        resize(map, map->count < map->entry_capacity / 2 ? map->slot_count : map->slot_count * 2);
+    }
+    entry = &map->entries[map->used];
+    entry->key = key;
+    entry->hash = hash;
+    entry->value = value;
+    insert_slot(map, hash, (uint32_t)map->used);
+    map->used++;
+    map->count++;
+}
+
+bool sky_map_delete(SkyMap *map, SkyString *key) {
+    int slot = find_slot(map, key, sky_string_hash(key));
+    SkyMapEntry *entry;
+    if (slot < 0) return false;
+    entry = &map->entries[map->slots[slot]];
+    entry->key = NULL;
+    entry->value = SKY_NIL();
+    map->control[slot] = SKY_MAP_DELETED;
+    map->count--;
+    return true;
+}
+
+SkyString* sky_map_key(SkyValue key) {
+    char text[32];
+    if (IS_STRING(key)) return AS_STRING_OBJ(key);
+    if (IS_INT(key)) {
+        snprintf(text, sizeof(text), "%lld", (long long)AS_INT(key));
+    } else if (IS_FLOAT(key) && isfinite(AS_FLOAT(key))) {
+        /* As json() writes it: the shorter form that reads back the same */
+        double d = AS_FLOAT(key);
+        snprintf(text, sizeof(text), "%.15g", d);
+        if (strtod(text, NULL) != d) snprintf(text, sizeof(text), "%.17g", d);
+    } else {
+        return NULL;
+    }
+    return sky_string_copy(text, (int)strlen(text));
+}
+
+void sky_map_free_buffers(SkyMap *map) {
+    free(map->entries);
+    free(map->control);
+    map->entries = NULL;
+    map->control = NULL;
+    map->slots = NULL;
+    map->used = map->count = map->entry_capacity = map->slot_count = 0;
+}
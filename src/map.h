@@ -0,0 +1,65 @@
+﻿/* map.h — Insertion-ordered hash maps (VAL_MAP) */
+#ifndef SKY_MAP_H
+#define SKY_MAP_H
+
+#include "value.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Entries sit in a dense array in insertion order, which is the order
+ * maps are walked and serialized in. Lookups go through a Swiss table
+ * beside it: one control byte per slot, SKY_MAP_EMPTY or the low 7 bits
+ * of the key's hash, probed a group of SKY_MAP_GROUP slots at a time
+ * (one SSE2 compare where available), and the entry index of each full
+ * slot. Keys are strings with their hash cached in the entry, so probing
+ * and growth never rehash characters, and a key that is the very string
+ * stored (a constant, say) matches without comparing characters.
+ *
+ * Removing a key leaves a hole in the entry array (a NULL key) and marks
+ * its slot SKY_MAP_DELETED, which probes step over. Holes are closed, in
+ * order, the next time the entry array fills up. Ints and floats are
+ * stored under their JSON text (sky_map_key), so m[1] and m["1"] are the
+ * same entry. */
+#define SKY_MAP_GROUP   16
+#define SKY_MAP_EMPTY   0x80
+#define SKY_MAP_DELETED 0xfe
+
+typedef struct {
+    SkyString *key;
+    uint32_t   hash;
+    SkyValue   value;
+} SkyMapEntry;
+
+typedef struct {
+    SkyObj       obj;
+    SkyMapEntry *entries;          /* `used` of them, holes included */
+    int          used;
+    int          count;            /* live entries */
+    int          entry_capacity;   /* 7/8 of slot_count: the most entries before growing */
+    uint8_t     *control;          /* slot_count control bytes, then the slots */
+    uint32_t    *slots;            /* entry index of each full slot */
+    int          slot_count;       /* a power of two, at least SKY_MAP_GROUP */
+} SkyMap;
+
+#ifdef SKY_NAN_BOXING
+#define IS_MAP(v)          sky_nan_is_obj_type(v, VAL_MAP)
+#else
+#define IS_MAP(v)          ((v).type == VAL_MAP)
+#endif
+#define AS_MAP(v)          ((SkyMap*)AS_OBJECT(v))
+
+/* A map with room for `count` entries before it first grows. */
+SkyMap* sky_map_new(int count);
+bool    sky_map_get(SkyMap *map, SkyString *key, SkyValue *out);
+/* Callers apply the GC barrier for the key and value (gc.h). */
+void    sky_map_set(SkyMap *map, SkyString *key, SkyValue value);
+/* False if the key was not there. */
+bool    sky_map_delete(SkyMap *map, SkyString *key);
+/* The string `key` is stored under, or NULL if it cannot be a key. May
+ * allocate, so `key` and the map must be reachable. */
+SkyString* sky_map_key(SkyValue key);
+size_t  sky_map_buffer_size(const SkyMap *map);
+void    sky_map_free_buffers(SkyMap *map);
+
+#endif
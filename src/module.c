@@ -139,7 +139,7 @@ bool sky_module_register_builtin(SkyModuleRegistry *reg,
     SkyModuleExport *exp = &mod->exports[mod->export_count++];
     strncpy(exp->name, func_name, sizeof(exp->name) - 1);
     exp->value = value;
-    exp->is_function = (value.type == VAL_NATIVE_FN);
+    exp->is_function = IS_NATIVE_FN(value);
 
     return true;
 }
@@ -0,0 +1,470 @@
+﻿/* optimizer.c — Bytecode optimization passes */
+#include "optimizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Unconditional jumps followed per jump site, so cycles terminate */
+#define MAX_THREAD_HOPS 16
+
+typedef struct {
+    int position;     /* new offset of the jump opcode */
+    int old_target;   /* target offset in the original code */
+} PendingJump;
+
+typedef struct {
+    uint8_t     *code;
+    SkyLineTable lines;
+    int          count;
+    PendingJump *jumps;
+    int          jump_count;
+} Rewriter;
+
+static bool is_jump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_BACK:
+        case OP_AND_JUMP:
+        case OP_OR_JUMP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP:
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool jumps_back(uint8_t op) {
+    return op == OP_JUMP_BACK || op == OP_FOR_RANGE_LOOP;
+}
+
+/* The distance is always the last two bytes, measured from the end of
+ * the instruction. */
+static int jump_target(const uint8_t *code, int offset) {
+    int end = offset + sky_opcode_length(code[offset]);
+    int distance = (code[end - 2] << 8) | code[end - 1];
+    return jumps_back(code[offset]) ? end - distance : end + distance;
+}
+
+static bool ends_block(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_BACK || op == OP_RETURN || op == OP_HALT;
+}
+
+/* Pushes one value and does nothing else, so it cancels against a POP. */
+static bool is_pure_push(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_DUP:
+        case OP_GET_LOCAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Always leaves a bool on top, which makes a following TO_BOOL a no-op. */
+static bool pushes_bool(uint8_t op) {
+    switch (op) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_TO_BOOL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQ:
+        case OP_GREATER:
+        case OP_GREATER_EQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Compare opcode -> fused compare-and-jump opcode, or 0. */
+static uint8_t fused_compare(uint8_t op) {
+    switch (op) {
+        case OP_LESS:       return OP_LESS_JUMP_IF_FALSE;
+        case OP_LESS_EQ:    return OP_LESS_EQ_JUMP_IF_FALSE;
+        case OP_GREATER:    return OP_GREATER_JUMP_IF_FALSE;
+        case OP_GREATER_EQ: return OP_GREATER_EQ_JUMP_IF_FALSE;
+        case OP_EQUAL:      return OP_EQUAL_JUMP_IF_FALSE;
+        case OP_NOT_EQUAL:  return OP_NOT_EQUAL_JUMP_IF_FALSE;
+        default:            return 0;
+    }
+}
+
+/* ADD / SUB / MUL -> register form with a slot (or constant) right
+ * operand, or 0. */
+static uint8_t register_arith(uint8_t op, bool constant) {
+    switch (op) {
+        case OP_ADD: return constant ? OP_ADD_RK : OP_ADD_RR;
+        case OP_SUB: return constant ? OP_SUB_RK : OP_SUB_RR;
+        case OP_MUL: return constant ? OP_MUL_RK : OP_MUL_RR;
+        default:     return 0;
+    }
+}
+
+/* Compare opcode -> register compare-and-jump opcode, or 0. */
+static uint8_t register_compare(uint8_t op, bool constant) {
+    switch (op) {
+        case OP_LESS:       return constant ? OP_LESS_RK_JUMP_IF_FALSE : OP_LESS_RR_JUMP_IF_FALSE;
+        case OP_LESS_EQ:    return constant ? OP_LESS_EQ_RK_JUMP_IF_FALSE : OP_LESS_EQ_RR_JUMP_IF_FALSE;
+        case OP_GREATER:    return constant ? OP_GREATER_RK_JUMP_IF_FALSE : OP_GREATER_RR_JUMP_IF_FALSE;
+        case OP_GREATER_EQ: return constant ? OP_GREATER_EQ_RK_JUMP_IF_FALSE : OP_GREATER_EQ_RR_JUMP_IF_FALSE;
+        case OP_EQUAL:      return constant ? OP_EQUAL_RK_JUMP_IF_FALSE : OP_EQUAL_RR_JUMP_IF_FALSE;
+        case OP_NOT_EQUAL:  return constant ? OP_NOT_EQUAL_RK_JUMP_IF_FALSE : OP_NOT_EQUAL_RR_JUMP_IF_FALSE;
+        default:            return 0;
+    }
+}
+
+/* Where the jump at `offset` ends up once it skips the unconditional
+ * jumps it lands on. A short-circuit jump also passes through another
+ * one of its kind: the value it carries makes that one jump too.
+ * Conditional jumps can only be encoded forwards. */
+static int thread_jump(const uint8_t *code, int n, int offset) {
+    uint8_t op = code[offset];
+    bool conditional = op != OP_JUMP && op != OP_JUMP_BACK;
+    int target = jump_target(code, offset);
+    int end = offset + sky_opcode_length(op);
+    int hops;
+
+    if (op == OP_FOR_RANGE_PREP || op == OP_FOR_RANGE_LOOP) return target;
+
+    for (hops = 0; hops < MAX_THREAD_HOPS && target >= 0 && target < n; hops++) {
+        uint8_t at = code[target];
+        int next;
+        if (at != OP_JUMP && at != OP_JUMP_BACK &&
+            !((op == OP_AND_JUMP || op == OP_OR_JUMP) && at == op)) {
+            break;
+        }
+        next = jump_target(code, target);
+        if (next < 0 || next > n || (conditional && next < end)) break;
+        if (abs(next - end) > 0xffff) break;
+        target = next;
+    }
+    return target;
+}
+
+static void emit(Rewriter *r, uint8_t byte, int line) {
+    sky_line_table_add(&r->lines, r->count, line);
+    r->code[r->count] = byte;
+    r->count++;
+}
+
+/* Emits `op` with its distance left to resolve. Operand bytes before
+ * the distance (a range loop's slot) are copied from `operands`. */
+static void emit_jump(Rewriter *r, uint8_t op, const uint8_t *operands, int old_target, int line) {
+    int length = sky_opcode_length(op);
+    int i;
+    r->jumps[r->jump_count].position = r->count;
+    r->jumps[r->jump_count].old_target = old_target;
+    r->jump_count++;
+    emit(r, op, line);
+    for (i = 1; i < length - 2; i++) emit(r, operands[i - 1], line);
+    emit(r, 0xff, line);
+    emit(r, 0xff, line);
+}
+
+/* Marks every instruction reachable from offset 0 through fall-through
+ * and (threaded) jump edges. */
+static void mark_reachable(const uint8_t *code, int n, const int *target, bool *reachable) {
+    int *work = (int*)malloc(sizeof(int) * (2 * n + 1));
+    int count = 0;
+
+    work[count++] = 0;
+    while (count > 0) {
+        int off = work[--count];
+        uint8_t op;
+        if (off < 0 || off >= n || reachable[off]) continue;
+        reachable[off] = true;
+        op = code[off];
+        if (is_jump(op)) work[count++] = target[off];
+        if (!ends_block(op)) work[count++] = off + sky_opcode_length(op);
+    }
+    free(work);
+}
+
+/* One rewrite of the chunk. The peephole level threads jump chains, drops
+ * unreachable code, jumps to the next instruction, pure push/POP pairs
+ * and TO_BOOL after a bool; the fusion level also folds the hot sequences
+ * the compiler emits for loops, increments and conditions into single
+ * instructions, and the register level turns statements and conditions
+ * over locals into three-address register forms first. Rewrites only
+ * apply when no jump lands inside the sequence, and jumps are re-resolved
+ * once the new layout is known. */
+static void rewrite_chunk(SkyChunk *chunk, int level) {
+    int n = chunk->code_count;
+    uint8_t *code = chunk->code;
+    int *target_count, *prev_start, *new_offset, *target;
+    bool *deleted, *reachable;
+    Rewriter r;
+    int off, prev, i;
+
+    if (n == 0) return;
+
+    target_count = (int*)calloc(n + 1, sizeof(int));
+    prev_start = (int*)malloc(sizeof(int) * (n + 1));
+    new_offset = (int*)malloc(sizeof(int) * (n + 1));
+    target = (int*)malloc(sizeof(int) * (n + 1));
+    deleted = (bool*)calloc(n + 1, sizeof(bool));
+    reachable = (bool*)calloc(n + 1, sizeof(bool));
+    r.code = (uint8_t*)malloc(n);
+    memset(&r.lines, 0, sizeof(r.lines));
+    r.jumps = (PendingJump*)malloc(sizeof(PendingJump) * n);
+    r.count = 0;
+    r.jump_count = 0;
+
+    prev = -1;
+    for (off = 0; off < n; off += sky_opcode_length(code[off])) {
+        prev_start[off] = prev;
+        prev = off;
+        if (is_jump(code[off])) target[off] = thread_jump(code, n, off);
+    }
+    mark_reachable(code, n, target, reachable);
+    for (off = 0; off < n; off += sky_opcode_length(code[off])) {
+        if (reachable[off] && is_jump(code[off]) && target[off] >= 0 && target[off] <= n) {
+            target_count[target[off]]++;
+        }
+    }
+
+#define OP_AT(o)      ((o) < n ? code[o] : OP_HALT)
+#define INSIDE(o)     ((o) < n && target_count[o] == 0)
+/* The POP at `o` runs only after a jump to it, never by falling in */
+#define JUMP_ONLY(o)  (target_count[o] == 1 && prev_start[o] >= 0 && \
+                       (!reachable[prev_start[o]] || ends_block(code[prev_start[o]])))
+
+    off = 0;
+    while (off < n) {
+        uint8_t op = code[off];
+        int line = sky_chunk_get_line(chunk, off);
+        new_offset[off] = r.count;
+
+        if (deleted[off] || !reachable[off]) {
+            off += sky_opcode_length(op);
+            continue;
+        }
+
+        /* <pure push>; POP  ->  nothing */
+        if (is_pure_push(op) && OP_AT(off + sky_opcode_length(op)) == OP_POP &&
+            INSIDE(off + sky_opcode_length(op))) {
+            int end = off + sky_opcode_length(op) + 1;
+            for (i = off + 1; i < end; i++) new_offset[i] = r.count;
+            off = end;
+            continue;
+        }
+
+        /* <bool>; TO_BOOL  ->  <bool> */
+        if (op == OP_TO_BOOL && prev_start[off] >= 0 && target_count[off] == 0 &&
+            pushes_bool(code[prev_start[off]])) {
+            off++;
+            continue;
+        }
+
+        /* JUMP L where only deleted or dead code lies before L  ->  nothing */
+        if (op == OP_JUMP && target[off] >= off + 3) {
+            int o = off + 3;
+            while (o < target[off] && (deleted[o] || !reachable[o])) o += sky_opcode_length(code[o]);
+            if (o == target[off]) {
+                for (i = off + 1; i < off + 3; i++) new_offset[i] = r.count;
+                off += 3;
+                continue;
+            }
+        }
+
+        if (level >= SKY_OPT_REGISTER && op == OP_GET_LOCAL) {
+            bool constant = OP_AT(off + 2) == OP_CONSTANT;
+            uint8_t arith = register_arith(OP_AT(off + 4), constant);
+            uint8_t compare = register_compare(OP_AT(off + 4), constant);
+
+            /* GET_LOCAL a; GET_LOCAL b | CONSTANT k; <ARITH>; SET_LOCAL d; POP
+             *   ->  <ARITH>_RR d a b | <ARITH>_RK d a k */
+            if ((constant || OP_AT(off + 2) == OP_GET_LOCAL) && arith &&
+                OP_AT(off + 5) == OP_SET_LOCAL && OP_AT(off + 7) == OP_POP &&
+                INSIDE(off + 2) && INSIDE(off + 4) && INSIDE(off + 5) && INSIDE(off + 7)) {
+                for (i = off + 1; i <= off + 7; i++) new_offset[i] = r.count;
+                emit(&r, arith, line);
+                emit(&r, code[off + 6], line);
+                emit(&r, code[off + 1], line);
+                emit(&r, code[off + 3], line);
+                off += 8;
+                continue;
+            }
+
+            /* GET_LOCAL a; GET_LOCAL b | CONSTANT k; <CMP>; JUMP_IF_FALSE L; POP
+             * ... L: POP  ->  <CMP>_RR_JUMP_IF_FALSE a b L' | <CMP>_RK_... a k L' */
+            if ((constant || OP_AT(off + 2) == OP_GET_LOCAL) && compare &&
+                OP_AT(off + 5) == OP_JUMP_IF_FALSE && OP_AT(off + 8) == OP_POP &&
+                INSIDE(off + 2) && INSIDE(off + 4) && INSIDE(off + 5) && INSIDE(off + 8)) {
+                int t = target[off + 5];
+                if (t > off + 8 && t < n && code[t] == OP_POP && JUMP_ONLY(t)) {
+                    uint8_t operands[2];
+                    operands[0] = code[off + 1];
+                    operands[1] = code[off + 3];
+                    deleted[t] = true;
+                    for (i = off + 1; i <= off + 8; i++) new_offset[i] = r.count;
+                    emit_jump(&r, compare, operands, t, line);
+                    off += 9;
+                    continue;
+                }
+            }
+
+            /* GET_LOCAL s; SET_LOCAL d; POP  ->  MOVE d s */
+            if (OP_AT(off + 2) == OP_SET_LOCAL && OP_AT(off + 4) == OP_POP &&
+                INSIDE(off + 2) && INSIDE(off + 4)) {
+                for (i = off + 1; i <= off + 4; i++) new_offset[i] = r.count;
+                emit(&r, OP_MOVE, line);
+                emit(&r, code[off + 3], line);
+                emit(&r, code[off + 1], line);
+                off += 5;
+                continue;
+            }
+        }
+
+        /* CONSTANT k; SET_LOCAL d; POP  ->  LOAD_CONST d k */
+        if (level >= SKY_OPT_REGISTER && op == OP_CONSTANT && OP_AT(off + 2) == OP_SET_LOCAL &&
+            OP_AT(off + 4) == OP_POP && INSIDE(off + 2) && INSIDE(off + 4)) {
+            for (i = off + 1; i <= off + 4; i++) new_offset[i] = r.count;
+            emit(&r, OP_LOAD_CONST, line);
+            emit(&r, code[off + 3], line);
+            emit(&r, code[off + 1], line);
+            off += 5;
+            continue;
+        }
+
+        if (level >= SKY_OPT_FUSE) {
+            /* GET_LOCAL s; CONSTANT k; ADD; SET_LOCAL s; POP  ->  INC_LOCAL s k */
+            if (op == OP_GET_LOCAL && OP_AT(off + 2) == OP_CONSTANT &&
+                OP_AT(off + 4) == OP_ADD && OP_AT(off + 5) == OP_SET_LOCAL &&
+                OP_AT(off + 7) == OP_POP && code[off + 6] == code[off + 1] &&
+                INSIDE(off + 2) && INSIDE(off + 4) && INSIDE(off + 5) && INSIDE(off + 7)) {
+                SkyValue k = chunk->constants.values[code[off + 3]];
+                if (IS_INT(k) || IS_FLOAT(k)) {
+                    for (i = off + 1; i <= off + 7; i++) new_offset[i] = r.count;
+                    emit(&r, OP_INC_LOCAL, line);
+                    emit(&r, code[off + 1], line);
+                    emit(&r, code[off + 3], line);
+                    off += 8;
+                    continue;
+                }
+            }
+
+            /* GET_LOCAL a; GET_LOCAL b; ADD  ->  GET_LOCAL_GET_LOCAL_ADD a b */
+            if (op == OP_GET_LOCAL && OP_AT(off + 2) == OP_GET_LOCAL &&
+                OP_AT(off + 4) == OP_ADD && INSIDE(off + 2) && INSIDE(off + 4)) {
+                for (i = off + 1; i <= off + 4; i++) new_offset[i] = r.count;
+                emit(&r, OP_GET_LOCAL_GET_LOCAL_ADD, line);
+                emit(&r, code[off + 1], line);
+                emit(&r, code[off + 3], line);
+                off += 5;
+                continue;
+            }
+
+            /* <CMP>; JUMP_IF_FALSE L; POP ... L: POP  ->  <CMP>_JUMP_IF_FALSE L' */
+            if (fused_compare(op) && OP_AT(off + 1) == OP_JUMP_IF_FALSE &&
+                OP_AT(off + 4) == OP_POP && INSIDE(off + 1) && INSIDE(off + 4)) {
+                int t = target[off + 1];
+                if (t > off + 4 && t < n && code[t] == OP_POP && JUMP_ONLY(t)) {
+                    deleted[t] = true;
+                    for (i = off + 1; i <= off + 4; i++) new_offset[i] = r.count;
+                    emit_jump(&r, fused_compare(op), NULL, t, line);
+                    off += 5;
+                    continue;
+                }
+            }
+
+            /* JUMP_IF_FALSE L; POP ... L: POP  ->  POP_JUMP_IF_FALSE L' */
+            if (op == OP_JUMP_IF_FALSE && OP_AT(off + 3) == OP_POP && INSIDE(off + 3)) {
+                int t = target[off];
+                if (t > off + 3 && t < n && code[t] == OP_POP && JUMP_ONLY(t)) {
+                    deleted[t] = true;
+                    for (i = off + 1; i <= off + 3; i++) new_offset[i] = r.count;
+                    emit_jump(&r, OP_POP_JUMP_IF_FALSE, NULL, t, line);
+                    off += 4;
+                    continue;
+                }
+            }
+        }
+
+        if (is_jump(op)) {
+            emit_jump(&r, op, code + off + 1, target[off], line);
+            off += sky_opcode_length(op);
+            continue;
+        }
+
+        for (i = 0; i < sky_opcode_length(op) && off + i < n; i++) {
+            if (i > 0) new_offset[off + i] = r.count;
+            emit(&r, code[off + i], sky_chunk_get_line(chunk, off + i));
+        }
+        off += i;
+    }
+    new_offset[n] = r.count;
+
+#undef OP_AT
+#undef INSIDE
+#undef JUMP_ONLY
+
+    for (i = 0; i < r.jump_count; i++) {
+        int pos = r.jumps[i].position;
+        int end = pos + sky_opcode_length(r.code[pos]);
+        int to = new_offset[r.jumps[i].old_target];
+        int distance;
+        /* A threaded unconditional jump may have changed direction */
+        if (r.code[pos] == OP_JUMP || r.code[pos] == OP_JUMP_BACK) {
+            r.code[pos] = to < end ? OP_JUMP_BACK : OP_JUMP;
+        }
+        distance = jumps_back(r.code[pos]) ? end - to : to - end;
+        r.code[end - 2] = (distance >> 8) & 0xff;
+        r.code[end - 1] = distance & 0xff;
+    }
+
+    free(chunk->code);
+    sky_line_table_free(&chunk->lines);
+    chunk->code = r.code;
+    chunk->lines = r.lines;
+    chunk->code_count = r.count;
+    chunk->code_capacity = n;
+
+    free(r.jumps);
+    free(target_count);
+    free(prev_start);
+    free(new_offset);
+    free(target);
+    free(deleted);
+    free(reachable);
+}
+
+void sky_optimize_chunk(SkyChunk *chunk, int level) {
+    int i;
+    if (!chunk || level <= SKY_OPT_NONE) return;
+    rewrite_chunk(chunk, level);
+    for (i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            sky_optimize_chunk(&AS_FUNCTION(chunk->constants.values[i])->chunk, level);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+﻿/* optimizer.h — Bytecode optimization passes */
+#ifndef SKY_OPTIMIZER_H
+#define SKY_OPTIMIZER_H
+
+#include "bytecode.h"
+
+/* Optimization levels: 0 runs the compiler output as is, 1 adds AST
+ * constant folding (fold.h) and the peephole pass (jump threading, dead
+ * code, push/pop pairs), 2 also fuses superinstructions, 3 also lowers
+ * statements over locals to the three-address register forms. */
+#define SKY_OPT_NONE     0
+#define SKY_OPT_PEEPHOLE 1
+#define SKY_OPT_FUSE     2
+#define SKY_OPT_REGISTER 3
+#define SKY_OPT_MAX      SKY_OPT_REGISTER
+#define SKY_OPT_DEFAULT  SKY_OPT_FUSE
+
+/* Rewrites a freshly compiled chunk and its functions in place. Must run
+ * before the chunk is first executed, since it renumbers code offsets. */
+void sky_optimize_chunk(SkyChunk *chunk, int level);
+
+#endif
@@ -81,7 +81,7 @@ static SkyASTNode* parse_primary(SkyParser *p) {
     if (match(p, TOKEN_NIL)) {
         return sky_ast_new(AST_NIL_LITERAL, p->previous.line);
     }
-    if (match(p, TOKEN_IDENTIFIER)) {
+    if (match(p, TOKEN_IDENTIFIER) || match(p, TOKEN_SELF)) {
         SkyASTNode *n = sky_ast_new(AST_IDENTIFIER, p->previous.line);
         n->data.identifier.name = copy_token_text(&p->previous);
         return n;
@@ -109,6 +109,29 @@ static SkyASTNode* parse_primary(SkyParser *p) {
         consume(p, TOKEN_RBRACKET, "Expected ']'");
         return arr;
     }
+    if (match(p, TOKEN_LBRACE)) {
+        SkyASTNode *map = sky_ast_new(AST_MAP_LITERAL, p->previous.line);
+        int cap = 8;
+        map->data.map_literal.keys = (SkyASTNode**)malloc(sizeof(SkyASTNode*) * cap);
+        map->data.map_literal.values = (SkyASTNode**)malloc(sizeof(SkyASTNode*) * cap);
+        map->data.map_literal.count = 0;
+        if (!check(p, TOKEN_RBRACE)) {
+            do {
+                if (map->data.map_literal.count >= cap) {
+                    cap *= 2;
+                    map->data.map_literal.keys = (SkyASTNode**)realloc(
+                        map->data.map_literal.keys, sizeof(SkyASTNode*) * cap);
+                    map->data.map_literal.values = (SkyASTNode**)realloc(
+                        map->data.map_literal.values, sizeof(SkyASTNode*) * cap);
+                }
+                map->data.map_literal.keys[map->data.map_literal.count] = parse_expression(p);
+                consume(p, TOKEN_COLON, "Expected ':' after map key");
+                map->data.map_literal.values[map->data.map_literal.count++] = parse_expression(p);
+            } while (match(p, TOKEN_COMMA));
+        }
+        consume(p, TOKEN_RBRACE, "Expected '}'");
+        return map;
+    }
     error_at(p, &p->current, "Expected expression");
     advance(p);
     return sky_ast_new(AST_NIL_LITERAL, p->current.line);
@@ -360,7 +383,7 @@ static SkyASTNode* parse_function(SkyParser *p) {
     node->data.function.param_count = 0;
     if (!check(p, TOKEN_RPAREN)) {
         do {
-            consume(p, TOKEN_IDENTIFIER, "Expected parameter name");
+            if (!match(p, TOKEN_SELF)) consume(p, TOKEN_IDENTIFIER, "Expected parameter name");
             char *pname = copy_token_text(&p->previous);
             char *ptype = NULL;
             if (check(p, TOKEN_IDENTIFIER)) {
@@ -412,10 +435,14 @@ static SkyASTNode* parse_class(SkyParser *p) {
     consume(p, TOKEN_IDENTIFIER, "Expected class name");
     SkyASTNode *node = sky_ast_new(AST_CLASS, line);
     node->data.class_def.name = copy_token_text(&p->previous);
+    node->data.class_def.fields = NULL;
+    node->data.class_def.field_count = 0;
     node->data.class_def.members = NULL;
     node->data.class_def.member_count = 0;
     consume(p, TOKEN_LBRACE, "Expected '{'");
     int cap = 8;
+    int field_cap = 8;
+    node->data.class_def.fields = (char**)malloc(sizeof(char*) * field_cap);
     node->data.class_def.members = (SkyASTNode**)malloc(sizeof(SkyASTNode*) * cap);
     while (!check(p, TOKEN_RBRACE) && !check(p, TOKEN_EOF)) {
         if (match(p, TOKEN_FN)) {
@@ -428,6 +455,13 @@ static SkyASTNode* parse_class(SkyParser *p) {
             node->data.class_def.members[node->data.class_def.member_count++] = fn;
         } else if (check(p, TOKEN_IDENTIFIER)) {
             advance(p);
+            if (node->data.class_def.field_count >= field_cap) {
+                field_cap *= 2;
+                node->data.class_def.fields = (char**)realloc(
+                    node->data.class_def.fields, sizeof(char*) * field_cap);
+            }
+            node->data.class_def.fields[node->data.class_def.field_count++] =
+                copy_token_text(&p->previous);
             if (check(p, TOKEN_IDENTIFIER)) {
                 advance(p);
             }
@@ -107,6 +107,7 @@
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
+    #include <time.h>
 
     typedef pthread_t sky_thread_t;
     typedef pthread_mutex_t sky_mutex_t;
@@ -128,8 +129,12 @@
     static inline void sky_thread_join(sky_thread_t t) {
         pthread_join(t, NULL);
     }
+    /* nanosleep rather than usleep, which -D_POSIX_C_SOURCE=200809L hides */
     static inline void sky_sleep_ms(int ms) {
-        usleep(ms * 1000);
+        struct timespec ts;
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+        nanosleep(&ts, NULL);
     }
 
     #define sky_close_socket close
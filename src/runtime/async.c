@@ -1,4 +1,9 @@
 ﻿/* src/runtime/async.c — Async I/O engine implementation */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L   /* nanosleep (platform.h) */
+#endif
+#endif
 #include "async.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -1,4 +1,9 @@
 ﻿/* src/runtime/http_server.c — Built-in HTTP server implementation */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L   /* nanosleep (platform.h) */
+#endif
+#endif
 #include "http_server.h"
 #include <stdio.h>
 #include <stdlib.h>
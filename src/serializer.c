@@ -0,0 +1,702 @@
+﻿/* serializer.c — Compiled bytecode files (.skyc) */
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+#include "serializer.h"
+#include "class.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define SKYC_BYTE_ORDER 0x0102
+#define SKYC_NONE       0xffffffffu
+#define FNV64_OFFSET    14695981039346656037ull
+#define FNV64_PRIME     1099511628211ull
+
+enum { SKYC_INT, SKYC_FLOAT, SKYC_STRING, SKYC_FUNCTION };
+
+/* All offsets are from the start of the file. */
+typedef struct {
+    char     magic[4];        /* "SKYC" */
+    uint16_t version;
+    uint16_t byte_order;      /* SKYC_BYTE_ORDER as the writer stored it */
+    uint32_t fingerprint;     /* opcode table and object layout of the writer */
+    uint32_t reserved;
+    uint64_t source_hash;
+    uint64_t checksum;        /* FNV-1a of every byte after the header */
+    uint64_t file_size;
+    uint32_t string_count;
+    uint32_t string_table;    /* uint32 offset of each SkyString image */
+    uint32_t chunk_count;     /* chunk 0 is the script, functions follow depth-first */
+    uint32_t chunk_table;     /* uint32 offset of each SkycChunk */
+    uint32_t global_count;
+    uint32_t global_table;    /* uint32 string index of each global slot name */
+} SkycHeader;
+
+typedef struct {
+    uint32_t name;            /* string index, SKYC_NONE for the script */
+    uint32_t arity;
+    uint32_t code_count;
+    uint32_t code;
+    uint32_t line_count;
+    uint32_t lines;           /* SkyLineRun[line_count] */
+    uint32_t constant_count;
+    uint32_t constants;       /* SkycConstant[constant_count] */
+} SkycChunk;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t index;           /* string or chunk index */
+    uint64_t bits;            /* int64 or double payload */
+} SkycConstant;
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t*)data;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+uint64_t sky_source_hash(const char *source, size_t length) {
+    uint64_t h = fnv64(FNV64_OFFSET, source, length);
+    return h ? h : 1;   /* 0 means "any source" to the loader */
+}
+
+static uint32_t build_fingerprint(void) {
+    static const char *const opcodes[] = {
+#define SKYC_OPCODE_ENTRY(name, operand_bytes) #name "/" #operand_bytes,
+        SKY_OPCODE_LIST(SKYC_OPCODE_ENTRY)
+#undef SKYC_OPCODE_ENTRY
+    };
+    const uint32_t layout[] = {
+        (uint32_t)sizeof(void*), (uint32_t)sizeof(SkyObj), (uint32_t)sizeof(SkyString),
+        (uint32_t)offsetof(SkyString, length), (uint32_t)offsetof(SkyString, hash),
+        (uint32_t)offsetof(SkyString, chars), (uint32_t)sizeof(SkyLineRun),
+        (uint32_t)sizeof(SkycHeader), (uint32_t)sizeof(SkycChunk), (uint32_t)sizeof(SkycConstant),
+        (uint32_t)SKY_IC_WAYS, (uint32_t)SKY_IC_ENTRY
+    };
+    uint64_t h = FNV64_OFFSET;
+    size_t i;
+    for (i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+        h = fnv64(h, opcodes[i], strlen(opcodes[i]) + 1);
+    }
+    h = fnv64(h, layout, sizeof(layout));
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static bool set_error(char *error, size_t error_size, const char *message) {
+    snprintf(error, error_size, "%s", message);
+    return false;
+}
+
+/* ---- Writing ---- */
+
+typedef struct {
+    const char *chars;
+    int         length;
+} WriterString;
+
+typedef struct {
+    uint8_t      *data;
+    size_t        count;
+    size_t        capacity;
+    SkyChunk    **chunks;
+    SkyFunction **functions;     /* owner of each chunk, NULL for the script */
+    uint32_t     *chunk_names;
+    int           chunk_count;
+    int           chunk_capacity;
+    WriterString *strings;
+    int           string_count;
+    int           string_capacity;
+    SkyString   **string_keys;   /* interned string -> index map */
+    int          *string_ids;
+    int           key_capacity;
+    bool          failed;
+} Writer;
+
+static size_t put(Writer *w, const void *data, size_t size) {
+    size_t at = w->count;
+    if (w->count + size > w->capacity) {
+        size_t capacity = w->capacity < 4096 ? 4096 : w->capacity;
+        uint8_t *grown;
+        while (w->count + size > capacity) capacity *= 2;
+        grown = (uint8_t*)realloc(w->data, capacity);
+        if (!grown) {
+            w->failed = true;
+            return at;
+        }
+        w->data = grown;
+        w->capacity = capacity;
+    }
+    if (data) memcpy(w->data + w->count, data, size);
+    else memset(w->data + w->count, 0, size);
+    w->count += size;
+    return at;
+}
+
+static void align_to(Writer *w, size_t alignment) {
+    while (!w->failed && w->count % alignment != 0) put(w, NULL, 1);
+}
+
+static uint32_t add_string(Writer *w, const char *chars, int length) {
+    if (w->string_count >= w->string_capacity) {
+        int capacity = w->string_capacity < 16 ? 16 : w->string_capacity * 2;
+        WriterString *grown = (WriterString*)realloc(w->strings, sizeof(WriterString) * capacity);
+        if (!grown) {
+            w->failed = true;
+            return 0;
+        }
+        w->strings = grown;
+        w->string_capacity = capacity;
+    }
+    w->strings[w->string_count].chars = chars;
+    w->strings[w->string_count].length = length;
+    return (uint32_t)w->string_count++;
+}
+
+static uint32_t string_index(Writer *w, SkyString *str) {
+    uint32_t slot;
+    if ((w->string_count + 1) * 2 > w->key_capacity) {
+        int capacity = w->key_capacity < 64 ? 64 : w->key_capacity * 2;
+        SkyString **keys = (SkyString**)calloc(capacity, sizeof(SkyString*));
+        int *ids = (int*)malloc(sizeof(int) * capacity);
+        int i;
+        if (!keys || !ids) {
+            free(keys);
+            free(ids);
+            w->failed = true;
+            return 0;
+        }
+        for (i = 0; i < w->key_capacity; i++) {
+            if (!w->string_keys[i]) continue;
+            slot = (uint32_t)(((uintptr_t)w->string_keys[i] >> 4) & (uintptr_t)(capacity - 1));
+            while (keys[slot]) slot = (slot + 1) & (uint32_t)(capacity - 1);
+            keys[slot] = w->string_keys[i];
+            ids[slot] = w->string_ids[i];
+        }
+        free(w->string_keys);
+        free(w->string_ids);
+        w->string_keys = keys;
+        w->string_ids = ids;
+        w->key_capacity = capacity;
+    }
+    slot = (uint32_t)(((uintptr_t)str >> 4) & (uintptr_t)(w->key_capacity - 1));
+    while (w->string_keys[slot] && w->string_keys[slot] != str) {
+        slot = (slot + 1) & (uint32_t)(w->key_capacity - 1);
+    }
+    if (!w->string_keys[slot]) {
+        w->string_keys[slot] = str;
+        w->string_ids[slot] = (int)add_string(w, str->chars, str->length);
+    }
+    return (uint32_t)w->string_ids[slot];
+}
+
+static int chunk_index(Writer *w, SkyFunction *fn) {
+    int i;
+    for (i = 1; i < w->chunk_count; i++) {
+        if (w->functions[i] == fn) return i;
+    }
+    return -1;
+}
+
+/* Numbers chunks depth-first and every string they reference. */
+static void collect(Writer *w, SkyChunk *chunk, SkyFunction *fn) {
+    int index, i;
+    if (w->chunk_count >= w->chunk_capacity) {
+        int capacity = w->chunk_capacity < 8 ? 8 : w->chunk_capacity * 2;
+        SkyChunk **chunks = (SkyChunk**)realloc(w->chunks, sizeof(SkyChunk*) * capacity);
+        SkyFunction **functions;
+        uint32_t *names;
+        if (chunks) w->chunks = chunks;
+        functions = (SkyFunction**)realloc(w->functions, sizeof(SkyFunction*) * capacity);
+        if (functions) w->functions = functions;
+        names = (uint32_t*)realloc(w->chunk_names, sizeof(uint32_t) * capacity);
+        if (names) w->chunk_names = names;
+        if (!chunks || !functions || !names) {
+            w->failed = true;
+            return;
+        }
+        w->chunk_capacity = capacity;
+    }
+    index = w->chunk_count++;
+    w->chunks[index] = chunk;
+    w->functions[index] = fn;
+    w->chunk_names[index] = fn ? add_string(w, fn->name, (int)strlen(fn->name)) : SKYC_NONE;
+    for (i = 0; i < chunk->constants.count && !w->failed; i++) {
+        SkyValue value = chunk->constants.values[i];
+        if (IS_STRING(value)) {
+            string_index(w, AS_STRING_OBJ(value));
+        } else if (IS_FUNCTION(value)) {
+            collect(w, &AS_FUNCTION(value)->chunk, AS_FUNCTION(value));
+        }
+    }
+}
+
+static void write_chunk(Writer *w, int index, uint32_t record_at) {
+    SkyChunk *chunk = w->chunks[index];
+    SkycChunk record;
+    int i;
+
+    memset(&record, 0, sizeof(record));
+    record.name = w->chunk_names[index];
+    record.arity = w->functions[index] ? (uint32_t)w->functions[index]->arity : 0;
+    record.code_count = (uint32_t)chunk->code_count;
+    record.code = (uint32_t)put(w, chunk->code, (size_t)chunk->code_count);
+    /* Shape ids mean nothing to another process; caches start empty */
+    if (!w->failed) sky_ic_clear(w->data + record.code, chunk->code_count);
+    align_to(w, 8);
+    record.line_count = (uint32_t)chunk->lines.count;
+    record.lines = (uint32_t)put(w, chunk->lines.runs, sizeof(SkyLineRun) * chunk->lines.count);
+    align_to(w, 8);
+    record.constant_count = (uint32_t)chunk->constants.count;
+    record.constants = (uint32_t)w->count;
+    for (i = 0; i < chunk->constants.count && !w->failed; i++) {
+        SkyValue value = chunk->constants.values[i];
+        SkycConstant k;
+        memset(&k, 0, sizeof(k));
+        if (IS_INT(value)) {
+            int64_t v = AS_INT(value);
+            k.tag = SKYC_INT;
+            memcpy(&k.bits, &v, sizeof(v));
+        } else if (IS_FLOAT(value)) {
+            double d = AS_FLOAT(value);
+            k.tag = SKYC_FLOAT;
+            memcpy(&k.bits, &d, sizeof(d));
+        } else if (IS_STRING(value)) {
+            k.tag = SKYC_STRING;
+            k.index = string_index(w, AS_STRING_OBJ(value));
+        } else if (IS_FUNCTION(value)) {
+            k.tag = SKYC_FUNCTION;
+            k.index = (uint32_t)chunk_index(w, AS_FUNCTION(value));
+        } else {
+            w->failed = true;
+            return;
+        }
+        put(w, &k, sizeof(k));
+    }
+    if (!w->failed) memcpy(w->data + record_at, &record, sizeof(record));
+}
+
+static void writer_free(Writer *w) {
+    free(w->data);
+    free(w->chunks);
+    free(w->functions);
+    free(w->chunk_names);
+    free(w->strings);
+    free(w->string_keys);
+    free(w->string_ids);
+}
+
+bool sky_skyc_encode(SkyChunk *chunk, uint64_t source_hash, uint8_t **data, size_t *size,
+                     char *error, size_t error_size) {
+    Writer w;
+    SkycHeader header;
+    uint32_t *offsets;
+    size_t table_at;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    collect(&w, chunk, NULL);
+    for (i = 0; i < chunk->global_count && !w.failed; i++) string_index(&w, chunk->global_names[i]);
+
+    memset(&header, 0, sizeof(header));
+    put(&w, &header, sizeof(header));
+
+    /* Strings, each a static SkyString ready to be used in place */
+    offsets = (uint32_t*)malloc(sizeof(uint32_t) * (w.string_count + 1));
+    if (!offsets) w.failed = true;
+    for (i = 0; i < w.string_count && !w.failed; i++) {
+        SkyString image;
+        memset(&image, 0, sizeof(image));
+        image.obj.type = VAL_STRING;
+        image.obj.flags = SKY_OBJ_STATIC | SKY_OBJ_INTERNED;
+        image.length = w.strings[i].length;
+        image.hash = sky_hash_chars(w.strings[i].chars, w.strings[i].length);
+        align_to(&w, 8);
+        offsets[i] = (uint32_t)put(&w, &image, sizeof(image));
+        put(&w, w.strings[i].chars, (size_t)w.strings[i].length);
+        put(&w, "", 1);
+    }
+    align_to(&w, 8);
+    header.string_count = (uint32_t)w.string_count;
+    header.string_table = (uint32_t)put(&w, offsets, sizeof(uint32_t) * w.string_count);
+    free(offsets);
+
+    header.global_count = (uint32_t)chunk->global_count;
+    align_to(&w, 8);
+    header.global_table = (uint32_t)w.count;
+    for (i = 0; i < chunk->global_count && !w.failed; i++) {
+        uint32_t id = string_index(&w, chunk->global_names[i]);
+        put(&w, &id, sizeof(id));
+    }
+
+    /* Chunk table, then each record followed by its code, lines and constants */
+    align_to(&w, 8);
+    header.chunk_count = (uint32_t)w.chunk_count;
+    table_at = put(&w, NULL, sizeof(uint32_t) * w.chunk_count);
+    header.chunk_table = (uint32_t)table_at;
+    for (i = 0; i < w.chunk_count && !w.failed; i++) {
+        uint32_t record_at;
+        align_to(&w, 8);
+        record_at = (uint32_t)put(&w, NULL, sizeof(SkycChunk));
+        if (w.failed) break;
+        memcpy(w.data + table_at + sizeof(uint32_t) * i, &record_at, sizeof(record_at));
+        write_chunk(&w, i, record_at);
+    }
+
+    if (w.failed || w.count > 0xffffffffu) {
+        writer_free(&w);
+        return set_error(error, error_size, "Cannot encode chunk");
+    }
+    memcpy(header.magic, "SKYC", 4);
+    header.version = SKY_SKYC_VERSION;
+    header.byte_order = SKYC_BYTE_ORDER;
+    header.fingerprint = build_fingerprint();
+    header.source_hash = source_hash;
+    header.file_size = w.count;
+    header.checksum = fnv64(FNV64_OFFSET, w.data + sizeof(header), w.count - sizeof(header));
+    memcpy(w.data, &header, sizeof(header));
+
+    *data = w.data;
+    *size = w.count;
+    w.data = NULL;
+    writer_free(&w);
+    return true;
+}
+
+bool sky_skyc_write(SkyChunk *chunk, uint64_t source_hash, const char *path,
+                    char *error, size_t error_size) {
+    uint8_t *data;
+    size_t size;
+    char temp_path[1024];
+    FILE *f;
+    bool ok;
+
+    if (!sky_skyc_encode(chunk, source_hash, &data, &size, error, error_size)) return false;
+
+    /* Write beside the target and rename, so readers never see half a file */
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    f = fopen(temp_path, "wb");
+    if (!f) {
+        free(data);
+        return set_error(error, error_size, "Cannot open output file");
+    }
+    ok = fwrite(data, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) remove(temp_path);
+    free(data);
+    return ok ? true : set_error(error, error_size, "Cannot write output file");
+}
+
+/* ---- Loading ---- */
+
+bool sky_image_map(const char *path, SkyImage *image) {
+    memset(image, 0, sizeof(*image));
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    long size;
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    image->base = size > 0 ? malloc((size_t)size) : NULL;
+    image->size = size > 0 ? (size_t)size : 0;
+    image->mapped = false;
+    if (!image->base || fread(image->base, 1, image->size, f) != image->size) {
+        free(image->base);
+        image->base = NULL;
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    return true;
+#else
+    struct stat st;
+    void *base;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    /* Private and writable: quickening patches opcodes in place, which
+     * copies only the pages it touches */
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    image->base = base;
+    image->size = (size_t)st.st_size;
+    image->mapped = true;
+    return true;
+#endif
+}
+
+void sky_image_free(SkyImage *image) {
+    if (!image || !image->base) return;
+#ifndef _WIN32
+    if (image->mapped) {
+        munmap(image->base, image->size);
+    } else
+#endif
+    if (!image->borrowed) {
+        free(image->base);
+    }
+    image->base = NULL;
+    image->size = 0;
+}
+
+static bool in_file(const SkyImage *image, uint64_t offset, uint64_t count,
+                    uint64_t elem_size, uint64_t alignment) {
+    if (offset % alignment != 0) return false;
+    if (count > image->size / (elem_size ? elem_size : 1)) return false;
+    return offset <= image->size && count * elem_size <= image->size - offset;
+}
+
+static const SkycChunk* chunk_record(const SkyImage *image, const SkycHeader *h, uint32_t i) {
+    const uint32_t *table = (const uint32_t*)((uint8_t*)image->base + h->chunk_table);
+    return (const SkycChunk*)((uint8_t*)image->base + table[i]);
+}
+
+static SkyString* string_at(const SkyImage *image, const SkycHeader *h, uint32_t i) {
+    const uint32_t *table = (const uint32_t*)((uint8_t*)image->base + h->string_table);
+    return (SkyString*)((uint8_t*)image->base + table[i]);
+}
+
+/* Every offset, index and string in the file, before anything is built. */
+static bool validate(const SkyImage *image, const SkycHeader *h, char *error, size_t error_size) {
+    uint8_t *refs;
+    uint32_t i, j;
+    bool ok = true;
+
+    if (!in_file(image, h->string_table, h->string_count, sizeof(uint32_t), 4) ||
+        !in_file(image, h->chunk_table, h->chunk_count, sizeof(uint32_t), 4) ||
+        !in_file(image, h->global_table, h->global_count, sizeof(uint32_t), 4) ||
+        h->chunk_count == 0 || h->global_count > SKY_MAX_GLOBAL_SLOTS) {
+        return set_error(error, error_size, "Corrupt section table");
+    }
+    for (i = 0; i < h->string_count; i++) {
+        const uint32_t *table = (const uint32_t*)((uint8_t*)image->base + h->string_table);
+        SkyString *str;
+        if (!in_file(image, table[i], 1, sizeof(SkyString), 8)) {
+            return set_error(error, error_size, "Corrupt string");
+        }
+        str = string_at(image, h, i);
+        if (str->obj.type != VAL_STRING || str->obj.flags != (SKY_OBJ_STATIC | SKY_OBJ_INTERNED) ||
+            str->obj.marked || str->length < 0 ||
+            !in_file(image, table[i] + sizeof(SkyString), (uint64_t)str->length + 1, 1, 1) ||
+            str->chars[str->length] != '\0' ||
+            str->hash != sky_hash_chars(str->chars, str->length)) {
+            return set_error(error, error_size, "Corrupt string");
+        }
+    }
+    for (i = 0; i < h->global_count; i++) {
+        const uint32_t *names = (const uint32_t*)((uint8_t*)image->base + h->global_table);
+        if (names[i] >= h->string_count) return set_error(error, error_size, "Corrupt global table");
+    }
+
+    /* Function chunks must each be referenced exactly once, from an
+     * earlier chunk, so the chunks form a tree */
+    refs = (uint8_t*)calloc(h->chunk_count, 1);
+    if (!refs) return set_error(error, error_size, "Out of memory");
+    for (i = 0; i < h->chunk_count && ok; i++) {
+        const uint32_t *table = (const uint32_t*)((uint8_t*)image->base + h->chunk_table);
+        const SkycChunk *c;
+        const SkycConstant *k;
+        const SkyLineRun *runs;
+        if (!in_file(image, table[i], 1, sizeof(SkycChunk), 8)) {
+            ok = false;
+            break;
+        }
+        c = chunk_record(image, h, i);
+        ok = (i == 0 ? c->name == SKYC_NONE : c->name < h->string_count) &&
+             c->arity < 256 && c->code_count > 0 && c->code_count <= 0x7fffffffu &&
+             c->constant_count <= SKY_MAX_CONSTANTS &&
+             in_file(image, c->code, c->code_count, 1, 1) &&
+             in_file(image, c->lines, c->line_count, sizeof(SkyLineRun), 4) &&
+             in_file(image, c->constants, c->constant_count, sizeof(SkycConstant), 8);
+        runs = (const SkyLineRun*)((uint8_t*)image->base + c->lines);
+        for (j = 0; j < c->line_count && ok; j++) {
+            ok = runs[j].offset >= 0 && (uint32_t)runs[j].offset < c->code_count &&
+                 (j == 0 || runs[j].offset > runs[j - 1].offset);
+        }
+        k = (const SkycConstant*)((uint8_t*)image->base + c->constants);
+        for (j = 0; j < c->constant_count && ok; j++) {
+            if (k[j].tag == SKYC_STRING) {
+                ok = k[j].index < h->string_count;
+            } else if (k[j].tag == SKYC_FUNCTION) {
+                ok = k[j].index > i && k[j].index < h->chunk_count && !refs[k[j].index];
+                if (ok) refs[k[j].index] = 1;
+            } else {
+                ok = k[j].tag == SKYC_INT || k[j].tag == SKYC_FLOAT;
+            }
+        }
+    }
+    for (j = 1; j < h->chunk_count && ok; j++) ok = refs[j] != 0;
+    free(refs);
+    return ok ? true : set_error(error, error_size, "Corrupt chunk");
+}
+
+/* Points `chunk` at the record's code and lines; constants are filled in
+ * once every function object exists. */
+static void borrow_chunk(const SkyImage *image, const SkycChunk *c, SkyChunk *chunk) {
+    chunk->code = (uint8_t*)image->base + c->code;
+    chunk->code_count = (int)c->code_count;
+    chunk->code_capacity = (int)c->code_count;
+    chunk->lines.runs = (SkyLineRun*)((uint8_t*)image->base + c->lines);
+    chunk->lines.count = (int)c->line_count;
+    chunk->lines.capacity = (int)c->line_count;
+    chunk->borrowed = true;
+}
+
+/* Checks and decodes the file in `image`, which is freed on failure */
+static bool load_image(SkyImage *image, uint64_t source_hash, SkyChunk *chunk,
+                       char *error, size_t error_size) {
+    SkycHeader h;
+    SkyFunction **functions;
+    uint32_t i, j;
+
+    if (image->size < sizeof(SkycHeader)) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Not a .skyc file");
+    }
+    memcpy(&h, image->base, sizeof(h));
+    if (memcmp(h.magic, "SKYC", 4) != 0) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Not a .skyc file");
+    }
+    if (h.version != SKY_SKYC_VERSION || h.byte_order != SKYC_BYTE_ORDER ||
+        h.fingerprint != build_fingerprint()) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Built by a different version of sky");
+    }
+    if (source_hash != 0 && h.source_hash != source_hash) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Built from a different source");
+    }
+    if (h.file_size != image->size ||
+        h.checksum != fnv64(FNV64_OFFSET, (uint8_t*)image->base + sizeof(h), image->size - sizeof(h))) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Checksum mismatch");
+    }
+    if (!validate(image, &h, error, error_size)) {
+        sky_image_free(image);
+        return false;
+    }
+
+    functions = (SkyFunction**)calloc(h.chunk_count, sizeof(SkyFunction*));
+    if (!functions) {
+        sky_image_free(image);
+        return set_error(error, error_size, "Out of memory");
+    }
+    sky_chunk_init(chunk);
+    borrow_chunk(image, chunk_record(image, &h, 0), chunk);
+    for (i = 1; i < h.chunk_count; i++) {
+        const SkycChunk *c = chunk_record(image, &h, i);
+        functions[i] = sky_function_new(string_at(image, &h, c->name)->chars, (int)c->arity);
+        borrow_chunk(image, c, &functions[i]->chunk);
+    }
+    for (i = 0; i < h.chunk_count; i++) {
+        const SkycChunk *c = chunk_record(image, &h, i);
+        const SkycConstant *k = (const SkycConstant*)((uint8_t*)image->base + c->constants);
+        SkyChunk *target = i == 0 ? chunk : &functions[i]->chunk;
+        for (j = 0; j < c->constant_count; j++) {
+            SkyValue value;
+            switch (k[j].tag) {
+                case SKYC_INT: {
+                    int64_t v;
+                    memcpy(&v, &k[j].bits, sizeof(v));
+                    value = SKY_INT(v);
+                    break;
+                }
+                case SKYC_FLOAT: {
+                    double d;
+                    memcpy(&d, &k[j].bits, sizeof(d));
+                    value = SKY_FLOAT(d);
+                    break;
+                }
+                case SKYC_STRING:
+                    value = SKY_STRING(string_at(image, &h, k[j].index));
+                    break;
+                default:
+                    value = SKY_OBJECT(functions[k[j].index]);
+                    break;
+            }
+            sky_value_array_write(&target->constants, value);
+        }
+    }
+    free(functions);
+
+    if (h.global_count > 0) {
+        const uint32_t *names = (const uint32_t*)((uint8_t*)image->base + h.global_table);
+        chunk->global_names = (SkyString**)malloc(sizeof(SkyString*) * h.global_count);
+        for (i = 0; i < h.global_count; i++) chunk->global_names[i] = string_at(image, &h, names[i]);
+        chunk->global_count = (int)h.global_count;
+        chunk->global_capacity = (int)h.global_count;
+    }
+    return true;
+}
+
+bool sky_skyc_load(const char *path, uint64_t source_hash, SkyChunk *chunk,
+                   SkyImage *image, char *error, size_t error_size) {
+    memset(image, 0, sizeof(*image));
+    if (!sky_image_map(path, image)) return set_error(error, error_size, "Cannot read file");
+    return load_image(image, source_hash, chunk, error, error_size);
+}
+
+bool sky_skyc_load_memory(void *data, size_t size, SkyChunk *chunk, SkyImage *image,
+                          char *error, size_t error_size) {
+    memset(image, 0, sizeof(*image));
+    if ((uintptr_t)data % 8 != 0) return set_error(error, error_size, "Misaligned image");
+    image->base = data;
+    image->size = size;
+    image->borrowed = true;
+    return load_image(image, 0, chunk, error, error_size);
+}
+
+/* ---- Run cache ---- */
+
+bool sky_skyc_cache_path(const char *source_path, char *out, size_t out_size, bool create) {
+    const char *slash = strrchr(source_path, '/');
+    const char *name;
+    size_t dir_len, name_len;
+    int n;
+#ifdef _WIN32
+    const char *backslash = strrchr(source_path, '\\');
+    if (backslash && (!slash || backslash > slash)) slash = backslash;
+#endif
+    name = slash ? slash + 1 : source_path;
+    dir_len = slash ? (size_t)(slash - source_path) + 1 : 0;
+    name_len = strlen(name);
+    if (name_len > 4 && strcmp(name + name_len - 4, ".sky") == 0) name_len -= 4;
+
+    n = snprintf(out, out_size, "%.*s.skycache", (int)dir_len, source_path);
+    if (n < 0 || (size_t)n >= out_size) return false;
+    if (create) {
+#ifdef _WIN32
+        _mkdir(out);
+#else
+        mkdir(out, 0755);
+#endif
+    }
+    n = snprintf(out, out_size, "%.*s.skycache/%.*s.skyc",
+                 (int)dir_len, source_path, (int)name_len, name);
+    return n >= 0 && (size_t)n < out_size;
+}
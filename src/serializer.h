@@ -0,0 +1,62 @@
+﻿/* serializer.h — Compiled bytecode files (.skyc) */
+#ifndef SKY_SERIALIZER_H
+#define SKY_SERIALIZER_H
+
+#include "bytecode.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A .skyc file holds a compiled top-level chunk and every function chunk
+ * under it: code, constants, line table and global names. Strings are
+ * stored as ready-made static SkyString objects, so a loaded chunk points
+ * straight into the file for its code, line runs and string constants;
+ * only the constant arrays and function objects are allocated.
+ *
+ * Files are tied to the build that wrote them. The header carries a
+ * format version and a fingerprint of the opcode table and object
+ * layout; anything else is rejected, as is a file whose checksum does not
+ * match. Loaded code still goes through the verifier before it runs. */
+#define SKY_SKYC_VERSION 1
+
+/* Backing memory of a loaded file; must outlive the chunk loaded from it. */
+typedef struct {
+    void  *base;
+    size_t size;
+    bool   mapped;     /* mmap'd (copy-on-write), else a heap buffer */
+    bool   borrowed;   /* the caller's memory (sky_skyc_load_memory), never freed */
+} SkyImage;
+
+uint64_t sky_source_hash(const char *source, size_t length);
+
+/* Encodes `chunk` (already optimized, ending in HALT) into a malloc'd
+ * buffer holding the file contents. */
+bool sky_skyc_encode(SkyChunk *chunk, uint64_t source_hash, uint8_t **data, size_t *size,
+                     char *error, size_t error_size);
+
+/* Writes `chunk` (already optimized, ending in HALT) to `path`. */
+bool sky_skyc_write(SkyChunk *chunk, uint64_t source_hash, const char *path,
+                    char *error, size_t error_size);
+
+/* Loads `path` into an empty chunk. With `source_hash` non-zero the file
+ * is only accepted if it was built from that source. */
+bool sky_skyc_load(const char *path, uint64_t source_hash, SkyChunk *chunk,
+                   SkyImage *image, char *error, size_t error_size);
+
+/* Loads a file image already in memory (8-byte aligned and writable, as
+ * quickening patches code in place). The memory stays the caller's. */
+bool sky_skyc_load_memory(void *data, size_t size, SkyChunk *chunk, SkyImage *image,
+                          char *error, size_t error_size);
+
+/* Maps `path` into `image`: private and writable, so pages are copied
+ * only when written (a heap copy where mmap is unavailable). */
+bool sky_image_map(const char *path, SkyImage *image);
+
+/* Free the chunk first, then its image. */
+void sky_image_free(SkyImage *image);
+
+/* Cache file for a source path: <dir>/.skycache/<name>.skyc. Creates the
+ * directory when `create` is set. */
+bool sky_skyc_cache_path(const char *source_path, char *out, size_t out_size, bool create);
+
+#endif
@@ -0,0 +1,912 @@
+﻿/* snapshot.c — Heap snapshots (.skysnap)
+ *
+ * Writing numbers every string, array, map, class and instance reachable
+ * from the globals table first (containers in the order they are found,
+ * so cycles are fine), then lays out the program, the strings, the
+ * containers as value records and the globals. Restoring allocates every
+ * container before filling any of them in, for the same reason; classes
+ * come back whole in that first pass, since instances are made from them.
+ *
+ * The globals table is the whole state to save: sky_vm_execute ends by
+ * writing every slot global back to it. */
+#include "snapshot.h"
+#include "map.h"
+#include "class.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAP_BYTE_ORDER 0x0102
+#define FNV64_OFFSET    14695981039346656037ull
+#define FNV64_PRIME     1099511628211ull
+
+enum { SNAP_NIL, SNAP_BOOL, SNAP_INT, SNAP_FLOAT, SNAP_STRING, SNAP_ARRAY, SNAP_FUNCTION, SNAP_NATIVE,
+       SNAP_MAP, SNAP_CLASS, SNAP_INSTANCE };
+
+/* All offsets are from the start of the file. */
+typedef struct {
+    char     magic[4];        /* "SKYS" */
+    uint16_t version;
+    uint16_t byte_order;      /* SNAP_BYTE_ORDER as the writer stored it */
+    uint32_t program;         /* the embedded .skyc image */
+    uint32_t program_size;
+    uint64_t checksum;        /* FNV-1a of every byte after the header */
+    uint64_t file_size;
+    uint32_t string_count;
+    uint32_t string_table;    /* uint32 offset of each SkyString image */
+    uint32_t array_count;
+    uint32_t array_table;     /* uint32 offset of each array's SnapRecord */
+    uint32_t map_count;
+    uint32_t map_table;       /* uint32 offset of each map's SnapRecord */
+    uint32_t class_count;
+    uint32_t class_table;     /* uint32 offset of each class's SnapRecord */
+    uint32_t instance_count;
+    uint32_t instance_table;  /* uint32 offset of each instance's SnapRecord */
+    uint32_t global_count;
+    uint32_t globals;         /* SnapPair[global_count] */
+} SnapHeader;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t index;           /* string, container or chunk index; a native's name */
+    uint64_t bits;            /* bool, int64 or double payload */
+} SnapValue;
+
+/* Followed by count SnapValues for an array, count SnapPairs for the
+ * rest. A class's pairs are its declared fields, each with a nil value,
+ * then its methods; an instance's are its fields in slot order. */
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;        /* a class's name; an instance's class index */
+} SnapRecord;
+
+typedef struct {
+    uint32_t  key;            /* string index */
+    uint32_t  reserved;
+    SnapValue value;
+} SnapPair;
+
+static uint64_t fnv64(const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t h = FNV64_OFFSET;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static bool set_error(char *error, size_t error_size, const char *message) {
+    snprintf(error, error_size, "%s", message);
+    return false;
+}
+
+/* Room for one more item in a growable array of `size`-byte items */
+static bool reserve(void **items, int *capacity, int count, size_t size) {
+    void *grown;
+    int cap;
+    if (count < *capacity) return true;
+    cap = *capacity < 16 ? 16 : *capacity * 2;
+    grown = realloc(*items, size * cap);
+    if (!grown) return false;
+    *items = grown;
+    *capacity = cap;
+    return true;
+}
+
+/* Every function under `chunk`, numbered as the .skyc format numbers
+ * their chunks: depth-first in constant order, the script first. */
+static bool collect_functions(SkyChunk *chunk, SkyFunction *fn, SkyFunction ***list,
+                              int *count, int *capacity) {
+    int i;
+    if (!reserve((void**)list, capacity, *count, sizeof(SkyFunction*))) return false;
+    (*list)[(*count)++] = fn;
+    for (i = 0; i < chunk->constants.count; i++) {
+        SkyValue k = chunk->constants.values[i];
+        if (IS_FUNCTION(k) && !collect_functions(&AS_FUNCTION(k)->chunk, AS_FUNCTION(k), list, count, capacity)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ---- Writing ---- */
+
+typedef struct {
+    uint8_t      *data;
+    size_t        count;
+    size_t        capacity;
+    SkyObj      **keys;          /* object -> index map */
+    uint32_t     *ids;
+    int           key_count;
+    int           key_capacity;
+    SkyString   **strings;
+    int           string_count;
+    int           string_capacity;
+    SkyArray    **arrays;
+    int           array_count;
+    int           array_capacity;
+    SkyMap      **maps;
+    int           map_count;
+    int           map_capacity;
+    SkyClass    **classes;
+    int           class_count;
+    int           class_capacity;
+    SkyInstance **instances;
+    int           instance_count;
+    int           instance_capacity;
+    SkyFunction **functions;
+    int           function_count;
+    int           function_capacity;
+    SkyTable     *globals;
+    const char   *problem;       /* why the heap cannot be written */
+} Writer;
+
+static size_t put(Writer *w, const void *data, size_t size) {
+    size_t at = w->count;
+    if (w->count + size > w->capacity) {
+        size_t capacity = w->capacity < 4096 ? 4096 : w->capacity;
+        uint8_t *grown;
+        while (w->count + size > capacity) capacity *= 2;
+        grown = (uint8_t*)realloc(w->data, capacity);
+        if (!grown) {
+            w->problem = "Out of memory";
+            return at;
+        }
+        w->data = grown;
+        w->capacity = capacity;
+    }
+    if (data) memcpy(w->data + w->count, data, size);
+    else memset(w->data + w->count, 0, size);
+    w->count += size;
+    return at;
+}
+
+static void align_to(Writer *w, size_t alignment) {
+    while (!w->problem && w->count % alignment != 0) put(w, NULL, 1);
+}
+
+static uint32_t key_slot(SkyObj **keys, int capacity, SkyObj *obj) {
+    uint32_t slot = (uint32_t)(((uintptr_t)obj >> 4) & (uintptr_t)(capacity - 1));
+    while (keys[slot] && keys[slot] != obj) slot = (slot + 1) & (uint32_t)(capacity - 1);
+    return slot;
+}
+
+/* Index of a string or container in its list, adding it on first sight */
+static uint32_t object_index(Writer *w, SkyObj *obj) {
+    uint32_t slot;
+    if ((w->key_count + 1) * 2 > w->key_capacity) {
+        int capacity = w->key_capacity < 64 ? 64 : w->key_capacity * 2;
+        SkyObj **keys = (SkyObj**)calloc(capacity, sizeof(SkyObj*));
+        uint32_t *ids = (uint32_t*)malloc(sizeof(uint32_t) * capacity);
+        int i;
+        if (!keys || !ids) {
+            free(keys);
+            free(ids);
+            w->problem = "Out of memory";
+            return 0;
+        }
+        for (i = 0; i < w->key_capacity; i++) {
+            if (!w->keys[i]) continue;
+            slot = key_slot(keys, capacity, w->keys[i]);
+            keys[slot] = w->keys[i];
+            ids[slot] = w->ids[i];
+        }
+        free(w->keys);
+        free(w->ids);
+        w->keys = keys;
+        w->ids = ids;
+        w->key_capacity = capacity;
+    }
+    slot = key_slot(w->keys, w->key_capacity, obj);
+    if (w->keys[slot]) return w->ids[slot];
+
+    if (obj->type == VAL_STRING) {
+        if (!reserve((void**)&w->strings, &w->string_capacity, w->string_count, sizeof(SkyString*))) {
+            w->problem = "Out of memory";
+            return 0;
+        }
+        w->strings[w->string_count] = (SkyString*)obj;
+        w->ids[slot] = (uint32_t)w->string_count++;
+    } else if (obj->type == VAL_ARRAY) {
+        if (!reserve((void**)&w->arrays, &w->array_capacity, w->array_count, sizeof(SkyArray*))) {
+            w->problem = "Out of memory";
+            return 0;
+        }
+        w->arrays[w->array_count] = (SkyArray*)obj;
+        w->ids[slot] = (uint32_t)w->array_count++;
+    } else if (obj->type == VAL_CLASS) {
+        if (!reserve((void**)&w->classes, &w->class_capacity, w->class_count, sizeof(SkyClass*))) {
+            w->problem = "Out of memory";
+            return 0;
+        }
+        w->classes[w->class_count] = (SkyClass*)obj;
+        w->ids[slot] = (uint32_t)w->class_count++;
+    } else if (obj->type == VAL_INSTANCE) {
+        if (!reserve((void**)&w->instances, &w->instance_capacity, w->instance_count,
+                     sizeof(SkyInstance*))) {
+            w->problem = "Out of memory";
+            return 0;
+        }
+        w->instances[w->instance_count] = (SkyInstance*)obj;
+        w->ids[slot] = (uint32_t)w->instance_count++;
+    } else {
+        if (!reserve((void**)&w->maps, &w->map_capacity, w->map_count, sizeof(SkyMap*))) {
+            w->problem = "Out of memory";
+            return 0;
+        }
+        w->maps[w->map_count] = (SkyMap*)obj;
+        w->ids[slot] = (uint32_t)w->map_count++;
+    }
+    w->keys[slot] = obj;
+    w->key_count++;
+    return w->ids[slot];
+}
+
+static int function_index(Writer *w, SkyFunction *fn) {
+    int i;
+    for (i = 1; i < w->function_count; i++) {
+        if (w->functions[i] == fn) return i;
+    }
+    return -1;
+}
+
+/* The global a native is bound to; natives are restored by that name */
+static SkyString* native_name(Writer *w, SkyNativeFn fn) {
+    int i;
+    for (i = 0; i < w->globals->capacity; i++) {
+        SkyTableEntry *entry = &w->globals->entries[i];
+        if (entry->occupied && IS_NATIVE_FN(entry->value) && AS_NATIVE_FN(entry->value) == fn) {
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
+/* Numbers whatever `value` refers to; with `out`, also encodes it. */
+static void visit_value(Writer *w, SkyValue value, SnapValue *out) {
+    SnapValue v;
+    memset(&v, 0, sizeof(v));
+    switch (SKY_TYPE(value)) {
+        case VAL_NIL:
+            v.tag = SNAP_NIL;
+            break;
+        case VAL_BOOL:
+            v.tag = SNAP_BOOL;
+            v.bits = AS_BOOL(value) ? 1 : 0;
+            break;
+        case VAL_INT: {
+            int64_t i = AS_INT(value);
+            v.tag = SNAP_INT;
+            memcpy(&v.bits, &i, sizeof(i));
+            break;
+        }
+        case VAL_FLOAT: {
+            double d = AS_FLOAT(value);
+            v.tag = SNAP_FLOAT;
+            memcpy(&v.bits, &d, sizeof(d));
+            break;
+        }
+        case VAL_STRING:
+            v.tag = SNAP_STRING;
+            v.index = object_index(w, (SkyObj*)AS_STRING_OBJ(value));
+            break;
+        case VAL_ARRAY:
+            v.tag = SNAP_ARRAY;
+            v.index = object_index(w, (SkyObj*)AS_ARRAY(value));
+            break;
+        case VAL_MAP:
+            v.tag = SNAP_MAP;
+            v.index = object_index(w, (SkyObj*)AS_MAP(value));
+            break;
+        case VAL_CLASS:
+            v.tag = SNAP_CLASS;
+            v.index = object_index(w, (SkyObj*)AS_CLASS(value));
+            break;
+        case VAL_INSTANCE:
+            v.tag = SNAP_INSTANCE;
+            v.index = object_index(w, (SkyObj*)AS_INSTANCE(value));
+            break;
+        case VAL_FUNCTION: {
+            int index = function_index(w, AS_FUNCTION(value));
+            if (index < 0) w->problem = "A global holds a function from another program";
+            v.tag = SNAP_FUNCTION;
+            v.index = (uint32_t)index;
+            break;
+        }
+        case VAL_NATIVE_FN: {
+            SkyString *name = native_name(w, AS_NATIVE_FN(value));
+            if (!name) {
+                w->problem = "A global holds a native function with no name";
+                break;
+            }
+            v.tag = SNAP_NATIVE;
+            v.index = object_index(w, &name->obj);
+            break;
+        }
+        default:
+            w->problem = "Only nil, bools, numbers, strings, arrays, maps, classes, instances "
+                         "and functions can be saved";
+            break;
+    }
+    if (out) *out = v;
+}
+
+static void put_pair(Writer *w, SkyString *key, SkyValue value) {
+    SnapPair pair;
+    memset(&pair, 0, sizeof(pair));
+    pair.key = object_index(w, &key->obj);
+    visit_value(w, value, &pair.value);
+    put(w, &pair, sizeof(pair));
+}
+
+/* Numbers what a class refers to; with `put_out`, also writes its pairs. */
+static void visit_class(Writer *w, SkyClass *klass, bool put_out) {
+    int i;
+    for (i = 0; i < klass->shape->field_count && !w->problem; i++) {
+        if (put_out) put_pair(w, klass->shape->names[i], SKY_NIL());
+        else object_index(w, &klass->shape->names[i]->obj);
+    }
+    for (i = 0; i < klass->method_count && !w->problem; i++) {
+        if (put_out) {
+            put_pair(w, klass->method_names[i], SKY_OBJECT(klass->methods[i]));
+        } else {
+            object_index(w, &klass->method_names[i]->obj);
+            visit_value(w, SKY_OBJECT(klass->methods[i]), NULL);
+        }
+    }
+}
+
+static void writer_free(Writer *w) {
+    free(w->data);
+    free(w->keys);
+    free(w->ids);
+    free(w->strings);
+    free(w->arrays);
+    free(w->maps);
+    free(w->classes);
+    free(w->instances);
+    free(w->functions);
+}
+
+static bool write_file(const char *path, const uint8_t *data, size_t size) {
+    char temp_path[1024];
+    FILE *f;
+    bool ok;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    f = fopen(temp_path, "wb");
+    if (!f) return false;
+    ok = fwrite(data, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok) remove(temp_path);
+    return ok;
+}
+
+bool sky_snapshot_write(SkyVM *vm, SkyChunk *chunk, const char *path,
+                        char *error, size_t error_size) {
+    Writer w;
+    SnapHeader header;
+    uint8_t *program;
+    size_t program_size, table_at;
+    uint32_t offset;
+    int i, j, k, c, n;
+    bool ok;
+
+    memset(&w, 0, sizeof(w));
+    w.globals = &vm->globals;
+    if (!collect_functions(chunk, NULL, &w.functions, &w.function_count, &w.function_capacity)) {
+        writer_free(&w);
+        return set_error(error, error_size, "Out of memory");
+    }
+
+    /* Number everything first: strings are laid out before the
+     * containers that refer to them */
+    for (i = 0; i < vm->globals.capacity && !w.problem; i++) {
+        SkyTableEntry *entry = &vm->globals.entries[i];
+        if (!entry->occupied) continue;
+        object_index(&w, &entry->key->obj);
+        visit_value(&w, entry->value, NULL);
+    }
+    for (i = 0, k = 0, c = 0, n = 0;
+         (i < w.array_count || k < w.map_count || c < w.class_count || n < w.instance_count) &&
+         !w.problem;) {
+        if (i < w.array_count) {
+            for (j = 0; j < w.arrays[i]->count && !w.problem; j++) visit_value(&w, w.arrays[i]->items[j], NULL);
+            i++;
+        } else if (k < w.map_count) {
+            for (j = 0; j < w.maps[k]->used && !w.problem; j++) {
+                if (!w.maps[k]->entries[j].key) continue;
+                object_index(&w, &w.maps[k]->entries[j].key->obj);
+                visit_value(&w, w.maps[k]->entries[j].value, NULL);
+            }
+            k++;
+        } else if (c < w.class_count) {
+            object_index(&w, &w.classes[c]->name->obj);
+            visit_class(&w, w.classes[c], false);
+            c++;
+        } else {
+            SkyInstance *instance = w.instances[n];
+            object_index(&w, &instance->klass->obj);
+            for (j = 0; j < instance->shape->field_count && !w.problem; j++) {
+                object_index(&w, &instance->shape->names[j]->obj);
+                visit_value(&w, instance->fields[j], NULL);
+            }
+            n++;
+        }
+    }
+    if (w.problem) {
+        set_error(error, error_size, w.problem);
+        writer_free(&w);
+        return false;
+    }
+    if (!sky_skyc_encode(chunk, 0, &program, &program_size, error, error_size)) {
+        writer_free(&w);
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    put(&w, &header, sizeof(header));
+    align_to(&w, 8);
+    header.program = (uint32_t)put(&w, program, program_size);
+    header.program_size = (uint32_t)program_size;
+    free(program);
+
+    /* Strings, each a static SkyString ready to be used in place */
+    align_to(&w, 8);
+    header.string_count = (uint32_t)w.string_count;
+    header.string_table = (uint32_t)(table_at = put(&w, NULL, sizeof(uint32_t) * w.string_count));
+    for (i = 0; i < w.string_count && !w.problem; i++) {
+        SkyString *str = w.strings[i];
+        SkyString image;
+        memset(&image, 0, sizeof(image));
+        image.obj.type = VAL_STRING;
+        image.obj.flags = SKY_OBJ_STATIC;
+        image.length = str->length;
+        image.hash = sky_hash_chars(str->chars, str->length);
+        align_to(&w, 8);
+        offset = (uint32_t)put(&w, &image, sizeof(image));
+        put(&w, str->chars, (size_t)str->length + 1);
+        if (!w.problem) memcpy(w.data + table_at + sizeof(uint32_t) * i, &offset, sizeof(offset));
+    }
+
+    align_to(&w, 8);
+    header.array_count = (uint32_t)w.array_count;
+    header.array_table = (uint32_t)(table_at = put(&w, NULL, sizeof(uint32_t) * w.array_count));
+    for (i = 0; i < w.array_count && !w.problem; i++) {
+        SkyArray *arr = w.arrays[i];
+        SnapRecord record;
+        memset(&record, 0, sizeof(record));
+        record.count = (uint32_t)arr->count;
+        align_to(&w, 8);
+        offset = (uint32_t)put(&w, &record, sizeof(record));
+        if (!w.problem) memcpy(w.data + table_at + sizeof(uint32_t) * i, &offset, sizeof(offset));
+        for (j = 0; j < arr->count && !w.problem; j++) {
+            SnapValue v;
+            visit_value(&w, arr->items[j], &v);
+            put(&w, &v, sizeof(v));
+        }
+    }
+
+    align_to(&w, 8);
+    header.map_count = (uint32_t)w.map_count;
+    header.map_table = (uint32_t)(table_at = put(&w, NULL, sizeof(uint32_t) * w.map_count));
+    for (i = 0; i < w.map_count && !w.problem; i++) {
+        SkyMap *map = w.maps[i];
+        SnapRecord record;
+        memset(&record, 0, sizeof(record));
+        record.count = (uint32_t)map->count;
+        align_to(&w, 8);
+        offset = (uint32_t)put(&w, &record, sizeof(record));
+        if (!w.problem) memcpy(w.data + table_at + sizeof(uint32_t) * i, &offset, sizeof(offset));
+        for (j = 0; j < map->used && !w.problem; j++) {
+            if (map->entries[j].key) put_pair(&w, map->entries[j].key, map->entries[j].value);
+        }
+    }
+
+    align_to(&w, 8);
+    header.class_count = (uint32_t)w.class_count;
+    header.class_table = (uint32_t)(table_at = put(&w, NULL, sizeof(uint32_t) * w.class_count));
+    for (i = 0; i < w.class_count && !w.problem; i++) {
+        SkyClass *klass = w.classes[i];
+        SnapRecord record;
+        memset(&record, 0, sizeof(record));
+        record.count = (uint32_t)(klass->shape->field_count + klass->method_count);
+        record.reserved = object_index(&w, &klass->name->obj);
+        align_to(&w, 8);
+        offset = (uint32_t)put(&w, &record, sizeof(record));
+        if (!w.problem) memcpy(w.data + table_at + sizeof(uint32_t) * i, &offset, sizeof(offset));
+        visit_class(&w, klass, true);
+    }
+
+    align_to(&w, 8);
+    header.instance_count = (uint32_t)w.instance_count;
+    header.instance_table = (uint32_t)(table_at = put(&w, NULL, sizeof(uint32_t) * w.instance_count));
+    for (i = 0; i < w.instance_count && !w.problem; i++) {
+        SkyInstance *instance = w.instances[i];
+        SnapRecord record;
+        memset(&record, 0, sizeof(record));
+        record.count = (uint32_t)instance->shape->field_count;
+        record.reserved = object_index(&w, &instance->klass->obj);
+        align_to(&w, 8);
+        offset = (uint32_t)put(&w, &record, sizeof(record));
+        if (!w.problem) memcpy(w.data + table_at + sizeof(uint32_t) * i, &offset, sizeof(offset));
+        for (j = 0; j < instance->shape->field_count && !w.problem; j++) {
+            put_pair(&w, instance->shape->names[j], instance->fields[j]);
+        }
+    }
+
+    align_to(&w, 8);
+    header.globals = (uint32_t)w.count;
+    for (i = 0; i < vm->globals.capacity && !w.problem; i++) {
+        SkyTableEntry *entry = &vm->globals.entries[i];
+        if (!entry->occupied) continue;
+        put_pair(&w, entry->key, entry->value);
+        header.global_count++;
+    }
+
+    if (w.problem || w.count > 0xffffffffu) {
+        set_error(error, error_size, w.problem ? w.problem : "Snapshot too large");
+        writer_free(&w);
+        return false;
+    }
+    memcpy(header.magic, "SKYS", 4);
+    header.version = SKY_SNAPSHOT_VERSION;
+    header.byte_order = SNAP_BYTE_ORDER;
+    header.file_size = w.count;
+    header.checksum = fnv64(w.data + sizeof(header), w.count - sizeof(header));
+    memcpy(w.data, &header, sizeof(header));
+
+    ok = write_file(path, w.data, w.count);
+    writer_free(&w);
+    return ok ? true : set_error(error, error_size, "Cannot write output file");
+}
+
+/* ---- Loading ---- */
+
+static const SnapHeader* header_of(const SkySnapshot *snapshot) {
+    return (const SnapHeader*)snapshot->image.base;
+}
+
+static bool in_file(const SkyImage *image, uint64_t offset, uint64_t count,
+                    uint64_t elem_size, uint64_t alignment) {
+    if (offset % alignment != 0) return false;
+    if (count > image->size / (elem_size ? elem_size : 1)) return false;
+    return offset <= image->size && count * elem_size <= image->size - offset;
+}
+
+static SkyString* string_at(const SkySnapshot *snapshot, uint32_t i) {
+    const uint8_t *base = (const uint8_t*)snapshot->image.base;
+    const uint32_t *table = (const uint32_t*)(base + header_of(snapshot)->string_table);
+    return (SkyString*)(base + table[i]);
+}
+
+static const SnapRecord* record_at(const SkySnapshot *snapshot, uint32_t table, uint32_t i) {
+    const uint8_t *base = (const uint8_t*)snapshot->image.base;
+    return (const SnapRecord*)(base + ((const uint32_t*)(base + table))[i]);
+}
+
+#define ARRAY_AT(snapshot, i) record_at((snapshot), header_of(snapshot)->array_table, (i))
+#define MAP_AT(snapshot, i)   record_at((snapshot), header_of(snapshot)->map_table, (i))
+#define CLASS_AT(snapshot, i) record_at((snapshot), header_of(snapshot)->class_table, (i))
+#define INSTANCE_AT(snapshot, i) record_at((snapshot), header_of(snapshot)->instance_table, (i))
+
+static const SnapPair* global_at(const SkySnapshot *snapshot, uint32_t i) {
+    const uint8_t *base = (const uint8_t*)snapshot->image.base;
+    return (const SnapPair*)(base + header_of(snapshot)->globals) + i;
+}
+
+static bool valid_value(const SkySnapshot *snapshot, const SnapValue *v) {
+    const SnapHeader *h = header_of(snapshot);
+    switch (v->tag) {
+        case SNAP_NIL:
+        case SNAP_INT:
+        case SNAP_FLOAT:    return true;
+        case SNAP_BOOL:     return v->bits <= 1;
+        case SNAP_STRING:
+        case SNAP_NATIVE:   return v->index < h->string_count;
+        case SNAP_ARRAY:    return v->index < h->array_count;
+        case SNAP_MAP:      return v->index < h->map_count;
+        case SNAP_CLASS:    return v->index < h->class_count;
+        case SNAP_INSTANCE: return v->index < h->instance_count;
+        case SNAP_FUNCTION: return v->index > 0 && v->index < (uint32_t)snapshot->function_count;
+        default:            return false;
+    }
+}
+
+static bool valid_pair(const SkySnapshot *snapshot, const SnapPair *pair) {
+    return pair->key < header_of(snapshot)->string_count && valid_value(snapshot, &pair->value);
+}
+
+/* A table of `count` records, each followed by its `item_size` items */
+static bool valid_records(const SkySnapshot *snapshot, uint32_t table, uint32_t count, size_t item_size) {
+    const SkyImage *image = &snapshot->image;
+    uint32_t i, j;
+    if (!in_file(image, table, count, sizeof(uint32_t), 4)) return false;
+    for (i = 0; i < count; i++) {
+        uint32_t at = ((const uint32_t*)((const uint8_t*)image->base + table))[i];
+        const SnapRecord *record;
+        const uint8_t *items;
+        if (!in_file(image, at, 1, sizeof(SnapRecord), 8)) return false;
+        record = record_at(snapshot, table, i);
+        if (record->count > 0x7fffffffu || !in_file(image, at + sizeof(SnapRecord), record->count, item_size, 8)) {
+            return false;
+        }
+        items = (const uint8_t*)(record + 1);
+        for (j = 0; j < record->count; j++) {
+            bool ok = item_size == sizeof(SnapValue)
+                    ? valid_value(snapshot, (const SnapValue*)items + j)
+                    : valid_pair(snapshot, (const SnapPair*)items + j);
+            if (!ok) return false;
+        }
+    }
+    return true;
+}
+
+/* Every offset, index and string outside the program, which its own
+ * loader checks */
+static bool validate(const SkySnapshot *snapshot) {
+    const SkyImage *image = &snapshot->image;
+    const SnapHeader *h = header_of(snapshot);
+    const uint8_t *base = (const uint8_t*)image->base;
+    uint32_t i;
+
+    if (!in_file(image, h->string_table, h->string_count, sizeof(uint32_t), 4) ||
+        !in_file(image, h->globals, h->global_count, sizeof(SnapPair), 8)) {
+        return false;
+    }
+    for (i = 0; i < h->string_count; i++) {
+        uint32_t at = ((const uint32_t*)(base + h->string_table))[i];
+        SkyString *str;
+        if (!in_file(image, at, 1, sizeof(SkyString), 8)) return false;
+        str = string_at(snapshot, i);
+        if (str->obj.type != VAL_STRING || str->obj.flags != SKY_OBJ_STATIC || str->obj.marked ||
+            str->length < 0 || !in_file(image, at + sizeof(SkyString), (uint64_t)str->length + 1, 1, 1) ||
+            str->chars[str->length] != '\0' || str->hash != sky_hash_chars(str->chars, str->length)) {
+            return false;
+        }
+    }
+    if (!valid_records(snapshot, h->array_table, h->array_count, sizeof(SnapValue)) ||
+        !valid_records(snapshot, h->map_table, h->map_count, sizeof(SnapPair)) ||
+        !valid_records(snapshot, h->class_table, h->class_count, sizeof(SnapPair)) ||
+        !valid_records(snapshot, h->instance_table, h->instance_count, sizeof(SnapPair))) {
+        return false;
+    }
+    /* Declared fields (nil) come before methods, which are functions;
+     * an instance's first fields are its class's declared ones */
+    for (i = 0; i < h->class_count; i++) {
+        const SnapRecord *record = CLASS_AT(snapshot, i);
+        const SnapPair *pairs = (const SnapPair*)(record + 1);
+        bool methods = false;
+        uint32_t j;
+        if (record->reserved >= h->string_count) return false;
+        for (j = 0; j < record->count; j++) {
+            if (pairs[j].value.tag == SNAP_FUNCTION) methods = true;
+            else if (pairs[j].value.tag != SNAP_NIL || methods) return false;
+        }
+    }
+    for (i = 0; i < h->instance_count; i++) {
+        const SnapRecord *record = INSTANCE_AT(snapshot, i);
+        const SnapPair *pairs = (const SnapPair*)(record + 1);
+        const SnapRecord *klass;
+        const SnapPair *declared;
+        uint32_t j;
+        if (record->reserved >= h->class_count) return false;
+        klass = CLASS_AT(snapshot, record->reserved);
+        declared = (const SnapPair*)(klass + 1);
+        for (j = 0; j < klass->count && declared[j].value.tag == SNAP_NIL; j++) {
+            if (j >= record->count || pairs[j].key != declared[j].key) return false;
+        }
+    }
+    for (i = 0; i < h->global_count; i++) {
+        if (!valid_pair(snapshot, global_at(snapshot, i))) return false;
+    }
+    return true;
+}
+
+bool sky_snapshot_load(const char *path, SkySnapshot *snapshot, char *error, size_t error_size) {
+    SnapHeader h;
+    int capacity = 0;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (!sky_image_map(path, &snapshot->image)) return set_error(error, error_size, "Cannot read file");
+    if (snapshot->image.size < sizeof(SnapHeader) || memcmp(snapshot->image.base, "SKYS", 4) != 0) {
+        sky_image_free(&snapshot->image);
+        return set_error(error, error_size, "Not a .skysnap file");
+    }
+    memcpy(&h, snapshot->image.base, sizeof(h));
+    if (h.version != SKY_SNAPSHOT_VERSION || h.byte_order != SNAP_BYTE_ORDER) {
+        sky_image_free(&snapshot->image);
+        return set_error(error, error_size, "Built by a different version of sky");
+    }
+    if (h.file_size != snapshot->image.size ||
+        h.checksum != fnv64((uint8_t*)snapshot->image.base + sizeof(h), snapshot->image.size - sizeof(h))) {
+        sky_image_free(&snapshot->image);
+        return set_error(error, error_size, "Checksum mismatch");
+    }
+    if (!in_file(&snapshot->image, h.program, h.program_size, 1, 8) ||
+        !sky_skyc_load_memory((uint8_t*)snapshot->image.base + h.program, h.program_size,
+                              &snapshot->chunk, &snapshot->program, error, error_size)) {
+        sky_image_free(&snapshot->image);
+        return error[0] ? false : set_error(error, error_size, "Corrupt program");
+    }
+    if (!collect_functions(&snapshot->chunk, NULL, &snapshot->functions, &snapshot->function_count,
+                           &capacity) ||
+        !validate(snapshot)) {
+        sky_snapshot_free(snapshot);
+        return set_error(error, error_size, "Corrupt heap");
+    }
+    return true;
+}
+
+void sky_snapshot_free(SkySnapshot *snapshot) {
+    sky_chunk_free(&snapshot->chunk);
+    sky_image_free(&snapshot->program);
+    sky_image_free(&snapshot->image);
+    free(snapshot->functions);
+    snapshot->functions = NULL;
+    snapshot->function_count = 0;
+}
+
+/* ---- Restoring ---- */
+
+typedef struct {
+    SkySnapshot *snapshot;
+    SkyVM       *vm;
+    SkyArray   **arrays;
+    SkyMap     **maps;
+    SkyClass   **classes;
+    SkyInstance **instances;
+} Restorer;
+
+static bool decode(Restorer *r, const SnapValue *v, SkyValue *out) {
+    switch (v->tag) {
+        case SNAP_NIL:
+            *out = SKY_NIL();
+            return true;
+        case SNAP_BOOL:
+            *out = SKY_BOOL(v->bits != 0);
+            return true;
+        case SNAP_INT: {
+            int64_t i;
+            memcpy(&i, &v->bits, sizeof(i));
+            *out = SKY_INT(i);
+            return true;
+        }
+        case SNAP_FLOAT: {
+            double d;
+            memcpy(&d, &v->bits, sizeof(d));
+            *out = SKY_FLOAT(d);
+            return true;
+        }
+        case SNAP_STRING:
+            *out = SKY_STRING(string_at(r->snapshot, v->index));
+            return true;
+        case SNAP_ARRAY:
+            *out = SKY_ARRAY(r->arrays[v->index]);
+            return true;
+        case SNAP_MAP:
+            *out = SKY_OBJECT(r->maps[v->index]);
+            return true;
+        case SNAP_CLASS:
+            *out = SKY_OBJECT(r->classes[v->index]);
+            return true;
+        case SNAP_INSTANCE:
+            *out = SKY_OBJECT(r->instances[v->index]);
+            return true;
+        case SNAP_FUNCTION:
+            *out = SKY_OBJECT(r->snapshot->functions[v->index]);
+            return true;
+        default:
+            return sky_table_get(&r->vm->globals, string_at(r->snapshot, v->index), out) && IS_NATIVE_FN(*out);
+    }
+}
+
+/* A class from its record: the declared fields, then the methods. */
+static SkyClass* restore_class(Restorer *r, const SnapRecord *record) {
+    const SnapPair *pairs = (const SnapPair*)(record + 1);
+    SkyValue *fields = (SkyValue*)malloc(sizeof(SkyValue) * (record->count + 1));
+    SkyClass *klass;
+    uint32_t j, field_count = 0;
+    if (!fields) return NULL;
+    while (field_count < record->count && pairs[field_count].value.tag == SNAP_NIL) {
+        fields[field_count] = SKY_STRING(string_at(r->snapshot, pairs[field_count].key));
+        field_count++;
+    }
+    klass = sky_class_new(string_at(r->snapshot, record->reserved), fields, (int)field_count);
+    free(fields);
+    for (j = field_count; j < record->count; j++) {
+        sky_class_set_method(klass, string_at(r->snapshot, pairs[j].key),
+                             r->snapshot->functions[pairs[j].value.index]);
+    }
+    return klass;
+}
+
+bool sky_snapshot_restore(SkySnapshot *snapshot, SkyVM *vm, char *error, size_t error_size) {
+    const SnapHeader *h = header_of(snapshot);
+    SkyHeap *previous_heap = sky_gc_set_current(&vm->heap);
+    size_t next_gc = vm->heap.next_gc;
+    bool stress = vm->heap.config.stress;
+    Restorer r;
+    uint32_t i, j;
+    bool ok = true;
+
+    r.snapshot = snapshot;
+    r.vm = vm;
+    r.arrays = (SkyArray**)malloc(sizeof(SkyArray*) * (h->array_count + 1));
+    r.maps = (SkyMap**)malloc(sizeof(SkyMap*) * (h->map_count + 1));
+    r.classes = (SkyClass**)malloc(sizeof(SkyClass*) * (h->class_count + 1));
+    r.instances = (SkyInstance**)malloc(sizeof(SkyInstance*) * (h->instance_count + 1));
+    if (!r.arrays || !r.maps || !r.classes || !r.instances) {
+        free(r.arrays);
+        free(r.maps);
+        free(r.classes);
+        free(r.instances);
+        sky_gc_set_current(previous_heap);
+        return set_error(error, error_size, "Out of memory");
+    }
+    /* Nothing is reachable until the globals are in, so hold off
+     * collecting while the heap is rebuilt */
+    vm->heap.next_gc = (size_t)-1;
+    vm->heap.config.stress = false;
+    for (i = 0; i < h->array_count; i++) {
+        r.arrays[i] = sky_array_new((int)ARRAY_AT(snapshot, i)->count);
+        r.arrays[i]->count = (int)ARRAY_AT(snapshot, i)->count;
+    }
+    for (i = 0; i < h->map_count; i++) r.maps[i] = sky_map_new((int)MAP_AT(snapshot, i)->count);
+    for (i = 0; i < h->class_count && ok; i++) {
+        r.classes[i] = restore_class(&r, CLASS_AT(snapshot, i));
+        ok = r.classes[i] != NULL;
+    }
+    for (i = 0; i < h->instance_count && ok; i++) {
+        r.instances[i] = sky_instance_new(r.classes[INSTANCE_AT(snapshot, i)->reserved]);
+    }
+    for (i = 0; i < h->array_count && ok; i++) {
+        const SnapValue *items = (const SnapValue*)(ARRAY_AT(snapshot, i) + 1);
+        for (j = 0; j < (uint32_t)r.arrays[i]->count && ok; j++) {
+            ok = decode(&r, &items[j], &r.arrays[i]->items[j]);
+        }
+    }
+    for (i = 0; i < h->map_count && ok; i++) {
+        const SnapRecord *record = MAP_AT(snapshot, i);
+        const SnapPair *pairs = (const SnapPair*)(record + 1);
+        for (j = 0; j < record->count && ok; j++) {
+            SkyValue value;
+            ok = decode(&r, &pairs[j].value, &value);
+            if (ok) sky_map_set(r.maps[i], string_at(snapshot, pairs[j].key), value);
+        }
+    }
+    for (i = 0; i < h->instance_count && ok; i++) {
+        const SnapRecord *record = INSTANCE_AT(snapshot, i);
+        const SnapPair *pairs = (const SnapPair*)(record + 1);
+        SkyInstance *instance = r.instances[i];
+        for (j = 0; j < record->count && ok; j++) {
+            SkyValue value;
+            ok = decode(&r, &pairs[j].value, &value);
+            if (!ok) break;
+            if ((int)j < instance->klass->shape->field_count) instance->fields[j] = value;
+            else sky_instance_add_field(instance, string_at(snapshot, pairs[j].key), value);
+        }
+    }
+    for (i = 0; i < h->global_count && ok; i++) {
+        const SnapPair *g = global_at(snapshot, i);
+        SkyValue value;
+        ok = decode(&r, &g->value, &value);
+        if (ok) sky_table_set(&vm->globals, string_at(snapshot, g->key), value);
+    }
+    if (ok) sky_vm_bind_globals(vm, &snapshot->chunk);
+
+    vm->heap.next_gc = next_gc;
+    vm->heap.config.stress = stress;
+    sky_gc_set_current(previous_heap);
+    free(r.arrays);
+    free(r.maps);
+    free(r.classes);
+    free(r.instances);
+    return ok ? true : set_error(error, error_size, "Snapshot needs a native function this VM lacks");
+}
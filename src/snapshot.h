@@ -0,0 +1,43 @@
+﻿/* snapshot.h — Heap snapshots (.skysnap) */
+#ifndef SKY_SNAPSHOT_H
+#define SKY_SNAPSHOT_H
+
+#include "vm.h"
+#include "serializer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A .skysnap file is a program together with the globals its top level
+ * left behind: the program as an embedded .skyc image, then every string,
+ * array, map, class and instance reachable from the globals. Nothing in
+ * it is a pointer, so the file maps anywhere. Strings are ready-made
+ * static SkyString objects used in place, like .skyc string constants;
+ * the rest stay mutable and are rebuilt on the heap of each VM restored
+ * from the file. Functions are stored by chunk number and natives by name. */
+#define SKY_SNAPSHOT_VERSION 3
+
+typedef struct {
+    SkyImage image;       /* the whole file */
+    SkyImage program;     /* its .skyc part (borrowed from image) */
+    SkyChunk chunk;
+    SkyFunction **functions;   /* by chunk number; [0] is the script's NULL */
+    int      function_count;
+} SkySnapshot;
+
+/* Writes `chunk` and the globals of `vm`, which has just executed it. */
+bool sky_snapshot_write(SkyVM *vm, SkyChunk *chunk, const char *path,
+                        char *error, size_t error_size);
+
+/* Maps and checks `path`, and loads its program into snapshot->chunk. */
+bool sky_snapshot_load(const char *path, SkySnapshot *snapshot, char *error, size_t error_size);
+
+/* Gives a freshly initialized VM the snapshot's globals and binds the
+ * chunk's global slots, as if the top level had just run there. Any
+ * number of VMs can be restored from one snapshot, which must outlive
+ * them all. */
+bool sky_snapshot_restore(SkySnapshot *snapshot, SkyVM *vm, char *error, size_t error_size);
+
+/* Free after every VM restored from it. */
+void sky_snapshot_free(SkySnapshot *snapshot);
+
+#endif
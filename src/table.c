@@ -6,15 +6,6 @@
 
 #define TABLE_MAX_LOAD 0.75
 
-static uint32_t hash_string(const char *key) {
-    uint32_t h = 2166136261u;
-    while (*key) {
-        h ^= (uint8_t)*key++;
-        h *= 16777619u;
-    }
-    return h;
-}
-
 void sky_table_init(SkyTable *table) {
     table->entries = NULL;
     table->count = 0;
@@ -22,20 +13,12 @@ void sky_table_init(SkyTable *table) {
 }
 
 void sky_table_free(SkyTable *table) {
-    int i;
-    if (table->entries) {
-        for (i = 0; i < table->capacity; i++) {
-            if (table->entries[i].occupied && table->entries[i].key) {
-                free(table->entries[i].key);
-            }
-        }
-        free(table->entries);
-    }
+    free(table->entries);
     sky_table_init(table);
 }
 
-static SkyTableEntry* find_entry(SkyTableEntry *entries, int capacity, const char *key) {
-    uint32_t index = hash_string(key) % (uint32_t)capacity;
+static SkyTableEntry* find_entry(SkyTableEntry *entries, int capacity, SkyString *key) {
+    uint32_t index = sky_string_hash(key) & (uint32_t)(capacity - 1);
     SkyTableEntry *tombstone = NULL;
     while (1) {
         SkyTableEntry *entry = &entries[index];
@@ -45,10 +28,10 @@ static SkyTableEntry* find_entry(SkyTableEntry *entries, int capacity, const cha
             } else {
                 if (tombstone == NULL) tombstone = entry;
             }
-        } else if (entry->key && strcmp(entry->key, key) == 0) {
+        } else if (sky_strings_equal(entry->key, key)) {
             return entry;
         }
-        index = (index + 1) % (uint32_t)capacity;
+        index = (index + 1) & (uint32_t)(capacity - 1);
     }
 }
 
@@ -70,7 +53,7 @@ static void adjust_capacity(SkyTable *table, int capacity) {
     table->capacity = capacity;
 }
 
-bool sky_table_set(SkyTable *table, const char *key, SkyValue value) {
+bool sky_table_set(SkyTable *table, SkyString *key, SkyValue value) {
     SkyTableEntry *entry;
     bool is_new;
     if (table->count + 1 > (int)(table->capacity * TABLE_MAX_LOAD)) {
@@ -79,17 +62,17 @@ bool sky_table_set(SkyTable *table, const char *key, SkyValue value) {
     }
     entry = find_entry(table->entries, table->capacity, key);
     is_new = !entry->occupied;
+    /* Reusing a tombstone does not change count, it already includes it */
     if (is_new) {
-        table->count++;
-        entry->key = (char*)malloc(strlen(key) + 1);
-        strcpy(entry->key, key);
+        if (entry->key == NULL) table->count++;
+        entry->key = key;
     }
     entry->value = value;
     entry->occupied = true;
     return is_new;
 }
 
-bool sky_table_get(SkyTable *table, const char *key, SkyValue *out) {
+bool sky_table_get(SkyTable *table, SkyString *key, SkyValue *out) {
     SkyTableEntry *entry;
     if (table->count == 0) return false;
     entry = find_entry(table->entries, table->capacity, key);
@@ -98,13 +81,13 @@ bool sky_table_get(SkyTable *table, const char *key, SkyValue *out) {
     return true;
 }
 
-bool sky_table_delete(SkyTable *table, const char *key) {
+bool sky_table_delete(SkyTable *table, SkyString *key) {
     SkyTableEntry *entry;
     if (table->count == 0) return false;
     entry = find_entry(table->entries, table->capacity, key);
     if (!entry->occupied) return false;
-    free(entry->key);
-    entry->key = NULL;
+    /* Leave the key in place as a tombstone so probe chains stay intact */
+    entry->value = SKY_NIL();
     entry->occupied = false;
     return true;
 }
@@ -118,3 +101,81 @@ void sky_table_copy(SkyTable *from, SkyTable *to) {
         }
     }
 }
+
+/* ---- Intern set ---- */
+
+void sky_string_set_init(SkyStringSet *set) {
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+void sky_string_set_free(SkyStringSet *set) {
+    free(set->entries);
+    sky_string_set_init(set);
+}
+
+SkyString* sky_string_set_find(SkyStringSet *set, const char *chars, int length, uint32_t hash) {
+    uint32_t index;
+    if (set->count == 0) return NULL;
+    index = hash & (uint32_t)(set->capacity - 1);
+    while (1) {
+        SkyString *str = set->entries[index];
+        if (str == NULL) return NULL;
+        if (str != SKY_STRING_SET_TOMBSTONE && str->hash == hash && str->length == length &&
+            memcmp(str->chars, chars, (size_t)length) == 0) {
+            return str;
+        }
+        index = (index + 1) & (uint32_t)(set->capacity - 1);
+    }
+}
+
+/* True when the string took a fresh slot rather than a tombstone. */
+static bool set_insert(SkyString **entries, int capacity, SkyString *str) {
+    uint32_t index = str->hash & (uint32_t)(capacity - 1);
+    bool fresh;
+    while (entries[index] != NULL && entries[index] != SKY_STRING_SET_TOMBSTONE) {
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    }
+    fresh = entries[index] == NULL;
+    entries[index] = str;
+    return fresh;
+}
+
+void sky_string_set_add(SkyStringSet *set, SkyString *str) {
+    if (set->count + 1 > (int)(set->capacity * TABLE_MAX_LOAD)) {
+        /* Rehashing drops the tombstones, so only grow for live entries */
+        int live = 0, capacity, i;
+        SkyString **entries;
+        for (i = 0; i < set->capacity; i++) {
+            if (set->entries[i] && set->entries[i] != SKY_STRING_SET_TOMBSTONE) live++;
+        }
+        capacity = set->capacity < 8 ? 8 : set->capacity;
+        while (live + 1 > (int)(capacity * TABLE_MAX_LOAD) / 2) capacity *= 2;
+        entries = (SkyString**)calloc(capacity, sizeof(SkyString*));
+        if (!entries) {
+            fprintf(stderr, "[SKY] Out of memory growing the string table\n");
+            exit(1);
+        }
+        for (i = 0; i < set->capacity; i++) {
+            SkyString *s = set->entries[i];
+            if (s && s != SKY_STRING_SET_TOMBSTONE) set_insert(entries, capacity, s);
+        }
+        free(set->entries);
+        set->entries = entries;
+        set->capacity = capacity;
+        set->count = live;
+    }
+    if (set_insert(set->entries, set->capacity, str)) set->count++;
+}
+
+void sky_string_set_remove_unmarked(SkyStringSet *set) {
+    int i;
+    for (i = 0; i < set->capacity; i++) {
+        SkyString *str = set->entries[i];
+        if (str && str != SKY_STRING_SET_TOMBSTONE &&
+            !str->obj.marked && !(str->obj.flags & SKY_OBJ_STATIC)) {
+            set->entries[i] = SKY_STRING_SET_TOMBSTONE;
+        }
+    }
+}
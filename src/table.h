@@ -6,10 +6,13 @@
 #include <stdbool.h>
 #include "value.h"
 
+/* Keys are string objects the table does not own; whoever inserts them
+ * keeps them alive (the VM heap marks the keys of its globals table).
+ * Setting an existing key keeps the key object already in the table. */
 typedef struct {
-    char      *key;
+    SkyString *key;
     SkyValue   value;
-    bool       occupied;
+    bool       occupied;   /* key != NULL && !occupied marks a tombstone */
 } SkyTableEntry;
 
 typedef struct {
@@ -20,9 +23,25 @@ typedef struct {
 
 void sky_table_init(SkyTable *table);
 void sky_table_free(SkyTable *table);
-bool sky_table_set(SkyTable *table, const char *key, SkyValue value);
-bool sky_table_get(SkyTable *table, const char *key, SkyValue *out);
-bool sky_table_delete(SkyTable *table, const char *key);
+bool sky_table_set(SkyTable *table, SkyString *key, SkyValue value);
+bool sky_table_get(SkyTable *table, SkyString *key, SkyValue *out);
+bool sky_table_delete(SkyTable *table, SkyString *key);
 void sky_table_copy(SkyTable *from, SkyTable *to);
 
+/* Weak set of interned strings, looked up by content. Entries do not keep
+ * their strings alive; the collector prunes dead ones before sweeping. */
+typedef struct {
+    SkyString **entries;   /* NULL empty, SKY_STRING_SET_TOMBSTONE removed */
+    int         count;     /* live entries plus tombstones */
+    int         capacity;
+} SkyStringSet;
+
+#define SKY_STRING_SET_TOMBSTONE ((SkyString*)(uintptr_t)1)
+
+void       sky_string_set_init(SkyStringSet *set);
+void       sky_string_set_free(SkyStringSet *set);
+SkyString* sky_string_set_find(SkyStringSet *set, const char *chars, int length, uint32_t hash);
+void       sky_string_set_add(SkyStringSet *set, SkyString *str);
+void       sky_string_set_remove_unmarked(SkyStringSet *set);
+
 #endif
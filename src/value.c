@@ -1,5 +1,6 @@
 ﻿/* value.c — Value operations implementation */
 #include "value.h"
+#include "gc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,28 +25,110 @@ void sky_value_array_free(SkyValueArray *arr) {
     sky_value_array_init(arr);
 }
 
+uint32_t sky_hash_chars(const char *chars, int length) {
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < length; i++) {
+        h ^= (uint8_t)chars[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static SkyString* string_init(SkyString *str, const char *chars, int length, uint32_t hash) {
+    str->length = length;
+    str->hash = hash;
+    if (length > 0) memcpy(str->chars, chars, (size_t)length);
+    str->chars[length] = '\0';
+    return str;
+}
+
+/* A string in the running VM's heap (static when none is running). */
+SkyString* sky_string_copy(const char *chars, int length) {
+    SkyString *str = (SkyString*)sky_gc_alloc(sizeof(SkyString) + (size_t)length + 1, VAL_STRING);
+    return string_init(str, chars, length, 0);
+}
+
+/* The running heap's canonical copy of a string, for keys that are looked
+ * up again and again. Values are not interned: most runtime strings are
+ * unique and would only pay for the set insert and the prune. */
+SkyString* sky_string_intern(const char *chars, int length) {
+    uint32_t hash = sky_hash_chars(chars, length);
+    SkyHeap *heap = sky_gc_current();
+    SkyString *str;
+    if (!heap) return sky_string_copy(chars, length);
+    str = sky_string_set_find(&heap->strings, chars, length, hash);
+    if (str) return str;
+    str = (SkyString*)sky_gc_alloc(sizeof(SkyString) + (size_t)length + 1, VAL_STRING);
+    string_init(str, chars, length, hash);
+    sky_string_set_add(&heap->strings, str);
+    return str;
+}
+
+/* A string owned by a chunk's constant pool; never collected. */
+SkyString* sky_string_static(const char *chars, int length) {
+    SkyString *str = (SkyString*)malloc(sizeof(SkyString) + (size_t)length + 1);
+    sky_obj_init_static(&str->obj, VAL_STRING);
+    return string_init(str, chars, length, sky_hash_chars(chars, length));
+}
+
+SkyValue sky_string_concat(SkyValue a, SkyValue b) {
+    SkyString *sa = AS_STRING_OBJ(a);
+    SkyString *sb = AS_STRING_OBJ(b);
+    SkyString *result;
+    /* The operands may already be off the stack */
+    sky_gc_push_root(a);
+    sky_gc_push_root(b);
+    result = (SkyString*)sky_gc_alloc(sizeof(SkyString) + (size_t)sa->length + sb->length + 1,
+                                      VAL_STRING);
+    sky_gc_pop_root();
+    sky_gc_pop_root();
+    result->length = sa->length + sb->length;
+    memcpy(result->chars, sa->chars, (size_t)sa->length);
+    memcpy(result->chars + sa->length, sb->chars, (size_t)sb->length + 1);
+    result->hash = 0;
+    return SKY_STRING(result);
+}
+
+SkyArray* sky_array_new(int capacity) {
+    SkyArray *arr = (SkyArray*)sky_gc_alloc(sizeof(SkyArray), VAL_ARRAY);
+    arr->count = 0;
+    arr->capacity = capacity > 0 ? capacity : 4;
+    arr->items = (SkyValue*)malloc(sizeof(SkyValue) * arr->capacity);
+    sky_gc_account((ptrdiff_t)(sizeof(SkyValue) * arr->capacity));
+    return arr;
+}
+
+#ifdef SKY_NAN_BOXING
+SkyValue sky_box_int(int64_t v) {
+    SkyBoxedInt *box = (SkyBoxedInt*)sky_gc_alloc(sizeof(SkyBoxedInt), VAL_INT);
+    box->value = v;
+    return SKY_OBJECT(box);
+}
+#endif
+
 bool sky_values_equal(SkyValue a, SkyValue b) {
-    if (a.type != b.type) return false;
-    switch (a.type) {
+    if (SKY_TYPE(a) != SKY_TYPE(b)) return false;
+    switch (SKY_TYPE(a)) {
         case VAL_NIL: return true;
-        case VAL_BOOL: return a.as.boolean == b.as.boolean;
-        case VAL_INT: return a.as.integer == b.as.integer;
-        case VAL_FLOAT: return a.as.floating == b.as.floating;
+        case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_INT: return AS_INT(a) == AS_INT(b);
+        case VAL_FLOAT: return AS_FLOAT(a) == AS_FLOAT(b);
         case VAL_STRING:
-            if (!a.as.string && !b.as.string) return true;
-            if (!a.as.string || !b.as.string) return false;
-            return strcmp(a.as.string, b.as.string) == 0;
-        default: return false;
+            return sky_strings_equal(AS_STRING_OBJ(a), AS_STRING_OBJ(b));
+        case VAL_NATIVE_FN: return AS_NATIVE_FN(a) == AS_NATIVE_FN(b);
+        /* Arrays, maps, functions, classes and instances: the same object */
+        default: return AS_OBJECT(a) == AS_OBJECT(b);
     }
 }
 
 void sky_print_value(SkyValue value) {
-    switch (value.type) {
+    switch (SKY_TYPE(value)) {
         case VAL_NIL: printf("nil"); break;
-        case VAL_BOOL: printf("%s", value.as.boolean ? "true" : "false"); break;
-        case VAL_INT: printf("%lld", (long long)value.as.integer); break;
-        case VAL_FLOAT: printf("%g", value.as.floating); break;
-        case VAL_STRING: printf("%s", value.as.string ? value.as.string : ""); break;
+        case VAL_BOOL: printf("%s", AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_INT: printf("%lld", (long long)AS_INT(value)); break;
+        case VAL_FLOAT: printf("%g", AS_FLOAT(value)); break;
+        case VAL_STRING: printf("%s", AS_STRING(value)); break;
         case VAL_ARRAY: printf("[array]"); break;
         case VAL_MAP: printf("{map}"); break;
         case VAL_FUNCTION: printf("<fn>"); break;
@@ -57,15 +140,13 @@ void sky_print_value(SkyValue value) {
 }
 
 SkyValue sky_value_copy(SkyValue value) {
-    SkyValue copy = value;
-    if (value.type == VAL_STRING && value.as.string) {
-        size_t len = strlen(value.as.string);
-        copy.as.string = (char*)malloc(len + 1);
-        memcpy(copy.as.string, value.as.string, len + 1);
+    if (IS_STRING(value)) {
+        return SKY_STRING(sky_string_copy(AS_STRING(value), AS_STRING_OBJ(value)->length));
     }
-    return copy;
+    return value;
 }
 
+/* Heap values are reclaimed by the collector (gc.c) */
 void sky_value_free(SkyValue *value) {
     (void)value;
 }
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 typedef enum {
     VAL_NIL,
@@ -20,27 +21,207 @@ typedef enum {
     VAL_INSTANCE
 } SkyValueType;
 
+/* Common header of every heap object (strings, arrays, functions, boxed
+ * ints). Collectable objects are linked into their VM heap's object list;
+ * static ones belong to a chunk and are never traced or swept (gc.h). */
+#define SKY_OBJ_STATIC   0x01
+#define SKY_OBJ_INTERNED 0x02   /* static string owned by a chunk's intern set */
+
+typedef struct SkyObj {
+    SkyValueType   type;
+    uint8_t        marked;
+    uint8_t        flags;
+    struct SkyObj *next;
+} SkyObj;
+
+typedef struct {
+    SkyObj   obj;
+    int      length;
+    uint32_t hash;      /* FNV-1a of chars, 0 until first needed */
+    char     chars[];
+} SkyString;
+
+#ifdef SKY_NAN_BOXING
+typedef uint64_t SkyValue;
+#else
 typedef struct SkyValue SkyValue;
+#endif
 
 typedef SkyValue (*SkyNativeFn)(int arg_count, SkyValue *args);
 
+typedef struct {
+    SkyObj    obj;
+    SkyValue *items;
+    int       count;
+    int       capacity;
+} SkyArray;
+
+#ifndef SKY_NAN_BOXING
+
+/* Tagged struct: 16 bytes, every payload inline. */
 struct SkyValue {
     SkyValueType type;
     union {
-        bool       boolean;
-        int64_t    integer;
-        double     floating;
-        char      *string;
-        struct {
-            SkyValue *items;
-            int       count;
-            int       capacity;
-        } array;
-        void      *object;
+        bool        boolean;
+        int64_t     integer;
+        double      floating;
+        SkyString  *string;
+        SkyArray   *array;
+        void       *object;
         SkyNativeFn native_fn;
     } as;
 };
 
+#define SKY_NIL()          ((SkyValue){VAL_NIL,       {.integer = 0}})
+#define SKY_BOOL(v)        ((SkyValue){VAL_BOOL,      {.boolean = (v)}})
+#define SKY_INT(v)         ((SkyValue){VAL_INT,       {.integer = (v)}})
+#define SKY_FLOAT(v)       ((SkyValue){VAL_FLOAT,     {.floating = (v)}})
+#define SKY_STRING(v)      ((SkyValue){VAL_STRING,    {.string = (SkyString*)(v)}})
+#define SKY_ARRAY(v)       ((SkyValue){VAL_ARRAY,     {.array = (v)}})
+#define SKY_NATIVE_FN(v)   ((SkyValue){VAL_NATIVE_FN, {.native_fn = (v)}})
+#define SKY_OBJECT(v)      ((SkyValue){((SkyObj*)(v))->type, {.object = (v)}})
+
+#define SKY_TYPE(v)        ((v).type)
+#define AS_BOOL(v)         ((v).as.boolean)
+#define AS_INT(v)          ((v).as.integer)
+#define AS_FLOAT(v)        ((v).as.floating)
+#define AS_STRING_OBJ(v)   ((v).as.string)
+#define AS_STRING(v)       ((v).as.string->chars)
+#define AS_ARRAY(v)        ((v).as.array)
+#define AS_NATIVE_FN(v)    ((v).as.native_fn)
+#define AS_OBJECT(v)       ((v).as.object)
+
+#define IS_NIL(v)          ((v).type == VAL_NIL)
+#define IS_BOOL(v)         ((v).type == VAL_BOOL)
+#define IS_INT(v)          ((v).type == VAL_INT)
+#define IS_FLOAT(v)        ((v).type == VAL_FLOAT)
+#define IS_STRING(v)       ((v).type == VAL_STRING)
+#define IS_ARRAY(v)        ((v).type == VAL_ARRAY)
+#define IS_NATIVE_FN(v)    ((v).type == VAL_NATIVE_FN)
+#define IS_FUNCTION(v)     ((v).type == VAL_FUNCTION)
+
+#else
+
+/* NaN-boxed: 8 bytes. Doubles are stored as themselves; everything else
+ * lives in the payload of a quiet NaN that arithmetic never produces
+ * (bit 50 set). The sign bit and bits 48-49 form a 3-bit tag, leaving a
+ * 48-bit payload for pointers and small integers. Integers outside the
+ * 48-bit range are boxed on the heap so int64 semantics are unchanged. */
+#define SKY_QNAN           ((uint64_t)0x7ffc000000000000)
+#define SKY_SIGN_BIT       ((uint64_t)0x8000000000000000)
+#define SKY_TAG_MASK       (SKY_SIGN_BIT | SKY_QNAN | ((uint64_t)3 << 48))
+#define SKY_PAYLOAD_MASK   ((uint64_t)0x0000ffffffffffff)
+#define SKY_TAG(t)         ((((t) & 4) ? SKY_SIGN_BIT : 0) | SKY_QNAN | ((uint64_t)((t) & 3) << 48))
+
+#define SKY_TAG_SPECIAL    SKY_TAG(1)
+#define SKY_TAG_INT        SKY_TAG(2)
+#define SKY_TAG_STRING     SKY_TAG(3)
+#define SKY_TAG_ARRAY      SKY_TAG(5)
+#define SKY_TAG_NATIVE     SKY_TAG(6)
+#define SKY_TAG_OBJECT     SKY_TAG(7)
+
+#define SKY_NIL_BITS       (SKY_TAG_SPECIAL | 1)
+#define SKY_FALSE_BITS     (SKY_TAG_SPECIAL | 2)
+#define SKY_TRUE_BITS      (SKY_TAG_SPECIAL | 3)
+
+#define SKY_INT_MIN_INLINE (-((int64_t)1 << 47))
+#define SKY_INT_MAX_INLINE (((int64_t)1 << 47) - 1)
+
+typedef struct {
+    SkyObj  obj;
+    int64_t value;
+} SkyBoxedInt;
+
+SkyValue sky_box_int(int64_t v);
+
+static inline SkyValue sky_nan_int(int64_t v) {
+    if (v < SKY_INT_MIN_INLINE || v > SKY_INT_MAX_INLINE) return sky_box_int(v);
+    return SKY_TAG_INT | ((uint64_t)v & SKY_PAYLOAD_MASK);
+}
+
+static inline SkyValue sky_nan_float(double d) {
+    SkyValue v;
+    memcpy(&v, &d, sizeof(v));
+    /* A NaN that happens to look like a boxed value becomes the canonical NaN */
+    if ((v & SKY_QNAN) == SKY_QNAN) v = (uint64_t)0x7ff8000000000000;
+    return v;
+}
+
+static inline double sky_nan_as_float(SkyValue v) {
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline void* sky_nan_as_pointer(SkyValue v) {
+    return (void*)(uintptr_t)(v & SKY_PAYLOAD_MASK);
+}
+
+static inline int64_t sky_nan_as_int(SkyValue v) {
+    if ((v & SKY_TAG_MASK) == SKY_TAG_INT) {
+        /* Sign-extend the 48-bit payload */
+        return (int64_t)(v << 16) >> 16;
+    }
+    return ((SkyBoxedInt*)sky_nan_as_pointer(v))->value;
+}
+
+static inline bool sky_nan_is_int(SkyValue v) {
+    uint64_t tag = v & SKY_TAG_MASK;
+    if (tag == SKY_TAG_INT) return true;
+    return tag == SKY_TAG_OBJECT && ((SkyObj*)sky_nan_as_pointer(v))->type == VAL_INT;
+}
+
+static inline bool sky_nan_is_obj_type(SkyValue v, SkyValueType type) {
+    return (v & SKY_TAG_MASK) == SKY_TAG_OBJECT &&
+           ((SkyObj*)sky_nan_as_pointer(v))->type == type;
+}
+
+static inline SkyValueType sky_nan_type(SkyValue v) {
+    if ((v & SKY_QNAN) != SKY_QNAN) return VAL_FLOAT;
+    switch (v & SKY_TAG_MASK) {
+        case SKY_TAG_SPECIAL: return v == SKY_NIL_BITS ? VAL_NIL : VAL_BOOL;
+        case SKY_TAG_INT:     return VAL_INT;
+        case SKY_TAG_STRING:  return VAL_STRING;
+        case SKY_TAG_ARRAY:   return VAL_ARRAY;
+        case SKY_TAG_NATIVE:  return VAL_NATIVE_FN;
+        case SKY_TAG_OBJECT:  return ((SkyObj*)sky_nan_as_pointer(v))->type;
+        default:              return VAL_FLOAT;
+    }
+}
+
+#define SKY_NIL()          ((SkyValue)SKY_NIL_BITS)
+#define SKY_BOOL(v)        ((v) ? (SkyValue)SKY_TRUE_BITS : (SkyValue)SKY_FALSE_BITS)
+#define SKY_INT(v)         sky_nan_int((int64_t)(v))
+#define SKY_FLOAT(v)       sky_nan_float((double)(v))
+#define SKY_STRING(v)      ((SkyValue)(SKY_TAG_STRING | (uint64_t)(uintptr_t)(v)))
+#define SKY_ARRAY(v)       ((SkyValue)(SKY_TAG_ARRAY | (uint64_t)(uintptr_t)(v)))
+#define SKY_NATIVE_FN(v)   ((SkyValue)(SKY_TAG_NATIVE | (uint64_t)(uintptr_t)(v)))
+#define SKY_OBJECT(v)      ((SkyValue)(SKY_TAG_OBJECT | (uint64_t)(uintptr_t)(v)))
+
+#define SKY_TYPE(v)        sky_nan_type(v)
+#define AS_BOOL(v)         ((v) == SKY_TRUE_BITS)
+#define AS_INT(v)          sky_nan_as_int(v)
+#define AS_FLOAT(v)        sky_nan_as_float(v)
+#define AS_STRING_OBJ(v)   ((SkyString*)sky_nan_as_pointer(v))
+#define AS_STRING(v)       (AS_STRING_OBJ(v)->chars)
+#define AS_ARRAY(v)        ((SkyArray*)sky_nan_as_pointer(v))
+#define AS_NATIVE_FN(v)    ((SkyNativeFn)(uintptr_t)((v) & SKY_PAYLOAD_MASK))
+#define AS_OBJECT(v)       sky_nan_as_pointer(v)
+
+#define IS_NIL(v)          ((v) == SKY_NIL_BITS)
+#define IS_BOOL(v)         (((v) | 1) == SKY_TRUE_BITS)
+#define IS_INT(v)          sky_nan_is_int(v)
+#define IS_FLOAT(v)        (((v) & SKY_QNAN) != SKY_QNAN)
+#define IS_STRING(v)       (((v) & SKY_TAG_MASK) == SKY_TAG_STRING)
+#define IS_ARRAY(v)        (((v) & SKY_TAG_MASK) == SKY_TAG_ARRAY)
+#define IS_NATIVE_FN(v)    (((v) & SKY_TAG_MASK) == SKY_TAG_NATIVE)
+#define IS_FUNCTION(v)     sky_nan_is_obj_type(v, VAL_FUNCTION)
+
+#endif /* SKY_NAN_BOXING */
+
+/* Int arithmetic wraps on overflow, in the VM as in generated C (aot.c) */
+#define SKY_WRAP(a, op, b) ((int64_t)((uint64_t)(a) op (uint64_t)(b)))
+
 typedef struct {
     SkyValue *values;
     int       count;
@@ -51,17 +232,29 @@ void sky_value_array_init(SkyValueArray *arr);
 void sky_value_array_write(SkyValueArray *arr, SkyValue value);
 void sky_value_array_free(SkyValueArray *arr);
 
-#define SKY_NIL()        ((SkyValue){VAL_NIL,    {.integer = 0}})
-#define SKY_BOOL(v)      ((SkyValue){VAL_BOOL,   {.boolean = (v)}})
-#define SKY_INT(v)       ((SkyValue){VAL_INT,    {.integer = (v)}})
-#define SKY_FLOAT(v)     ((SkyValue){VAL_FLOAT,  {.floating = (v)}})
-#define SKY_STRING(v)    ((SkyValue){VAL_STRING, {.string = (char*)(v)}})
-
-#define IS_NIL(v)    ((v).type == VAL_NIL)
-#define IS_BOOL(v)   ((v).type == VAL_BOOL)
-#define IS_INT(v)    ((v).type == VAL_INT)
-#define IS_FLOAT(v)  ((v).type == VAL_FLOAT)
-#define IS_STRING(v) ((v).type == VAL_STRING)
+uint32_t   sky_hash_chars(const char *chars, int length);
+SkyString* sky_string_copy(const char *chars, int length);
+SkyString* sky_string_static(const char *chars, int length);
+SkyString* sky_string_intern(const char *chars, int length);
+SkyValue   sky_string_concat(SkyValue a, SkyValue b);
+SkyArray*  sky_array_new(int capacity);
+
+/* Hashing is deferred to the first table or intern lookup, so strings
+ * that are only printed or concatenated never pay for it. A string whose
+ * hash really is 0 is simply rehashed each time. */
+static inline uint32_t sky_string_hash(SkyString *str) {
+    if (str->hash == 0) str->hash = sky_hash_chars(str->chars, str->length);
+    return str->hash;
+}
+
+/* Interned copies compare by address; a cached hash on both sides
+ * rejects almost every other mismatch before the characters are touched. */
+static inline bool sky_strings_equal(const SkyString *a, const SkyString *b) {
+    if (a == b) return true;
+    if (a->length != b->length) return false;
+    if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+    return memcmp(a->chars, b->chars, (size_t)a->length) == 0;
+}
 
 bool sky_values_equal(SkyValue a, SkyValue b);
 void sky_print_value(SkyValue value);
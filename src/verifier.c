@@ -0,0 +1,363 @@
+﻿/* verifier.c — Bytecode verifier */
+#include "verifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    SkyChunk *chunk;
+    int       global_count;   /* slots bound by the VM for this program */
+    int      *depth;          /* stack depth on entry, -1 if not reached */
+    int      *worklist;
+    int       work_count;
+    int       max_depth;
+    char     *error;
+    size_t    error_size;
+} Verifier;
+
+static bool fail(Verifier *v, int offset, const char *message) {
+    snprintf(v->error, v->error_size, "%s at offset %04d", message, offset);
+    return false;
+}
+
+static bool is_branch(uint8_t op) {
+    switch (op) {
+        case OP_JUMP_IF_FALSE:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_AND_JUMP:
+        case OP_OR_JUMP:
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP:
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Values an instruction needs on the stack and values it leaves in their
+ * place. Mirrors the handlers in vm_loop.h. */
+static void stack_effect(const uint8_t *code, int offset, int *pops, int *pushes) {
+    uint8_t op = code[offset];
+    int n = sky_opcode_length(op) > 1 ? code[offset + 1] : 0;
+    *pops = 0;
+    *pushes = 0;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_AND_JUMP:      /* fall-through edge; see verify_code */
+        case OP_OR_JUMP:
+            *pops = 1;
+            break;
+        case OP_DUP:
+            *pops = 1; *pushes = 2;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_GET_FIELD:
+        case OP_GET_FIELD_LONG:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_TO_BOOL:
+        case OP_JUMP_IF_FALSE:
+            *pops = 1; *pushes = 1;
+            break;
+        case OP_SET_FIELD:
+        case OP_SET_FIELD_LONG:
+        case OP_GET_INDEX:
+        case OP_GET_INDEX_UNCHECKED:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_EQUAL: case OP_NOT_EQUAL:
+        case OP_GREATER: case OP_GREATER_EQ: case OP_LESS: case OP_LESS_EQ:
+        case OP_AND: case OP_OR:
+        case OP_ADD_INT_INT: case OP_ADD_FLOAT_FLOAT:
+        case OP_SUB_INT_INT: case OP_SUB_FLOAT_FLOAT:
+        case OP_MUL_INT_INT: case OP_MUL_FLOAT_FLOAT:
+        case OP_LESS_INT_INT: case OP_LESS_FLOAT_FLOAT:
+        case OP_LESS_EQ_INT_INT: case OP_LESS_EQ_FLOAT_FLOAT:
+        case OP_GREATER_INT_INT: case OP_GREATER_FLOAT_FLOAT:
+        case OP_GREATER_EQ_INT_INT: case OP_GREATER_EQ_FLOAT_FLOAT:
+            *pops = 2; *pushes = 1;
+            break;
+        case OP_SET_INDEX:
+            *pops = 3; *pushes = 1;
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_LESS_EQ_JUMP_IF_FALSE:
+        case OP_GREATER_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_JUMP_IF_FALSE:
+        case OP_EQUAL_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_JUMP_IF_FALSE:
+            *pops = 2;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            *pops = n + 1; *pushes = 1;
+            break;
+        case OP_ARRAY:
+            *pops = n; *pushes = 1;
+            break;
+        case OP_MAP:
+            *pops = 2 * n; *pushes = 1;
+            break;
+        case OP_CLASS:
+            *pops = n + 1; *pushes = 1;
+            break;
+        case OP_METHOD:
+            *pops = 3; *pushes = 1;
+            break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+            *pops = n + 2; *pushes = 1;
+            break;
+        case OP_RETURN:
+            *pops = 1;
+            break;
+        default:
+            /* NOP, jumps, INC_LOCAL, the register forms, HALT and the
+             * reserved opcodes the VM treats as no-ops */
+            break;
+    }
+}
+
+static bool reach(Verifier *v, int from, int target, int depth) {
+    if (target < 0 || target >= v->chunk->code_count) {
+        return fail(v, from, "Jump outside the chunk");
+    }
+    if (v->depth[target] < 0) {
+        v->depth[target] = depth;
+        v->worklist[v->work_count++] = target;
+    } else if (v->depth[target] != depth) {
+        return fail(v, target, "Inconsistent stack depth");
+    }
+    return true;
+}
+
+static int long_operand(const uint8_t *code, int offset) {
+    return (code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3];
+}
+
+/* Operand indices: constants, locals below the current depth, global slots. */
+static bool check_operands(Verifier *v, int offset, int depth) {
+    const uint8_t *code = v->chunk->code;
+    int constants = v->chunk->constants.count;
+    switch (code[offset]) {
+        case OP_CONSTANT:
+            if (code[offset + 1] >= constants) return fail(v, offset, "Constant index out of range");
+            break;
+        case OP_CONSTANT_LONG:
+            if (long_operand(code, offset) >= constants) return fail(v, offset, "Constant index out of range");
+            break;
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+        case OP_GET_FIELD_LONG:
+        case OP_SET_FIELD_LONG: {
+            bool wide = code[offset] == OP_GET_FIELD_LONG || code[offset] == OP_SET_FIELD_LONG;
+            int idx = wide ? long_operand(code, offset) : code[offset + 1];
+            if (idx >= constants || !IS_STRING(v->chunk->constants.values[idx])) {
+                return fail(v, offset, "Field name must be a string constant");
+            }
+            break;
+        }
+        case OP_INVOKE:
+        case OP_INVOKE_LONG: {
+            /* The name follows the argument count */
+            int idx = code[offset] == OP_INVOKE_LONG ? long_operand(code, offset + 1) : code[offset + 2];
+            if (idx >= constants || !IS_STRING(v->chunk->constants.values[idx])) {
+                return fail(v, offset, "Method name must be a string constant");
+            }
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG: {
+            bool wide = code[offset] == OP_GET_GLOBAL_LONG || code[offset] == OP_SET_GLOBAL_LONG;
+            int idx = wide ? long_operand(code, offset) : code[offset + 1];
+            if (idx >= constants || !IS_STRING(v->chunk->constants.values[idx])) {
+                return fail(v, offset, "Global name must be a string constant");
+            }
+            break;
+        }
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+            if (code[offset + 1] >= v->global_count) return fail(v, offset, "Global slot out of range");
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            if (code[offset + 1] >= depth) return fail(v, offset, "Local slot out of range");
+            break;
+        case OP_INC_LOCAL:
+            if (code[offset + 1] >= depth) return fail(v, offset, "Local slot out of range");
+            if (code[offset + 2] >= constants) return fail(v, offset, "Constant index out of range");
+            break;
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE_LOOP:
+            /* The loop variable and the bound above it */
+            if (code[offset + 1] + 1 >= depth) return fail(v, offset, "Local slot out of range");
+            break;
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+        case OP_MOVE:
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+            if (code[offset + 1] >= depth || code[offset + 2] >= depth) {
+                return fail(v, offset, "Local slot out of range");
+            }
+            break;
+        case OP_LOAD_CONST:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQ_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQ_RK_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            if (code[offset + 1] >= depth) return fail(v, offset, "Local slot out of range");
+            if (code[offset + 2] >= constants) return fail(v, offset, "Constant index out of range");
+            break;
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+            if (code[offset + 1] >= depth || code[offset + 2] >= depth || code[offset + 3] >= depth) {
+                return fail(v, offset, "Local slot out of range");
+            }
+            break;
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK:
+            if (code[offset + 1] >= depth || code[offset + 2] >= depth) {
+                return fail(v, offset, "Local slot out of range");
+            }
+            if (code[offset + 3] >= constants) return fail(v, offset, "Constant index out of range");
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+static bool verify_code(Verifier *v, int base_depth) {
+    SkyChunk *chunk = v->chunk;
+    const uint8_t *code = chunk->code;
+    int n = chunk->code_count;
+    int offset, i;
+
+    if (n == 0) return true;
+    v->depth[0] = base_depth;
+    v->worklist[v->work_count++] = 0;
+    v->max_depth = base_depth;
+
+    while (v->work_count > 0) {
+        int depth, pops, pushes, length, after;
+        uint8_t op;
+        offset = v->worklist[--v->work_count];
+        depth = v->depth[offset];
+        op = code[offset];
+        if (op >= OP_COUNT) return fail(v, offset, "Unknown opcode");
+        length = sky_opcode_length(op);
+        if (offset + length > n) return fail(v, offset, "Truncated instruction");
+        if (!check_operands(v, offset, depth)) return false;
+
+        stack_effect(code, offset, &pops, &pushes);
+        if (depth - pops < base_depth) return fail(v, offset, "Stack underflow");
+        after = depth - pops + pushes;
+        if (after > v->max_depth) v->max_depth = after;
+
+        if (op == OP_RETURN || op == OP_HALT) continue;
+        if (op == OP_JUMP || op == OP_JUMP_BACK || is_branch(op)) {
+            int distance = (code[offset + length - 2] << 8) | code[offset + length - 1];
+            bool back = op == OP_JUMP_BACK || op == OP_FOR_RANGE_LOOP;
+            int target = back ? offset + length - distance : offset + length + distance;
+            /* AND_JUMP / OR_JUMP leave their operand in place when taken */
+            int taken = op == OP_AND_JUMP || op == OP_OR_JUMP ? depth : after;
+            if (!reach(v, offset, target, taken)) return false;
+            if (!is_branch(op)) continue;
+        }
+        if (offset + length >= n) return fail(v, offset, "Execution falls off the end of the chunk");
+        if (!reach(v, offset, offset + length, after)) return false;
+    }
+
+    /* A jump into the middle of another instruction shows up as an
+     * operand byte that was also decoded as an opcode. */
+    for (offset = 0; offset < n; offset++) {
+        if (v->depth[offset] < 0) continue;
+        for (i = 1; i < sky_opcode_length(code[offset]); i++) {
+            if (offset + i < n && v->depth[offset + i] >= 0) {
+                return fail(v, offset + i, "Jump into the middle of an instruction");
+            }
+        }
+    }
+    return true;
+}
+
+static bool verify(SkyChunk *chunk, int base_depth, int global_count,
+                   char *error, size_t error_size) {
+    Verifier v;
+    bool ok;
+    int i;
+
+    memset(&v, 0, sizeof(v));
+    v.chunk = chunk;
+    v.global_count = global_count;
+    v.error = error;
+    v.error_size = error_size;
+    v.depth = (int*)malloc(sizeof(int) * (chunk->code_count + 1));
+    v.worklist = (int*)malloc(sizeof(int) * (chunk->code_count + 1));
+    for (i = 0; i < chunk->code_count; i++) v.depth[i] = -1;
+
+    ok = verify_code(&v, base_depth);
+    chunk->max_stack = v.max_depth;
+    free(v.depth);
+    free(v.worklist);
+    if (!ok) return false;
+
+    for (i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            SkyFunction *fn = AS_FUNCTION(chunk->constants.values[i]);
+            /* Frames start with the callee and its arguments in place */
+            if (!verify(&fn->chunk, fn->arity + 1, global_count, error, error_size)) return false;
+        }
+    }
+    chunk->verified = true;
+    return true;
+}
+
+bool sky_verify_chunk(SkyChunk *chunk, char *error, size_t error_size) {
+    if (!chunk) return false;
+    return verify(chunk, 0, chunk->global_count, error, error_size);
+}
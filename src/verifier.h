@@ -0,0 +1,17 @@
+﻿/* verifier.h — Bytecode verifier */
+#ifndef SKY_VERIFIER_H
+#define SKY_VERIFIER_H
+
+#include "bytecode.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Checks that every reachable instruction decodes, that jumps land on
+ * instruction boundaries, that operand indices are in range and that the
+ * stack depth is the same on every path into an instruction. Fills in
+ * max_stack for the chunk and every function chunk it contains, which
+ * lets the VM use unchecked pushes and pops. On failure writes a message
+ * to `error` and returns false. */
+bool sky_verify_chunk(SkyChunk *chunk, char *error, size_t error_size);
+
+#endif
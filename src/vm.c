@@ -1,10 +1,15 @@
 ﻿/* vm.c — Virtual machine implementation */
 #include "vm.h"
 #include "debug.h"
+#include "verifier.h"
+#include "jit.h"
+#include "map.h"
+#include "class.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 static void runtime_error(SkyVM *vm, const char *format, ...) {
     va_list args;
@@ -21,12 +26,13 @@ static SkyValue native_print(int arg_count, SkyValue *args) {
     int i;
     for (i = 0; i < arg_count; i++) {
         if (i > 0) printf(" ");
-        switch (args[i].type) {
+        switch (SKY_TYPE(args[i])) {
             case VAL_NIL: printf("nil"); break;
-            case VAL_BOOL: printf("%s", args[i].as.boolean ? "true" : "false"); break;
-            case VAL_INT: printf("%lld", (long long)args[i].as.integer); break;
-            case VAL_FLOAT: printf("%g", args[i].as.floating); break;
-            case VAL_STRING: printf("%s", args[i].as.string ? args[i].as.string : ""); break;
+            case VAL_BOOL: printf("%s", AS_BOOL(args[i]) ? "true" : "false"); break;
+            case VAL_INT: printf("%lld", (long long)AS_INT(args[i])); break;
+            case VAL_FLOAT: printf("%g", AS_FLOAT(args[i])); break;
+            case VAL_STRING: printf("%s", AS_STRING(args[i])); break;
+            case VAL_FUNCTION: printf("<fn %s>", AS_FUNCTION(args[i])->name); break;
             default: printf("<object>"); break;
         }
     }
@@ -37,59 +43,336 @@ static SkyValue native_print(int arg_count, SkyValue *args) {
 /* Native: str (convert to string) */
 static SkyValue native_str(int arg_count, SkyValue *args) {
     char buf[256];
-    if (arg_count < 1) return SKY_STRING("");
-    switch (args[0].type) {
-        case VAL_INT: snprintf(buf, sizeof(buf), "%lld", (long long)args[0].as.integer); break;
-        case VAL_FLOAT: snprintf(buf, sizeof(buf), "%g", args[0].as.floating); break;
-        case VAL_BOOL: snprintf(buf, sizeof(buf), "%s", args[0].as.boolean ? "true" : "false"); break;
+    if (arg_count < 1) return SKY_STRING(sky_string_copy("", 0));
+    switch (SKY_TYPE(args[0])) {
+        case VAL_INT: snprintf(buf, sizeof(buf), "%lld", (long long)AS_INT(args[0])); break;
+        case VAL_FLOAT: snprintf(buf, sizeof(buf), "%g", AS_FLOAT(args[0])); break;
+        case VAL_BOOL: snprintf(buf, sizeof(buf), "%s", AS_BOOL(args[0]) ? "true" : "false"); break;
         case VAL_NIL: snprintf(buf, sizeof(buf), "nil"); break;
         case VAL_STRING: return args[0];
+        case VAL_FUNCTION: snprintf(buf, sizeof(buf), "<fn %s>", AS_FUNCTION(args[0])->name); break;
+        case VAL_CLASS:
+            snprintf(buf, sizeof(buf), "<class %s>", AS_CLASS(args[0])->name->chars);
+            break;
+        case VAL_INSTANCE:
+            snprintf(buf, sizeof(buf), "<%s instance>", AS_INSTANCE(args[0])->klass->name->chars);
+            break;
         default: snprintf(buf, sizeof(buf), "<object>"); break;
     }
-    {
-        size_t len = strlen(buf);
-        char *s = (char*)malloc(len + 1);
-        memcpy(s, buf, len + 1);
-        return SKY_STRING(s);
-    }
+    return SKY_STRING(sky_string_copy(buf, (int)strlen(buf)));
+}
+
+/* Native: clock (CPU seconds, for benchmarks) */
+static SkyValue native_clock(int arg_count, SkyValue *args) {
+    (void)arg_count;
+    (void)args;
+    return SKY_FLOAT((double)clock() / CLOCKS_PER_SEC);
 }
 
 /* Native: len */
 static SkyValue native_len(int arg_count, SkyValue *args) {
     if (arg_count < 1) return SKY_INT(0);
-    if (args[0].type == VAL_STRING && args[0].as.string) {
-        return SKY_INT((int64_t)strlen(args[0].as.string));
+    if (IS_STRING(args[0])) {
+        return SKY_INT((int64_t)AS_STRING_OBJ(args[0])->length);
+    }
+    if (IS_ARRAY(args[0])) {
+        return SKY_INT((int64_t)AS_ARRAY(args[0])->count);
     }
-    if (args[0].type == VAL_ARRAY) {
-        return SKY_INT((int64_t)args[0].as.array.count);
+    if (IS_MAP(args[0])) {
+        return SKY_INT((int64_t)AS_MAP(args[0])->count);
     }
     return SKY_INT(0);
 }
 
+/* Native: __native_array_push (stdlib/array.sky). Appends in place and
+ * returns the array, doubling the item buffer when it is full. */
+static SkyValue native_array_push(int arg_count, SkyValue *args) {
+    SkyArray *arr;
+    if (arg_count < 2 || !IS_ARRAY(args[0])) return SKY_NIL();
+    arr = AS_ARRAY(args[0]);
+    if (arr->count == arr->capacity) {
+        int capacity = arr->capacity < 4 ? 4 : arr->capacity * 2;
+        SkyValue *grown = (SkyValue*)realloc(arr->items, sizeof(SkyValue) * capacity);
+        if (!grown) {
+            fprintf(stderr, "[SKY] Out of memory growing an array\n");
+            exit(1);
+        }
+        sky_gc_account((ptrdiff_t)(sizeof(SkyValue) * (capacity - arr->capacity)));
+        arr->items = grown;
+        arr->capacity = capacity;
+    }
+    sky_gc_barrier(&arr->obj, args[1]);
+    arr->items[arr->count++] = args[1];
+    return args[0];
+}
+
+/* Native: __native_array_pop. The last item, or nil when empty. */
+static SkyValue native_array_pop(int arg_count, SkyValue *args) {
+    SkyArray *arr;
+    if (arg_count < 1 || !IS_ARRAY(args[0])) return SKY_NIL();
+    arr = AS_ARRAY(args[0]);
+    if (arr->count == 0) return SKY_NIL();
+    return arr->items[--arr->count];
+}
+
+/* Native: __native_map_delete. Whether the key was there. */
+static SkyValue native_map_delete(int arg_count, SkyValue *args) {
+    SkyString *key;
+    if (arg_count < 2 || !IS_MAP(args[0])) return SKY_BOOL(false);
+    key = sky_map_key(args[1]);
+    return SKY_BOOL(key != NULL && sky_map_delete(AS_MAP(args[0]), key));
+}
+
+/* Native: json. Maps keep their insertion order, so the same map always
+ * serializes the same way. Values JSON cannot hold, and containers nested
+ * deeper than JSON_MAX_DEPTH (cycles included), become null. */
+#define JSON_MAX_DEPTH 64
+
+typedef struct {
+    char *chars;
+    int   length;
+    int   capacity;
+} JsonBuffer;
+
+static void json_append(JsonBuffer *b, const char *chars, int length) {
+    if (b->length + length + 1 > b->capacity) {
+        int capacity = b->capacity < 64 ? 64 : b->capacity;
+        char *grown;
+        while (b->length + length + 1 > capacity) capacity *= 2;
+        grown = (char*)realloc(b->chars, (size_t)capacity);
+        if (!grown) {
+            fprintf(stderr, "[SKY] Out of memory in json()\n");
+            exit(1);
+        }
+        b->chars = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->chars + b->length, chars, (size_t)length);
+    b->length += length;
+}
+
+static void json_string(JsonBuffer *b, const SkyString *str) {
+    int i, start = 0;
+    json_append(b, "\"", 1);
+    for (i = 0; i < str->length; i++) {
+        unsigned char ch = (unsigned char)str->chars[i];
+        char escape[8];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        json_append(b, str->chars + start, i - start);
+        switch (ch) {
+            case '"':  json_append(b, "\\\"", 2); break;
+            case '\\': json_append(b, "\\\\", 2); break;
+            case '\n': json_append(b, "\\n", 2); break;
+            case '\r': json_append(b, "\\r", 2); break;
+            case '\t': json_append(b, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                json_append(b, escape, 6);
+                break;
+        }
+        start = i + 1;
+    }
+    json_append(b, str->chars + start, str->length - start);
+    json_append(b, "\"", 1);
+}
+
+static void json_value(JsonBuffer *b, SkyValue value, int depth) {
+    char number[32];
+    int i;
+    switch (SKY_TYPE(value)) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) json_append(b, "true", 4);
+            else json_append(b, "false", 5);
+            return;
+        case VAL_INT:
+            json_append(b, number, snprintf(number, sizeof(number), "%lld", (long long)AS_INT(value)));
+            return;
+        case VAL_FLOAT: {
+            double d = AS_FLOAT(value);
+            if (d != d || d - d != 0) break;   /* NaN and infinities */
+            /* Shortest of the two that reads back as the same double */
+            snprintf(number, sizeof(number), "%.15g", d);
+            if (strtod(number, NULL) != d) snprintf(number, sizeof(number), "%.17g", d);
+            json_append(b, number, (int)strlen(number));
+            return;
+        }
+        case VAL_STRING:
+            json_string(b, AS_STRING_OBJ(value));
+            return;
+        case VAL_ARRAY: {
+            SkyArray *arr = AS_ARRAY(value);
+            if (depth >= JSON_MAX_DEPTH) break;
+            json_append(b, "[", 1);
+            for (i = 0; i < arr->count; i++) {
+                if (i > 0) json_append(b, ",", 1);
+                json_value(b, arr->items[i], depth + 1);
+            }
+            json_append(b, "]", 1);
+            return;
+        }
+        case VAL_MAP: {
+            SkyMap *map = AS_MAP(value);
+            bool first = true;
+            if (depth >= JSON_MAX_DEPTH) break;
+            json_append(b, "{", 1);
+            for (i = 0; i < map->used; i++) {
+                if (!map->entries[i].key) continue;
+                if (!first) json_append(b, ",", 1);
+                first = false;
+                json_string(b, map->entries[i].key);
+                json_append(b, ":", 1);
+                json_value(b, map->entries[i].value, depth + 1);
+            }
+            json_append(b, "}", 1);
+            return;
+        }
+        case VAL_INSTANCE: {
+            /* Fields in slot order, declared ones first */
+            SkyInstance *instance = AS_INSTANCE(value);
+            if (depth >= JSON_MAX_DEPTH) break;
+            json_append(b, "{", 1);
+            for (i = 0; i < instance->shape->field_count; i++) {
+                if (i > 0) json_append(b, ",", 1);
+                json_string(b, instance->shape->names[i]);
+                json_append(b, ":", 1);
+                json_value(b, instance->fields[i], depth + 1);
+            }
+            json_append(b, "}", 1);
+            return;
+        }
+        default:
+            break;
+    }
+    json_append(b, "null", 4);
+}
+
+static SkyValue native_json(int arg_count, SkyValue *args) {
+    JsonBuffer b = {NULL, 0, 0};
+    SkyString *str;
+    json_value(&b, arg_count < 1 ? SKY_NIL() : args[0], 0);
+    str = sky_string_copy(b.chars, b.length);
+    free(b.chars);
+    return SKY_STRING(str);
+}
+
 void sky_vm_init(SkyVM *vm) {
     if (!vm) return;
     memset(vm, 0, sizeof(SkyVM));
+    vm->stack = (SkyValue*)malloc(sizeof(SkyValue) * SKY_STACK_INITIAL);
+    vm->stack_capacity = vm->stack ? SKY_STACK_INITIAL : 0;
+    vm->stack_limit = SKY_STACK_LIMIT_DEFAULT;
     vm->stack_top = vm->stack;
+    vm->frames = (SkyCallFrame*)malloc(sizeof(SkyCallFrame) * SKY_FRAMES_INITIAL);
+    vm->frame_capacity = vm->frames ? SKY_FRAMES_INITIAL : 0;
+    vm->frame_limit = SKY_FRAMES_LIMIT_DEFAULT;
     vm->frame_count = 0;
     sky_table_init(&vm->globals);
-    sky_table_init(&vm->strings);
+    sky_table_init(&vm->saved_globals);
+    sky_gc_init(&vm->heap, vm);
     /* Register native functions */
     sky_vm_define_native(vm, "print", native_print);
     sky_vm_define_native(vm, "str", native_str);
     sky_vm_define_native(vm, "len", native_len);
+    sky_vm_define_native(vm, "clock", native_clock);
+    sky_vm_define_native(vm, "json", native_json);
+    sky_vm_define_native(vm, "__native_array_push", native_array_push);
+    sky_vm_define_native(vm, "__native_array_pop", native_array_pop);
+    sky_vm_define_native(vm, "__native_map_delete", native_map_delete);
 }
 
 void sky_vm_destroy(SkyVM *vm) {
     if (!vm) return;
     sky_table_free(&vm->globals);
-    sky_table_free(&vm->strings);
+    free(vm->global_slots);
+    vm->global_slots = NULL;
+    vm->global_slot_count = 0;
+    sky_table_free(&vm->saved_globals);
+    free(vm->saved_slots);
+    vm->saved_slots = NULL;
+    vm->saved_slot_count = 0;
+    free(vm->stack);
+    vm->stack = vm->stack_top = NULL;
+    vm->stack_capacity = 0;
+    free(vm->frames);
+    vm->frames = NULL;
+    vm->frame_capacity = vm->frame_count = 0;
+    sky_gc_free_all(&vm->heap);
 }
 
-void sky_vm_push(SkyVM *vm, SkyValue value) {
-    if (vm->stack_top - vm->stack >= SKY_STACK_MAX) {
+/* Ceilings for the value stack (in values) and call depth; zero or
+ * negative leaves a limit unchanged. Already allocated space is kept. */
+void sky_vm_set_limits(SkyVM *vm, int max_stack, int max_frames) {
+    if (!vm) return;
+    if (max_stack > 0) vm->stack_limit = max_stack;
+    if (max_frames > 0) vm->frame_limit = max_frames;
+}
+
+/* Relocate the value stack so it holds at least `needed` values, then
+ * rebase stack_top and every frame's slot window. */
+static bool vm_grow_stack(SkyVM *vm, int needed) {
+    ptrdiff_t top = vm->stack_top - vm->stack;
+    ptrdiff_t *bases;
+    SkyValue *stack;
+    int cap = vm->stack_capacity > 0 ? vm->stack_capacity : SKY_STACK_INITIAL;
+    int i;
+
+    if (needed > vm->stack_limit) {
         runtime_error(vm, "Stack overflow");
-        return;
+        return false;
+    }
+    while (cap < needed) cap *= 2;
+    if (cap > vm->stack_limit) cap = vm->stack_limit;
+
+    bases = (ptrdiff_t*)malloc(sizeof(ptrdiff_t) * (vm->frame_count + 1));
+    if (!bases) {
+        runtime_error(vm, "Out of memory growing the stack");
+        return false;
+    }
+    for (i = 0; i < vm->frame_count; i++) bases[i] = vm->frames[i].slots - vm->stack;
+    stack = (SkyValue*)realloc(vm->stack, sizeof(SkyValue) * cap);
+    if (!stack) {
+        free(bases);
+        runtime_error(vm, "Out of memory growing the stack");
+        return false;
     }
+    vm->stack = stack;
+    vm->stack_capacity = cap;
+    vm->stack_top = stack + top;
+    for (i = 0; i < vm->frame_count; i++) vm->frames[i].slots = stack + bases[i];
+    free(bases);
+    return true;
+}
+
+/* Room for `needed` values from the bottom of the stack. */
+static inline bool vm_reserve_stack(SkyVM *vm, ptrdiff_t needed) {
+    if (needed <= vm->stack_capacity) return true;
+    return vm_grow_stack(vm, (int)needed);
+}
+
+/* Next call frame, growing the frame array if needed. The array may
+ * move, so callers must not hold frame pointers across this. */
+static SkyCallFrame* vm_push_frame(SkyVM *vm) {
+    if (vm->frame_count >= vm->frame_capacity) {
+        int cap = vm->frame_capacity > 0 ? vm->frame_capacity * 2 : SKY_FRAMES_INITIAL;
+        SkyCallFrame *frames;
+        if (vm->frame_count >= vm->frame_limit) {
+            runtime_error(vm, "Stack overflow (too many nested calls)");
+            return NULL;
+        }
+        if (cap > vm->frame_limit) cap = vm->frame_limit;
+        frames = (SkyCallFrame*)realloc(vm->frames, sizeof(SkyCallFrame) * cap);
+        if (!frames) {
+            runtime_error(vm, "Out of memory growing the call stack");
+            return NULL;
+        }
+        vm->frames = frames;
+        vm->frame_capacity = cap;
+    }
+    return &vm->frames[vm->frame_count++];
+}
+
+void sky_vm_push(SkyVM *vm, SkyValue value) {
+    if (!vm_reserve_stack(vm, (vm->stack_top - vm->stack) + 1)) return;
     *vm->stack_top = value;
     vm->stack_top++;
 }
@@ -108,459 +391,609 @@ SkyValue sky_vm_peek(SkyVM *vm, int distance) {
 }
 
 void sky_vm_define_native(SkyVM *vm, const char *name, SkyNativeFn fn) {
-    SkyValue val;
-    val.type = VAL_NATIVE_FN;
-    val.as.native_fn = fn;
-    sky_table_set(&vm->globals, name, val);
+    SkyHeap *previous_heap = sky_gc_set_current(&vm->heap);
+    sky_table_set(&vm->globals, sky_string_intern(name, (int)strlen(name)), SKY_NATIVE_FN(fn));
+    vm->globals_version++;
+    sky_gc_set_current(previous_heap);
 }
 
-static uint8_t read_byte(SkyCallFrame *frame) {
-    return *frame->ip++;
+/* Table keys must live as long as the VM, so a name that is still the
+ * compiler's static copy is replaced by a heap one on first definition. */
+static void vm_set_global(SkyVM *vm, SkyString *name, SkyValue value) {
+    SkyValue existing;
+    if ((name->obj.flags & SKY_OBJ_STATIC) && !sky_table_get(&vm->globals, name, &existing)) {
+        name = sky_string_intern(name->chars, name->length);
+    }
+    sky_table_set(&vm->globals, name, value);
+    vm->globals_version++;
 }
 
-static uint16_t read_short(SkyCallFrame *frame) {
-    uint16_t hi = frame->ip[0];
-    uint16_t lo = frame->ip[1];
-    frame->ip += 2;
-    return (hi << 8) | lo;
+/* Slow paths shared by the superinstructions; same semantics and errors
+ * as the generic ADD and comparison handlers. */
+static bool vm_add_values(SkyVM *vm, SkyValue a, SkyValue b, SkyValue *out) {
+    if (IS_INT(a) && IS_INT(b)) {
+        *out = SKY_INT(SKY_WRAP(AS_INT(a), +, AS_INT(b)));
+    } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        *out = SKY_FLOAT(AS_FLOAT(a) + AS_FLOAT(b));
+    } else if (IS_INT(a) && IS_FLOAT(b)) {
+        *out = SKY_FLOAT((double)AS_INT(a) + AS_FLOAT(b));
+    } else if (IS_FLOAT(a) && IS_INT(b)) {
+        *out = SKY_FLOAT(AS_FLOAT(a) + (double)AS_INT(b));
+    } else if (IS_STRING(a) && IS_STRING(b)) {
+        *out = sky_string_concat(a, b);
+    } else {
+        runtime_error(vm, "Cannot add these types");
+        return false;
+    }
+    return true;
 }
 
-static SkyValue read_constant(SkyCallFrame *frame) {
-    uint8_t idx = read_byte(frame);
-    return frame->chunk->constants.values[idx];
+/* Slow path of the register forms of ADD, SUB and MUL, which have no
+ * quickened variants to fall back on. */
+static bool vm_arith_values(SkyVM *vm, uint8_t op, SkyValue a, SkyValue b, SkyValue *out) {
+    double x, y;
+    if (op == OP_ADD) return vm_add_values(vm, a, b, out);
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t i = AS_INT(a), j = AS_INT(b);
+        *out = SKY_INT(op == OP_SUB ? SKY_WRAP(i, -, j) : SKY_WRAP(i, *, j));
+        return true;
+    }
+    if ((!IS_INT(a) && !IS_FLOAT(a)) || (!IS_INT(b) && !IS_FLOAT(b))) {
+        runtime_error(vm, op == OP_SUB ? "Cannot subtract these types" : "Cannot multiply these types");
+        return false;
+    }
+    x = IS_INT(a) ? (double)AS_INT(a) : AS_FLOAT(a);
+    y = IS_INT(b) ? (double)AS_INT(b) : AS_FLOAT(b);
+    *out = SKY_FLOAT(op == OP_SUB ? x - y : x * y);
+    return true;
 }
 
-static char* concat_strings(const char *a, const char *b) {
-    size_t la, lb;
-    char *result;
-    la = a ? strlen(a) : 0;
-    lb = b ? strlen(b) : 0;
-    result = (char*)malloc(la + lb + 1);
-    if (!result) return NULL;
-    if (a) memcpy(result, a, la);
-    if (b) memcpy(result + la, b, lb);
-    result[la + lb] = '\0';
-    return result;
+static bool vm_compare_values(SkyVM *vm, uint8_t op, SkyValue a, SkyValue b, bool *out) {
+    double x, y;
+    if (op == OP_EQUAL) {
+        *out = sky_values_equal(a, b);
+        return true;
+    }
+    if (op == OP_NOT_EQUAL) {
+        *out = !sky_values_equal(a, b);
+        return true;
+    }
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t i = AS_INT(a), j = AS_INT(b);
+        switch (op) {
+            case OP_LESS:       *out = i < j; break;
+            case OP_LESS_EQ:    *out = i <= j; break;
+            case OP_GREATER:    *out = i > j; break;
+            default:            *out = i >= j; break;
+        }
+        return true;
+    }
+    if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        x = AS_FLOAT(a);
+        y = AS_FLOAT(b);
+    } else if ((op == OP_LESS || op == OP_GREATER) && IS_INT(a) && IS_FLOAT(b)) {
+        x = (double)AS_INT(a);
+        y = AS_FLOAT(b);
+    } else if ((op == OP_LESS || op == OP_GREATER) && IS_FLOAT(a) && IS_INT(b)) {
+        x = AS_FLOAT(a);
+        y = (double)AS_INT(b);
+    } else {
+        runtime_error(vm, "Cannot compare these types");
+        return false;
+    }
+    switch (op) {
+        case OP_LESS:       *out = x < y; break;
+        case OP_LESS_EQ:    *out = x <= y; break;
+        case OP_GREATER:    *out = x > y; break;
+        default:            *out = x >= y; break;
+    }
+    return true;
 }
 
-SkyVMResult sky_vm_execute(SkyVM *vm, SkyChunk *chunk) {
-    SkyCallFrame *frame;
-    uint8_t instruction;
+/* Truthiness for `and`, `or` and `not`: only nil and false are false.
+ * (Conditions in JUMP_IF_FALSE also treat integer 0 as false.) */
+static inline bool vm_logical_truth(SkyValue v) {
+    return IS_BOOL(v) ? AS_BOOL(v) : !IS_NIL(v);
+}
 
-    if (!vm || !chunk) return VM_RUNTIME_ERROR;
+static bool vm_check_arity(SkyVM *vm, SkyFunction *fn, int arg_count) {
+    if (fn->arity != arg_count) {
+        runtime_error(vm, "%s() expects %d arguments but got %d",
+                      fn->name, fn->arity, arg_count);
+        return false;
+    }
+    return true;
+}
 
-    vm->frame_count = 1;
-    frame = &vm->frames[0];
-    frame->chunk = chunk;
-    frame->ip = chunk->code;
-    frame->slots = vm->stack;
+/* Stores into a map that marking may already have traced. */
+static void vm_map_set(SkyMap *map, SkyString *key, SkyValue value) {
+    sky_gc_barrier(&map->obj, SKY_STRING(key));
+    sky_gc_barrier(&map->obj, value);
+    sky_map_set(map, key, value);
+}
 
-    while (1) {
-        if (sky_debug_trace_execution) {
-            sky_debug_print_stack(vm->stack, (int)(vm->stack_top - vm->stack));
-            sky_disassemble_instruction(chunk, (int)(frame->ip - chunk->code));
+/* GET_INDEX past its fast path: arrays and strings by integer index,
+ * maps by key (sky_map_key). Anything else has no indices and yields nil.
+ * Both operands must still be on the stack, since keys may allocate. */
+static bool vm_get_index(SkyVM *vm, SkyValue object, SkyValue index, SkyValue *out) {
+    if (IS_ARRAY(object) || IS_STRING(object)) {
+        int64_t i;
+        int length = IS_ARRAY(object) ? AS_ARRAY(object)->count : AS_STRING_OBJ(object)->length;
+        if (!IS_INT(index)) {
+            runtime_error(vm, "%s indices must be integers", IS_ARRAY(object) ? "Array" : "String");
+            return false;
         }
+        i = AS_INT(index);
+        if (i < 0 || i >= length) {
+            runtime_error(vm, "Index %lld out of bounds for length %d", (long long)i, length);
+            return false;
+        }
+        if (IS_ARRAY(object)) *out = AS_ARRAY(object)->items[i];
+        else *out = SKY_STRING(sky_string_copy(AS_STRING_OBJ(object)->chars + i, 1));
+        return true;
+    }
+    if (IS_MAP(object)) {
+        SkyString *key = sky_map_key(index);
+        if (!key) {
+            runtime_error(vm, "Map keys must be strings or numbers");
+            return false;
+        }
+        if (sky_map_get(AS_MAP(object), key, out)) return true;
+    }
+    *out = SKY_NIL();
+    return true;
+}
 
-        instruction = read_byte(frame);
-
-        switch (instruction) {
-            case OP_NOP:
-                break;
-
-            case OP_CONSTANT: {
-                SkyValue val = read_constant(frame);
-                sky_vm_push(vm, val);
-                break;
-            }
-
-            case OP_CONSTANT_LONG: {
-                uint32_t idx = ((uint32_t)read_byte(frame) << 16) |
-                               ((uint32_t)read_byte(frame) << 8) |
-                               (uint32_t)read_byte(frame);
-                if ((int)idx < chunk->constants.count) {
-                    sky_vm_push(vm, chunk->constants.values[idx]);
-                } else {
-                    sky_vm_push(vm, SKY_NIL());
-                }
-                break;
-            }
-
-            case OP_TRUE:
-                sky_vm_push(vm, SKY_BOOL(true));
-                break;
-
-            case OP_FALSE:
-                sky_vm_push(vm, SKY_BOOL(false));
-                break;
-
-            case OP_NIL:
-                sky_vm_push(vm, SKY_NIL());
-                break;
-
-            case OP_POP:
-                sky_vm_pop(vm);
-                break;
-
-            case OP_DUP:
-                sky_vm_push(vm, sky_vm_peek(vm, 0));
-                break;
-
-            case OP_GET_LOCAL: {
-                uint8_t slot = read_byte(frame);
-                sky_vm_push(vm, frame->slots[slot]);
-                break;
-            }
-
-            case OP_SET_LOCAL: {
-                uint8_t slot = read_byte(frame);
-                frame->slots[slot] = sky_vm_peek(vm, 0);
-                break;
-            }
+/* SET_INDEX: arrays within their bounds and maps; strings are immutable
+ * and anything else keeps just the stack effect. */
+static bool vm_set_index(SkyVM *vm, SkyValue object, SkyValue index, SkyValue value) {
+    if (IS_ARRAY(object)) {
+        SkyArray *arr = AS_ARRAY(object);
+        int64_t i;
+        if (!IS_INT(index)) {
+            runtime_error(vm, "Array indices must be integers");
+            return false;
+        }
+        i = AS_INT(index);
+        if (i < 0 || i >= arr->count) {
+            runtime_error(vm, "Index %lld out of bounds for length %d", (long long)i, arr->count);
+            return false;
+        }
+        sky_gc_barrier(&arr->obj, value);
+        arr->items[i] = value;
+    } else if (IS_MAP(object)) {
+        SkyString *key = sky_map_key(index);
+        if (!key) {
+            runtime_error(vm, "Map keys must be strings or numbers");
+            return false;
+        }
+        vm_map_set(AS_MAP(object), key, value);
+    } else if (IS_STRING(object)) {
+        runtime_error(vm, "Strings cannot be changed");
+        return false;
+    }
+    return true;
+}
 
-            case OP_GET_GLOBAL: {
-                SkyValue name_val = read_constant(frame);
-                SkyValue value;
-                if (name_val.type != VAL_STRING || !name_val.as.string) {
-                    runtime_error(vm, "Global name must be a string");
-                    return VM_RUNTIME_ERROR;
-                }
-                if (!sky_table_get(&vm->globals, name_val.as.string, &value)) {
-                    runtime_error(vm, "Undefined variable '%s'", name_val.as.string);
-                    return VM_RUNTIME_ERROR;
-                }
-                sky_vm_push(vm, value);
-                break;
-            }
+/* Slot of `name` in `shape` through the site's inline cache; a miss
+ * looks it up and records the answer, except in shared chunks, which
+ * stay exactly as they are. */
+static inline int vm_field_slot(SkyChunk *chunk, uint8_t *cache, SkyShape *shape, SkyString *name) {
+    int slot = sky_ic_find(cache, shape->id);
+    if (slot >= 0) return slot;
+    slot = sky_shape_find(shape, name);
+    if (slot >= 0 && !chunk->shared) sky_ic_add(cache, shape->id, slot);
+    return slot;
+}
 
-            case OP_SET_GLOBAL: {
-                SkyValue name_val = read_constant(frame);
-                if (name_val.type != VAL_STRING || !name_val.as.string) {
-                    runtime_error(vm, "Global name must be a string");
-                    return VM_RUNTIME_ERROR;
-                }
-                sky_table_set(&vm->globals, name_val.as.string, sky_vm_peek(vm, 0));
-                break;
-            }
+/* Method index of `name` for an instance in `shape`, the same way. A
+ * field of that name hides the method, and is never cached: the site
+ * falls back to calling the field. */
+static inline int vm_method_index(SkyChunk *chunk, uint8_t *cache, SkyInstance *instance,
+                                  SkyString *name) {
+    int index = sky_ic_find(cache, instance->shape->id);
+    if (index >= 0) return index;
+    if (sky_shape_find(instance->shape, name) >= 0) return -1;
+    index = sky_class_find_method(instance->klass, name);
+    if (index >= 0 && !chunk->shared) sky_ic_add(cache, instance->shape->id, index);
+    return index;
+}
 
-            case OP_ADD: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_INT(a.as.integer + b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating + b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT((double)a.as.integer + b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating + (double)b.as.integer));
-                } else if (a.type == VAL_STRING && b.type == VAL_STRING) {
-                    char *result = concat_strings(a.as.string, b.as.string);
-                    sky_vm_push(vm, SKY_STRING(result));
-                } else {
-                    runtime_error(vm, "Cannot add these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Stores a field, moving the instance to a new shape if it lacks it. */
+static void vm_instance_set(SkyInstance *instance, int slot, SkyString *name, SkyValue value) {
+    sky_gc_barrier(&instance->obj, value);
+    if (slot >= 0) {
+        instance->fields[slot] = value;
+    } else {
+        sky_gc_barrier(&instance->klass->obj, SKY_STRING(name));
+        sky_instance_add_field(instance, name, value);
+    }
+}
 
-            case OP_SUB: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_INT(a.as.integer - b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating - b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT((double)a.as.integer - b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating - (double)b.as.integer));
-                } else {
-                    runtime_error(vm, "Cannot subtract these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Calling a class that has an init method calls init instead, with a
+ * new instance slotted in as self ahead of the arguments. */
+static bool vm_prepare_init(SkyVM *vm, int arg_count) {
+    SkyClass *klass = AS_CLASS(vm->stack_top[-arg_count - 1]);
+    SkyInstance *instance;
+    SkyValue *callee;
+    if (klass->init->arity != arg_count + 1) {
+        runtime_error(vm, "%s() expects %d arguments but got %d",
+                      klass->name->chars, klass->init->arity - 1, arg_count);
+        return false;
+    }
+    if (!vm_reserve_stack(vm, (vm->stack_top - vm->stack) + 1)) return false;
+    instance = sky_instance_new(klass);
+    callee = vm->stack_top - arg_count - 1;
+    memmove(callee + 2, callee + 1, sizeof(SkyValue) * arg_count);
+    callee[0] = SKY_OBJECT(klass->init);
+    callee[1] = SKY_OBJECT(instance);
+    vm->stack_top++;
+    return true;
+}
 
-            case OP_MUL: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_INT(a.as.integer * b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating * b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT((double)a.as.integer * b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating * (double)b.as.integer));
-                } else {
-                    runtime_error(vm, "Cannot multiply these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Calls that don't enter a new frame: natives, classes without init
+ * (whose arguments fill the declared fields in order), and nil (a
+ * declared but unimplemented callee) which yields nil. Replaces callee
+ * and arguments with the result. */
+static bool vm_call_native(SkyVM *vm, SkyValue callee, int arg_count) {
+    SkyValue result;
+    if (IS_NATIVE_FN(callee) && AS_NATIVE_FN(callee)) {
+        result = AS_NATIVE_FN(callee)(arg_count, vm->stack_top - arg_count);
+    } else if (IS_CLASS(callee)) {
+        SkyClass *klass = AS_CLASS(callee);
+        SkyInstance *instance;
+        int i;
+        if (arg_count > klass->shape->field_count) {
+            runtime_error(vm, "%s() expects at most %d arguments but got %d",
+                          klass->name->chars, klass->shape->field_count, arg_count);
+            return false;
+        }
+        instance = sky_instance_new(klass);
+        for (i = 0; i < arg_count; i++) instance->fields[i] = vm->stack_top[i - arg_count];
+        result = SKY_OBJECT(instance);
+    } else if (IS_NIL(callee)) {
+        result = SKY_NIL();
+    } else {
+        runtime_error(vm, "Can only call functions");
+        return false;
+    }
+    vm->stack_top -= arg_count;
+    vm->stack_top[-1] = result;
+    return true;
+}
 
-            case OP_DIV: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (b.type == VAL_INT && b.as.integer == 0) {
-                    runtime_error(vm, "Division by zero");
-                    return VM_RUNTIME_ERROR;
-                }
-                if (b.type == VAL_FLOAT && b.as.floating == 0.0) {
-                    runtime_error(vm, "Division by zero");
-                    return VM_RUNTIME_ERROR;
-                }
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_INT(a.as.integer / b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating / b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT((double)a.as.integer / b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_FLOAT(a.as.floating / (double)b.as.integer));
-                } else {
-                    runtime_error(vm, "Cannot divide these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Frame entry: room for the chunk's whole verified depth above the
+ * frame base (an index, since growing may move the stack). */
+static inline bool vm_check_stack(SkyVM *vm, ptrdiff_t base, SkyChunk *chunk) {
+    return vm_reserve_stack(vm, base + chunk->max_stack);
+}
 
-            case OP_MOD: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    if (b.as.integer == 0) {
-                        runtime_error(vm, "Modulo by zero");
-                        return VM_RUNTIME_ERROR;
-                    }
-                    sky_vm_push(vm, SKY_INT(a.as.integer % b.as.integer));
-                } else {
-                    runtime_error(vm, "Modulo requires integers");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Quickening: rewrite the generic op at `at` to its specialized form,
+ * unless the site has already fallen back too often. Shared chunks run
+ * on several threads at once and stay exactly as they are. */
+static inline void vm_quicken(SkyChunk *chunk, uint8_t *at, uint8_t op) {
+    if (chunk->shared) return;
+    if (chunk->deopt_counts &&
+        chunk->deopt_counts[at - chunk->code] >= SKY_QUICKEN_MAX_DEOPTS) {
+        return;
+    }
+    *at = op;
+    chunk->quicken.quickened++;
+}
 
-            case OP_NEGATE: {
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_INT(-a.as.integer));
-                } else if (a.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_FLOAT(-a.as.floating));
-                } else {
-                    runtime_error(vm, "Cannot negate this type");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+static void vm_deopt(SkyChunk *chunk, uint8_t *at, uint8_t op) {
+    int offset = (int)(at - chunk->code);
+    if (chunk->shared) return;
+    if (!chunk->deopt_counts) {
+        chunk->deopt_counts = (uint8_t*)calloc(chunk->code_count, 1);
+    }
+    if (chunk->deopt_counts[offset] < 255) chunk->deopt_counts[offset]++;
+    *at = op;
+    chunk->quicken.deopts++;
+}
 
-            case OP_NOT: {
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_BOOL) {
-                    sky_vm_push(vm, SKY_BOOL(!a.as.boolean));
-                } else if (a.type == VAL_NIL) {
-                    sky_vm_push(vm, SKY_BOOL(true));
-                } else {
-                    sky_vm_push(vm, SKY_BOOL(false));
-                }
-                break;
-            }
+/* Bind the chunk's global slots to the current contents of vm->globals
+ * (natives and anything left by an earlier run). */
+void sky_vm_bind_globals(SkyVM *vm, SkyChunk *chunk) {
+    int i;
+    if (chunk->global_count > vm->global_slot_count) {
+        vm->global_slots = (SkyGlobalSlot*)realloc(vm->global_slots,
+            sizeof(SkyGlobalSlot) * chunk->global_count);
+        vm->global_slot_count = chunk->global_count;
+    }
+    vm->global_names = chunk->global_names;
+    for (i = 0; i < chunk->global_count; i++) {
+        SkyGlobalSlot *g = &vm->global_slots[i];
+        g->defined = sky_table_get(&vm->globals, chunk->global_names[i], &g->value);
+        if (!g->defined) g->value = SKY_NIL();
+    }
+}
 
-            case OP_EQUAL: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                sky_vm_push(vm, SKY_BOOL(sky_values_equal(a, b)));
-                break;
-            }
+/* Write slot values back so vm->globals stays the by-name view. */
+static void vm_sync_globals(SkyVM *vm, SkyChunk *chunk) {
+    int i;
+    for (i = 0; i < chunk->global_count; i++) {
+        if (vm->global_slots[i].defined) {
+            vm_set_global(vm, chunk->global_names[i], vm->global_slots[i].value);
+        }
+    }
+}
 
-            case OP_NOT_EQUAL: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                sky_vm_push(vm, SKY_BOOL(!sky_values_equal(a, b)));
-                break;
-            }
+#define SKY_TRACE_MAX_FRAMES 8
+
+/* Source line of every active call, innermost first, after a runtime
+ * error. Frame slot 0 holds the callee for everything but the script. */
+static void vm_print_trace(SkyVM *vm) {
+    int i, shown = 0;
+    for (i = vm->frame_count - 1; i >= 0; i--) {
+        SkyCallFrame *f = &vm->frames[i];
+        int line = sky_chunk_get_line(f->chunk, (int)(f->ip - f->chunk->code) - 1);
+        if (shown == SKY_TRACE_MAX_FRAMES && i > 0) {
+            fprintf(stderr, "  ... %d more\n", i);
+            i = 0;
+            f = &vm->frames[0];
+            line = sky_chunk_get_line(f->chunk, (int)(f->ip - f->chunk->code) - 1);
+        }
+        if (i > 0 && IS_FUNCTION(f->slots[0])) {
+            fprintf(stderr, "  [line %d] in %s()\n", line, AS_FUNCTION(f->slots[0])->name);
+        } else {
+            fprintf(stderr, "  [line %d] in script\n", line);
+        }
+        shown++;
+    }
+}
 
-            case OP_GREATER: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.integer > b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating > b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL((double)a.as.integer > b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating > (double)b.as.integer));
-                } else {
-                    runtime_error(vm, "Cannot compare these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Per-instruction hook of the instrumented loop. */
+static void vm_instrument(SkyVM *vm, SkyCallFrame *frame) {
+    if (sky_debug_profile_opcodes) {
+        sky_debug_record_opcode(*frame->ip);
+    }
+    if (sky_debug_trace_execution) {
+        sky_debug_print_stack(vm->stack, (int)(vm->stack_top - vm->stack));
+        sky_disassemble_instruction(frame->chunk, (int)(frame->ip - frame->chunk->code));
+    }
+}
 
-            case OP_GREATER_EQ: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.integer >= b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating >= b.as.floating));
-                } else {
-                    runtime_error(vm, "Cannot compare these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Labels-as-values dispatch where the compiler supports it; build with
+ * -DSKY_NO_COMPUTED_GOTO to force the portable switch loop. */
+#if defined(__GNUC__) && !defined(SKY_NO_COMPUTED_GOTO)
+#define SKY_COMPUTED_GOTO
+#endif
+
+#define SKY_VM_LOOP_NAME    run_step
+#define SKY_VM_INSTRUMENTED 0
+#define SKY_VM_SINGLE_STEP  1
+#define SKY_VM_JIT_HOOKS    0
+#include "vm_loop.h"
+#undef SKY_VM_LOOP_NAME
+#undef SKY_VM_INSTRUMENTED
+#undef SKY_VM_SINGLE_STEP
+#undef SKY_VM_JIT_HOOKS
+
+/* Native code runs every instruction it has no inline form for, and
+ * every guard miss, through here: one interpreter step, then whether
+ * execution fell through, branched within the frame or left it. */
+SkyStepStatus sky_vm_step(SkyVM *vm, SkyCallFrame *frame, uint8_t *ip) {
+    SkyChunk *chunk = frame->chunk;
+    int depth = vm->frame_count;
+    uint8_t *next = ip + sky_opcode_length(*ip);
+    SkyVMResult result;
+
+    frame->ip = ip;
+    result = run_step(vm, frame);
+    if (result == VM_RUNTIME_ERROR) return SKY_STEP_ERROR;
+    if (result == VM_OK) return SKY_STEP_HALT;
+    if (vm->frame_count != depth || frame->chunk != chunk) return SKY_STEP_EXIT;
+    return frame->ip == next ? SKY_STEP_NEXT : SKY_STEP_BRANCH;
+}
 
-            case OP_LESS: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.integer < b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating < b.as.floating));
-                } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL((double)a.as.integer < b.as.floating));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating < (double)b.as.integer));
-                } else {
-                    runtime_error(vm, "Cannot compare these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+static SkyJitTarget vm_jit_resume(SkyVM *vm);
 
-            case OP_LESS_EQ: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                if (a.type == VAL_INT && b.type == VAL_INT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.integer <= b.as.integer));
-                } else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-                    sky_vm_push(vm, SKY_BOOL(a.as.floating <= b.as.floating));
-                } else {
-                    runtime_error(vm, "Cannot compare these types");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+/* Ticks a chunk about to run and compiles it once it gets hot; true if
+ * it has JIT code. Chunks compiled ahead of time never need any, and
+ * shared chunks keep only what they had when they were shared. */
+static bool vm_jit_ready(SkyChunk *chunk) {
+    if (chunk->jit) return true;
+    if (chunk->aot || chunk->shared) return false;
+    return ++chunk->hotness == SKY_JIT_THRESHOLD && sky_jit_compile(chunk, vm_jit_resume);
+}
 
-            case OP_AND: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                bool ba = (a.type == VAL_BOOL) ? a.as.boolean : (a.type != VAL_NIL);
-                bool bb = (b.type == VAL_BOOL) ? b.as.boolean : (b.type != VAL_NIL);
-                sky_vm_push(vm, SKY_BOOL(ba && bb));
-                break;
-            }
+/* JIT code lands here when a step leaves its frame: carry on in the JIT
+ * code of the frame now on top, if it has (or now gets) some. */
+static SkyJitTarget vm_jit_resume(SkyVM *vm) {
+    SkyJitTarget target = {NULL, NULL};
+    SkyCallFrame *frame = &vm->frames[vm->frame_count - 1];
+    if (vm_jit_ready(frame->chunk)) {
+        target.resume = sky_jit_entry(frame->chunk, frame->ip);
+        target.frame = frame;
+    }
+    return target;
+}
 
-            case OP_OR: {
-                SkyValue b = sky_vm_pop(vm);
-                SkyValue a = sky_vm_pop(vm);
-                bool ba = (a.type == VAL_BOOL) ? a.as.boolean : (a.type != VAL_NIL);
-                bool bb = (b.type == VAL_BOOL) ? b.as.boolean : (b.type != VAL_NIL);
-                sky_vm_push(vm, SKY_BOOL(ba || bb));
-                break;
+/* Runs native code for as long as the frame on top has some: its
+ * ahead-of-time compiled body, else (with vm->jit) JIT code once it is
+ * hot. Reached with the top frame's ip saved, on entry and from the
+ * interpreter's calls, returns and loop back-edges. VM_STEPPED hands
+ * the top frame back to the interpreter; errors have already been
+ * reported. */
+static SkyVMResult vm_native_enter(SkyVM *vm) {
+    for (;;) {
+        SkyCallFrame *frame = &vm->frames[vm->frame_count - 1];
+        int status;
+        if (frame->chunk->aot) {
+            status = frame->chunk->aot(vm, frame);
+        } else if (vm->jit && vm_jit_ready(frame->chunk)) {
+            status = sky_jit_run(frame->chunk, vm, frame);
+            /* JIT code only exits to a frame without JIT code */
+            if (status == SKY_STEP_EXIT && !vm->frames[vm->frame_count - 1].chunk->aot) {
+                return VM_STEPPED;
             }
+        } else {
+            return VM_STEPPED;
+        }
+        if (status == SKY_STEP_HALT) return VM_OK;
+        if (status == SKY_STEP_ERROR) return VM_RUNTIME_ERROR;
+    }
+}
 
-            case OP_JUMP: {
-                uint16_t offset = read_short(frame);
-                frame->ip += offset;
-                break;
-            }
+#define SKY_VM_LOOP_NAME    run_plain
+#define SKY_VM_INSTRUMENTED 0
+#define SKY_VM_SINGLE_STEP  0
+#define SKY_VM_JIT_HOOKS    SKY_JIT_AVAILABLE
+#include "vm_loop.h"
+#undef SKY_VM_LOOP_NAME
+#undef SKY_VM_INSTRUMENTED
+#undef SKY_VM_SINGLE_STEP
+#undef SKY_VM_JIT_HOOKS
+
+#define SKY_VM_LOOP_NAME    run_instrumented
+#define SKY_VM_INSTRUMENTED 1
+#define SKY_VM_SINGLE_STEP  0
+#define SKY_VM_JIT_HOOKS    0
+#include "vm_loop.h"
+#undef SKY_VM_LOOP_NAME
+#undef SKY_VM_INSTRUMENTED
+#undef SKY_VM_SINGLE_STEP
+#undef SKY_VM_JIT_HOOKS
+
+/* Runs from the top frame, which is already set up, until the program
+ * finishes, the bottom frame returns or an error is reported. The VM's
+ * heap must be current. */
+static SkyVMResult vm_run(SkyVM *vm) {
+    SkyCallFrame *frame = &vm->frames[vm->frame_count - 1];
+    SkyVMResult result;
+
+    if (sky_debug_trace_execution || sky_debug_collect_stats || sky_debug_profile_opcodes) {
+        return run_instrumented(vm, frame);
+    }
+    result = frame->chunk->aot ? vm_native_enter(vm) : VM_STEPPED;
+    if (result == VM_STEPPED) result = run_plain(vm, &vm->frames[vm->frame_count - 1]);
+    return result;
+}
 
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = read_short(frame);
-                SkyValue cond = sky_vm_peek(vm, 0);
-                bool is_falsy = (cond.type == VAL_NIL) ||
-                                (cond.type == VAL_BOOL && !cond.as.boolean) ||
-                                (cond.type == VAL_INT && cond.as.integer == 0);
-                if (is_falsy) {
-                    frame->ip += offset;
-                }
-                break;
-            }
+SkyVMResult sky_vm_execute(SkyVM *vm, SkyChunk *chunk) {
+    SkyCallFrame *frame;
+    SkyHeap *previous_heap;
+    SkyVMResult result;
 
-            case OP_JUMP_BACK: {
-                uint16_t offset = read_short(frame);
-                frame->ip -= offset;
-                break;
-            }
+    if (!vm || !chunk) return VM_RUNTIME_ERROR;
+    if (!chunk->verified) {
+        char error[128];
+        if (!sky_verify_chunk(chunk, error, sizeof(error))) {
+            fprintf(stderr, "[SKY VERIFY ERROR] %s\n", error);
+            return VM_COMPILE_ERROR;
+        }
+    }
 
-            case OP_CALL: {
-                uint8_t arg_count = read_byte(frame);
-                SkyValue callee = sky_vm_peek(vm, arg_count);
-                if (callee.type == VAL_NATIVE_FN && callee.as.native_fn) {
-                    SkyNativeFn native = callee.as.native_fn;
-                    SkyValue result = native(arg_count, vm->stack_top - arg_count);
-                    vm->stack_top -= arg_count + 1;
-                    sky_vm_push(vm, result);
-                } else if (callee.type == VAL_NIL) {
-                    /* Skip call to nil (unimplemented function) */
-                    vm->stack_top -= arg_count + 1;
-                    sky_vm_push(vm, SKY_NIL());
-                } else {
-                    runtime_error(vm, "Can only call functions");
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
-            }
+    vm->frame_count = 0;
+    vm->stack_top = vm->stack;
+    if (!vm_check_stack(vm, 0, chunk)) return VM_RUNTIME_ERROR;
+    frame = vm_push_frame(vm);
+    if (!frame) return VM_RUNTIME_ERROR;
+    frame->chunk = chunk;
+    frame->ip = chunk->code;
+    frame->slots = vm->stack;
+    sky_vm_bind_globals(vm, chunk);
 
-            case OP_RETURN: {
-                if (vm->frame_count <= 1) {
-                    return VM_OK;
-                }
-                vm->frame_count--;
-                frame = &vm->frames[vm->frame_count - 1];
-                break;
-            }
+    previous_heap = sky_gc_set_current(&vm->heap);
+    result = vm_run(vm);
+    vm_sync_globals(vm, chunk);
+    sky_gc_set_current(previous_heap);
+    return result;
+}
 
-            case OP_PRINT: {
-                SkyValue val = sky_vm_pop(vm);
-                sky_debug_print_value(val);
-                printf("\n");
-                break;
-            }
+SkyVMResult sky_vm_call(SkyVM *vm, SkyValue callee, int arg_count, const SkyValue *args,
+                        SkyValue *result) {
+    SkyCallFrame *frame;
+    SkyFunction *fn;
+    SkyHeap *previous_heap;
+    SkyVMResult status;
+    int i;
 
-            case OP_ARRAY: {
-                uint8_t count = read_byte(frame);
-                SkyValue arr;
-                int i;
-                arr.type = VAL_ARRAY;
-                arr.as.array.count = count;
-                arr.as.array.capacity = count > 0 ? count : 4;
-                arr.as.array.items = (SkyValue*)malloc(sizeof(SkyValue) * arr.as.array.capacity);
-                for (i = count - 1; i >= 0; i--) {
-                    arr.as.array.items[i] = sky_vm_pop(vm);
-                }
-                sky_vm_push(vm, arr);
-                break;
-            }
+    if (!vm) return VM_RUNTIME_ERROR;
+    vm->frame_count = 0;
+    vm->stack_top = vm->stack;
+    if (!vm_reserve_stack(vm, arg_count + 1)) return VM_RUNTIME_ERROR;
+    *vm->stack_top++ = callee;
+    for (i = 0; i < arg_count; i++) *vm->stack_top++ = args[i];
+
+    previous_heap = sky_gc_set_current(&vm->heap);
+    if (IS_CLASS(callee) && AS_CLASS(callee)->init) {
+        if (!vm_prepare_init(vm, arg_count)) {
+            sky_gc_set_current(previous_heap);
+            return VM_RUNTIME_ERROR;
+        }
+        callee = vm->stack[0];
+        arg_count++;
+    }
+    if (!IS_FUNCTION(callee)) {
+        status = vm_call_native(vm, callee, arg_count) ? VM_OK : VM_RUNTIME_ERROR;
+        if (status == VM_OK) *result = vm->stack_top[-1];
+    } else {
+        fn = AS_FUNCTION(callee);
+        if (!vm_check_arity(vm, fn, arg_count) || !vm_check_stack(vm, 0, &fn->chunk) ||
+            !(frame = vm_push_frame(vm))) {
+            status = VM_RUNTIME_ERROR;
+        } else {
+            frame->chunk = &fn->chunk;
+            frame->ip = fn->chunk.code;
+            frame->slots = vm->stack;
+            /* The last RETURN pops the result, leaving it just above the stack */
+            status = vm_run(vm);
+            if (status == VM_OK) *result = *vm->stack_top;
+        }
+    }
+    sky_gc_set_current(previous_heap);
+    return status;
+}
 
-            case OP_MAP:
-            case OP_CLASS:
-            case OP_METHOD:
-            case OP_INVOKE:
-            case OP_IMPORT:
-            case OP_SERVER:
-            case OP_ROUTE:
-            case OP_RESPOND:
-            case OP_SECURITY:
-            case OP_ASYNC:
-            case OP_AWAIT:
-                break;
+/* Slots first: while a chunk is bound they hold the live values, and
+ * vm->globals only catches up at the end of sky_vm_execute. */
+bool sky_vm_get_global(SkyVM *vm, const char *name, SkyValue *out) {
+    int length = (int)strlen(name);
+    int i;
 
-            case OP_GET_FIELD:
-            case OP_SET_FIELD:
-            case OP_GET_INDEX:
-            case OP_SET_INDEX:
-                break;
+    for (i = 0; i < vm->global_slot_count && vm->global_names; i++) {
+        SkyString *slot_name = vm->global_names[i];
+        if (slot_name->length == length && memcmp(slot_name->chars, name, (size_t)length) == 0) {
+            if (!vm->global_slots[i].defined) return false;
+            *out = vm->global_slots[i].value;
+            return true;
+        }
+    }
+    for (i = 0; i < vm->globals.capacity; i++) {
+        SkyTableEntry *entry = &vm->globals.entries[i];
+        if (entry->occupied && entry->key->length == length &&
+            memcmp(entry->key->chars, name, (size_t)length) == 0) {
+            *out = entry->value;
+            return true;
+        }
+    }
+    return false;
+}
 
-            case OP_HALT:
-                return VM_OK;
+void sky_vm_checkpoint(SkyVM *vm) {
+    if (vm->global_slot_count > vm->saved_slot_count) {
+        vm->saved_slots = (SkyGlobalSlot*)realloc(vm->saved_slots,
+            sizeof(SkyGlobalSlot) * vm->global_slot_count);
+    }
+    vm->saved_slot_count = vm->global_slot_count;
+    memcpy(vm->saved_slots, vm->global_slots, sizeof(SkyGlobalSlot) * vm->global_slot_count);
+    sky_table_free(&vm->saved_globals);
+    sky_table_copy(&vm->globals, &vm->saved_globals);
+    vm->saved_version = vm->globals_version;
+}
 
-            default:
-                runtime_error(vm, "Unknown opcode: %d", instruction);
-                return VM_RUNTIME_ERROR;
-        }
+/* A copy of the slots; the by-name table only when something stored
+ * into it since the checkpoint. */
+void sky_vm_reset(SkyVM *vm) {
+    vm->frame_count = 0;
+    vm->stack_top = vm->stack;
+    vm->heap.temp_root_count = 0;
+    memcpy(vm->global_slots, vm->saved_slots, sizeof(SkyGlobalSlot) * vm->saved_slot_count);
+    if (vm->globals_version != vm->saved_version) {
+        sky_table_free(&vm->globals);
+        sky_table_copy(&vm->saved_globals, &vm->globals);
+        vm->globals_version = vm->saved_version;
     }
 }
@@ -5,38 +5,97 @@
 #include "bytecode.h"
 #include "value.h"
 #include "table.h"
+#include "gc.h"
 
-#define SKY_STACK_MAX 1024
-#define SKY_MAX_CALL_FRAMES 64
+/* The value stack and frame array start small and grow by relocation
+ * up to per-VM ceilings (see sky_vm_set_limits). */
+#define SKY_STACK_INITIAL        256
+#define SKY_FRAMES_INITIAL       8
+#define SKY_STACK_LIMIT_DEFAULT  (1 << 20)
+#define SKY_FRAMES_LIMIT_DEFAULT (1 << 14)
 #define SKY_MAX_LOCALS 256
 
 typedef enum {
     VM_OK,
     VM_COMPILE_ERROR,
-    VM_RUNTIME_ERROR
+    VM_RUNTIME_ERROR,
+    VM_STEPPED          /* internal: one instruction ran, keep going */
 } SkyVMResult;
 
-typedef struct {
+typedef struct SkyCallFrame {
     SkyChunk *chunk;
     uint8_t  *ip;
     SkyValue *slots;
 } SkyCallFrame;
 
+/* Binding of one compiler-assigned global slot (see GET_GLOBAL_SLOT) */
 typedef struct {
-    SkyCallFrame frames[SKY_MAX_CALL_FRAMES];
+    SkyValue value;
+    bool     defined;
+} SkyGlobalSlot;
+
+typedef struct SkyVM {
+    SkyCallFrame *frames;
     int          frame_count;
-    SkyValue     stack[SKY_STACK_MAX];
+    int          frame_capacity;
+    int          frame_limit;
+    SkyValue    *stack;
     SkyValue    *stack_top;
+    int          stack_capacity;
+    int          stack_limit;
     SkyTable     globals;
-    SkyTable     strings;
+    SkyGlobalSlot *global_slots;
+    int          global_slot_count;
+    SkyString  **global_names;       /* slot -> name, from the running chunk */
+    uint32_t     globals_version;    /* bumped by every store into `globals` */
+    SkyGlobalSlot *saved_slots;      /* what sky_vm_reset restores (sky_vm_checkpoint) */
+    int          saved_slot_count;
+    SkyTable     saved_globals;
+    uint32_t     saved_version;
+    SkyHeap      heap;
+    bool         jit;                /* tier hot chunks up to native code (jit.h) */
 } SkyVM;
 
+/* What one instruction run for native code did, and why a run of native
+ * code (JIT or ahead-of-time compiled) ended. */
+typedef enum {
+    SKY_STEP_NEXT,      /* fell through to the next instruction */
+    SKY_STEP_BRANCH,    /* jumped within the frame */
+    SKY_STEP_EXIT,      /* left the frame (call, return); frame->ip is saved */
+    SKY_STEP_ERROR,     /* runtime error, already reported */
+    SKY_STEP_HALT       /* the program finished */
+} SkyStepStatus;
+
 void        sky_vm_init(SkyVM *vm);
 void        sky_vm_destroy(SkyVM *vm);
+void        sky_vm_set_limits(SkyVM *vm, int max_stack, int max_frames);
 SkyVMResult sky_vm_execute(SkyVM *vm, SkyChunk *chunk);
 void        sky_vm_push(SkyVM *vm, SkyValue value);
 SkyValue    sky_vm_pop(SkyVM *vm);
 SkyValue    sky_vm_peek(SkyVM *vm, int distance);
 void        sky_vm_define_native(SkyVM *vm, const char *name, SkyNativeFn fn);
 
+/* Binds the chunk's global slots to vm->globals, as sky_vm_execute does
+ * first; lets sky_vm_call run code whose top level never ran on `vm`
+ * (a restored snapshot). */
+void        sky_vm_bind_globals(SkyVM *vm, SkyChunk *chunk);
+
+/* Calls a function value of the chunk last executed or bound on `vm`
+ * (whose global slots it uses) with `args`, on an empty stack. The return
+ * value goes to `result` on VM_OK. */
+SkyVMResult sky_vm_call(SkyVM *vm, SkyValue callee, int arg_count, const SkyValue *args,
+                        SkyValue *result);
+bool        sky_vm_get_global(SkyVM *vm, const char *name, SkyValue *out);
+
+/* Remembers the current globals; sky_vm_reset puts them back and empties
+ * the stack. Objects the globals point to keep whatever was stored in
+ * them since, and everything else made since becomes garbage. */
+void        sky_vm_checkpoint(SkyVM *vm);
+void        sky_vm_reset(SkyVM *vm);
+
+/* Runs the single instruction at `ip` of `frame` in the interpreter.
+ * Native code calls it for every opcode it has no inline form for and
+ * whenever an inline form's type guard misses. */
+SkyStepStatus sky_vm_step(SkyVM *vm, SkyCallFrame *frame, uint8_t *ip);
+
 #endif
@@ -0,0 +1,1117 @@
+﻿/* vm_loop.h — Bytecode dispatch loop body
+ *
+ * Not a standalone header: vm.c includes it once per loop flavour with
+ * SKY_VM_LOOP_NAME, SKY_VM_INSTRUMENTED, SKY_VM_SINGLE_STEP and
+ * SKY_VM_JIT_HOOKS defined. The instrumented copy calls vm_instrument()
+ * before every instruction; the plain copy carries no per-instruction
+ * checks at all. The single-step copy runs one instruction and returns
+ * VM_STEPPED with the frame's ip saved (see sky_vm_step). */
+
+static SkyVMResult SKY_VM_LOOP_NAME(SkyVM *vm, SkyCallFrame *frame) {
+    uint8_t  *ip = frame->ip;
+    SkyChunk *chunk = frame->chunk;
+    uint8_t   instruction;
+
+#define READ_BYTE()     (*ip++)
+#define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()     (ip += 3, ((uint32_t)ip[-3] << 16) | ((uint32_t)ip[-2] << 8) | ip[-1])
+#define READ_CONSTANT() (chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (chunk->constants.values[READ_LONG()])
+/* Unchecked: the verifier bounded each chunk's depth (max_stack) and
+ * frame entry made sure that much stack is free. */
+#define PUSH(v)         (*vm->stack_top++ = (v))
+#define POP()           (*--vm->stack_top)
+#define PEEK(distance)  (vm->stack_top[-1 - (distance)])
+
+#define QUICKEN(op)     vm_quicken(chunk, ip - 1, (op))
+
+/* The message is already out; add where each frame was. The top frame
+ * is always the last one in vm->frames, even if pushing a new one failed. */
+#define RUNTIME_FAILURE() \
+    (vm->frames[vm->frame_count - 1].ip = ip, vm_print_trace(vm), VM_RUNTIME_ERROR)
+
+#if SKY_VM_INSTRUMENTED
+#define INSTRUMENT()    (frame->ip = ip, vm_instrument(vm, frame))
+#define COUNT(field)    (chunk->quicken.field++)
+#else
+#define INSTRUMENT()    ((void)0)
+#define COUNT(field)    ((void)0)
+#endif
+
+/* Calls, returns and loop back-edges are where a chunk can tier up to
+ * native code; the interpreter resumes with whatever frame is then on top. */
+#if SKY_VM_JIT_HOOKS
+#define JIT_HOTSPOT()                                            \
+    do {                                                         \
+        if (vm->jit) {                                           \
+            SkyVMResult native;                                  \
+            frame->ip = ip;                                      \
+            native = vm_native_enter(vm);                        \
+            if (native != VM_STEPPED) return native;             \
+            frame = &vm->frames[vm->frame_count - 1];            \
+            chunk = frame->chunk;                                \
+            ip = frame->ip;                                      \
+        }                                                        \
+    } while (0)
+#else
+#define JIT_HOTSPOT()   ((void)0)
+#endif
+
+/* Calls the value below the top `argc` ones (CALL, INVOKE). Calling a
+ * class with an init method calls init with a new instance as self. */
+#define CALL_VALUE(argc)                                                 \
+    do {                                                                 \
+        int call_argc = (argc);                                          \
+        SkyValue callee = PEEK(call_argc);                               \
+        if (IS_CLASS(callee) && AS_CLASS(callee)->init) {                \
+            if (!vm_prepare_init(vm, call_argc)) return RUNTIME_FAILURE(); \
+            callee = PEEK(++call_argc);                                  \
+        }                                                                \
+        if (IS_FUNCTION(callee)) {                                       \
+            SkyFunction *fn = AS_FUNCTION(callee);                       \
+            if (!vm_check_arity(vm, fn, call_argc)) return RUNTIME_FAILURE(); \
+            /* Growing may move the stack and the frame array */         \
+            frame->ip = ip;                                              \
+            if (!vm_check_stack(vm, vm->stack_top - call_argc - 1 - vm->stack, &fn->chunk) || \
+                !(frame = vm_push_frame(vm))) {                          \
+                return RUNTIME_FAILURE();                                \
+            }                                                            \
+            frame->chunk = chunk = &fn->chunk;                           \
+            frame->ip = ip = chunk->code;                                \
+            frame->slots = vm->stack_top - call_argc - 1;                \
+            JIT_HOTSPOT();                                               \
+        } else if (!vm_call_native(vm, callee, call_argc)) {             \
+            return RUNTIME_FAILURE();                                    \
+        }                                                                \
+    } while (0)
+
+/* Body of a fused compare-and-jump: pops both operands, jumps when the
+ * comparison is false. Ints are compared inline, the rest via the slow path. */
+#define COMPARE_JUMP(cmp, generic)                               \
+    do {                                                         \
+        uint16_t offset = READ_SHORT();                          \
+        SkyValue b = POP();                                      \
+        SkyValue a = POP();                                      \
+        bool result;                                             \
+        if (IS_INT(a) && IS_INT(b)) {                            \
+            result = AS_INT(a) cmp AS_INT(b);                    \
+        } else if (!vm_compare_values(vm, generic, a, b, &result)) { \
+            return RUNTIME_FAILURE();                             \
+        }                                                        \
+        if (!result) ip += offset;                               \
+    } while (0)
+
+/* Body of a register compare-and-jump: R[a] against R[b] or K[k]. */
+#define REGISTER_COMPARE_JUMP(cmp, generic, right)               \
+    do {                                                         \
+        SkyValue a = frame->slots[READ_BYTE()];                  \
+        SkyValue b = (right);                                    \
+        uint16_t offset = READ_SHORT();                          \
+        bool result;                                             \
+        if (IS_INT(a) && IS_INT(b)) {                            \
+            result = AS_INT(a) cmp AS_INT(b);                    \
+        } else if (!vm_compare_values(vm, generic, a, b, &result)) { \
+            return RUNTIME_FAILURE();                             \
+        }                                                        \
+        if (!result) ip += offset;                               \
+    } while (0)
+
+/* Body of a register arithmetic op: R[d] = R[a] op R[b] or K[k]. */
+#define REGISTER_ARITH(op, generic, right)                       \
+    do {                                                         \
+        SkyValue *dst = &frame->slots[READ_BYTE()];              \
+        SkyValue a = frame->slots[READ_BYTE()];                  \
+        SkyValue b = (right);                                    \
+        if (IS_INT(a) && IS_INT(b)) {                            \
+            *dst = SKY_INT(SKY_WRAP(AS_INT(a), op, AS_INT(b)));  \
+        } else if (!vm_arith_values(vm, generic, a, b, dst)) {   \
+            return RUNTIME_FAILURE();                             \
+        }                                                        \
+    } while (0)
+
+/* Operand and result forms for the int arithmetic ops, which wrap */
+#define AS_WRAPPING(v) ((uint64_t)AS_INT(v))
+#define WRAPPED_INT(v) SKY_INT((int64_t)(v))
+
+/* Body of a quickened binary op: guard both operands, else rewrite the
+ * site back to its generic form and run that instead. */
+#define SPECIALIZED_BINARY(guard, as, make, op, generic)         \
+    do {                                                         \
+        SkyValue b = PEEK(0);                                    \
+        SkyValue a = PEEK(1);                                    \
+        if (!guard(a) || !guard(b)) DEOPT(generic);              \
+        COUNT(hits);                                             \
+        vm->stack_top--;                                         \
+        vm->stack_top[-1] = make(as(a) op as(b));                \
+    } while (0)
+
+#if defined(SKY_COMPUTED_GOTO) && !SKY_VM_SINGLE_STEP
+    /* Built by the compiler, so threads share it without setting it up.
+     * Entries follow the opcode enum (bytecode.h); the rest are unknown. */
+#define SKY_OPCODE_LABEL(name, operand_bytes) &&L_##name,
+    static void *const dispatch_table[256] = {
+        SKY_OPCODE_LIST(SKY_OPCODE_LABEL)
+        [OP_COUNT ... 255] = &&L_UNKNOWN
+    };
+#undef SKY_OPCODE_LABEL
+#define CASE(name)      L_##name:
+#define CASE_UNKNOWN    L_UNKNOWN:
+#define DISPATCH()                                               \
+    do {                                                         \
+        INSTRUMENT();                                            \
+        instruction = READ_BYTE();                               \
+        goto *dispatch_table[instruction];                       \
+    } while (0)
+#define DEOPT(op)                                                \
+    do {                                                         \
+        vm_deopt(chunk, ip - 1, (op));                           \
+        instruction = (op);                                      \
+        goto *dispatch_table[instruction];                       \
+    } while (0)
+
+    DISPATCH();
+#else
+#define CASE(name)      case OP_##name:
+#define CASE_UNKNOWN    default:
+#define DISPATCH()      break
+#define DEOPT(op)                                                \
+    do {                                                         \
+        vm_deopt(chunk, ip - 1, (op));                           \
+        instruction = (op);                                      \
+        goto redispatch;                                         \
+    } while (0)
+
+    for (;;) {
+        INSTRUMENT();
+        instruction = READ_BYTE();
+redispatch:
+        switch (instruction) {
+#endif
+
+            CASE(NOP)
+                DISPATCH();
+
+            CASE(CONSTANT) {
+                PUSH(READ_CONSTANT());
+                DISPATCH();
+            }
+
+            CASE(CONSTANT_LONG)
+                PUSH(READ_CONSTANT_LONG());
+                DISPATCH();
+
+            CASE(TRUE)
+                PUSH(SKY_BOOL(true));
+                DISPATCH();
+
+            CASE(FALSE)
+                PUSH(SKY_BOOL(false));
+                DISPATCH();
+
+            CASE(NIL)
+                PUSH(SKY_NIL());
+                DISPATCH();
+
+            CASE(POP)
+                (void)POP();
+                DISPATCH();
+
+            CASE(DUP) {
+                SkyValue top = PEEK(0);
+                PUSH(top);
+                DISPATCH();
+            }
+
+            CASE(GET_LOCAL) {
+                uint8_t slot = READ_BYTE();
+                PUSH(frame->slots[slot]);
+                DISPATCH();
+            }
+
+            CASE(SET_LOCAL) {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = PEEK(0);
+                DISPATCH();
+            }
+
+            CASE(GET_GLOBAL)
+            CASE(GET_GLOBAL_LONG) {
+                SkyValue name_val = instruction == OP_GET_GLOBAL ? READ_CONSTANT()
+                                                                 : READ_CONSTANT_LONG();
+                SkyValue value;
+                if (!IS_STRING(name_val)) {
+                    runtime_error(vm, "Global name must be a string");
+                    return RUNTIME_FAILURE();
+                }
+                if (!sky_table_get(&vm->globals, AS_STRING_OBJ(name_val), &value)) {
+                    runtime_error(vm, "Undefined variable '%s'", AS_STRING(name_val));
+                    return RUNTIME_FAILURE();
+                }
+                PUSH(value);
+                DISPATCH();
+            }
+
+            CASE(SET_GLOBAL)
+            CASE(SET_GLOBAL_LONG) {
+                SkyValue name_val = instruction == OP_SET_GLOBAL ? READ_CONSTANT()
+                                                                 : READ_CONSTANT_LONG();
+                if (!IS_STRING(name_val)) {
+                    runtime_error(vm, "Global name must be a string");
+                    return RUNTIME_FAILURE();
+                }
+                vm_set_global(vm, AS_STRING_OBJ(name_val), PEEK(0));
+                DISPATCH();
+            }
+
+            CASE(GET_GLOBAL_SLOT) {
+                uint8_t slot = READ_BYTE();
+                SkyGlobalSlot *g = &vm->global_slots[slot];
+                if (!g->defined) {
+                    runtime_error(vm, "Undefined variable '%s'", vm->global_names[slot]->chars);
+                    return RUNTIME_FAILURE();
+                }
+                PUSH(g->value);
+                DISPATCH();
+            }
+
+            CASE(SET_GLOBAL_SLOT) {
+                SkyGlobalSlot *g = &vm->global_slots[READ_BYTE()];
+                g->value = PEEK(0);
+                g->defined = true;
+                DISPATCH();
+            }
+
+            CASE(ADD) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_ADD_INT_INT);
+                    PUSH(SKY_INT(SKY_WRAP(AS_INT(a), +, AS_INT(b))));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_ADD_FLOAT_FLOAT);
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) + AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_FLOAT((double)AS_INT(a) + AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) + (double)AS_INT(b)));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    PUSH(sky_string_concat(a, b));
+                } else {
+                    runtime_error(vm, "Cannot add these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(SUB) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_SUB_INT_INT);
+                    PUSH(SKY_INT(SKY_WRAP(AS_INT(a), -, AS_INT(b))));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_SUB_FLOAT_FLOAT);
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) - AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_FLOAT((double)AS_INT(a) - AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) - (double)AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Cannot subtract these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(MUL) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_MUL_INT_INT);
+                    PUSH(SKY_INT(SKY_WRAP(AS_INT(a), *, AS_INT(b))));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_MUL_FLOAT_FLOAT);
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) * AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_FLOAT((double)AS_INT(a) * AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) * (double)AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Cannot multiply these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(DIV) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                if (IS_INT(b) && AS_INT(b) == 0) {
+                    runtime_error(vm, "Division by zero");
+                    return RUNTIME_FAILURE();
+                }
+                if (IS_FLOAT(b) && AS_FLOAT(b) == 0.0) {
+                    runtime_error(vm, "Division by zero");
+                    return RUNTIME_FAILURE();
+                }
+                if (IS_INT(a) && IS_INT(b)) {
+                    /* INT64_MIN / -1 traps in hardware; it wraps like + and * */
+                    if (AS_INT(b) == -1) PUSH(SKY_INT(SKY_WRAP(0, -, AS_INT(a))));
+                    else PUSH(SKY_INT(AS_INT(a) / AS_INT(b)));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) / AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_FLOAT((double)AS_INT(a) / AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_FLOAT(AS_FLOAT(a) / (double)AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Cannot divide these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(MOD) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                if (IS_INT(a) && IS_INT(b)) {
+                    if (AS_INT(b) == 0) {
+                        runtime_error(vm, "Modulo by zero");
+                        return RUNTIME_FAILURE();
+                    }
+                    PUSH(SKY_INT(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Modulo requires integers");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(NEGATE) {
+                SkyValue a = POP();
+                if (IS_INT(a)) {
+                    PUSH(SKY_INT(SKY_WRAP(0, -, AS_INT(a))));
+                } else if (IS_FLOAT(a)) {
+                    PUSH(SKY_FLOAT(-AS_FLOAT(a)));
+                } else {
+                    runtime_error(vm, "Cannot negate this type");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(NOT) {
+                SkyValue a = POP();
+                if (IS_BOOL(a)) {
+                    PUSH(SKY_BOOL(!AS_BOOL(a)));
+                } else if (IS_NIL(a)) {
+                    PUSH(SKY_BOOL(true));
+                } else {
+                    PUSH(SKY_BOOL(false));
+                }
+                DISPATCH();
+            }
+
+            CASE(EQUAL) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                PUSH(SKY_BOOL(sky_values_equal(a, b)));
+                DISPATCH();
+            }
+
+            CASE(NOT_EQUAL) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                PUSH(SKY_BOOL(!sky_values_equal(a, b)));
+                DISPATCH();
+            }
+
+            CASE(GREATER) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_GREATER_INT_INT);
+                    PUSH(SKY_BOOL(AS_INT(a) > AS_INT(b)));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_GREATER_FLOAT_FLOAT);
+                    PUSH(SKY_BOOL(AS_FLOAT(a) > AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_BOOL((double)AS_INT(a) > AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_BOOL(AS_FLOAT(a) > (double)AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Cannot compare these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(GREATER_EQ) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_GREATER_EQ_INT_INT);
+                    PUSH(SKY_BOOL(AS_INT(a) >= AS_INT(b)));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_GREATER_EQ_FLOAT_FLOAT);
+                    PUSH(SKY_BOOL(AS_FLOAT(a) >= AS_FLOAT(b)));
+                } else {
+                    runtime_error(vm, "Cannot compare these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(LESS) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_LESS_INT_INT);
+                    PUSH(SKY_BOOL(AS_INT(a) < AS_INT(b)));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_LESS_FLOAT_FLOAT);
+                    PUSH(SKY_BOOL(AS_FLOAT(a) < AS_FLOAT(b)));
+                } else if (IS_INT(a) && IS_FLOAT(b)) {
+                    PUSH(SKY_BOOL((double)AS_INT(a) < AS_FLOAT(b)));
+                } else if (IS_FLOAT(a) && IS_INT(b)) {
+                    PUSH(SKY_BOOL(AS_FLOAT(a) < (double)AS_INT(b)));
+                } else {
+                    runtime_error(vm, "Cannot compare these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(LESS_EQ) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                COUNT(generic);
+                if (IS_INT(a) && IS_INT(b)) {
+                    QUICKEN(OP_LESS_EQ_INT_INT);
+                    PUSH(SKY_BOOL(AS_INT(a) <= AS_INT(b)));
+                } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+                    QUICKEN(OP_LESS_EQ_FLOAT_FLOAT);
+                    PUSH(SKY_BOOL(AS_FLOAT(a) <= AS_FLOAT(b)));
+                } else {
+                    runtime_error(vm, "Cannot compare these types");
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(AND) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                PUSH(SKY_BOOL(vm_logical_truth(a) && vm_logical_truth(b)));
+                DISPATCH();
+            }
+
+            CASE(OR) {
+                SkyValue b = POP();
+                SkyValue a = POP();
+                PUSH(SKY_BOOL(vm_logical_truth(a) || vm_logical_truth(b)));
+                DISPATCH();
+            }
+
+            CASE(AND_JUMP) {
+                uint16_t offset = READ_SHORT();
+                if (vm_logical_truth(PEEK(0))) {
+                    vm->stack_top--;
+                } else {
+                    vm->stack_top[-1] = SKY_BOOL(false);
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+
+            CASE(OR_JUMP) {
+                uint16_t offset = READ_SHORT();
+                if (vm_logical_truth(PEEK(0))) {
+                    vm->stack_top[-1] = SKY_BOOL(true);
+                    ip += offset;
+                } else {
+                    vm->stack_top--;
+                }
+                DISPATCH();
+            }
+
+            CASE(TO_BOOL)
+                vm->stack_top[-1] = SKY_BOOL(vm_logical_truth(PEEK(0)));
+                DISPATCH();
+
+            CASE(JUMP) {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
+            }
+
+            CASE(JUMP_IF_FALSE) {
+                uint16_t offset = READ_SHORT();
+                SkyValue cond = PEEK(0);
+                bool is_falsy = (IS_NIL(cond)) ||
+                                (IS_BOOL(cond) && !AS_BOOL(cond)) ||
+                                (IS_INT(cond) && AS_INT(cond) == 0);
+                if (is_falsy) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+
+            CASE(JUMP_BACK) {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                JIT_HOTSPOT();
+                DISPATCH();
+            }
+
+            CASE(FOR_RANGE_PREP) {
+                uint8_t slot = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                SkyValue *range = &frame->slots[slot];
+                bool more;
+                if (IS_INT(range[0]) && IS_INT(range[1])) {
+                    more = AS_INT(range[0]) < AS_INT(range[1]);
+                } else if (!vm_compare_values(vm, OP_LESS, range[0], range[1], &more)) {
+                    return RUNTIME_FAILURE();
+                }
+                if (!more) ip += offset;
+                DISPATCH();
+            }
+
+            CASE(FOR_RANGE_LOOP) {
+                uint8_t slot = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                SkyValue *range = &frame->slots[slot];
+                bool more;
+                if (IS_INT(range[0]) && IS_INT(range[1])) {
+                    int64_t next = SKY_WRAP(AS_INT(range[0]), +, 1);
+                    range[0] = SKY_INT(next);
+                    more = next < AS_INT(range[1]);
+                } else if (!vm_add_values(vm, range[0], SKY_INT(1), &range[0]) ||
+                           !vm_compare_values(vm, OP_LESS, range[0], range[1], &more)) {
+                    return RUNTIME_FAILURE();
+                }
+                if (more) {
+                    ip -= offset;
+                    JIT_HOTSPOT();
+                }
+                DISPATCH();
+            }
+
+            CASE(CALL) {
+                int arg_count = READ_BYTE();
+                CALL_VALUE(arg_count);
+                DISPATCH();
+            }
+
+            CASE(TAIL_CALL) {
+                int arg_count = READ_BYTE();
+                SkyValue callee = PEEK(arg_count);
+                if (IS_CLASS(callee) && AS_CLASS(callee)->init) {
+                    if (!vm_prepare_init(vm, arg_count)) return RUNTIME_FAILURE();
+                    callee = PEEK(++arg_count);
+                }
+                if (IS_FUNCTION(callee)) {
+                    /* Slide callee and arguments down over the current frame */
+                    SkyFunction *fn = AS_FUNCTION(callee);
+                    if (!vm_check_arity(vm, fn, arg_count)) return RUNTIME_FAILURE();
+                    if (!vm_check_stack(vm, frame->slots - vm->stack, &fn->chunk)) {
+                        return RUNTIME_FAILURE();
+                    }
+                    memmove(frame->slots, vm->stack_top - arg_count - 1,
+                            sizeof(SkyValue) * (arg_count + 1));
+                    vm->stack_top = frame->slots + arg_count + 1;
+                    frame->chunk = chunk = &fn->chunk;
+                    ip = chunk->code;
+                    JIT_HOTSPOT();
+                } else if (!vm_call_native(vm, callee, arg_count)) {
+                    /* Natives run as an ordinary call; the RETURN that
+                     * follows hands their result back */
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(RETURN) {
+                SkyValue result = POP();
+                if (vm->frame_count <= 1) {
+                    return VM_OK;
+                }
+                vm->stack_top = frame->slots;
+                vm->frame_count--;
+                frame = &vm->frames[vm->frame_count - 1];
+                chunk = frame->chunk;
+                ip = frame->ip;
+                PUSH(result);
+                JIT_HOTSPOT();
+                DISPATCH();
+            }
+
+            CASE(PRINT) {
+                SkyValue val = POP();
+                sky_debug_print_value(val);
+                printf("\n");
+                DISPATCH();
+            }
+
+            CASE(ARRAY) {
+                uint8_t count = READ_BYTE();
+                SkyArray *arr = sky_array_new(count);
+                int i;
+                arr->count = count;
+                for (i = count - 1; i >= 0; i--) {
+                    arr->items[i] = POP();
+                }
+                PUSH(SKY_ARRAY(arr));
+                DISPATCH();
+            }
+
+            CASE(MAP) {
+                uint8_t count = READ_BYTE();
+                SkyValue *pairs = vm->stack_top - 2 * count;
+                SkyMap *map;
+                int i;
+                for (i = 0; i < count; i++) {
+                    SkyString *key = sky_map_key(pairs[2 * i]);
+                    if (!key) {
+                        runtime_error(vm, "Map keys must be strings or numbers");
+                        return RUNTIME_FAILURE();
+                    }
+                    pairs[2 * i] = SKY_STRING(key);
+                }
+                /* The pairs stay on the stack, and rooted, until it is filled */
+                map = sky_map_new(count);
+                for (i = 0; i < count; i++) {
+                    sky_map_set(map, AS_STRING_OBJ(pairs[2 * i]), pairs[2 * i + 1]);
+                }
+                vm->stack_top = pairs;
+                PUSH(SKY_OBJECT(map));
+                DISPATCH();
+            }
+
+            CASE(CLASS) {
+                int count = READ_BYTE();
+                SkyValue *names = vm->stack_top - count - 1;
+                SkyClass *klass;
+                int i;
+                for (i = 0; i <= count; i++) {
+                    if (!IS_STRING(names[i])) {
+                        runtime_error(vm, "Class and field names must be strings");
+                        return RUNTIME_FAILURE();
+                    }
+                }
+                /* The names stay on the stack, and rooted, until the class holds them */
+                klass = sky_class_new(AS_STRING_OBJ(names[0]), names + 1, count);
+                vm->stack_top = names;
+                PUSH(SKY_OBJECT(klass));
+                DISPATCH();
+            }
+
+            CASE(METHOD) {
+                SkyValue method = POP();
+                SkyValue name = POP();
+                SkyValue klass = PEEK(0);
+                if (!IS_CLASS(klass) || !IS_STRING(name) || !IS_FUNCTION(method)) {
+                    runtime_error(vm, "A method must be a named function on a class");
+                    return RUNTIME_FAILURE();
+                }
+                sky_gc_barrier(AS_OBJECT(klass), name);
+                sky_gc_barrier(AS_OBJECT(klass), method);
+                sky_class_set_method(AS_CLASS(klass), AS_STRING_OBJ(name), AS_FUNCTION(method));
+                DISPATCH();
+            }
+
+            CASE(INVOKE)
+            CASE(INVOKE_LONG) {
+                int arg_count = READ_BYTE();
+                SkyString *name = AS_STRING_OBJ(instruction == OP_INVOKE ? READ_CONSTANT()
+                                                                         : READ_CONSTANT_LONG());
+                uint8_t *cache = ip;
+                SkyValue receiver = PEEK(arg_count);
+                SkyValue method = SKY_NIL();
+                ip += SKY_IC_SIZE;
+                if (IS_INSTANCE(receiver)) {
+                    SkyInstance *instance = AS_INSTANCE(receiver);
+                    int index = vm_method_index(chunk, cache, instance, name);
+                    if (index >= 0) {
+                        /* The method takes the nil's place; the receiver stays as self */
+                        SkyFunction *fn = instance->klass->methods[index];
+                        if (fn->arity != arg_count + 1) {
+                            runtime_error(vm, "%s() expects %d arguments but got %d",
+                                          fn->name, fn->arity - 1, arg_count);
+                            return RUNTIME_FAILURE();
+                        }
+                        vm->stack_top[-arg_count - 2] = SKY_OBJECT(fn);
+                        CALL_VALUE(arg_count + 1);
+                        DISPATCH();
+                    }
+                    index = sky_shape_find(instance->shape, name);
+                    if (index < 0) {
+                        runtime_error(vm, "Undefined method '%s'", name->chars);
+                        return RUNTIME_FAILURE();
+                    }
+                    method = instance->fields[index];
+                } else if (IS_MAP(receiver) && !sky_map_get(AS_MAP(receiver), name, &method)) {
+                    method = SKY_NIL();
+                }
+                /* A field: call it with the arguments alone */
+                memmove(vm->stack_top - arg_count - 1, vm->stack_top - arg_count,
+                        sizeof(SkyValue) * arg_count);
+                vm->stack_top--;
+                vm->stack_top[-arg_count - 1] = method;
+                CALL_VALUE(arg_count);
+                DISPATCH();
+            }
+
+            CASE(IMPORT)
+            CASE(SERVER)
+            CASE(ROUTE)
+            CASE(RESPOND)
+            CASE(SECURITY)
+            CASE(ASYNC)
+            CASE(AWAIT)
+                ip += sky_opcode_length(instruction) - 1;
+                DISPATCH();
+
+            /* Instances and maps have fields. Reading anything else
+             * produces nil, and writing it keeps just the stack effect.
+             * Instance fields go through the inline cache that follows the
+             * name operand. */
+            CASE(GET_FIELD)
+            CASE(GET_FIELD_LONG) {
+                SkyString *name = AS_STRING_OBJ(instruction == OP_GET_FIELD ? READ_CONSTANT()
+                                                                            : READ_CONSTANT_LONG());
+                uint8_t *cache = ip;
+                SkyValue object = PEEK(0);
+                ip += SKY_IC_SIZE;
+                if (IS_INSTANCE(object)) {
+                    SkyInstance *instance = AS_INSTANCE(object);
+                    int slot = vm_field_slot(chunk, cache, instance->shape, name);
+                    vm->stack_top[-1] = slot >= 0 ? instance->fields[slot] : SKY_NIL();
+                } else if (!IS_MAP(object) || !sky_map_get(AS_MAP(object), name, &vm->stack_top[-1])) {
+                    vm->stack_top[-1] = SKY_NIL();
+                }
+                DISPATCH();
+            }
+
+            CASE(SET_FIELD)
+            CASE(SET_FIELD_LONG) {
+                SkyString *name = AS_STRING_OBJ(instruction == OP_SET_FIELD ? READ_CONSTANT()
+                                                                            : READ_CONSTANT_LONG());
+                uint8_t *cache = ip;
+                SkyValue object = POP();
+                ip += SKY_IC_SIZE;
+                if (IS_INSTANCE(object)) {
+                    SkyInstance *instance = AS_INSTANCE(object);
+                    vm_instance_set(instance, vm_field_slot(chunk, cache, instance->shape, name),
+                                    name, PEEK(0));
+                } else if (IS_MAP(object)) {
+                    vm_map_set(AS_MAP(object), name, PEEK(0));
+                }
+                DISPATCH();
+            }
+
+            /* Integer indices into arrays take the inline path; strings,
+             * maps and errors go through vm_get_index / vm_set_index with
+             * the operands still on the stack */
+            CASE(GET_INDEX) {
+                SkyValue index = PEEK(0);
+                SkyValue object = PEEK(1);
+                SkyValue result;
+                if (IS_ARRAY(object) && IS_INT(index)) {
+                    SkyArray *arr = AS_ARRAY(object);
+                    int64_t i = AS_INT(index);
+                    if (i >= 0 && i < arr->count) {
+                        vm->stack_top--;
+                        vm->stack_top[-1] = arr->items[i];
+                        DISPATCH();
+                    }
+                }
+                if (!vm_get_index(vm, object, index, &result)) return RUNTIME_FAILURE();
+                vm->stack_top--;
+                vm->stack_top[-1] = result;
+                DISPATCH();
+            }
+
+            CASE(GET_INDEX_UNCHECKED) {
+                /* In bounds by construction when it is an array (bytecode.h) */
+                SkyValue index = PEEK(0);
+                SkyValue object = PEEK(1);
+                SkyValue result;
+                if (IS_ARRAY(object) && IS_INT(index)) {
+                    vm->stack_top--;
+                    vm->stack_top[-1] = AS_ARRAY(object)->items[AS_INT(index)];
+                    DISPATCH();
+                }
+                if (!vm_get_index(vm, object, index, &result)) return RUNTIME_FAILURE();
+                vm->stack_top--;
+                vm->stack_top[-1] = result;
+                DISPATCH();
+            }
+
+            CASE(SET_INDEX) {
+                SkyValue index = PEEK(0);
+                SkyValue object = PEEK(1);
+                SkyValue value = PEEK(2);
+                if (IS_ARRAY(object) && IS_INT(index)) {
+                    SkyArray *arr = AS_ARRAY(object);
+                    int64_t i = AS_INT(index);
+                    if (i >= 0 && i < arr->count) {
+                        sky_gc_barrier(&arr->obj, value);
+                        arr->items[i] = value;
+                        vm->stack_top -= 2;
+                        DISPATCH();
+                    }
+                }
+                if (!vm_set_index(vm, object, index, value)) return RUNTIME_FAILURE();
+                vm->stack_top -= 2;
+                DISPATCH();
+            }
+
+            CASE(ADD_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_WRAPPING, WRAPPED_INT, +, OP_ADD);
+                DISPATCH();
+
+            CASE(ADD_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_FLOAT, +, OP_ADD);
+                DISPATCH();
+
+            CASE(SUB_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_WRAPPING, WRAPPED_INT, -, OP_SUB);
+                DISPATCH();
+
+            CASE(SUB_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_FLOAT, -, OP_SUB);
+                DISPATCH();
+
+            CASE(MUL_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_WRAPPING, WRAPPED_INT, *, OP_MUL);
+                DISPATCH();
+
+            CASE(MUL_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_FLOAT, *, OP_MUL);
+                DISPATCH();
+
+            CASE(LESS_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_INT, SKY_BOOL, <, OP_LESS);
+                DISPATCH();
+
+            CASE(LESS_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_BOOL, <, OP_LESS);
+                DISPATCH();
+
+            CASE(LESS_EQ_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_INT, SKY_BOOL, <=, OP_LESS_EQ);
+                DISPATCH();
+
+            CASE(LESS_EQ_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_BOOL, <=, OP_LESS_EQ);
+                DISPATCH();
+
+            CASE(GREATER_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_INT, SKY_BOOL, >, OP_GREATER);
+                DISPATCH();
+
+            CASE(GREATER_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_BOOL, >, OP_GREATER);
+                DISPATCH();
+
+            CASE(GREATER_EQ_INT_INT)
+                SPECIALIZED_BINARY(IS_INT, AS_INT, SKY_BOOL, >=, OP_GREATER_EQ);
+                DISPATCH();
+
+            CASE(GREATER_EQ_FLOAT_FLOAT)
+                SPECIALIZED_BINARY(IS_FLOAT, AS_FLOAT, SKY_BOOL, >=, OP_GREATER_EQ);
+                DISPATCH();
+
+            CASE(INC_LOCAL) {
+                uint8_t slot = READ_BYTE();
+                SkyValue k = READ_CONSTANT();
+                SkyValue *local = &frame->slots[slot];
+                if (IS_INT(*local) && IS_INT(k)) {
+                    *local = SKY_INT(SKY_WRAP(AS_INT(*local), +, AS_INT(k)));
+                } else if (!vm_add_values(vm, *local, k, local)) {
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(GET_LOCAL_GET_LOCAL_ADD) {
+                SkyValue a = frame->slots[READ_BYTE()];
+                SkyValue b = frame->slots[READ_BYTE()];
+                SkyValue result;
+                if (IS_INT(a) && IS_INT(b)) {
+                    PUSH(SKY_INT(SKY_WRAP(AS_INT(a), +, AS_INT(b))));
+                } else if (vm_add_values(vm, a, b, &result)) {
+                    PUSH(result);
+                } else {
+                    return RUNTIME_FAILURE();
+                }
+                DISPATCH();
+            }
+
+            CASE(LESS_JUMP_IF_FALSE)
+                COMPARE_JUMP(<, OP_LESS);
+                DISPATCH();
+
+            CASE(LESS_EQ_JUMP_IF_FALSE)
+                COMPARE_JUMP(<=, OP_LESS_EQ);
+                DISPATCH();
+
+            CASE(GREATER_JUMP_IF_FALSE)
+                COMPARE_JUMP(>, OP_GREATER);
+                DISPATCH();
+
+            CASE(GREATER_EQ_JUMP_IF_FALSE)
+                COMPARE_JUMP(>=, OP_GREATER_EQ);
+                DISPATCH();
+
+            CASE(EQUAL_JUMP_IF_FALSE)
+                COMPARE_JUMP(==, OP_EQUAL);
+                DISPATCH();
+
+            CASE(NOT_EQUAL_JUMP_IF_FALSE)
+                COMPARE_JUMP(!=, OP_NOT_EQUAL);
+                DISPATCH();
+
+            CASE(POP_JUMP_IF_FALSE) {
+                uint16_t offset = READ_SHORT();
+                SkyValue cond = POP();
+                if (IS_NIL(cond) || (IS_BOOL(cond) && !AS_BOOL(cond)) ||
+                    (IS_INT(cond) && AS_INT(cond) == 0)) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+
+            CASE(MOVE) {
+                uint8_t dst = READ_BYTE();
+                frame->slots[dst] = frame->slots[READ_BYTE()];
+                DISPATCH();
+            }
+
+            CASE(LOAD_CONST) {
+                uint8_t dst = READ_BYTE();
+                frame->slots[dst] = READ_CONSTANT();
+                DISPATCH();
+            }
+
+            CASE(ADD_RR)
+                REGISTER_ARITH(+, OP_ADD, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(SUB_RR)
+                REGISTER_ARITH(-, OP_SUB, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(MUL_RR)
+                REGISTER_ARITH(*, OP_MUL, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(ADD_RK)
+                REGISTER_ARITH(+, OP_ADD, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(SUB_RK)
+                REGISTER_ARITH(-, OP_SUB, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(MUL_RK)
+                REGISTER_ARITH(*, OP_MUL, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(LESS_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(<, OP_LESS, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(LESS_EQ_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(<=, OP_LESS_EQ, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(GREATER_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(>, OP_GREATER, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(GREATER_EQ_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(>=, OP_GREATER_EQ, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(EQUAL_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(==, OP_EQUAL, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(NOT_EQUAL_RR_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(!=, OP_NOT_EQUAL, frame->slots[READ_BYTE()]);
+                DISPATCH();
+
+            CASE(LESS_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(<, OP_LESS, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(LESS_EQ_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(<=, OP_LESS_EQ, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(GREATER_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(>, OP_GREATER, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(GREATER_EQ_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(>=, OP_GREATER_EQ, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(EQUAL_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(==, OP_EQUAL, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(NOT_EQUAL_RK_JUMP_IF_FALSE)
+                REGISTER_COMPARE_JUMP(!=, OP_NOT_EQUAL, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(HALT)
+                return VM_OK;
+
+            CASE_UNKNOWN
+                runtime_error(vm, "Unknown opcode: %d", instruction);
+                return RUNTIME_FAILURE();
+
+#if !defined(SKY_COMPUTED_GOTO) || SKY_VM_SINGLE_STEP
+        }
+#if SKY_VM_SINGLE_STEP
+        frame->ip = ip;
+        return VM_STEPPED;
+#endif
+    }
+#endif
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef INSTRUMENT
+#undef JIT_HOTSPOT
+#undef QUICKEN
+#undef RUNTIME_FAILURE
+#undef COUNT
+#undef SPECIALIZED_BINARY
+#undef AS_WRAPPING
+#undef WRAPPED_INT
+#undef CALL_VALUE
+#undef COMPARE_JUMP
+#undef REGISTER_COMPARE_JUMP
+#undef REGISTER_ARITH
+#undef DEOPT
+#undef CASE
+#undef CASE_UNKNOWN
+#undef DISPATCH
+}